@@ -621,6 +621,8 @@ browse_host_open(
 		args.gzip = 0 != (flags & BH_F_GZIP);
 		args.buffer_flush = INT_MAX;		/* Flush only at the end */
 		args.buffer_size = BH_BUFSIZ;
+		args.bws = BSCHED_BWS_INVALID;		/* Short-lived, fixed level */
+		args.reduced = FALSE;
 
 		tx = tx_make_above(bh->tx, tx_deflate_get_ops(), &args);
 		if (tx == NULL) {
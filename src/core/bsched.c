@@ -41,6 +41,7 @@
 #include "if/core/wrap.h"		/* For wrapped_io_t */
 #include "if/gnet_property_priv.h"
 
+#include "lib/cq.h"
 #include "lib/glib-missing.h"
 #include "lib/halloc.h"
 #include "lib/walloc.h"
@@ -65,6 +66,8 @@ enum {
 	BS_F_NO_STEALING	= (1 << 8),		/**< Prevent b/w stealing from us */
 	BS_F_STOLEN_IGN		= (1 << 9),		/**< Ignore stolen bandwidth */
 	BS_F_UNIFORM_BW		= (1 << 10),	/**< Uniform b/w allocation */
+	BS_F_PACED			= (1 << 11),	/**< Bandwidth refilled by ticks */
+	BS_F_STARVED		= (1 << 12),	/**< Capped a source since last tick */
 
 	BS_F_RW				= (BS_F_READ|BS_F_WRITE)
 };
@@ -108,6 +111,15 @@ enum bsched_magic {
  * of the period, any amount of bandwidth that has been unused will be
  * given as "stolen" bandwidth to some of the schedulers stealing from us.
  * Priority is given to schedulers that used up all their bandwidth.
+ *
+ * When pacing is enabled, the bandwidth of the period is not available at
+ * once but refilled about every BSCHED_TICK_MS, in proportion of the time
+ * actually elapsed, into a token bucket that can hold at most
+ * BSCHED_BURST_TICKS refills.  What overflows the bucket is lent
+ * to the stealers that ran short of bandwidth during the last tick, in
+ * proportion of their configured weight.  Within a scheduler, the tokens
+ * are shared among the sources using deficit round-robin: each source
+ * gets a credit per refill, which it can only carry over if it was capped.
  */
 
 struct bsched {
@@ -138,6 +150,10 @@ struct bsched {
 	int last_used;				/**< Nb of active sources last period */
 	int current_used;			/**< Nb of active sources this period */
 	int bw_urgent;				/**< Urgent b/w required in stealing */
+	int tokens;					/**< Bandwidth left in bucket (pacing) */
+	int tick_refill;			/**< Bandwidth per BSCHED_TICK_MS (pacing) */
+	int quantum;				/**< Per-source credit per tick (pacing) */
+	const guint32 *weight;		/**< Weight property, NULL means 1 */
 	gboolean looped;			/**< True when looped once over sources */
 };
 
@@ -153,6 +169,8 @@ static GSList *bws_in_list = NULL;
 static int bws_out_ema = 0;
 static int bws_in_ema = 0;
 
+static bio_source_t *bio_sending;	/**< Source within bio_sendto() */
+
 #define BW_SLOT_MIN		64	 /**< Minimum bandwidth/slot for realloc */
 
 #define BW_OUT_UP_MIN	8192 /**< Minimum out bandwidth for becoming ultra */
@@ -165,6 +183,15 @@ static int bws_in_ema = 0;
 
 #define BW_UDP_OVERSIZE	1024 /**< Allow that many bytes over available b/w */
 
+#define BSCHED_TICK_MS		50	/**< Refill period when pacing, in ms */
+#define BSCHED_BURST_TICKS	2	/**< Bucket depth, in refills */
+#define BSCHED_LEND_TICKS	4	/**< Max bucket level after borrowing */
+
+static cperiodic_t *bsched_tick_ev;	/**< Refilling of token buckets */
+static tm_t bsched_last_tick;		/**< Time of last refill */
+
+static gboolean bsched_tick(void *unused_data);
+
 static inline void
 bsched_check(const bsched_t * const bs)
 {
@@ -267,6 +294,8 @@ bsched_saturated(bsched_bws_t bws)
 	const bsched_t *bs = bsched_get(bws);
 	if (!(bs->flags & BS_F_ENABLED))		/* Scheduler disabled */
 		return FALSE;
+	if ((bs->flags & BS_F_PACED) && bs->tokens <= 0)
+		return TRUE;
 	return bs->bw_actual > bs->bw_max;
 }
 
@@ -481,6 +510,23 @@ bsched_early_init(void)
 	bws_set[BSCHED_BWS_DHT_IN] = bsched_make("DHT in",
 		BS_T_STREAM, BS_F_READ, 0, 1000);
 
+	/*
+	 * Weights used to lend unused bandwidth between schedulers when pacing.
+	 */
+
+	bws_set[BSCHED_BWS_OUT]->weight = GNET_PROPERTY_PTR(bw_weight_http);
+	bws_set[BSCHED_BWS_IN]->weight = GNET_PROPERTY_PTR(bw_weight_http);
+	bws_set[BSCHED_BWS_GOUT]->weight = GNET_PROPERTY_PTR(bw_weight_gnet_tcp);
+	bws_set[BSCHED_BWS_GIN]->weight = GNET_PROPERTY_PTR(bw_weight_gnet_tcp);
+	bws_set[BSCHED_BWS_GLOUT]->weight = GNET_PROPERTY_PTR(bw_weight_gnet_tcp);
+	bws_set[BSCHED_BWS_GLIN]->weight = GNET_PROPERTY_PTR(bw_weight_gnet_tcp);
+	bws_set[BSCHED_BWS_GOUT_UDP]->weight =
+		GNET_PROPERTY_PTR(bw_weight_gnet_udp);
+	bws_set[BSCHED_BWS_GIN_UDP]->weight =
+		GNET_PROPERTY_PTR(bw_weight_gnet_udp);
+	bws_set[BSCHED_BWS_DHT_OUT]->weight = GNET_PROPERTY_PTR(bw_weight_dht);
+	bws_set[BSCHED_BWS_DHT_IN]->weight = GNET_PROPERTY_PTR(bw_weight_dht);
+
 	bws_list = g_slist_prepend(bws_list, 
 						GUINT_TO_POINTER(BSCHED_BWS_LOOPBACK_IN));
 	bws_list = g_slist_prepend(bws_list, 
@@ -579,6 +625,9 @@ bsched_init(void)
 		bsched_config_steal_gnet();
 
 	bsched_set_peermode(GNET_PROPERTY(current_peermode));
+
+	tm_now_exact(&bsched_last_tick);
+	bsched_tick_ev = cq_periodic_main_add(BSCHED_TICK_MS, bsched_tick, NULL);
 }
 
 /**
@@ -590,6 +639,8 @@ bsched_close(void)
 	GSList *iter;
 	guint i;
 
+	cq_periodic_remove(&bsched_tick_ev);
+
 	for (iter = bws_list; iter; iter = g_slist_next(iter)) {
 		bsched_bws_t bws = GPOINTER_TO_UINT(iter->data);
 		bsched_free(bsched_get(bws));
@@ -968,6 +1019,7 @@ bsched_begin_timeslice(bsched_t *bs)
 		bio->bw_slow_ema += (actual >> 6) - (bio->bw_slow_ema >> 6);
 		bio->bw_last_bps = (guint) (bio->bw_actual * norm_factor);
 		bio->bw_actual = 0;
+		bio->bw_tick_start = 0;
 	}
 
 	g_assert(bs->count == count);	/* All sources are there */
@@ -1051,6 +1103,18 @@ bsched_begin_timeslice(bsched_t *bs)
 
 	bs->current_used = 0;
 	bs->looped = FALSE;
+
+	/*
+	 * When pacing, only the token bucket rules: sources re-enabled above
+	 * must stay quiet until the next refill if the bucket is empty.
+	 */
+
+	if (
+		(bs->flags & BS_F_PACED) && (bs->flags & BS_F_ENABLED) &&
+		bs->tokens <= 0
+	) {
+		bsched_no_more_bandwidth(bs);
+	}
 }
 
 /**
@@ -1065,6 +1129,8 @@ bsched_bio_add(bsched_t *bs, bio_source_t *bio)
 	bs->sources = g_list_append(bs->sources, bio);
 	bs->count++;
 
+	bio->bw_credit = MAX(bs->quantum, BW_SLOT_MIN);
+
 	bs->bw_slot = (bs->bw_max + bs->bw_stolen) / bs->count;
 
 	/*
@@ -1158,6 +1224,8 @@ bsched_source_remove(bio_source_t *bio)
 {
 	bio_check(bio);
 
+	if (bio->flags & BIO_F_WRITE)
+		socket_udp_forget(bio);		/* Refunds whilst still scheduled */
 	if (BSCHED_BWS_INVALID != bio->bws) {
 		bsched_bio_remove(bio->bws, bio);
 		bio->bws = BSCHED_BWS_INVALID;
@@ -1202,15 +1270,99 @@ bsched_set_bandwidth(bsched_bws_t bws, int bandwidth)
 
 	/*
 	 * When all bandwidth has been used, disable all sources.
+	 * When pacing, this will be handled at the next refill.
 	 */
 
-	if (bs->bw_actual >= (bs->bw_max + bs->bw_stolen))
+	if (
+		!(bs->flags & BS_F_PACED) &&
+		bs->bw_actual >= (bs->bw_max + bs->bw_stolen)
+	) {
 		bsched_no_more_bandwidth(bs);
+	}
 
 	bs->flags |= BS_F_CHANGED_BW;
 }
 
 
+/**
+ * @return amount of bandwidth used by source since the last refill.
+ */
+static inline int
+bio_tick_used(const bio_source_t *bio)
+{
+	/* The bw_actual counter is reset at the beginning of each timeslice */
+	if (bio->bw_actual < bio->bw_tick_start)
+		return bio->bw_actual;
+
+	return bio->bw_actual - bio->bw_tick_start;
+}
+
+/**
+ * Compute bandwidth available for a source when pacing.
+ *
+ * The source is granted at most its remaining credit for the refill
+ * period, and no more than what is left in the scheduler's bucket.
+ *
+ * @param `bs' the scheduler of the source.
+ * @param `bio' the source.
+ * @param `len' is the amount of bytes requested by the application.
+ *
+ * @returns the bandwidth available for the source.
+ */
+static int
+bw_available_paced(bsched_t *bs, bio_source_t *bio, int len)
+{
+	int result;
+
+	if (!(bio->flags & BIO_F_USED)) {
+		bs->current_used++;
+		bio->flags |= BIO_F_USED;
+	}
+
+	bio->flags |= BIO_F_TICKED | BIO_F_ACTIVE;
+
+	result = bio->bw_credit - bio_tick_used(bio);
+	result = MIN(result, bs->tokens);
+	result = MIN(result, len);
+	result = MAX(result, 0);
+
+	if (GNET_PROPERTY(bsched_debug) > 8)
+		g_debug("BSCHED bw_available_paced: "
+			"[fd #%d] credit=%d, used=%d, tokens=%d => avail=%d",
+			bio->wio->fd(bio->wio), bio->bw_credit, bio_tick_used(bio),
+			bs->tokens, result);
+
+	/*
+	 * A capped source can carry its unused credit over to the next refill
+	 * (deficit round-robin), and signals that the scheduler could use more
+	 * bandwidth if any were to be lent.
+	 */
+
+	if (result < len) {
+		bio->flags |= BIO_F_BACKLOG;
+		bs->flags |= BS_F_STARVED;
+		bs->bw_capped += len - result;
+	}
+
+	if (0 == result) {
+		if (bs->tokens <= 0)
+			bsched_no_more_bandwidth(bs);
+		else if (bio->io_tag)
+			bio_disable(bio);		/* Until the next refill */
+		return 0;
+	}
+
+	/*
+	 * If uniform scheduling is on, disable source so that it does not
+	 * trigger again before the next refill.
+	 */
+
+	if ((bs->flags & BS_F_UNIFORM_BW) && bio->io_tag)
+		bio_disable(bio);
+
+	return result;
+}
+
 /**
  * @param `bio' no brief description.
  * @param `len' is the amount of bytes requested by the application.
@@ -1240,6 +1392,9 @@ bw_available(bio_source_t *bio, int len)
 	if (bio->io_callback && !bio->io_tag)	/* Source already disabled */
 		return 0;							/* No bandwidth available */
 
+	if (bs->flags & BS_F_PACED)
+		return bw_available_paced(bs, bio, len);
+
 	/*
 	 * If uniform scheduling is on, disable source so that it does not
 	 * trigger again for this timeslice.
@@ -1497,8 +1652,13 @@ bsched_bw_update(bsched_t *bs, int used, int requested)
 	 * When all bandwidth has been used, disable all sources.
 	 */
 
-	if (bs->bw_actual >= (bs->bw_max + bs->bw_stolen))
+	if (bs->flags & BS_F_PACED) {
+		bs->tokens -= used;
+		if (bs->tokens <= 0)
+			bsched_no_more_bandwidth(bs);
+	} else if (bs->bw_actual >= (bs->bw_max + bs->bw_stolen)) {
 		bsched_no_more_bandwidth(bs);
+	}
 }
 
 /**
@@ -1727,7 +1887,11 @@ bio_sendto(bio_source_t *bio, const gnet_host_t *to,
 
 	g_assert(bio->wio != NULL);
 	g_assert(bio->wio->sendto != NULL);
+	g_assert(NULL == bio_sending);
+
+	bio_sending = bio;
 	r = (*bio->wio->sendto)(bio->wio, to, data, len);
+	bio_sending = NULL;
 
 	/*
 	 * XXX hack for broken libc, which can return -1 with errno = 0!
@@ -1743,6 +1907,12 @@ bio_sendto(bio_source_t *bio, const gnet_host_t *to,
 		errno = VAL_EAGAIN;
 	}
 
+	/*
+	 * A datagram queued by the socket layer is charged right away, so that
+	 * the batch cannot exceed the slice budget: it is refunded through
+	 * bio_unsent() should it be dropped before reaching the wire.
+	 */
+
 	if (r > 0) {
 		bsched_bw_update(bsched_get(bio->bws),
 			r + BW_UDP_MSG, len + BW_UDP_MSG);
@@ -1752,6 +1922,47 @@ bio_sendto(bio_source_t *bio, const gnet_host_t *to,
 	return r;
 }
 
+/**
+ * Called by the socket layer when the datagram being sent is queued for
+ * later emission instead of being written right away.
+ *
+ * @return the I/O source to give to bio_unsent() if the datagram is
+ * dropped, NULL if we are not within bio_sendto().
+ */
+bio_source_t *
+bio_sendto_deferred(void)
+{
+	return bio_sending;
+}
+
+/**
+ * Refund the I/O source for a `len'-byte datagram that was charged by
+ * bio_sendto() when queued by the socket layer, but which was dropped
+ * without being written.
+ */
+void
+bio_unsent(bio_source_t *bio, size_t len)
+{
+	bsched_t *bs;
+	size_t amount = len + BW_UDP_MSG;
+
+	bio_check(bio);
+	g_assert(bio->flags & BIO_F_WRITE);
+
+	if (BSCHED_BWS_INVALID == bio->bws)
+		return;
+
+	bs = bsched_get(bio->bws);
+	bsched_check(bs);
+
+	bio->bw_actual -= MIN(bio->bw_actual, amount);
+	if (bs->bw_actual > 0)
+		bs->bw_actual -= MIN((size_t) bs->bw_actual, amount);
+
+	if ((bs->flags & BS_F_ENABLED) && (bs->flags & BS_F_PACED))
+		bs->tokens += amount;
+}
+
 /**
  * Write at most `len' bytes to source's fd, as bandwidth permits.
  *
@@ -2592,13 +2803,18 @@ bsched_heartbeat(bsched_t *bs, tm_t *tv)
 	 *
 	 * If a correction is due but the bandwidth settings changed in the
 	 * period, forget it: allow a full period at the nominal new settings.
+	 *
+	 * When pacing, any overuse is already a debt in the token bucket.
 	 */
 
 	/* Following is the overused "EMA" */
 	correction = bs->bw_ema - bs->bw_stolen_ema - theoric;
 	correction = MAX(correction, overused);
 
-	if (correction > 0 && !(bs->flags & BS_F_CHANGED_BW)) {
+	if (
+		correction > 0 &&
+		!(bs->flags & (BS_F_CHANGED_BW | BS_F_PACED))
+	) {
 		bs->bw_max -= correction;
 		if (bs->bw_max < 0)
 			bs->bw_max = 0;
@@ -2700,6 +2916,9 @@ bsched_stealbeat(bsched_t *bs)
 	if (bs->flags & BS_F_NO_STEALING)	/* Stealing from scheduler disabled */
 		return;
 
+	if (bs->flags & BS_F_PACED)			/* Lending done at each refill */
+		return;
+
 	/**
 	 * Note that we do not use the theoric bandwidth, but bs->bw_max to
 	 * estimate the amount of underused bandwidth.  The reason is that
@@ -2832,6 +3051,264 @@ done:
 	g_slist_free(all_used);
 }
 
+/**
+ * @return lending weight of scheduler.
+ */
+static inline guint32
+bsched_weight(const bsched_t *bs)
+{
+	return NULL == bs->weight ? 1 : MAX(1, *bs->weight);
+}
+
+/**
+ * Refill the token bucket of a paced scheduler with the bandwidth of the
+ * `elapsed' ms since the last refill.
+ *
+ * @return the amount of bandwidth overflowing the bucket, which can be
+ * lent to other schedulers.
+ */
+static int
+bsched_paced_refill(bsched_t *bs, long elapsed)
+{
+	int depth, spare = 0;
+
+	bsched_check(bs);
+	g_assert(elapsed >= 0);
+
+	bs->tick_refill = bs->bw_max * BSCHED_TICK_MS / bs->period;
+	depth = BSCHED_BURST_TICKS * bs->tick_refill;
+
+	bs->tokens += (int) ((double) bs->bw_max * elapsed / bs->period);
+
+	if (bs->tokens > depth) {
+		spare = bs->tokens - depth;
+		bs->tokens = depth;
+	}
+
+	return spare;
+}
+
+/**
+ * Give some bandwidth to a scheduler.
+ */
+static void
+bsched_paced_give(bsched_t *bs, bsched_t *xbs, int amount)
+{
+	g_assert(amount >= 0);
+
+	xbs->tokens += amount;
+	xbs->bw_stolen = MIN(BS_BW_MAX, xbs->bw_stolen + amount);
+
+	if (GNET_PROPERTY(bsched_debug) > 4)
+		g_debug("BSCHED b/w sched \"%s\" lending %d bytes to \"%s\"",
+			bs->name, amount, xbs->name);
+}
+
+/**
+ * Lend the bandwidth that overflowed the bucket of a paced scheduler to
+ * its stealers which ran short of bandwidth since the last refill.
+ *
+ * Urgent needs are served first, then the remaining is split among the
+ * starving stealers according to their weight.
+ */
+static void
+bsched_paced_lend(bsched_t *bs, int spare)
+{
+	GSList *l;
+	guint32 total = 0;
+	int available;
+
+	bsched_check(bs);
+
+	if (spare <= 0 || NULL == bs->stealers)
+		return;
+
+	if (bs->flags & BS_F_NO_STEALING)
+		return;
+
+	for (l = bs->stealers; l; l = g_slist_next(l)) {
+		bsched_t *xbs = l->data;
+
+		if (
+			(xbs->flags & (BS_F_PACED | BS_F_ENABLED)) !=
+				(BS_F_PACED | BS_F_ENABLED) ||
+			(xbs->flags & BS_F_STOLEN_IGN)
+		)
+			continue;
+
+		if (xbs->bw_urgent > 0) {
+			int amount = MIN(spare, xbs->bw_urgent);
+
+			bsched_paced_give(bs, xbs, amount);
+			xbs->bw_urgent -= amount;
+			spare -= amount;
+
+			if (spare <= 0)
+				return;
+		}
+
+		if (xbs->flags & BS_F_STARVED)
+			total += bsched_weight(xbs);
+	}
+
+	if (0 == total)
+		return;
+
+	available = spare;
+
+	for (l = bs->stealers; l; l = g_slist_next(l)) {
+		bsched_t *xbs = l->data;
+		int amount, room;
+
+		if (
+			(xbs->flags & (BS_F_PACED | BS_F_ENABLED | BS_F_STARVED)) !=
+				(BS_F_PACED | BS_F_ENABLED | BS_F_STARVED) ||
+			(xbs->flags & BS_F_STOLEN_IGN)
+		)
+			continue;
+
+		amount = (int) ((double) available * bsched_weight(xbs) / total);
+		room = BSCHED_LEND_TICKS * MAX(xbs->tick_refill, BW_SLOT_MIN) -
+			xbs->tokens;
+		amount = MIN(amount, room);
+		amount = MIN(amount, spare);
+
+		if (amount > 0) {
+			bsched_paced_give(bs, xbs, amount);
+			spare -= amount;
+		}
+	}
+}
+
+/**
+ * Start a new refill period for the sources of a paced scheduler.
+ *
+ * Each source gets a credit equal to the scheduler quantum.  Sources that
+ * were capped since the last refill keep their unused credit, up to twice
+ * the quantum.  Sources that were disabled are re-enabled if there is
+ * bandwidth in the bucket.
+ */
+static void
+bsched_paced_distribute(bsched_t *bs)
+{
+	GList *iter;
+	int active = 0;
+
+	bsched_check(bs);
+
+	for (iter = bs->sources; iter; iter = g_list_next(iter)) {
+		bio_source_t *bio = iter->data;
+
+		if (bio->flags & BIO_F_TICKED)
+			active++;
+	}
+
+	bs->quantum = MAX(bs->tokens, 0) / MAX(active, 1);
+	bs->quantum = MAX(bs->quantum, BW_SLOT_MIN);
+
+	for (iter = bs->sources; iter; iter = g_list_next(iter)) {
+		bio_source_t *bio = iter->data;
+
+		bio_check(bio);
+
+		if (bio->flags & BIO_F_BACKLOG) {
+			int left = MAX(0, bio->bw_credit - bio_tick_used(bio));
+			bio->bw_credit = MIN(left + bs->quantum, 2 * bs->quantum);
+		} else {
+			bio->bw_credit = bs->quantum;
+		}
+
+		bio->bw_tick_start = bio->bw_actual;
+		bio->flags &= ~(BIO_F_TICKED | BIO_F_BACKLOG);
+
+		if (bs->tokens > 0 && 0 == bio->io_tag && bio->io_callback)
+			bio_enable(bio);
+	}
+
+	if (bs->tokens > 0)
+		bs->flags &= ~BS_F_NOBW;
+	else
+		bsched_no_more_bandwidth(bs);
+
+	bs->flags &= ~BS_F_STARVED;
+}
+
+/**
+ * Periodic refill of the token buckets, when pacing is enabled.
+ */
+static gboolean
+bsched_tick(void *unused_data)
+{
+	int spare[NUM_BSCHED_BWS];
+	GSList *l;
+	tm_t now;
+	long elapsed;
+
+	(void) unused_data;
+
+	/*
+	 * The main callout queue can run us later than requested, so the
+	 * buckets are refilled by the time actually elapsed since the last
+	 * refill, which cannot exceed the bucket depth anyway.
+	 */
+
+	tm_now_exact(&now);
+	elapsed = tm_elapsed_ms(&now, &bsched_last_tick);
+	elapsed = MAX(elapsed, 0);
+	elapsed = MIN(elapsed, BSCHED_BURST_TICKS * BSCHED_TICK_MS);
+	bsched_last_tick = now;
+
+	/*
+	 * First pass: refill the buckets, turning pacing on or off as configured.
+	 */
+
+	for (l = bws_list; l; l = g_slist_next(l)) {
+		bsched_bws_t bws = GPOINTER_TO_UINT(l->data);
+		bsched_t *bs = bsched_get(bws);
+
+		spare[bws] = 0;
+
+		if (!GNET_PROPERTY(bw_pacing)) {
+			bs->flags &= ~BS_F_PACED;
+			continue;
+		}
+
+		if (!(bs->flags & BS_F_PACED)) {
+			bs->flags |= BS_F_PACED;
+			bs->tokens = 0;
+		}
+
+		if (bs->flags & BS_F_ENABLED)
+			spare[bws] = bsched_paced_refill(bs, elapsed);
+	}
+
+	if (!GNET_PROPERTY(bw_pacing))
+		return TRUE;
+
+	/*
+	 * Second pass: lend what overflowed to starving stealers.
+	 */
+
+	for (l = bws_list; l; l = g_slist_next(l)) {
+		bsched_bws_t bws = GPOINTER_TO_UINT(l->data);
+		bsched_paced_lend(bsched_get(bws), spare[bws]);
+	}
+
+	/*
+	 * Third pass: hand out the credits to the sources.
+	 */
+
+	for (l = bws_list; l; l = g_slist_next(l)) {
+		bsched_bws_t bws = GPOINTER_TO_UINT(l->data);
+		bsched_t *bs = bsched_get(bws);
+
+		if (bs->flags & BS_F_ENABLED)
+			bsched_paced_distribute(bs);
+	}
+
+	return TRUE;		/* Keep calling */
+}
+
 /**
  * Periodic timer.
  */
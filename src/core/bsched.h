@@ -72,6 +72,8 @@ ssize_t bio_write(bio_source_t *bio, gconstpointer data, size_t len);
 ssize_t bio_writev(bio_source_t *bio, iovec_t *iov, int iovcnt);
 ssize_t bio_sendto(bio_source_t *bio, const gnet_host_t *to,
 	gconstpointer data, size_t len);
+bio_source_t *bio_sendto_deferred(void);
+void bio_unsent(bio_source_t *bio, size_t len);
 ssize_t bio_sendfile(sendfile_ctx_t *ctx, bio_source_t *bio, int in_fd,
 	fileoffset_t *offset, size_t len);
 ssize_t bio_read(bio_source_t *bio, gpointer data, size_t len);
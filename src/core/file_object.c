@@ -85,8 +85,10 @@
 #include "common.h"
 
 #include "file_object.h"
+#include "gnet_stats.h"
 
 #include "lib/atoms.h"
+#include "lib/compat_misc.h"
 #include "lib/compat_pio.h"
 #include "lib/fd.h"
 #include "lib/file.h"
@@ -763,6 +765,56 @@ file_object_preadv(const struct file_object * const fo,
 	return compat_preadv(fo->fd, iov, MIN(iov_cnt, MAX_IOV_COUNT), offset);
 }
 
+/**
+ * Advise the kernel about how a range of the file object is going to be
+ * accessed.  This is only a hint and never blocks: data requested with
+ * FILE_OBJECT_WILLNEED is read in the background.
+ *
+ * FILE_OBJECT_DONTNEED is ignored when the file object is shared, since
+ * another user (e.g. an upload of a file being verified) may still need
+ * the cached pages.
+ *
+ * @param fo An initialized file object.
+ * @param hint The access hint.
+ * @param offset Start of the range.
+ * @param size Length of the range, 0 meaning up to the end of the file.
+ */
+void
+file_object_hint(const struct file_object * const fo,
+	enum file_object_hint hint, const filesize_t offset, const filesize_t size)
+{
+	file_object_check(fo);
+
+	if (!is_valid_fd(fo->fd))
+		return;
+
+	/* Ranges beyond what an off_t can express cannot be hinted */
+	if (offset > (filesize_t) OFF_T_MAX || size > (filesize_t) OFF_T_MAX)
+		return;
+
+	switch (hint) {
+	case FILE_OBJECT_SEQUENTIAL:
+		compat_fadvise_sequential(fo->fd, offset, size);
+		gnet_stats_count_general(GNR_FILE_HINT_SEQUENTIAL, 1);
+		return;
+	case FILE_OBJECT_WILLNEED:
+		if (0 == size)
+			return;
+		compat_fadvise_willneed(fo->fd, offset, size);
+		gnet_stats_count_general(GNR_FILE_HINT_WILLNEED_BYTES,
+			MIN(size, INT_MAX));
+		return;
+	case FILE_OBJECT_DONTNEED:
+		if (0 == size || fo->ref_count > 1)
+			return;
+		compat_fadvise_dontneed(fo->fd, offset, size);
+		gnet_stats_count_general(GNR_FILE_HINT_DONTNEED_BYTES,
+			MIN(size, INT_MAX));
+		return;
+	}
+	g_assert_not_reached();
+}
+
 /**
  * Get opened file status.
  *
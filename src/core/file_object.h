@@ -41,6 +41,18 @@ ssize_t file_object_pread(const struct file_object *fo,
 ssize_t file_object_preadv(const struct file_object *fo,
 					iovec_t *iov, int iov_cnt, filesize_t offset);
 
+/**
+ * Access pattern hints, see file_object_hint().
+ */
+enum file_object_hint {
+	FILE_OBJECT_SEQUENTIAL,		/**< Range will be read sequentially */
+	FILE_OBJECT_WILLNEED,		/**< Range will be read soon */
+	FILE_OBJECT_DONTNEED		/**< Range will not be read again */
+};
+
+void file_object_hint(const struct file_object *fo,
+	enum file_object_hint hint, filesize_t offset, filesize_t size);
+
 int file_object_get_fd(const struct file_object *fo);
 const char *file_object_get_pathname(const struct file_object *fo);
 
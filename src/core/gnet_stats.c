@@ -317,6 +317,22 @@ gnet_stats_general_to_string(gnr_stats_t type)
 		"dht_successful_push_proxy_lookups",
 		"dht_successful_node_push_entry_lookups",
 		"dht_seeding_of_orphan",
+		"qrp_shared_table_hits",
+		"qrp_shared_table_misses",
+		"qrp_shared_arenas",
+		"qrp_merge_dups_skipped",
+		"local_query_cache_hits",
+		"local_query_cache_misses",
+		"file_hint_sequential",
+		"file_hint_willneed_bytes",
+		"file_hint_dontneed_bytes",
+		"tx_deflate_level_raised",
+		"tx_deflate_level_lowered",
+		"udp_read_syscalls",
+		"udp_read_datagrams",
+		"udp_write_syscalls",
+		"udp_write_datagrams",
+		"udp_write_batch_lost",
 	};
 
 	STATIC_ASSERT(G_N_ELEMENTS(type_string) == GNR_TYPE_COUNT);
@@ -46,9 +46,13 @@
 #include "version.h"
 #include "settings.h"
 #include "spam.h"
+#include "tth_cache.h"
 
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/cq.h"
+#include "lib/dbmw.h"
+#include "lib/dbstore.h"
 #include "lib/file.h"
 #include "lib/halloc.h"
 #include "lib/header.h"
@@ -59,7 +63,6 @@
 #include "lib/stringify.h"
 #include "lib/tm.h"
 #include "lib/urn.h"
-#include "lib/walloc.h"
 
 #include "if/gnet_property.h"
 #include "if/gnet_property_priv.h"
@@ -72,219 +75,255 @@
  ***/
 
 /**
- * There's an in-core cache (the GHashTable sha1_cache), and a
- * persistent copy (normally in ~/.gtk-gnutella/sha1_cache). The
- * in-core cache is filled with the persistent one at launch. When the
- * "shared_file" (the records describing the shared files, see
- * share.h) are created, a call is made to sha1_set_digest to fill the
- * SHA1 digest part of the shared_file. If the digest isn't found in
- * the in-core cache, it's computed, stored in the in-core cache and
- * appended at the end of the persistent cache. If the digest is found
- * in the cache, a check is made based on the file size and last
- * modification time. If they're identical to the ones in the cache,
- * the digest is considered to be accurate, and is used. If the file
- * size or last modification time don't match, the digest is computed
- * again and stored in the in-core cache, but it isn't stored in the
- * persistent one. Instead, the cache is marked as dirty, and will be
- * entirely overwritten by dump_cache, called when everything has been
- * computed.
+ * The SHA-1 cache is a persistent database (normally in
+ * ~/.gtk-gnutella/gnet-db/sha1_cache.{dir,pag}), keyed by the full
+ * pathname of the files and holding their size, last modification time,
+ * SHA-1 and TTH. When the "shared_file" (the records describing the
+ * shared files, see share.h) are created, a call is made to request_sha1()
+ * to fill the SHA1 digest part of the shared_file. If the digest isn't found
+ * in the cache, it's computed and stored in the cache. If the digest is found
+ * in the cache, a check is made based on the file size and last modification
+ * time. If they're identical to the ones in the cache, the digest is
+ * considered to be accurate, and is used. Otherwise, the digest is computed
+ * again and the entry is superseded.
+ *
+ * Entries are never loaded into memory all at once: the DBMW layer only
+ * keeps the most recently used ones cached. Each entry records the last
+ * time its file was seen in the library, and entries for files which have
+ * not been shared for HUGE_CACHE_EXPIRE seconds are eventually pruned.
+ *
+ * Older versions kept the cache in a text file (~/.gtk-gnutella/sha1_cache),
+ * which is imported in the database at startup when present, and then
+ * removed. This also lets external scripts feed the cache with hashes they
+ * computed, using the text format.
  */
 
+#define HUGE_CACHE_SIZE			1024	/**< Amount of entries cached */
+#define HUGE_CACHE_EXPIRE		(30 * 86400)	/**< 30 days */
+#define HUGE_CACHE_SEEN_DELAY	86400	/**< Refresh "seen" once a day */
+#define HUGE_SYNC_PERIOD		(60 * 1000)			/**< ms: 1 minute */
+#define HUGE_PRUNE_PERIOD		(24 * 3600 * 1000)	/**< ms: 1 day */
+
 struct sha1_cache_entry {
-    const char *file_name;		/**< Full path name (atom)          */
-	const struct sha1 *sha1;	/**< SHA-1 (binary; atom)			*/
-	const struct tth *tth;		/**< TTH (binary; atom)				*/
-    filesize_t  size;			/**< File size                      */
-    time_t mtime;				/**< Last modification time         */
-    gboolean shared;			/**< There's a known entry for this
-                                     file in the share library      */
+	struct sha1 sha1;			/**< SHA-1 (binary) */
+	struct tth tth;				/**< TTH (binary), if has_tth */
+	filesize_t size;			/**< File size */
+	time_t mtime;				/**< Last modification time */
+	time_t seen;				/**< Last time file was seen in library */
+	gboolean has_tth;			/**< Whether the TTH is known */
 };
 
-static GHashTable *sha1_cache;
+static dbmw_t *db_sha1;
+static char db_sha1_base[] = "sha1_cache";
+static char db_sha1_what[] = "SHA-1 cache";
 
-/**
- * cache_dirty = TRUE means that in-core cache is different from the disk one.
- */
-static gboolean cache_dirty;
-static time_t cache_dumped;
+static cperiodic_t *huge_sync_ev;
+static cperiodic_t *huge_prune_ev;
 
 static cpattern_t *has_http_urls;
 
 /**
- ** Handling of persistent buffer
+ ** Persistent cache
  **/
 
-/* In-memory cache */
+#define HUGE_CACHE_VERSION	0		/**< Serialization version number */
+
+#define HUGE_HAS_TTH		(1 << 0)
 
 /**
- * Takes an in-memory cached entry, and update its content.
+ * Serialization routine for sha1_cache_entry.
  */
-static void update_volatile_cache(
-	struct sha1_cache_entry *item,
-	filesize_t size,
-	time_t mtime,
-	const struct sha1 *sha1,
-	const struct tth *tth)
+static void
+serialize_sha1_cache_entry(pmsg_t *mb, const void *data)
 {
-	g_assert(sha1);	/* tth may be NULL but sha1 not */
-
-	item->shared = TRUE;
-	item->size = size;
-	item->mtime = mtime;
-	atom_sha1_change(&item->sha1, sha1);
-	atom_tth_change(&item->tth, tth);
+	const struct sha1_cache_entry *e = data;
+
+	pmsg_write_u8(mb, HUGE_CACHE_VERSION);
+	pmsg_write_u8(mb, e->has_tth ? HUGE_HAS_TTH : 0);
+	pmsg_write(mb, e->sha1.data, sizeof e->sha1.data);
+	if (e->has_tth)
+		pmsg_write(mb, e->tth.data, sizeof e->tth.data);
+	pmsg_write_be64(mb, e->size);
+	pmsg_write_time(mb, e->mtime);
+	pmsg_write_time(mb, e->seen);
 }
 
 /**
- * Add a new entry to the in-memory cache.
+ * Deserialization routine for sha1_cache_entry.
  */
 static void
-add_volatile_cache_entry(const char *filename, filesize_t size, time_t mtime,
-	const struct sha1 *sha1, const struct tth *tth, gboolean known_to_be_shared)
+deserialize_sha1_cache_entry(bstr_t *bs, void *valptr, size_t len)
+{
+	struct sha1_cache_entry *e = valptr;
+	guint8 version, flags;
+
+	g_assert(sizeof *e == len);
+
+	ZERO(e);
+	bstr_read_u8(bs, &version);
+	bstr_read_u8(bs, &flags);
+	bstr_read(bs, e->sha1.data, sizeof e->sha1.data);
+	e->has_tth = booleanize(flags & HUGE_HAS_TTH);
+	if (e->has_tth)
+		bstr_read(bs, e->tth.data, sizeof e->tth.data);
+	bstr_read_be64(bs, &e->size);
+	bstr_read_time(bs, &e->mtime);
+	bstr_read_time(bs, &e->seen);
+}
+
+/**
+ * @return length of the database key for a pathname, trailing NUL included.
+ */
+static size_t
+huge_cache_keylen(const void *key)
 {
-	struct sha1_cache_entry *item;
-   
-	WALLOC(item);
-	item->file_name = atom_str_get(filename);
-	item->size = size;
-	item->mtime = mtime;
-	item->sha1 = atom_sha1_get(sha1);
-	item->tth = tth ? atom_tth_get(tth) : NULL;
-	item->shared = known_to_be_shared;
-	g_hash_table_insert(sha1_cache, deconstify_gchar(item->file_name), item);
+	return strlen(key) + 1;
 }
 
-/* Disk cache */
+/**
+ * Can pathname be used as a database key?
+ */
+static inline gboolean
+huge_cache_key_ok(const char *pathname)
+{
+	return strlen(pathname) < MAX_PATH_LEN;
+}
+
+/**
+ * Lookup the cache entry for pathname.
+ *
+ * The returned data are only valid until the next operation on the cache.
+ *
+ * @return the cached entry, NULL if not found.
+ */
+static const struct sha1_cache_entry *
+huge_cache_lookup(const char *pathname)
+{
+	if (NULL == db_sha1 || !huge_cache_key_ok(pathname))
+		return NULL;
 
-static const char sha1_persistent_cache_file_header[] =
-"#\n"
-"# gtk-gnutella SHA1 cache file.\n"
-"# This file is automatically generated.\n"
-"# Format is: URN<TAB>file_size<TAB>file_mtime<TAB>file_name\n"
-"# Comment lines start with a sharp (#)\n"
-"#\n"
-"\n";
+	return dbmw_read(db_sha1, pathname, NULL);
+}
 
+/**
+ * Record the hashes of a file in the cache.
+ */
 static void
-cache_entry_print(FILE *f, const char *filename,
-	const struct sha1 *sha1, const struct tth *tth,
-	filesize_t size, time_t mtime)
+huge_cache_store(const char *pathname, filesize_t size, time_t mtime,
+	const struct sha1 *sha1, const struct tth *tth, time_t seen)
 {
-	char size_buf[UINT64_DEC_BUFLEN], mtime_buf[UINT64_DEC_BUFLEN];
+	struct sha1_cache_entry e;
 
-	g_return_if_fail(f);
-	g_return_if_fail(filename);
-	g_return_if_fail(sha1);
-	g_return_if_fail(size > 0);
+	g_assert(sha1);	/* tth may be NULL but sha1 not */
+
+	if (NULL == db_sha1 || !huge_cache_key_ok(pathname))
+		return;
 
-	uint64_to_string_buf(size, size_buf, sizeof size_buf);
-	uint64_to_string_buf(mtime, mtime_buf, sizeof mtime_buf);
+	ZERO(&e);
+	e.sha1 = *sha1;
+	if (tth != NULL) {
+		e.tth = *tth;
+		e.has_tth = TRUE;
+	}
+	e.size = size;
+	e.mtime = mtime;
+	e.seen = seen;
 
-	fprintf(f, "%s\t%s\t%s\t%s\n", bitprint_to_urn_string(sha1, tth),
-		size_buf, mtime_buf, filename);
+	dbmw_write(db_sha1, pathname, &e, sizeof e);
 }
 
 /**
- * Add an entry to the persistent cache.
+ * Record that the file of a cached entry is still part of the library.
+ *
+ * To avoid rewriting the whole cache each time the library is scanned,
+ * this is only recorded once per HUGE_CACHE_SEEN_DELAY seconds.
  */
 static void
-add_persistent_cache_entry(const char *filename, filesize_t size,
-	time_t mtime, const struct sha1 *sha1, const struct tth *tth)
+huge_cache_seen(const char *pathname, const struct sha1_cache_entry *cached)
 {
-	char *pathname;
-	FILE *f;
-
-	pathname = make_pathname(settings_config_dir(), "sha1_cache");
-	f = file_fopen(pathname, "a");
-	if (f) {
-		filestat_t sb;
+	time_t now = tm_time();
 
-		/*
-		 * If we're adding the very first entry (file empty), then emit header.
-		 */
+	if (delta_time(now, cached->seen) > HUGE_CACHE_SEEN_DELAY) {
+		struct sha1_cache_entry e = *cached;
 
-		if (fstat(fileno(f), &sb)) {
-			g_warning("add_persistent_cache_entry: could not stat \"%s\"",
-				pathname);
-		} else {
-			if (0 == sb.st_size) {
-				fputs(sha1_persistent_cache_file_header, f);
-			}
-			cache_entry_print(f, filename, sha1, tth, size, mtime);
-		}
-		fclose(f);
-	} else {
-		g_warning("add_persistent_cache_entry: could not open \"%s\"",
-			pathname);
+		e.seen = now;
+		dbmw_write(db_sha1, pathname, &e, sizeof e);
 	}
-	HFREE_NULL(pathname);
 }
 
-struct dump_cache_context {
-	FILE *f;
-	gboolean forced;
-};
+/**
+ * DBMW foreach iterator to remove entries not seen for too long.
+ */
+static gboolean
+huge_cache_entry_prune(void *key, void *value, size_t u_len, void *u_data)
+{
+	const struct sha1_cache_entry *e = value;
+	time_t now = pointer_to_ulong(u_data);
+
+	(void) key;
+	(void) u_len;
+
+	return delta_time(now, e->seen) > HUGE_CACHE_EXPIRE;
+}
 
 /**
- * Dump one (in-memory) cache into the persistent cache. This is a callback
- * called by dump_cache to dump the whole in-memory cache onto disk.
+ * Remove expired entries from the cache.
  */
 static void
-dump_cache_one_entry(gpointer unused_key, gpointer value, gpointer udata)
+huge_cache_prune_old(void)
 {
-	struct sha1_cache_entry *e = value;
-	struct dump_cache_context *ctx = udata;
+	size_t count = dbmw_count(db_sha1);
 
-	(void) unused_key;
+	dbmw_foreach_remove(db_sha1, huge_cache_entry_prune,
+		ulong_to_pointer(tm_time()));
 
-	if (ctx->forced || e->shared) {
-		cache_entry_print(ctx->f,
-			e->file_name, e->sha1, e->tth, e->size, e->mtime);
+	if (GNET_PROPERTY(share_debug)) {
+		g_debug("SHA-1 cache pruned %lu expired entries (%lu remaining)",
+			(unsigned long) (count - dbmw_count(db_sha1)),
+			(unsigned long) dbmw_count(db_sha1));
 	}
+
+	dbstore_shrink(db_sha1);
 }
 
 /**
- * Dump the whole in-memory cache onto disk.
+ * Callout queue periodic event to expire old entries.
  */
-static void
-dump_cache(gboolean force)
+static gboolean
+huge_cache_prune(void *unused_obj)
 {
-	FILE *f;
-	file_path_t fp;
+	(void) unused_obj;
 
-	if (!force && !cache_dirty)
-		return;
-	
-	file_path_set(&fp, settings_config_dir(), "sha1_cache");
-	f = file_config_open_write("SHA-1 cache", &fp);
-	if (f) {
-		struct dump_cache_context ctx;
-		
-		fputs(sha1_persistent_cache_file_header, f);
-		ctx.f = f;
-		ctx.forced = force;
-		g_hash_table_foreach(sha1_cache, dump_cache_one_entry, &ctx);
-		if (file_config_close(f, &fp)) {
-			cache_dirty = FALSE;
-		}
-	}
+	huge_cache_prune_old();
+	return TRUE;		/* Keep calling */
+}
 
-	/*
-	 * Update the timestamp even on failure to avoid that we retry this
-	 * too frequently.
-	 */
-	cache_dumped = tm_time();
+/**
+ * Callout queue periodic event to synchronize persistent DB.
+ */
+static gboolean
+huge_cache_sync(void *unused_obj)
+{
+	(void) unused_obj;
+
+	dbstore_sync_flush(db_sha1);
+	return TRUE;		/* Keep calling */
 }
 
 /**
- * This function is used to read the disk cache into memory.
+ ** Import of the text cache
+ **/
+
+/**
+ * This function is used to import the text cache into the database.
  *
  * It must be passed one line from the cache (ending with '\n'). It
  * performs all the syntactic processing to extract the fields from
- * the line and calls add_volatile_cache_entry() to append the record
- * to the in-memory cache.
+ * the line and calls huge_cache_store() to record the entry.
+ *
+ * @return TRUE if an entry was imported.
  */
-static G_GNUC_COLD void
+static G_GNUC_COLD gboolean
 parse_and_append_cache_entry(char *line)
 {
 	const char *file_name;
@@ -300,7 +339,7 @@ parse_and_append_cache_entry(char *line)
 	/* Skip comments and blank lines */
 	c = line[0];
 	if (c == '\0' || c == '#' || c == '\n')
-		return;
+		return FALSE;
 
 	/* Scan until file size */
 
@@ -363,29 +402,44 @@ parse_and_append_cache_entry(char *line)
 	/* Set string end markers */
 	*file_name_end = '\0';
 
-	add_volatile_cache_entry(file_name, size, mtime,
-		&sha1, has_tth ? &tth : NULL, FALSE);
-	return;
+	/*
+	 * Imported entries are considered as seen now, so that they are not
+	 * pruned before the library had a chance to be scanned.
+	 */
+
+	huge_cache_store(file_name, size, mtime,
+		&sha1, has_tth ? &tth : NULL, tm_time());
+	return TRUE;
 
 failure:
 	g_warning("Malformed line in SHA1 cache file: %s", line);
+	return FALSE;
 }
 
 /**
- * Read the whole persistent cache into memory.
+ * Import the text cache file into the database, if present, then remove it.
  */
 static G_GNUC_COLD void
-sha1_read_cache(void)
+sha1_import_cache(void)
 {
 	FILE *f;
 	file_path_t fp[1];
 	gboolean truncated = FALSE;
+	unsigned long count = 0;
 
 	g_return_if_fail(settings_config_dir());
 
+	/*
+	 * Reading the file renames it as "sha1_cache.orig", which is only
+	 * removed once fully imported: if we crash in the middle, the import
+	 * will be resumed at next startup.
+	 */
+
 	file_path_set(fp, settings_config_dir(), "sha1_cache");
 	f = file_config_open_read("SHA-1 cache", fp, G_N_ELEMENTS(fp));
 	if (f) {
+		char *path;
+
 		for (;;) {
 			char buffer[4096];
 
@@ -396,12 +450,23 @@ sha1_read_cache(void)
 				truncated = TRUE;
 			} else if (truncated) {
 				truncated = FALSE;
-			} else {
-				parse_and_append_cache_entry(buffer);
+			} else if (parse_and_append_cache_entry(buffer)) {
+				count++;
 			}
 		}
 		fclose(f);
-		dump_cache(TRUE);
+
+		dbstore_sync_flush(db_sha1);
+
+		path = make_pathname(settings_config_dir(), "sha1_cache.orig");
+		if (-1 == unlink(path) && ENOENT != errno) {
+			g_warning("could not remove imported SHA-1 cache \"%s\": %s",
+				path, g_strerror(errno));
+		}
+		HFREE_NULL(path);
+
+		g_info("imported %lu entr%s from the text SHA-1 cache",
+			count, 1 == count ? "y" : "ies");
 	}
 }
 
@@ -431,7 +496,6 @@ gboolean
 huge_update_hashes(shared_file_t *sf,
 	const struct sha1 *sha1, const struct tth *tth)
 {
-	struct sha1_cache_entry *cached;
 	filestat_t sb;
 
 	shared_file_check(sf);
@@ -466,26 +530,9 @@ huge_update_hashes(shared_file_t *sf,
 
 	/* Update cache */
 
-	cached = g_hash_table_lookup(sha1_cache,
-					cast_to_gconstpointer(shared_file_path(sf)));
+	huge_cache_store(shared_file_path(sf), shared_file_size(sf),
+		shared_file_modification_time(sf), sha1, tth, tm_time());
 
-	if (cached) {
-		update_volatile_cache(cached, shared_file_size(sf),
-			shared_file_modification_time(sf), sha1, tth);
-		cache_dirty = TRUE;
-
-		/* Dump the cache at most about once per minute. */
-		if (!cache_dumped || delta_time(tm_time(), cache_dumped) > 60) {
-			dump_cache(FALSE);
-		}
-	} else {
-		add_volatile_cache_entry(shared_file_path(sf),
-			shared_file_size(sf), shared_file_modification_time(sf),
-			sha1, tth, TRUE);
-		add_persistent_cache_entry(shared_file_path(sf),
-			shared_file_size(sf), shared_file_modification_time(sf),
-			sha1, tth);
-	}
 	if (NULL == tth) {
 		request_tigertree(sf, FALSE);
 	}
@@ -501,7 +548,7 @@ huge_update_hashes(shared_file_t *sf,
 static gboolean
 huge_need_sha1(shared_file_t *sf)
 {
-	struct sha1_cache_entry *cached;
+	const struct sha1_cache_entry *cached;
 
 	shared_file_check(sf);
 
@@ -520,7 +567,7 @@ huge_need_sha1(shared_file_t *sf)
 	 * yet.  This means that when we rescan the library during a computation,
 	 * we'll add duplicates to our working queue.
 	 *
-	 * Fortunately, we can probe our in-core cache to see if what we have
+	 * Fortunately, we can probe our cache to see if what we have
 	 * is already up-to-date.
 	 *
 	 * XXX It would be best to maintain a hash table of all the filenames
@@ -528,7 +575,7 @@ huge_need_sha1(shared_file_t *sf)
 	 * XXX		--RAM, 21/05/2002
 	 */
 
-	cached = g_hash_table_lookup(sha1_cache, shared_file_path(sf));
+	cached = huge_cache_lookup(shared_file_path(sf));
 	if (cached) {
 		filestat_t sb;
 
@@ -559,7 +606,8 @@ huge_need_sha1(shared_file_t *sf)
  * computation of SHA1 values for shared_file is repeatedly requested
  * through sha1_set_digest. If the value is found in the cache (and
  * the cache is up to date), it's set immediately. Otherwise, the file
- * is put in a queue for it's SHA1 digest to be computed.
+ * is put in a queue for its SHA1 and TTH digests to be computed, both
+ * at once to read the file only once.
  */
 
 static gboolean
@@ -572,15 +620,31 @@ huge_verify_callback(const struct verify *ctx, enum verify_status status,
 	switch (status) {
 	case VERIFY_START:
 		gnet_prop_set_boolean_val(PROP_SHA1_REBUILDING, TRUE);
+		gnet_prop_set_boolean_val(PROP_TTH_REBUILDING, TRUE);
 		return huge_need_sha1(sf);
 	case VERIFY_PROGRESS:
 		return 0 != (SHARE_F_INDEXED & shared_file_flags(sf));
 	case VERIFY_DONE:
-		huge_update_hashes(sf, verify_sha1_digest(ctx), NULL);
+		{
+			const struct tth *tth = verify_tth_digest(ctx);
+
+			huge_update_hashes(sf, verify_sha1_digest(ctx), tth);
+
+			/*
+			 * Only keep the leaves if the TTH was accepted: the file
+			 * may have been modified during the computation.
+			 */
+
+			if (shared_file_tth(sf) && tth_eq(shared_file_tth(sf), tth)) {
+				tth_cache_insert(tth, verify_tth_leaves(ctx),
+					verify_tth_leave_count(ctx));
+			}
+		}
 		/* FALL THROUGH */
 	case VERIFY_ERROR:
 	case VERIFY_SHUTDOWN:
 		gnet_prop_set_boolean_val(PROP_SHA1_REBUILDING, FALSE);
+		gnet_prop_set_boolean_val(PROP_TTH_REBUILDING, FALSE);
 		shared_file_unref(&sf);
 		return TRUE;
 	case VERIFY_INVALID:
@@ -601,7 +665,7 @@ queue_shared_file_for_sha1_computation(shared_file_t *sf)
 	
  	shared_file_check(sf);
 
-	inserted = verify_sha1_enqueue(FALSE, shared_file_path(sf),
+	inserted = verify_sha1_tth_enqueue(FALSE, shared_file_path(sf),
 					shared_file_size(sf), huge_verify_callback,
 					shared_file_ref(sf));
 	if (!inserted) {
@@ -610,7 +674,7 @@ queue_shared_file_for_sha1_computation(shared_file_t *sf)
 }
 
 /**
- * Check to see if an (in-memory) entry cache is up to date.
+ * Check to see if a cached entry is up to date.
  *
  * @return true (in the C sense) if it is, or false otherwise.
  */
@@ -630,7 +694,7 @@ sha1_is_cached(const shared_file_t *sf)
 {
 	const struct sha1_cache_entry *cached;
 
-	cached = g_hash_table_lookup(sha1_cache, shared_file_path(sf));
+	cached = huge_cache_lookup(shared_file_path(sf));
 	return cached && cached_entry_up_to_date(cached, sf);
 }
 
@@ -641,16 +705,15 @@ sha1_is_cached(const shared_file_t *sf)
 void
 request_sha1(shared_file_t *sf)
 {
-	struct sha1_cache_entry *cached;
+	const struct sha1_cache_entry *cached;
 
 	shared_file_check(sf);
 
-	cached = g_hash_table_lookup(sha1_cache, shared_file_path(sf));
+	cached = huge_cache_lookup(shared_file_path(sf));
 	if (cached && cached_entry_up_to_date(cached, sf)) {
-		cache_dirty = TRUE;
-		cached->shared = TRUE;
-		shared_file_set_sha1(sf, cached->sha1);
-		shared_file_set_tth(sf, cached->tth);
+		shared_file_set_sha1(sf, &cached->sha1);
+		shared_file_set_tth(sf, cached->has_tth ? &cached->tth : NULL);
+		huge_cache_seen(shared_file_path(sf), cached);
 		request_tigertree(sf, FALSE);
 	} else {
 
@@ -891,28 +954,24 @@ huge_collect_locations(const struct sha1 *sha1, const header_t *header)
 void
 huge_init(void)
 {
-	sha1_cache = g_hash_table_new(pointer_hash_func, NULL);
-	sha1_read_cache();
-	has_http_urls = pattern_compile("http://");
-}
+	dbstore_kv_t kv = { MAX_PATH_LEN, huge_cache_keylen,
+		sizeof(struct sha1_cache_entry), sizeof(struct sha1_cache_entry) };
+	dbstore_packing_t packing =
+		{ serialize_sha1_cache_entry, deserialize_sha1_cache_entry, NULL };
 
-/**
- * Free SHA1 cache entry.
- */
-static gboolean
-cache_free_entry(gpointer unused_key, gpointer v, gpointer unused_udata)
-{
-	struct sha1_cache_entry *e = v;
+	db_sha1 = dbstore_open(db_sha1_what, settings_gnet_db_dir(),
+		db_sha1_base, kv, packing, HUGE_CACHE_SIZE, g_str_hash, g_str_equal,
+		FALSE);
 
-	(void) unused_key;
-	(void) unused_udata;
+	sha1_import_cache();
+	huge_cache_prune_old();
 
-	atom_str_free_null(&e->file_name);
-	atom_sha1_free_null(&e->sha1);
-	atom_tth_free_null(&e->tth);
-	WFREE(e);
+	huge_sync_ev = cq_periodic_main_add(HUGE_SYNC_PERIOD,
+		huge_cache_sync, NULL);
+	huge_prune_ev = cq_periodic_main_add(HUGE_PRUNE_PERIOD,
+		huge_cache_prune, NULL);
 
-	return TRUE;
+	has_http_urls = pattern_compile("http://");
 }
 
 /**
@@ -921,10 +980,11 @@ cache_free_entry(gpointer unused_key, gpointer v, gpointer unused_udata)
 void
 huge_close(void)
 {
-	dump_cache(FALSE);
+	cq_periodic_remove(&huge_sync_ev);
+	cq_periodic_remove(&huge_prune_ev);
 
-	g_hash_table_foreach_remove(sha1_cache, cache_free_entry, NULL);
-	gm_hash_table_destroy_null(&sha1_cache);
+	dbstore_close(db_sha1, settings_gnet_db_dir(), db_sha1_base);
+	db_sha1 = NULL;
 
 	pattern_free(has_http_urls);
 	has_http_urls = NULL;
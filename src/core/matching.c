@@ -43,7 +43,6 @@
 #include "if/gnet_property_priv.h"
 
 #include "lib/override.h"		/* Must be the last header included */
-
 #define WOVEC_DFLT	10			/**< Default size of word-vectors */
 
 /*
@@ -56,29 +55,53 @@
 /*
  * Search table searching routines.
  *
- * We're building an inverted index of all the file names by linking
- * together all the names having in common sequences of two chars.
+ * We're building an inverted index of all the file names, mapping short
+ * keys to the sorted list of entries (the "posting list") holding them.
+ * Entries are numbered in insertion order, so posting lists are naturally
+ * built sorted.
+ *
+ * Since st_search() only matches query words at the *beginning* of words
+ * in the file name, we index for each word of a name:
  *
- * For instance, given the filenames "foo", "bar", "ar" and "arc", we'll
- * have the following bins:
+ *  - its first 1, 2 and 3 characters as "prefix" keys,
+ *  - all the sequences of 3 characters it contains as "trigram" keys.
  *
- *    bin["fo"] = { "foo" };
- *    bin["oo"] = { "foo" };
- *    bin["ba"] = { "bar" };
- *    bin["ar"] = { "bar", "ar", "arc" };
- *    bin["rc"] = { "arc" };
+ * For instance, given the filenames "foo", "bar" and "arc", we'll have:
  *
- * Now assume we're looking for "arc". We're scanning the pattern to find
- * the bin which has the less amount of files listed insided.  The patterns
- * gives us the bins "ar" and "rc", and:
+ *    prefix["f"] = prefix["fo"] = prefix["foo"] = trigram["foo"] = { 0 };
+ *    prefix["b"] = prefix["ba"] = prefix["bar"] = trigram["bar"] = { 1 };
+ *    prefix["a"] = prefix["ar"] = prefix["arc"] = trigram["arc"] = { 2 };
  *
- *    bin["ar"] has 3 items
- *    bin["rc"] has 1
+ * Now assume we're looking for "rc".  There is no prefix["rc"], hence we
+ * know immediately that there cannot be any match.  When looking for
+ * "arcade", we intersect prefix["arc"], trigram["rca"], trigram["cad"] and
+ * trigram["ade"], starting with the smallest lists.  Only the entries
+ * surviving the intersection are then matched against the query words.
  *
- * Therefore we'll look for "arc" in the bin["rc"] list.
+ * Posting lists are stored as delta-encoded varints, cut in blocks of
+ * ST_BLOCK entries whose first entry is recorded in a skip table, so that
+ * we can gallop over the larger lists during intersection without having
+ * to decode them entirely.
  */
 
 #define ST_MIN_BIN_SIZE		4
+#define ST_BLOCK			64		/**< Entries per posting list block */
+#define ST_MAX_TERMS		16		/**< Max lists intersected per search */
+
+/*
+ * Index keys: the kind of key in the upper byte, then up to 3 characters.
+ */
+
+#define ST_KEY_PREFIX1		1
+#define ST_KEY_PREFIX2		2
+#define ST_KEY_PREFIX3		3
+#define ST_KEY_TRIGRAM		4
+
+#define ST_KEY(kind, s, n) \
+	(((kind) << 24) | \
+	 ((guint32) (guchar) (s)[0] << 16) | \
+	 ((n) > 1 ? (guint32) (guchar) (s)[1] << 8 : 0) | \
+	 ((n) > 2 ? (guint32) (guchar) (s)[2] : 0))
 
 struct st_entry {
 	const char *string;				/* atom */
@@ -91,15 +114,51 @@ struct st_bin {
 	struct st_entry **vals;
 };
 
+/**
+ * Skip table entry, one per block of a posting list.
+ */
+struct st_skip {
+	guint32 id;				/**< First entry of the block */
+	guint32 offset;			/**< Offset of the next entry in the data */
+};
+
+/**
+ * A posting list: the sorted entry numbers holding a given key.
+ */
+struct st_posting {
+	guint8 *data;			/**< Varint deltas between consecutive entries */
+	struct st_skip *skip;	/**< Skip table, one item per block */
+	guint32 len;			/**< Amount of data bytes used */
+	guint32 size;			/**< Amount of data bytes allocated */
+	guint32 nskip;			/**< Amount of blocks */
+	guint32 skip_size;		/**< Amount of skip items allocated */
+	guint32 count;			/**< Amount of entries in list */
+	guint32 last;			/**< Last entry inserted */
+	unsigned mapped:1;		/**< Data and skip table lie in a mapped image */
+};
+
+/**
+ * Cursor iterating over a posting list.
+ */
+struct st_cursor {
+	const struct st_posting *pl;
+	guint32 idx;			/**< Index of current entry in the list */
+	guint32 block;			/**< Block of current entry */
+	guint32 offset;			/**< Offset of next entry in the data */
+	guint32 id;				/**< Current entry */
+};
+
 enum search_table_magic { SEARCH_TABLE_MAGIC = 0x0cf66242 };
 
 struct search_table {
 	enum search_table_magic magic;
-	int nentries, nchars, nbins;
-	struct st_bin **bins;
+	int nentries;
+	GHashTable *index;			/**< Key => struct st_posting */
+	GHashTable *by_file;		/**< shared_file_t => struct st_entry */
 	struct st_bin all_entries;
-	guchar index_map[MAX_INT_VAL(guchar)];
-	guchar fold_map[MAX_INT_VAL(guchar)];
+	void *image;				/**< Mapped image holding posting lists */
+	size_t image_len;			/**< Length of image */
+	st_image_free_t image_free;	/**< Releases the image */
 };
 
 static inline void
@@ -115,7 +174,8 @@ destroy_entry(struct st_entry *entry)
 	g_assert(entry != NULL);
 
 	atom_str_free_null(&entry->string);
-	shared_file_unref(&entry->sf);
+	if (entry->sf != NULL)
+		shared_file_unref(&entry->sf);
 	WFREE(entry);
 }
 
@@ -135,19 +195,6 @@ bin_initialize(struct st_bin *bin, int size)
 		bin->vals[i] = NULL;
 }
 
-/**
- * Allocate a bin.
- */
-static struct st_bin *
-bin_allocate(void)
-{
-	struct st_bin *bin;
-
-	WALLOC(bin);
-	bin_initialize(bin, ST_MIN_BIN_SIZE);
-	return bin;
-}
-
 /**
  * Destroy a bin.
  *
@@ -186,103 +233,266 @@ bin_compact(struct st_bin *bin)
 	bin->nslots = bin->nvals;
 }
 
-static guchar map[MAX_INT_VAL(guchar)];
+/**
+ * Free posting list.
+ */
+static void
+posting_free(struct st_posting *pl)
+{
+	if (!pl->mapped) {
+		HFREE_NULL(pl->data);
+		HFREE_NULL(pl->skip);
+	}
+	WFREE(pl);
+}
 
+/**
+ * Copy posting list data out of the mapped image, so that it can be modified.
+ */
 static void
-setup_map(void)
+posting_unmap(struct st_posting *pl)
 {
-	static gboolean done;
-	guint i;
+	g_assert(pl->mapped);
+
+	pl->data = pl->len != 0 ? hcopy(pl->data, pl->len) : NULL;
+	pl->skip = pl->nskip != 0 ?
+		hcopy(pl->skip, pl->nskip * sizeof pl->skip[0]) : NULL;
+	pl->size = pl->len;
+	pl->skip_size = pl->nskip;
+	pl->mapped = FALSE;
+}
 
-	if (done)
-		return;
+/**
+ * Append entry `id' to the posting list, unless it is already the last one.
+ *
+ * Entries must be appended in increasing order.
+ */
+static void
+posting_append(struct st_posting *pl, guint32 id)
+{
+	if (pl->mapped)
+		posting_unmap(pl);
 
-	for (i = 0; i < G_N_ELEMENTS(map); i++)	{
-		guchar c;
-
-		if (i > 0 && utf8_byte_is_allowed(i)) {
-			if (is_ascii_upper(i)) {
-				c = ascii_tolower(i);
-			} else if (
-				is_ascii_punct(i) || is_ascii_cntrl(i) || is_ascii_space(i)
-			) {
-				c = ' ';
-			} else { 
-				c = i;
-			}
-		} else {
-			c = 0;
+	if (pl->count != 0) {
+		if (pl->last == id)
+			return;					/* Key seen twice in same entry */
+		g_assert(id > pl->last);
+	}
+
+	if (0 == pl->count % ST_BLOCK) {
+		struct st_skip *sk;
+
+		if (pl->nskip == pl->skip_size) {
+			pl->skip_size = MAX(4, pl->skip_size * 2);
+			pl->skip = hrealloc(pl->skip, pl->skip_size * sizeof pl->skip[0]);
+		}
+		sk = &pl->skip[pl->nskip++];
+		sk->id = id;
+		sk->offset = pl->len;
+	} else {
+		guint32 delta = id - pl->last;
+
+		if (pl->size - pl->len < 5) {		/* Max varint size for 32 bits */
+			pl->size = MAX(16, pl->size * 2);
+			pl->data = hrealloc(pl->data, pl->size);
 		}
-		map[i] = c;
+
+		while (delta >= 0x80) {
+			pl->data[pl->len++] = (delta & 0x7f) | 0x80;
+			delta >>= 7;
+		}
+		pl->data[pl->len++] = delta;
 	}
 
-	done = TRUE;
+	pl->last = id;
+	pl->count++;
 }
 
 /**
- * Initialize permanent data in search table.
+ * Makes a posting list take as little memory as needed.
  */
 static void
-st_initialize(search_table_t *table)
+posting_compact(gpointer unused_key, gpointer value, gpointer unused_udata)
 {
-	guchar cur_char = '\0';
-	guint i;
+	struct st_posting *pl = value;
 
-	search_table_check(table);
+	(void) unused_key;
+	(void) unused_udata;
+
+	if (pl->mapped)
+		return;
+
+	pl->data = hrealloc(pl->data, pl->len);
+	pl->size = pl->len;
+	pl->skip = hrealloc(pl->skip, pl->nskip * sizeof pl->skip[0]);
+	pl->skip_size = pl->nskip;
+}
+
+/**
+ * Position cursor at the first entry of the posting list.
+ */
+static void
+cursor_start(struct st_cursor *c, const struct st_posting *pl)
+{
+	g_assert(pl->count > 0);
+
+	c->pl = pl;
+	c->idx = 0;
+	c->block = 0;
+	c->offset = pl->skip[0].offset;
+	c->id = pl->skip[0].id;
+}
+
+/**
+ * Move cursor to the next entry.
+ *
+ * @return FALSE when the end of the list was reached.
+ */
+static inline gboolean
+cursor_next(struct st_cursor *c)
+{
+	const struct st_posting *pl = c->pl;
+
+	if (++c->idx >= pl->count)
+		return FALSE;
+
+	if (0 == c->idx % ST_BLOCK) {
+		c->block++;
+		c->offset = pl->skip[c->block].offset;
+		c->id = pl->skip[c->block].id;
+	} else {
+		guint32 delta = 0;
+		unsigned shift = 0;
+		guint8 b;
+
+		do {
+			b = pl->data[c->offset++];
+			delta |= (guint32) (b & 0x7f) << shift;
+			shift += 7;
+		} while (b & 0x80);
+
+		c->id += delta;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Move cursor forward to the first entry greater or equal to `target'.
+ *
+ * We gallop over the skip table to locate the block that may hold the
+ * target, then decode that block sequentially.
+ *
+ * @return FALSE when the end of the list was reached.
+ */
+static gboolean
+cursor_seek(struct st_cursor *c, guint32 target)
+{
+	const struct st_posting *pl = c->pl;
+	guint32 lo, hi, step;
+
+	if (c->idx >= pl->count)
+		return FALSE;
 
-	table->nentries = table->nchars = 0;
-	setup_map();
+	if (c->id >= target)
+		return TRUE;
 
 	/*
-	 * The indexing map is used to avoid having 256*256 bins.
+	 * Invariant: skip[lo].id <= c->id < target.
 	 */
 
-	for (i = 0; i < G_N_ELEMENTS(table->index_map); i++) {
-		guchar map_char = map[i];
+	lo = c->block;
+	hi = lo + 1;
+	step = 1;
 
-		if (table->fold_map[map_char]) {
-			table->index_map[i] = table->fold_map[map_char];
-		} else {
-			table->fold_map[map_char] = cur_char;
-			table->index_map[i] = cur_char;
-			cur_char++;
-		}
+	while (hi < pl->nskip && pl->skip[hi].id <= target) {
+		lo = hi;
+		step *= 2;
+		hi = lo + step;
 	}
+	hi = MIN(hi, pl->nskip);
 
-	table->nchars = cur_char;
-	table->nbins = table->nchars * table->nchars;
-	table->bins = NULL;
-	table->all_entries.vals = 0;
+	while (hi - lo > 1) {
+		guint32 mid = lo + (hi - lo) / 2;
 
-	if (GNET_PROPERTY(matching_debug)) {
-		static gboolean done;
+		if (pl->skip[mid].id <= target)
+			lo = mid;
+		else
+			hi = mid;
+	}
 
-		if (!done) {
-			done = TRUE;
-			g_debug("MATCH search tables will use %d bins max "
-				"(%d indexing chars)", table->nbins, table->nchars);
-		}
+	if (lo != c->block) {
+		c->block = lo;
+		c->idx = lo * ST_BLOCK;
+		c->offset = pl->skip[lo].offset;
+		c->id = pl->skip[lo].id;
+	}
+
+	while (c->id < target) {
+		if (!cursor_next(c))
+			return FALSE;
 	}
+
+	return TRUE;
 }
 
 /**
- * Recreate variable parts of the search table.
+ * Record that entry `id' holds the key.
  */
 static void
-st_recreate(search_table_t *table)
+st_index_key(search_table_t *table, guint32 key, guint32 id)
 {
-	int i;
+	struct st_posting *pl;
 
+	pl = g_hash_table_lookup(table->index, GUINT_TO_POINTER(key));
+	if (NULL == pl) {
+		WALLOC0(pl);
+		g_hash_table_insert(table->index, GUINT_TO_POINTER(key), pl);
+	}
+
+	posting_append(pl, id);
+}
+
+/**
+ * Initialize permanent data in search table.
+ */
+static void
+st_initialize(search_table_t *table)
+{
 	search_table_check(table);
-	g_assert(NULL == table->bins);
 
-	table->bins = halloc(table->nbins * sizeof table->bins[0]);
-	for (i = 0; i < table->nbins; i++)
-		table->bins[i] = NULL;
+	table->nentries = 0;
+	table->index = NULL;
+	table->by_file = NULL;
+	table->all_entries.vals = 0;
+	table->image = NULL;
+	table->image_len = 0;
+	table->image_free = NULL;
+}
 
+/**
+ * Recreate variable parts of the search table.
+ */
+static void
+st_recreate(search_table_t *table)
+{
+	search_table_check(table);
+	g_assert(NULL == table->index);
+
+	table->index = g_hash_table_new(NULL, NULL);
+	table->by_file = g_hash_table_new(NULL, NULL);
     bin_initialize(&table->all_entries, ST_MIN_BIN_SIZE);
 }
 
+static void
+st_free_posting_kv(gpointer unused_key, gpointer value, gpointer unused_udata)
+{
+	(void) unused_key;
+	(void) unused_udata;
+
+	posting_free(value);
+}
+
 /**
  * Destroy a search table.
  */
@@ -293,16 +503,15 @@ st_destroy(search_table_t *table)
 
 	search_table_check(table);
 
-	if (table->bins) {
-		for (i = 0; i < table->nbins; i++) {
-			struct st_bin *bin = table->bins[i];
+	if (table->index) {
+		g_hash_table_foreach(table->index, st_free_posting_kv, NULL);
+		g_hash_table_destroy(table->index);
+		table->index = NULL;
+	}
 
-			if (bin) {
-				bin_destroy(bin);
-				WFREE(bin);
-			}
-		}
-		HFREE_NULL(table->bins);
+	if (table->by_file) {
+		g_hash_table_destroy(table->by_file);
+		table->by_file = NULL;
 	}
 
 	if (table->all_entries.vals) {
@@ -312,6 +521,15 @@ st_destroy(search_table_t *table)
 		}
 		bin_destroy(&table->all_entries);
 	}
+
+	/*
+	 * Posting lists are gone, we can now release the image they pointed to.
+	 */
+
+	if (table->image != NULL) {
+		(*table->image_free)(table->image, table->image_len);
+		table->image = NULL;
+	}
 }
 
 /**
@@ -354,7 +572,7 @@ st_count(const search_table_t *table)
 {
 	search_table_check(table);
 
-	return table->all_entries.nvals;
+	return table->nentries;
 }
 
 /**
@@ -381,20 +599,13 @@ mask_hash(const char *s) {
 	return mask;
 }
 
-/**
- * Get key of two-char pair.
- */
-static inline int
-st_key(search_table_t *table, const char k[2])
-{
-	return table->index_map[(guchar) k[0]] * table->nchars +
-		table->index_map[(guchar) k[1]];
-}
-
 /**
  * Insert an item into the search_table
  * one-char strings are silently ignored.
  *
+ * The string must be canonized the same way st_search() canonizes queries,
+ * so that words are only separated by spaces.
+ *
  * @return TRUE if the item was inserted; FALSE otherwise.
  */
 gboolean
@@ -402,40 +613,79 @@ st_insert_item(search_table_t *table, const char *s, const shared_file_t *sf)
 {
 	size_t i, len;
 	struct st_entry *entry;
-	GHashTable *seen_keys;
+	guint32 id;
+	const char *p;
 
 	len = utf8_char_count(s);
 	if ((size_t) -1 == len || len < 2)
 		return FALSE;
 
-	seen_keys = g_hash_table_new(NULL, NULL);
-
 	WALLOC(entry);
 	entry->string = atom_str_get(s);
 	entry->sf = shared_file_ref(sf);
 	entry->mask = mask_hash(entry->string);
 
-	len = strlen(entry->string);
-	for (i = 0; i < len - 1; i++) {
-		int key = st_key(table, &entry->string[i]);
+	id = table->all_entries.nvals;
+	p = entry->string;
+
+	while (*p != '\0') {
+		size_t wlen;
+
+		if (' ' == *p) {
+			p++;
+			continue;
+		}
 
-		/* don't insert item into same bin twice */
-		if (g_hash_table_lookup(seen_keys, GINT_TO_POINTER(key)))
+		for (wlen = 1; p[wlen] != '\0' && p[wlen] != ' '; wlen++)
 			continue;
 
-		g_hash_table_insert(seen_keys, GINT_TO_POINTER(key),
-			GINT_TO_POINTER(1));
+		st_index_key(table, ST_KEY(ST_KEY_PREFIX1, p, 1), id);
+		if (wlen >= 2)
+			st_index_key(table, ST_KEY(ST_KEY_PREFIX2, p, 2), id);
+		if (wlen >= 3)
+			st_index_key(table, ST_KEY(ST_KEY_PREFIX3, p, 3), id);
 
-		g_assert(key < table->nbins);
-		if (table->bins[key] == NULL)
-			table->bins[key] = bin_allocate();
+		for (i = 0; i + 3 <= wlen; i++)
+			st_index_key(table, ST_KEY(ST_KEY_TRIGRAM, &p[i], 3), id);
 
-		bin_insert_item(table->bins[key], entry);
+		p += wlen;
 	}
+
 	bin_insert_item(&table->all_entries, entry);
+	g_hash_table_insert(table->by_file, entry->sf, entry);
 	table->nentries++;
 
-	g_hash_table_destroy(seen_keys);
+	return TRUE;
+}
+
+/**
+ * Remove the entry for the shared file from the table.
+ *
+ * The entry is only emptied: its number remains referenced by the posting
+ * lists, which cannot be updated in place, and st_search() skips it.
+ * The entry is located through the file, so that bursts of removals
+ * do not need to scan the whole table each time.
+ *
+ * @return TRUE if the item was found and removed.
+ */
+gboolean
+st_remove_item(search_table_t *table, const shared_file_t *sf)
+{
+	struct st_entry *entry;
+
+	search_table_check(table);
+
+	entry = g_hash_table_lookup(table->by_file, sf);
+	if (NULL == entry)
+		return FALSE;
+
+	g_assert(entry->sf == sf);
+
+	g_hash_table_remove(table->by_file, sf);
+	shared_file_unref(&entry->sf);
+	entry->mask = 0;
+	table->nentries--;
+
 	return TRUE;
 }
 
@@ -445,15 +695,380 @@ st_insert_item(search_table_t *table, const char *s, const shared_file_t *sf)
 void
 st_compact(search_table_t *table)
 {
-	int i;
-
 	if (!table->all_entries.nvals)
 		return;			/* Nothing in table */
 
 	bin_compact(&table->all_entries);
-	for (i = 0; i < table->nbins; i++)
-		if (table->bins[i])
-			bin_compact(table->bins[i]);
+	g_hash_table_foreach(table->index, posting_compact, NULL);
+}
+
+/**
+ * Iterate over all the shared files in the table, in insertion order,
+ * which is the order st_load() expects them.
+ *
+ * The table must not have had any item removed.
+ */
+void
+st_foreach(const search_table_t *table, st_foreach_cb cb, gpointer udata)
+{
+	int i;
+
+	search_table_check(table);
+
+	g_assert(table->nentries == table->all_entries.nvals);
+
+	for (i = 0; i < table->all_entries.nvals; i++)
+		(*cb)(table->all_entries.vals[i]->sf, udata);
+}
+
+/*
+ * Persistent image of the index.
+ *
+ * The image is made of a header followed by all the posting lists, each
+ * one being a posting list header, its skip table and its data, padded to
+ * a multiple of 4 bytes.  Everything is written in native byte order and
+ * aligned on 4 bytes, so that posting lists can be used in place once the
+ * image is mapped in memory.
+ */
+
+#define ST_IMAGE_MAGIC		0x58495453U		/* "STIX" in little-endian */
+#define ST_IMAGE_VERSION	1
+
+struct st_image_header {
+	guint32 magic;
+	guint32 version;
+	guint32 entries;		/**< Amount of entries in the table */
+	guint32 keys;			/**< Amount of posting lists */
+};
+
+struct st_image_posting {
+	guint32 key;
+	guint32 count;
+	guint32 last;
+	guint32 nskip;
+	guint32 len;
+};
+
+static void
+st_save_posting(gpointer key, gpointer value, gpointer udata)
+{
+	const struct st_posting *pl = value;
+	struct st_image_posting ip;
+	FILE *f = udata;
+	static const char zero[4];
+
+	ip.key = GPOINTER_TO_UINT(key);
+	ip.count = pl->count;
+	ip.last = pl->last;
+	ip.nskip = pl->nskip;
+	ip.len = pl->len;
+
+	fwrite(&ip, sizeof ip, 1, f);
+	fwrite(pl->skip, sizeof pl->skip[0], pl->nskip, f);
+	fwrite(pl->data, 1, pl->len, f);
+	fwrite(zero, 1, (4 - (pl->len & 3)) & 3, f);
+}
+
+/**
+ * Save image of the index to the file, at the current position, which must
+ * be aligned on 4 bytes.
+ *
+ * @return TRUE on success.
+ */
+gboolean
+st_save(const search_table_t *table, FILE *f)
+{
+	struct st_image_header h;
+
+	search_table_check(table);
+	g_assert(0 == (ftell(f) & 3));
+
+	h.magic = ST_IMAGE_MAGIC;
+	h.version = ST_IMAGE_VERSION;
+	h.entries = table->all_entries.nvals;
+	h.keys = g_hash_table_size(table->index);
+
+	fwrite(&h, sizeof h, 1, f);
+	g_hash_table_foreach(table->index, st_save_posting, f);
+
+	return !ferror(f);
+}
+
+/**
+ * Check that a posting list read from an image can be safely traversed by
+ * cursors: every delta must be decoded within the data, every skip item
+ * must point where its block starts, and all the entries must be strictly
+ * increasing and below `count'.
+ *
+ * @return TRUE if the posting list is valid.
+ */
+static gboolean
+posting_check(const struct st_posting *pl, size_t count)
+{
+	guint32 i, offset = 0, id = 0;
+
+	for (i = 0; i < pl->count; i++) {
+		if (0 == i % ST_BLOCK) {
+			const struct st_skip *sk = &pl->skip[i / ST_BLOCK];
+
+			if (sk->offset != offset || sk->id >= count)
+				return FALSE;
+			if (i != 0 && sk->id <= id)
+				return FALSE;
+			id = sk->id;
+		} else {
+			guint32 delta = 0;
+			unsigned shift = 0;
+			guint8 b;
+
+			do {
+				if (offset >= pl->len || shift > 28)
+					return FALSE;
+				b = pl->data[offset++];
+				delta |= (guint32) (b & 0x7f) << shift;
+				shift += 7;
+			} while (b & 0x80);
+
+			if (0 == delta || delta >= count - id)
+				return FALSE;
+			id += delta;
+		}
+	}
+
+	return offset == pl->len && id == pl->last;
+}
+
+/**
+ * Create a search table from an image saved by st_save(), using the posting
+ * lists in place.
+ *
+ * @param base			start of the memory region holding the image
+ * @param len			length of the memory region
+ * @param offset		offset of the image in the region, multiple of 4
+ * @param files			shared files, in the order given by st_foreach()
+ * @param count			amount of shared files
+ * @param image_free	called to release the region when table is freed
+ *
+ * The image comes from disk and may be truncated or corrupted, so all the
+ * posting lists are fully checked before being used in place.
+ *
+ * @return the new table, NULL if the image is invalid, in which case the
+ * caller remains responsible for the memory region.
+ */
+search_table_t *
+st_load(void *base, size_t len, size_t offset,
+	const struct shared_file **files, size_t count,
+	st_image_free_t image_free)
+{
+	search_table_t *table;
+	struct st_image_header h;
+	const char *p, *end;
+	size_t i;
+
+	g_assert(base != NULL);
+	g_assert(0 == (pointer_to_ulong(base) & 3));
+	g_assert(0 == (offset & 3));
+	g_assert(image_free != NULL);
+
+	if (offset > len || len - offset < sizeof h)
+		return NULL;
+
+	p = const_ptr_add_offset(base, offset);
+	end = const_ptr_add_offset(base, len);
+
+	memcpy(&h, p, sizeof h);
+	p += sizeof h;
+
+	if (
+		h.magic != ST_IMAGE_MAGIC || h.version != ST_IMAGE_VERSION ||
+		h.entries != count
+	)
+		return NULL;
+
+	table = st_create();
+
+	for (i = 0; i < h.keys; i++) {
+		const struct st_image_posting *ip = (const void *) p;
+		struct st_posting *pl;
+		size_t size;
+
+		if (UNSIGNED(end - p) < sizeof *ip)
+			goto failed;
+
+		if (
+			0 == ip->count || ip->count > count || ip->last >= count ||
+			ip->nskip != (ip->count + ST_BLOCK - 1) / ST_BLOCK ||
+			ip->len > 5 * ip->count
+		)
+			goto failed;
+
+		size = sizeof *ip + ip->nskip * sizeof pl->skip[0] +
+			((ip->len + 3) & ~3U);
+
+		if (UNSIGNED(end - p) < size)
+			goto failed;
+
+		if (g_hash_table_lookup(table->index, GUINT_TO_POINTER(ip->key)))
+			goto failed;
+
+		WALLOC0(pl);
+		pl->skip = deconstify_gpointer(&ip[1]);
+		pl->data = (guint8 *) &pl->skip[ip->nskip];
+		pl->count = ip->count;
+		pl->last = ip->last;
+		pl->nskip = pl->skip_size = ip->nskip;
+		pl->len = pl->size = ip->len;
+		pl->mapped = TRUE;
+
+		g_hash_table_insert(table->index, GUINT_TO_POINTER(ip->key), pl);
+
+		if (!posting_check(pl, count))
+			goto failed;
+
+		p += size;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct st_entry *entry;
+
+		WALLOC(entry);
+		entry->string = atom_str_get(shared_file_name_canonic(files[i]));
+		entry->sf = shared_file_ref(files[i]);
+		entry->mask = mask_hash(entry->string);
+		bin_insert_item(&table->all_entries, entry);
+		g_hash_table_insert(table->by_file, entry->sf, entry);
+		table->nentries++;
+	}
+
+	table->image = base;
+	table->image_len = len;
+	table->image_free = image_free;
+
+	return table;
+
+failed:
+	st_free(&table);
+	return NULL;
+}
+
+/**
+ * qsort() callback to sort posting lists by increasing size.
+ */
+static int
+posting_cmp(const void *a, const void *b)
+{
+	const struct st_posting * const *pa = a, * const *pb = b;
+
+	return CMP((*pa)->count, (*pb)->count);
+}
+
+/**
+ * Compute the entries which may match all the words of the query, by
+ * intersecting the posting lists of the keys derived from each word.
+ *
+ * Words shorter than 2 characters are not used for filtering (they would
+ * hardly filter anything) but are still checked by entry_match() later.
+ *
+ * @param table		the search table
+ * @param wovec		the query words
+ * @param wocnt		amount of query words
+ * @param count		where the amount of candidates is written
+ *
+ * @return halloc()'ed array of candidate entry numbers, NULL if there cannot
+ * be any match.
+ */
+static guint32 *
+st_candidates(search_table_t *table,
+	const word_vec_t *wovec, size_t wocnt, size_t *count)
+{
+	struct st_posting *terms[ST_MAX_TERMS * 2];
+	size_t nterms = 0;
+	struct st_cursor c;
+	guint32 *cand;
+	size_t i, n;
+
+	*count = 0;
+
+	for (i = 0; i < wocnt; i++) {
+		const char *w = wovec[i].word;
+		size_t j, wlen = wovec[i].len;
+		guint32 keys[ST_MAX_TERMS];
+		size_t nkeys = 0;
+
+		if (wlen < 2)
+			continue;
+
+		if (2 == wlen) {
+			keys[nkeys++] = ST_KEY(ST_KEY_PREFIX2, w, 2);
+		} else {
+			keys[nkeys++] = ST_KEY(ST_KEY_PREFIX3, w, 3);
+			for (j = 1; j + 3 <= wlen && nkeys < G_N_ELEMENTS(keys); j++)
+				keys[nkeys++] = ST_KEY(ST_KEY_TRIGRAM, &w[j], 3);
+		}
+
+		for (j = 0; j < nkeys; j++) {
+			struct st_posting *pl;
+
+			pl = g_hash_table_lookup(table->index, GUINT_TO_POINTER(keys[j]));
+			if (NULL == pl)
+				return NULL;		/* Key absent, no possible match */
+
+			/*
+			 * Keep only the smallest lists, which are the most selective.
+			 */
+
+			if (nterms < G_N_ELEMENTS(terms)) {
+				terms[nterms++] = pl;
+			} else {
+				qsort(terms, nterms, sizeof terms[0], posting_cmp);
+				nterms = ST_MAX_TERMS;
+				terms[nterms++] = pl;
+			}
+		}
+	}
+
+	if (0 == nterms)
+		return NULL;
+
+	qsort(terms, nterms, sizeof terms[0], posting_cmp);
+	nterms = MIN(nterms, ST_MAX_TERMS);
+
+	/*
+	 * Decode the smallest list, then filter it through the others.
+	 */
+
+	cand = halloc(terms[0]->count * sizeof cand[0]);
+	n = 0;
+	cursor_start(&c, terms[0]);
+	do {
+		cand[n++] = c.id;
+	} while (cursor_next(&c));
+
+	g_assert(n == terms[0]->count);
+
+	for (i = 1; i < nterms && n != 0; i++) {
+		size_t j, m = 0;
+
+		if (terms[i] == terms[i - 1])
+			continue;				/* Same key used twice in the query */
+
+		cursor_start(&c, terms[i]);
+		for (j = 0; j < n; j++) {
+			if (!cursor_seek(&c, cand[j]))
+				break;
+			if (c.id == cand[j])
+				cand[m++] = cand[j];
+		}
+		n = m;
+	}
+
+	if (0 == n) {
+		HFREE_NULL(cand);
+		return NULL;
+	}
+
+	*count = n;
+	return cand;
 }
 
 /**
@@ -544,15 +1159,13 @@ st_search(
 	query_hashvec_t *qhv)
 {
 	char *search;
-	int key, nres = 0;
+	int nres = 0;
 	guint i, len;
-	struct st_bin *best_bin = NULL;
-	int best_bin_size = INT_MAX;
 	word_vec_t *wovec;
 	guint wocnt;
 	cpattern_t **pattern;
-	struct st_entry **vals;
-	guint vcnt;
+	guint32 *cand;
+	size_t vcnt;
 	int scanned = 0;		/* measure search mask efficiency */
 	guint32 search_mask;
 	size_t minlen;
@@ -572,50 +1185,6 @@ st_search(
 	}
 	len = strlen(search);
 
-	/*
-	 * Find smallest bin
-	 */
-
-	if (len >= 2) {
-		for (i = 0; i < len - 1; i++) {
-			struct st_bin *bin;
-			if (is_ascii_space(search[i]) || is_ascii_space(search[i+1]))
-				continue;
-			key = st_key(table, search + i);
-			if ((bin = table->bins[key]) == NULL) {
-				best_bin = NULL;
-				break;
-			}
-			if (bin->nvals < best_bin_size) {
-				best_bin = bin;
-				best_bin_size = bin->nvals;
-			}
-		}
-
-		if (GNET_PROPERTY(matching_debug) > 4)
-			g_debug("MATCH st_search(): str=\"%s\", len=%d, best_bin_size=%d",
-				lazy_safe_search(search_term), len, best_bin_size);
-	}
-
-	/*
-	 * If the best_bin is NULL, we did not find a matching bin, and we're
-	 * sure we won't be able to find the search string.
-	 *
-	 * Note that on search strings like "r e m ", we always have a letter
-	 * followed by spaces, so we won't search that.
-	 *		--RAM, 06/10/2001
-	 */
-
-	if (best_bin == NULL) {
-		/*
-		 * If we have a `qhv', we need to compute the word vector anway,
-		 * for query routing...
-		 */
-
-		if (qhv == NULL)
-			goto finish;
-	}
-
 	/*
 	 * Prepare matching patterns
 	 */
@@ -633,14 +1202,30 @@ st_search(
 		}
 	}
 
-	if (wocnt == 0 || best_bin == NULL) {
-		if (wocnt > 0)
-			word_vec_free(wovec, wocnt);
+	if (0 == wocnt)
 		goto finish;
-	}
 
-	g_assert(best_bin_size > 0);	/* Allocated bin, it must hold something */
+	/*
+	 * Intersect the posting lists of all the query words.
+	 *
+	 * If there are no candidates, we're sure we won't be able to find the
+	 * search string.
+	 *
+	 * Note that on search strings like "r e m ", we only have one-letter
+	 * words, so we won't search that.
+	 *		--RAM, 06/10/2001
+	 */
+
+	cand = st_candidates(table, wovec, wocnt, &vcnt);
+
+	if (GNET_PROPERTY(matching_debug) > 4)
+		g_debug("MATCH st_search(): str=\"%s\", len=%d, candidates=%lu",
+			lazy_safe_search(search_term), len, (unsigned long) vcnt);
 
+	if (NULL == cand) {
+		word_vec_free(wovec, wocnt);
+		goto finish;
+	}
 
 	pattern = walloc0(wocnt * sizeof *pattern);
 
@@ -675,11 +1260,9 @@ st_search(
 	g_assert(minlen <= INT_MAX);
 
 	/*
-	 * Search through the smallest bin
+	 * Search through the candidates
 	 */
 
-	vcnt = best_bin->nvals;
-	vals = best_bin->vals;
 	random_offset = random_u32() % vcnt;
 
 	nres = 0;
@@ -693,13 +1276,15 @@ st_search(
 		 * offset, so that repeated searches will match different items
 		 * instead of always the first - with some probability.
 		 */
-		e = vals[(i + random_offset) % vcnt];
-		
+		e = table->all_entries.vals[cand[(i + random_offset) % vcnt]];
+		sf = e->sf;
+
+		if (NULL == sf)
+			continue;		/* Removed entry */
+
 		if ((e->mask & search_mask) != search_mask)
 			continue;		/* Can't match */
 
-		sf = e->sf;
-
 		canonic_len = shared_file_name_canonic_len(sf);
 		if (canonic_len < minlen)
 			continue;		/* Can't match */
@@ -721,10 +1306,11 @@ st_search(
 	}
 
 	if (GNET_PROPERTY(matching_debug) > 3)
-		g_debug("MATCH st_search(): scanned %d entr%s from the %d in bin, "
+		g_debug("MATCH st_search(): scanned %d entr%s from the %lu candidate%s, "
 			"got %d match%s",
 			scanned, 1 == scanned ? "y" : "ies",
-			best_bin_size, nres, 1 == nres ? "" : "es");
+			(unsigned long) vcnt, 1 == vcnt ? "" : "s",
+			nres, 1 == nres ? "" : "es");
 
 	for (i = 0; i < wocnt; i++)
 		if (pattern[i])					/* Lazily compiled by entry_match() */
@@ -732,6 +1318,7 @@ st_search(
 
 	wfree(pattern, wocnt * sizeof *pattern);
 	word_vec_free(wovec, wocnt);
+	HFREE_NULL(cand);
 
 finish:
 	if (search != search_term) {
@@ -30,20 +30,18 @@
  * Basic explanation of how search table works:
  *
  *    A search_table is a global object.  Only one of these is expected to
- *  exist.  It consists of a number of "bins", each bin containing all
- *  entries which have a certain sequence of two characters in a row, plus
- *  some metadata.
+ *  exist.  It consists of an inverted index mapping the first characters
+ *  of each word, and every sequence of three characters within words, to
+ *  the sorted list of entries holding them, plus some metadata.
  *
- *    Each bin is a simple array, without repetitions, of items.  Each item
- *  consists of a string to which a certain mapping of characters onto
- *  characters has been applied, plus a void * representing the actual data
- *  mapped to.  (I used void * to make this code reasonably generic, so that
- *  in any project I or someone else wants to use code like this for, they
- *  can just use it.)  The same mapping is also applied to each search before
+ *    Each entry consists of a string to which a certain mapping of
+ *  characters onto characters has been applied, plus the shared file it
+ *  maps to.  The same mapping is also applied to each search before
  *  running it.  This maps uppercase and lowercase letters to match one
  *  another, maps all whitespace and punctuation to a simple space, etc.
- *  This mechanism is very flexible and could easily be adapted to match
- *  accented characters, etc.
+ *
+ *    Searching intersects the lists of all the query words, starting with
+ *  the smallest ones, and only the surviving entries are then matched.
  *
  *    The actual search builds a regular expression to do the matching.  This
  *  might have a tiny bit higher overhead than a custom implementation of
@@ -73,9 +71,26 @@ search_table_t *st_create(void);
 void st_free(search_table_t **);
 gboolean st_insert_item(search_table_t *, const char *key,
 	const struct shared_file *sf);
+gboolean st_remove_item(search_table_t *, const struct shared_file *sf);
 void st_compact(search_table_t *);
 int st_count(const search_table_t *st);
 
+/**
+ * Callback for st_foreach().
+ */
+typedef void (*st_foreach_cb)(const struct shared_file *sf, gpointer udata);
+
+/**
+ * Callback releasing the image given to st_load().
+ */
+typedef void (*st_image_free_t)(void *image, size_t len);
+
+void st_foreach(const search_table_t *, st_foreach_cb cb, gpointer udata);
+gboolean st_save(const search_table_t *, FILE *f);
+search_table_t *st_load(void *base, size_t len, size_t offset,
+	const struct shared_file **files, size_t count,
+	st_image_free_t image_free);
+
 /**
  * Callback for st_search().
  *
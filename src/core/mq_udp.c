@@ -44,6 +44,7 @@
 #include "hosts.h"
 #include "mq_udp.h"
 #include "dump.h"
+#include "sockets.h"
 
 #include "lib/pmsg.h"
 #include "lib/walloc.h"
@@ -190,9 +191,12 @@ mq_udp_service(gpointer data)
 	dropped = 0;
 
 	/*
-	 * Write as much as possible.
+	 * Write as much as possible, letting the socket layer coalesce the
+	 * datagrams into as few system calls as it can.
 	 */
 
+	socket_udp_batch_begin();
+
 	for (l = q->qtail; l; /* empty */) {
 		pmsg_t *mb = l->data;
 		char *mb_start = pmsg_start(mb);
@@ -246,6 +250,8 @@ mq_udp_service(gpointer data)
 		l = q->cops->rmlink_prev(q, l, mb_size);
 	}
 
+	socket_udp_batch_end();
+
 	mq_check(q, 0);
 	g_assert(q->size >= 0 && q->count >= 0);
 
@@ -3299,6 +3299,15 @@ node_add_tx_deflated(gpointer o, int amount)
 	n->tx_deflated += amount;
 }
 
+static void
+node_tx_deflate_stats(gpointer o, int level, unsigned long usecs)
+{
+	gnutella_node_t *n = o;
+
+	n->tx_deflate_level = level;
+	n->tx_deflate_usecs += usecs;
+}
+
 static void
 node_tx_shutdown(gpointer o, const char *reason, ...)
 {
@@ -3313,6 +3322,7 @@ node_tx_shutdown(gpointer o, const char *reason, ...)
 static struct tx_deflate_cb node_tx_deflate_cb = {
 	node_add_tx_deflated,		/* add_tx_deflated */
 	node_tx_shutdown,			/* shutdown */
+	node_tx_deflate_stats,		/* deflate_stats */
 };
 
 /***
@@ -3639,6 +3649,10 @@ node_is_now_connected(struct gnutella_node *n)
 		args.gzip = FALSE;
 		args.buffer_size = NODE_TX_BUFSIZ;
 		args.buffer_flush = NODE_TX_FLUSH;
+		args.bws = n->peermode == NODE_P_LEAF
+					? BSCHED_BWS_GLOUT : BSCHED_BWS_GOUT;
+		args.reduced = n->peermode == NODE_P_LEAF && settings_is_ultra() &&
+					GNET_PROPERTY(gnet_deflate_leaf_reduced);
 
 		ctx = tx_make_above(tx, tx_deflate_get_ops(), &args);
 		if (ctx == NULL) {
@@ -9444,6 +9458,8 @@ node_get_status(const struct nid *node_id, gnet_node_status_t *status)
     status->tx_written  = node->tx_written;
     status->tx_compressed = NODE_TX_COMPRESSED(node);
     status->tx_compression_ratio = NODE_TX_COMPRESSION_RATIO(node);
+	status->tx_deflate_level = node->tx_deflate_level;
+	status->tx_deflate_usecs = node->tx_deflate_usecs;
 	status->tx_bps = node->outq ? bio_bps(mq_bio(node->outq)) : 0;
 
     status->rx_given    = node->rx_given;
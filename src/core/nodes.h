@@ -246,6 +246,8 @@ typedef struct gnutella_node {
 
 	guint64 tx_given;			/**< Bytes fed to the TX stack (from top) */
 	guint64 tx_deflated;		/**< Bytes deflated by the TX stack */
+	guint64 tx_deflate_usecs;	/**< Time spent compressing TX stack (us) */
+	int tx_deflate_level;		/**< Current TX compression level */
 	guint64 tx_written;			/**< Bytes written by the TX stack */
 
 	guint64 rx_given;			/**< Bytes fed to the RX stack (from bottom) */
@@ -50,7 +50,9 @@
 
 #include "lib/atoms.h"
 #include "lib/bg.h"
+#include "lib/bit_array.h"
 #include "lib/cq.h"
+#include "lib/debug.h"
 #include "lib/glib-missing.h"
 #include "lib/endian.h"
 #include "lib/halloc.h"
@@ -67,6 +69,19 @@
 #include "if/gnet_property.h"
 #include "if/gnet_property_priv.h"
 
+/*
+ * The SSE2 kernels are compiled with a target attribute, so that the
+ * rest of the file keeps the baseline instruction set, and are only
+ * used when the CPU supports them.
+ */
+#if \
+	(defined(__x86_64__) || defined(__i386__)) && \
+	(HAS_GCC(4, 9) || (defined(__clang__) && __clang_major__ >= 4))
+#define QRP_X86
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+
 #include "lib/override.h"			/* Must be the last header included */
 
 #define MIN_SPARSE_RATIO	1		/**< At most 1% of slots used */
@@ -152,6 +167,8 @@ struct routing_table {
 	int set_count;			/**< Amount of slots set in table */
 	int fill_ratio;			/**< 100 * fill ratio for table (received) */
 	int pass_throw;			/**< Query must pass a d100 throw to be forwarded */
+	int leaf_id;			/**< Column in the leaf index, -1 if none */
+	struct qrt_arena *shared;	/**< Shared arena holder, NULL if private */
 	const struct sha1 *digest;	/**< SHA1 digest of the whole table (atom) */
 	char *name;				/**< Name for dumping purposes */
 	unsigned reset:1;		/**< This is a new table, after a RESET */
@@ -202,6 +219,8 @@ void test_hash(void);
 static gboolean
 qrp_can_route_default(const query_hashvec_t *qhv,
 					  const struct routing_table *rt);
+static void qrp_incremental_reset(GHashTable **words_ptr, int bits);
+static void qrp_incremental_close(void);
 
 /**
  * Install supplied routing_table as the global `routing_table'.
@@ -385,6 +404,632 @@ RT_SLOT_READ(const guint8 *arena, guint i)
 	return RT_SLOT_READ_and128(arena, i);
 }
 
+/***
+ *** Word-wide kernels for the routing table inner loops.
+ ***
+ *** Tables hold up to 2 Mslots and get patched, diffed and compacted in
+ *** bursts, e.g. when all our leaves reconnect and send a RESET.  These
+ *** routines handle the slots 8 at a time with plain 64-bit arithmetic,
+ *** and skip over unchanged runs, which are by far the most common.
+ *** Where the CPU allows, SSE2 versions handle 16 slots at a time, and
+ *** qrp_check() selects the fastest engine at startup.
+ ***/
+
+#define QRP_W_REPEAT(x)	(((guint64) (x) << 32) | (guint64) (x))
+#define QRP_W_LOW7		QRP_W_REPEAT(0x7f7f7f7fU)
+#define QRP_W_HIGH		QRP_W_REPEAT(0x80808080U)
+#define QRP_W_ONES		QRP_W_REPEAT(0x01010101U)
+#define QRP_W_GATHER	(((guint64) 0x01020408U << 32) | 0x10204080U)
+
+static guint8 qrp_p4_set[256];		/**< 4-bit patch byte -> slots to set */
+static guint8 qrp_p4_clear[256];	/**< 4-bit patch byte -> slots to clear */
+static guint8 qrp_rev8[256];		/**< Byte with its bits reversed */
+
+/**
+ * 4-bit patch value for 2 slots, indexed by the 2 changed bits (high
+ * part of the index) and the 2 old bits (low part).  A set bit going
+ * away yields +1 (back to infinity), a new bit yields -1.
+ */
+static const guint8 qrp_d4[16] = {
+	0x00, 0x00, 0x00, 0x00,		/* No change */
+	0x0f, 0x01, 0x0f, 0x01,		/* Second slot changed */
+	0xf0, 0xf0, 0x10, 0x10,		/* First slot changed */
+	0xff, 0xf1, 0x1f, 0x11,		/* Both slots changed */
+};
+
+/**
+ * Gather the high bit of each byte of `w' into a single byte, the most
+ * significant byte of `w' yielding bit 7, i.e. the first slot in a
+ * compacted arena when `w' was read as a big-endian quantity.
+ */
+static inline G_GNUC_CONST guint8
+qrp_w_gather(guint64 w)
+{
+	return (((w & QRP_W_HIGH) >> 7) * QRP_W_GATHER) >> 56;
+}
+
+/**
+ * @return word with the high bit of each byte set when that byte is not 0.
+ */
+static inline G_GNUC_CONST guint64
+qrp_w_nonzero(guint64 w)
+{
+	return (((w & QRP_W_LOW7) + QRP_W_LOW7) | w) & QRP_W_HIGH;
+}
+
+/**
+ * Initialize the 4-bit patch and bit reversal lookup tables.
+ */
+static G_GNUC_COLD void
+qrp_w_init(void)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(qrp_p4_set); i++) {
+		guint hi = i >> 4, lo = i & 0xf;
+
+		/* Negative quartet sets the slot, positive one clears it */
+
+		qrp_p4_set[i] = ((hi & 0x8) ? 2 : 0) | ((lo & 0x8) ? 1 : 0);
+		qrp_p4_clear[i] = ((hi != 0 && !(hi & 0x8)) ? 2 : 0) |
+			((lo != 0 && !(lo & 0x8)) ? 1 : 0);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(qrp_rev8); i++) {
+		guint j;
+
+		for (j = 0; j < 8; j++) {
+			if (i & (1U << j))
+				qrp_rev8[i] |= 0x80U >> j;
+		}
+	}
+}
+
+/**
+ * Compact `slots' bytes from `src' into `dst', one bit per slot which is
+ * set when the slot is not "infinity".
+ *
+ * @return amount of bits set in the compacted arena.
+ */
+static int
+qrp_w_compact(guint8 *dst, const guint8 *src, int slots, guint8 infinity)
+{
+	guint64 inf = QRP_W_ONES * infinity;
+	int count = 0;
+	int i;
+
+	g_assert(0 == (slots & 0x7));
+
+	for (i = 0; i < slots; i += 8) {
+		guint8 v = qrp_w_gather(qrp_w_nonzero(peek_be64(&src[i]) ^ inf));
+
+		*dst++ = v;
+		count += bits_set(v);
+	}
+
+	return count;
+}
+
+/**
+ * Apply `n' runs of 8-bit patch entries to the compacted arena, covering
+ * 8 slots (one arena byte) per run.
+ *
+ * @return amount of bits set in the patched arena bytes.
+ */
+static G_GNUC_HOT int
+qrp_w_patch8(guint8 *arena, const guint8 *data, int n)
+{
+	int count = 0;
+
+	for (/* empty */; n > 0; n--, arena++, data += 8) {
+		guint64 w = peek_be64(data);
+
+		if (0 != w) {
+			guint8 set = qrp_w_gather(w);
+			guint8 clear = qrp_w_gather(qrp_w_nonzero(w)) & ~set;
+
+			*arena = (*arena & ~clear) | set;
+		}
+		count += bits_set(*arena);
+	}
+
+	return count;
+}
+
+/**
+ * Apply `n' runs of 4-bit patch entries to the compacted arena, covering
+ * 8 slots (4 patch bytes, one arena byte) per run.
+ *
+ * @return amount of bits set in the patched arena bytes.
+ */
+static G_GNUC_HOT int
+qrp_w_patch4(guint8 *arena, const guint8 *data, int n)
+{
+	int count = 0;
+
+	for (/* empty */; n > 0; n--, arena++, data += 4) {
+		if (0 != peek_be32(data)) {
+			guint8 set, clear;
+
+			set = qrp_p4_set[data[0]] << 6 | qrp_p4_set[data[1]] << 4 |
+				qrp_p4_set[data[2]] << 2 | qrp_p4_set[data[3]];
+			clear = qrp_p4_clear[data[0]] << 6 | qrp_p4_clear[data[1]] << 4 |
+				qrp_p4_clear[data[2]] << 2 | qrp_p4_clear[data[3]];
+
+			*arena = (*arena & ~clear) | set;
+		}
+		count += bits_set(*arena);
+	}
+
+	return count;
+}
+
+/**
+ * Compute 4-bit patch between the `bytes' first bytes of two compacted
+ * arenas, `old' being NULL to compare against an empty table.
+ *
+ * @return whether there were any differences.
+ */
+static G_GNUC_HOT gboolean
+qrp_w_diff4(guint8 *patch, const guint8 *old, const guint8 *new, int bytes)
+{
+	gboolean changed = FALSE;
+	int i = 0;
+
+	while (i < bytes) {
+		guint8 o, d;
+
+		if (
+			i + 8 <= bytes &&
+			peek_be64(&new[i]) == (NULL == old ? 0 : peek_be64(&old[i]))
+		) {
+			memset(patch, 0, 32);	/* 8 unchanged bytes, 64 slots */
+			patch += 32;
+			i += 8;
+			continue;
+		}
+
+		o = NULL == old ? 0 : old[i];
+		d = o ^ new[i++];
+
+		if (0 == d) {
+			memset(patch, 0, 4);
+			patch += 4;
+			continue;
+		}
+
+		changed = TRUE;
+		*patch++ = qrp_d4[((d >> 4) & 0xc) | ((o >> 6) & 0x3)];
+		*patch++ = qrp_d4[((d >> 2) & 0xc) | ((o >> 4) & 0x3)];
+		*patch++ = qrp_d4[(d & 0xc) | ((o >> 2) & 0x3)];
+		*patch++ = qrp_d4[((d << 2) & 0xc) | (o & 0x3)];
+	}
+
+	return changed;
+}
+
+#ifdef QRP_X86
+/*
+ * SSE2 kernels, handling 16 slots (2 arena bytes) per iteration.
+ *
+ * The byte sign bits and comparison results are gathered with a single
+ * PMOVMSKB, which puts the first slot in bit 0 whereas the arena keeps
+ * it in bit 7, hence the bit reversal through qrp_rev8[].  The 4-bit
+ * patch kernel is not vectorized: the quartets would need to be spread
+ * over whole bytes first, for a gain not worth the extra code.
+ */
+
+/**
+ * SSE2 version of qrp_w_compact().
+ */
+static G_GNUC_HOT int __attribute__((target("sse2")))
+qrp_sse2_compact(guint8 *dst, const guint8 *src, int slots, guint8 infinity)
+{
+	const __m128i inf = _mm_set1_epi8(infinity);
+	int count = 0;
+	int i;
+
+	g_assert(0 == (slots & 0x7));
+
+	for (i = 0; i + 16 <= slots; i += 16) {
+		__m128i v = _mm_loadu_si128((const void *) &src[i]);
+		__m128i eq = _mm_cmpeq_epi8(v, inf);
+		unsigned m = ~_mm_movemask_epi8(eq) & 0xffff;
+
+		*dst++ = qrp_rev8[m & 0xff];
+		*dst++ = qrp_rev8[m >> 8];
+		count += bits_set32(m);
+	}
+
+	if (i < slots)
+		count += qrp_w_compact(dst, &src[i], slots - i, infinity);
+
+	return count;
+}
+
+/**
+ * SSE2 version of qrp_w_patch8().
+ */
+static G_GNUC_HOT int __attribute__((target("sse2")))
+qrp_sse2_patch8(guint8 *arena, const guint8 *data, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int count = 0;
+
+	for (/* empty */; n >= 2; n -= 2, arena += 2, data += 16) {
+		__m128i v = _mm_loadu_si128((const void *) data);
+		unsigned nul = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+
+		if (0xffff != nul) {
+			unsigned set = _mm_movemask_epi8(v);
+			unsigned clear = ~(nul | set) & 0xffff;
+
+			arena[0] = (arena[0] & ~qrp_rev8[clear & 0xff]) |
+				qrp_rev8[set & 0xff];
+			arena[1] = (arena[1] & ~qrp_rev8[clear >> 8]) |
+				qrp_rev8[set >> 8];
+		}
+		count += bits_set(arena[0]) + bits_set(arena[1]);
+	}
+
+	if (n != 0)
+		count += qrp_w_patch8(arena, data, n);
+
+	return count;
+}
+
+/**
+ * SSE2 version of qrp_w_diff4(), skipping unchanged runs 16 bytes
+ * (128 slots) at a time.
+ */
+static G_GNUC_HOT gboolean __attribute__((target("sse2")))
+qrp_sse2_diff4(guint8 *patch, const guint8 *old, const guint8 *new, int bytes)
+{
+	gboolean changed = FALSE;
+	int i = 0;
+
+	while (i < bytes) {
+		int n = MIN(16, bytes - i);
+
+		if (16 == n) {
+			__m128i nv = _mm_loadu_si128((const void *) &new[i]);
+			__m128i ov = NULL == old ? _mm_setzero_si128() :
+				_mm_loadu_si128((const void *) &old[i]);
+
+			if (0xffff == _mm_movemask_epi8(_mm_cmpeq_epi8(nv, ov))) {
+				memset(patch, 0, 64);
+				patch += 64;
+				i += 16;
+				continue;
+			}
+		}
+
+		changed |= qrp_w_diff4(patch, NULL == old ? NULL : &old[i],
+			&new[i], n);
+		patch += 4 * n;
+		i += n;
+	}
+
+	return changed;
+}
+
+/**
+ * @return whether CPU supports SSE2.
+ */
+static gboolean
+qrp_cpu_sse2(void)
+{
+#ifdef __x86_64__
+	return TRUE;		/* Part of the x86-64 base instruction set */
+#else
+	unsigned eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return FALSE;
+
+	return booleanize(edx & (1U << 26));
+#endif
+}
+#endif	/* QRP_X86 */
+
+/**
+ * Known kernel engines, by order of preference.
+ */
+static const struct qrp_engine {
+	const char *name;
+	int (*compact)(guint8 *dst, const guint8 *src, int slots, guint8 inf);
+	int (*patch8)(guint8 *arena, const guint8 *data, int n);
+	int (*patch4)(guint8 *arena, const guint8 *data, int n);
+	gboolean (*diff4)(guint8 *patch, const guint8 *old, const guint8 *new,
+		int bytes);
+	gboolean (*supported)(void);
+} qrp_engines[] = {
+#ifdef QRP_X86
+	{ "SSE2", qrp_sse2_compact, qrp_sse2_patch8, qrp_w_patch4,
+		qrp_sse2_diff4, qrp_cpu_sse2 },
+#endif
+	{ "SWAR", qrp_w_compact, qrp_w_patch8, qrp_w_patch4,
+		qrp_w_diff4, NULL },
+};
+
+/**
+ * Engine in use, selected by qrp_check().
+ */
+static const struct qrp_engine *qrp_engine =
+	&qrp_engines[G_N_ELEMENTS(qrp_engines) - 1];
+
+#define QRP_BENCH_SLOTS	(256 * 1024)	/**< Slots in benchmark table */
+#define QRP_BENCH_LOOPS	4				/**< Runs per engine */
+#define QRP_CHECK_SLOTS	4096			/**< Slots in test tables */
+#define QRP_CHECK_LOOPS	32				/**< Random tests per engine */
+
+/**
+ * @return whether engine can be used on this CPU.
+ */
+static gboolean
+qrp_engine_supported(const struct qrp_engine *qe)
+{
+	return NULL == qe->supported || (*qe->supported)();
+}
+
+/**
+ * Fill buffer with random bytes, forcing about 7 out of 8 bytes to
+ * `common' so that unchanged runs get exercised as well.
+ */
+static void
+qrp_check_fill(guint8 *p, size_t len, guint8 common)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		guint32 r = random_u32();
+		p[i] = 0 == (r & 0x700) ? (r & 0xff) : common;
+	}
+}
+
+/**
+ * Check all the kernels of an engine against the slot-by-slot semantics,
+ * on randomly generated tables.
+ *
+ * @return the first failing kernel, NULL if all passed.
+ */
+static G_GNUC_COLD const char *
+qrp_engine_check(const struct qrp_engine *qe)
+{
+	const int slots = QRP_CHECK_SLOTS, bytes = QRP_CHECK_SLOTS / 8;
+	guint8 *src, *arena, *ref, *old, *patch;
+	const char *failed = NULL;
+	unsigned loop;
+
+	src = halloc(slots + 1);
+	arena = halloc(bytes);
+	ref = halloc(bytes);
+	old = halloc(bytes);
+	patch = halloc(slots / 2);
+
+	for (loop = 0; loop < QRP_CHECK_LOOPS && NULL == failed; loop++) {
+		guint8 *s = &src[loop & 1];		/* Test misaligned input */
+		guint8 infinity = 2 + (loop & 0x7);
+		gboolean empty = booleanize(loop & 0x2);
+		gboolean changed;
+		int count, i, n;
+
+		/*
+		 * Compaction: a set bit for each slot which is not infinity.
+		 */
+
+		qrp_check_fill(s, slots, infinity);
+		memset(ref, 0, bytes);
+		for (i = 0, count = 0; i < slots; i++) {
+			if (s[i] != infinity) {
+				ref[i >> 3] |= 0x80U >> (i & 0x7);
+				count++;
+			}
+		}
+		if (
+			(*qe->compact)(arena, s, slots, infinity) != count ||
+			0 != memcmp(arena, ref, bytes)
+		) {
+			failed = "compact";
+			break;
+		}
+
+		/*
+		 * 8-bit patch: a negative value sets the bit, a positive one clears
+		 * it.
+		 * Patches need not cover the whole arena.
+		 */
+
+		n = 1 + random_value(bytes - 1);
+		qrp_check_fill(s, n * 8, 0);
+		for (i = 0; i < n * 8; i++) {
+			guint8 b = 0x80U >> (i & 0x7);
+
+			if (s[i] & 0x80)
+				ref[i >> 3] |= b;
+			else if (s[i] != 0)
+				ref[i >> 3] &= ~b;
+		}
+		for (i = 0, count = 0; i < n; i++)
+			count += bits_set(ref[i]);
+		if (
+			(*qe->patch8)(arena, s, n) != count ||
+			0 != memcmp(arena, ref, bytes)
+		) {
+			failed = "patch8";
+			break;
+		}
+
+		/*
+		 * 4-bit patch: same with quartets, the high one being the first
+		 * slot.
+		 */
+
+		n = 1 + random_value(bytes - 1);
+		qrp_check_fill(s, n * 4, 0);
+		for (i = 0; i < n * 8; i++) {
+			guint8 q = (i & 0x1) ? s[i >> 1] & 0xf : s[i >> 1] >> 4;
+			guint8 b = 0x80U >> (i & 0x7);
+
+			if (q & 0x8)
+				ref[i >> 3] |= b;
+			else if (q != 0)
+				ref[i >> 3] &= ~b;
+		}
+		for (i = 0, count = 0; i < n; i++)
+			count += bits_set(ref[i]);
+		if (
+			(*qe->patch4)(arena, s, n) != count ||
+			0 != memcmp(arena, ref, bytes)
+		) {
+			failed = "patch4";
+			break;
+		}
+
+		/*
+		 * 4-bit diff: -1 for a new bit, +1 for a bit going away,
+		 * computed against a previous table or against an empty one.
+		 */
+
+		memcpy(old, arena, bytes);
+		for (i = 0; i < 4; i++)
+			arena[random_value(bytes - 1)] ^= 1U << random_value(7);
+
+		n = 1 + random_value(bytes - 1);
+		if (empty)
+			memset(old, 0, bytes);
+		for (i = 0; i < n * 8; i++) {
+			guint8 b = 0x80U >> (i & 0x7);
+			gboolean was = booleanize(old[i >> 3] & b);
+			gboolean is = booleanize(arena[i >> 3] & b);
+			guint8 q = was == is ? 0x0 : is ? 0xf : 0x1;
+
+			if (i & 0x1)
+				s[i >> 1] |= q;
+			else
+				s[i >> 1] = q << 4;
+		}
+		changed = 0 != memcmp(arena, old, n);
+		if (
+			changed != (*qe->diff4)(patch, empty ? NULL : old, arena, n) ||
+			0 != memcmp(patch, s, n * 4)
+		) {
+			failed = "diff4";
+			break;
+		}
+	}
+
+	HFREE_NULL(src);
+	HFREE_NULL(arena);
+	HFREE_NULL(ref);
+	HFREE_NULL(old);
+	HFREE_NULL(patch);
+
+	return failed;
+}
+
+/**
+ * Benchmark an engine on a large table, timing a full compaction, a full
+ * 4-bit diff against an almost identical table and a full 8-bit patch.
+ *
+ * @return the amount of slots processed per second, in millions.
+ */
+static G_GNUC_COLD double
+qrp_engine_bench(const struct qrp_engine *qe,
+	guint8 *src, guint8 *arena, guint8 *old, guint8 *patch)
+{
+	const int slots = QRP_BENCH_SLOTS;
+	tm_t start, end;
+	double elapsed;
+	unsigned k;
+	int count = 0;
+
+	tm_now_exact(&start);
+	for (k = 0; k < QRP_BENCH_LOOPS; k++) {
+		count += (*qe->compact)(arena, src, slots, 2);
+		count += (*qe->diff4)(patch, old, arena, slots / 8);
+		count += (*qe->patch8)(arena, src, slots / 8);
+	}
+	tm_now_exact(&end);
+
+	(void) count;		/* Prevents dead code elimination */
+
+	elapsed = tm_elapsed_f(&end, &start);
+	return 3.0 * slots * QRP_BENCH_LOOPS / MAX(elapsed, 1e-6) / 1e6;
+}
+
+/**
+ * Initializes the kernel tables, then checks all the kernel engines the
+ * CPU supports against the slot-by-slot semantics, benchmarks them and
+ * selects the fastest one.
+ */
+G_GNUC_COLD void
+qrp_check(void)
+{
+	const struct qrp_engine *best = NULL;
+	double best_rate = 0.0;
+	guint8 *src, *arena, *old, *patch;
+	unsigned i;
+
+	qrp_w_init();
+
+	for (i = 0; i < G_N_ELEMENTS(qrp_engines); i++) {
+		const struct qrp_engine *qe = &qrp_engines[i];
+		const char *failed;
+
+		if (!qrp_engine_supported(qe))
+			continue;
+
+		failed = qrp_engine_check(qe);
+		if (failed != NULL) {
+			g_warning("QRP %s engine failed \"%s\" test",
+				qe->name, failed);
+			g_assert_not_reached();
+		}
+	}
+
+	/*
+	 * All the supported engines are correct, pick the fastest.
+	 */
+
+	src = halloc(QRP_BENCH_SLOTS);
+	arena = halloc(QRP_BENCH_SLOTS / 8);
+	old = halloc(QRP_BENCH_SLOTS / 8);
+	patch = halloc(QRP_BENCH_SLOTS / 2);
+
+	qrp_check_fill(src, QRP_BENCH_SLOTS, 2);
+	qrp_w_compact(old, src, QRP_BENCH_SLOTS, 2);
+	old[QRP_BENCH_SLOTS / 16] ^= 0x1;
+
+	for (i = 0; i < G_N_ELEMENTS(qrp_engines); i++) {
+		const struct qrp_engine *qe = &qrp_engines[i];
+		double rate;
+
+		if (!qrp_engine_supported(qe))
+			continue;
+
+		rate = qrp_engine_bench(qe, src, arena, old, patch);
+
+		if (common_dbg > 0) {
+			g_debug("QRP %s engine: %.0f Mslots/s", qe->name, rate);
+		}
+
+		if (NULL == best || rate > best_rate) {
+			best = qe;
+			best_rate = rate;
+		}
+	}
+
+	HFREE_NULL(src);
+	HFREE_NULL(arena);
+	HFREE_NULL(old);
+	HFREE_NULL(patch);
+
+	g_assert(best != NULL);
+
+	qrp_engine = best;
+}
+
 /**
  * In a compressed routing table, patch entry ``i'' with ``v'', the value
  * we got from the routing patch.
@@ -421,10 +1066,6 @@ qrt_compact(struct routing_table *rt)
 {
 	int nsize;				/* New table size */
 	char *narena;			/* New arena */
-	int i;
-	guint mask;
-	guchar *p;
-	guchar *q;
 	guint32 token = 0;
 
 	g_assert(rt);
@@ -438,9 +1079,7 @@ qrt_compact(struct routing_table *rt)
 	}
 
 	nsize = rt->slots / 8;
-	narena = halloc0(nsize);
-	rt->set_count = 0;
-	q = ptr_add_offset(narena, nsize - 1);
+	narena = halloc(nsize);
 
 	/*
 	 * Because we're compacting an ultranode -> leafnode routing table,
@@ -453,19 +1092,8 @@ qrt_compact(struct routing_table *rt)
 	 * Therefore, the sequence of bits mimics the slots in the original table.
 	 */
 
-	for (mask = 0, i = rt->slots - 1, p = &rt->arena[i]; i >= 0; i--, p--) {
-		if (*p != rt->infinity) {
-			mask |= 0x80;				/* Bit set to indicates presence */
-			rt->set_count++;
-		}
-		if (0 == (i & 0x7)) {			/* Reached "bit 0" */
-			*q-- = mask;
-			mask = 0;
-		} else
-			mask >>= 1;					/* Starting from end of table */
-	}
-
-	g_assert((char *) (q+1) == narena);/* Filled 1st byte at last iteration */
+	rt->set_count = (*qrp_engine->compact)((guint8 *) narena,
+						rt->arena, rt->slots, rt->infinity);
 
 	/*
 	 * Install new compacted arena in place of the non-compacted one.
@@ -567,13 +1195,8 @@ qrt_patch_unref(struct routing_patch *rp)
 static struct routing_patch *
 qrt_diff_4(struct routing_table *old, struct routing_table *new)
 {
-	int bytes;
 	struct routing_patch *rp;
-	guchar *op;
-	guchar *np;
-	guchar *pp;
-	int i;
-	gboolean changed = FALSE;
+	gboolean changed;
 
 	g_assert(old == NULL || old->magic == QRP_ROUTE_MAGIC);
 	g_assert(old == NULL || old->compacted);
@@ -589,48 +1212,21 @@ qrt_diff_4(struct routing_table *old, struct routing_table *new)
 	rp->len = rp->size / 2;			/* Each entry stored on 4 bits */
 	rp->entry_bits = 4;
 	rp->compressed = FALSE;
-	pp = rp->arena = halloc(rp->len);
-
-	op = old ? old->arena : NULL;
-	np = new->arena;
+	rp->arena = halloc(rp->len);
 
-	for (i = 0, bytes = new->slots / 8; i < bytes; i++) {
-		guint8 obyte = op ? *op++ : 0x0;	/* Nothing */
-		guint8 nbyte = *np++;
-		int j;
-		guint8 v;
-
-		/*
-		 * In our compacted table, set bits indicate presence.
-		 * Thus, we need to build the patch quartets as:
-		 *
-		 *     old bit      new bit      patch
-		 *        0            0          0x0     (no change)
-		 *        0            1          0xf     (-1, from INFINITY=2 to 1)
-		 *        1            0          0x1     (+1, from 1 to INFINITY)
-		 *        1            1          0x0     (no change)
-		 */
-
-		for (v = 0, j = 7; j >= 0; j--) {
-			guint8 mask = 1 << j;
-
-			if ((obyte & mask) ^ (nbyte & mask)) {	/* Bit `j' changed */
-				v |= (obyte & mask) ? 0x1 : 0xf;
-				changed = TRUE;
-			}
-
-			if (j & 0x1)
-				v <<= 4;			/* We have upper half of octet (byte) */
-			else {
-				*pp++ = v;
-				v = 0;
-			}
-		}
-	}
+	/*
+	 * In our compacted table, set bits indicate presence.
+	 * Thus, we need to build the patch quartets as:
+	 *
+	 *     old bit      new bit      patch
+	 *        0            0          0x0     (no change)
+	 *        0            1          0xf     (-1, from INFINITY=2 to 1)
+	 *        1            0          0x1     (+1, from 1 to INFINITY)
+	 *        1            1          0x0     (no change)
+	 */
 
-	g_assert(np == (new->arena + new->slots / 8));
-	g_assert(op == NULL || op == (old->arena + old->slots / 8));
-	g_assert(pp == (rp->arena + rp->len));
+	changed = (*qrp_engine->diff4)(rp->arena,
+				old ? old->arena : NULL, new->arena, new->slots / 8);
 
 	if (!changed && old != NULL) {
 		qrt_patch_free(rp);
@@ -820,6 +1416,417 @@ qrt_patch_compress(
 	return task;
 }
 
+/***
+ *** Transposed index of leaf routing tables.
+ ***
+ *** Instead of probing the arena of each leaf for every query we route,
+ *** we keep a "slot -> leaves" view of all the leaf QRTs: row `j' holds one
+ *** bit per indexed leaf table, set when that leaf has something at slot `j'.
+ *** Routing a query then boils down to a few word-wide AND (keywords) or
+ *** OR (URNs) operations across all the leaves at once.
+ ***
+ *** The index has a fixed resolution of QIDX_BITS.  Smaller tables are
+ *** expanded and remain exact, larger tables are folded so the index only
+ *** yields candidates that need to be confirmed against the leaf's table.
+ ***/
+
+#define QIDX_BITS		16		/**< Index resolution: 64 Kslots */
+#define QIDX_SLOTS		(1U << QIDX_BITS)
+#define QIDX_MIN_LEAVES	64		/**< Initial amount of columns */
+
+static struct qrt_index {
+	bit_array_t *rows;		/**< QIDX_SLOTS rows of `words' words each */
+	bit_array_t *used;		/**< Columns currently allocated to a table */
+	bit_array_t *result;	/**< Candidate columns for the last query */
+	size_t words;			/**< Amount of words per row */
+	size_t capacity;		/**< Amount of columns per row */
+	size_t count;			/**< Amount of tables indexed */
+} qidx;
+
+static inline bit_array_t *
+qidx_row(guint32 j)
+{
+	return &qidx.rows[j * qidx.words];
+}
+
+static inline size_t
+qidx_arena_size(size_t words)
+{
+	return QIDX_SLOTS * words * sizeof(bit_array_t);
+}
+
+/**
+ * Double the amount of columns the index can hold.
+ */
+static void
+qidx_grow(void)
+{
+	size_t capacity, words;
+	bit_array_t *rows;
+
+	capacity = 0 == qidx.capacity ? QIDX_MIN_LEAVES : qidx.capacity * 2;
+	words = BIT_ARRAY_SIZE(capacity);
+	rows = halloc0(qidx_arena_size(words));
+
+	if (qidx.rows != NULL) {
+		guint32 j;
+
+		for (j = 0; j < QIDX_SLOTS; j++) {
+			memcpy(&rows[j * words], qidx_row(j),
+				qidx.words * sizeof(bit_array_t));
+		}
+		HFREE_NULL(qidx.rows);
+	}
+
+	gnet_prop_set_guint32_val(PROP_QRP_MEMORY, GNET_PROPERTY(qrp_memory) +
+		qidx_arena_size(words) - qidx_arena_size(qidx.words));
+
+	bit_array_resize(&qidx.used, qidx.capacity, capacity);
+	qidx.result = hrealloc(qidx.result, words * sizeof(bit_array_t));
+	qidx.rows = rows;
+	qidx.words = words;
+	qidx.capacity = capacity;
+
+	if (GNET_PROPERTY(qrp_debug) > 1)
+		g_debug("QRP leaf index grown to %lu columns (%s)",
+			(unsigned long) capacity,
+			short_size(qidx_arena_size(words), FALSE));
+}
+
+/**
+ * Clear column `id' in all the rows of the index.
+ */
+static void
+qidx_clear_column(size_t id)
+{
+	bit_array_t *w = &BIT_ARRAY_WORD(qidx.rows, id);
+	bit_array_t mask = ~BIT_ARRAY_BIT(qidx.rows, id);
+	guint32 j;
+
+	for (j = 0; j < QIDX_SLOTS; j++, w += qidx.words)
+		*w &= mask;
+}
+
+/**
+ * Remove routing table from the leaf index.
+ */
+static void
+qidx_remove(struct routing_table *rt)
+{
+	g_assert(rt->leaf_id >= 0);
+
+	/*
+	 * The index is released at qrp_close() time, before the nodes drop
+	 * their own references to the leaf tables.
+	 */
+
+	if G_LIKELY(qidx.rows != NULL) {
+		g_assert(bit_array_get(qidx.used, rt->leaf_id));
+		g_assert(qidx.count > 0);
+
+		qidx_clear_column(rt->leaf_id);
+		bit_array_clear(qidx.used, rt->leaf_id);
+		qidx.count--;
+	}
+
+	rt->leaf_id = -1;
+}
+
+/**
+ * Record fully received leaf routing table into the index, superseding
+ * any previous content for that table.
+ */
+static void
+qidx_add(struct routing_table *rt)
+{
+	size_t id;
+	int shift;
+	int b, bytes;
+
+	g_assert(rt->compacted);
+
+	if (rt->slots < 8)
+		return;				/* Too small to be of any interest */
+
+	if (rt->leaf_id >= 0) {
+		id = rt->leaf_id;
+		qidx_clear_column(id);
+	} else {
+		id = (size_t) -1;
+		if (qidx.capacity != 0)
+			id = bit_array_first_clear(qidx.used, 0, qidx.capacity - 1);
+		if ((size_t) -1 == id) {
+			id = qidx.capacity;
+			qidx_grow();
+		}
+		bit_array_set(qidx.used, id);
+		rt->leaf_id = id;
+		qidx.count++;
+	}
+
+	shift = rt->bits - QIDX_BITS;
+	bytes = rt->slots / 8;
+
+	for (b = 0; b < bytes; b++) {
+		guint8 v = rt->arena[b];
+		guint32 s;
+
+		if (0 == v)
+			continue;
+
+		for (s = b * 8; v != 0; s++, v <<= 1) {
+			if (0 == (v & 0x80))
+				continue;
+
+			if (shift >= 0) {
+				bit_array_set(qidx_row(s >> shift), id);
+			} else {
+				guint32 j = s << -shift;
+				guint32 end = (s + 1) << -shift;
+
+				for (/* empty */; j < end; j++)
+					bit_array_set(qidx_row(j), id);
+			}
+		}
+	}
+}
+
+/**
+ * Compute the set of leaf columns which can route the query into
+ * `qidx.result'.
+ *
+ * @returns TRUE if the index was used, FALSE if there is nothing indexed.
+ */
+static G_GNUC_HOT gboolean
+qidx_evaluate(const query_hashvec_t *qhv)
+{
+	const struct query_hash *qh = qhv->vec;
+	bit_array_t *result = qidx.result;
+	size_t words = qidx.words;
+	guint i;
+
+	if (0 == qidx.count || 0 == qhv->count)
+		return FALSE;
+
+	if (qhv->has_urn) {
+		/*
+		 * URNs come first in the vector and are OR-ed: a leaf is a
+		 * candidate as soon as one of them is present.
+		 */
+
+		memset(result, 0, words * sizeof result[0]);
+
+		for (i = 0; i < qhv->count && QUERY_H_URN == qh[i].source; i++) {
+			const bit_array_t *row =
+				qidx_row(qh[i].hashcode >> (32 - QIDX_BITS));
+			size_t w;
+
+			for (w = 0; w < words; w++)
+				result[w] |= row[w];
+		}
+	} else {
+		/*
+		 * Keywords are AND-ed, stop as soon as no leaf remains.
+		 */
+
+		memcpy(result, qidx_row(qh[0].hashcode >> (32 - QIDX_BITS)),
+			words * sizeof result[0]);
+
+		for (i = 1; i < qhv->count; i++) {
+			const bit_array_t *row =
+				qidx_row(qh[i].hashcode >> (32 - QIDX_BITS));
+			bit_array_t any = 0;
+			size_t w;
+
+			for (w = 0; w < words; w++)
+				any |= (result[w] &= row[w]);
+
+			if (0 == any)
+				break;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Release the leaf index.
+ */
+static void
+qidx_close(void)
+{
+	HFREE_NULL(qidx.rows);
+	HFREE_NULL(qidx.result);
+	G_FREE_NULL(qidx.used);
+	qidx.words = qidx.capacity = qidx.count = 0;
+}
+
+/***
+ *** Content-addressed sharing of leaf routing tables.
+ ***
+ *** Many leaves run the same client with the same (or an empty) library,
+ *** hence send us the exact same table.  Once a leaf table is fully patched,
+ *** we look up its SHA1 and, when an identical table is already held, we
+ *** release our copy and point to the shared one.  Shared arenas are never
+ *** modified: a table being patched first gets a private copy back.
+ ***/
+
+enum qrt_arena_magic {
+	QRT_ARENA_MAGIC = 0x2f1c58e3U
+};
+
+/**
+ * A compacted arena shared by all the identical leaf routing tables.
+ */
+struct qrt_arena {
+	enum qrt_arena_magic magic;
+	const struct sha1 *digest;	/**< SHA1 of the table (atom), hash key */
+	guint8 *arena;				/**< Compacted arena, read-only */
+	int slots;					/**< Amount of slots in the arena */
+	int refcnt;					/**< Amount of tables using the arena */
+};
+
+static GHashTable *qrt_arenas;	/**< SHA1 => struct qrt_arena */
+
+/**
+ * Update the statistics about the amount of distinct shared arenas.
+ */
+static void
+qrt_arena_update_stats(void)
+{
+	gnet_stats_set_general(GNR_QRP_SHARED_ARENAS,
+		NULL == qrt_arenas ? 0 : g_hash_table_size(qrt_arenas));
+}
+
+/**
+ * Share the arena of a fully patched leaf routing table with all the other
+ * identical tables we hold, releasing the private copy when possible.
+ */
+static void
+qrt_arena_share(struct routing_table *rt)
+{
+	struct qrt_arena *qa;
+
+	g_assert(rt->compacted);
+	g_assert(NULL == rt->shared);
+
+	if (NULL == qrt_arenas)
+		return;
+
+	if (NULL == rt->digest)
+		rt->digest = atom_sha1_get(qrt_sha1(rt));
+
+	qa = g_hash_table_lookup(qrt_arenas, rt->digest);
+
+	if (NULL == qa) {
+		WALLOC(qa);
+		qa->magic = QRT_ARENA_MAGIC;
+		qa->digest = atom_sha1_get(rt->digest);
+		qa->arena = rt->arena;
+		qa->slots = rt->slots;
+		qa->refcnt = 1;
+		gm_hash_table_insert_const(qrt_arenas, qa->digest, qa);
+		rt->shared = qa;
+		gnet_stats_count_general(GNR_QRP_SHARED_TABLE_MISSES, 1);
+		qrt_arena_update_stats();
+		return;
+	}
+
+	g_assert(QRT_ARENA_MAGIC == qa->magic);
+
+	/*
+	 * Paranoid: never trust the digest alone, a collision would corrupt
+	 * the routing of all the leaves sharing the arena.
+	 */
+
+	if (
+		qa->slots != rt->slots ||
+		0 != memcmp(qa->arena, rt->arena, rt->slots / 8)
+	) {
+		if (GNET_PROPERTY(qrp_debug))
+			g_warning("QRP SHA1 collision for \"%s\" (SHA1=%s)",
+				rt->name, sha1_base32(rt->digest));
+		return;
+	}
+
+	HFREE_NULL(rt->arena);
+	gnet_prop_set_guint32_val(PROP_QRP_MEMORY,
+		GNET_PROPERTY(qrp_memory) - rt->slots / 8);
+
+	qa->refcnt++;
+	rt->arena = qa->arena;
+	rt->shared = qa;
+	gnet_stats_count_general(GNR_QRP_SHARED_TABLE_HITS, 1);
+
+	if (GNET_PROPERTY(qrp_debug) > 2)
+		g_debug("QRP \"%s\" shares its arena with %d other table%s (SHA1=%s)",
+			rt->name, qa->refcnt - 1, 2 == qa->refcnt ? "" : "s",
+			sha1_base32(qa->digest));
+}
+
+/**
+ * Stop sharing the arena of a routing table.
+ *
+ * @param rt	the routing table
+ * @param keep	whether the table must keep a private copy of the arena
+ *
+ * When `keep' is FALSE and the arena is still used by other tables, the
+ * arena of `rt' is reset to NULL.
+ */
+static void
+qrt_arena_unshare(struct routing_table *rt, gboolean keep)
+{
+	struct qrt_arena *qa = rt->shared;
+
+	g_assert(qa != NULL);
+	g_assert(QRT_ARENA_MAGIC == qa->magic);
+	g_assert(qa->refcnt > 0);
+	g_assert(qa->arena == rt->arena);
+
+	rt->shared = NULL;
+
+	if (1 == qa->refcnt) {
+		/*
+		 * Last user: the table inherits the arena, which it already owns
+		 * as far as memory accounting is concerned.
+		 */
+
+		if (qrt_arenas != NULL) {
+			g_hash_table_remove(qrt_arenas, qa->digest);
+			qrt_arena_update_stats();
+		}
+		atom_sha1_free_null(&qa->digest);
+		qa->magic = 0;
+		WFREE(qa);
+		return;
+	}
+
+	qa->refcnt--;
+
+	if (keep) {
+		rt->arena = hcopy(qa->arena, rt->slots / 8);
+		gnet_prop_set_guint32_val(PROP_QRP_MEMORY,
+			GNET_PROPERTY(qrp_memory) + rt->slots / 8);
+	} else {
+		rt->arena = NULL;
+	}
+}
+
+/**
+ * Forget about all the shared arenas.
+ *
+ * Tables still referencing a shared arena remain valid: the holder is
+ * reclaimed when the last of them is freed.
+ */
+static void
+qrt_arena_close(void)
+{
+	if (qrt_arenas != NULL) {
+		g_hash_table_destroy(qrt_arenas);
+		qrt_arenas = NULL;
+	}
+}
+
 /**
  * Create a new query routing table, with supplied `arena' and `slots'.
  * The value used for infinity is given as `max'.
@@ -845,6 +1852,8 @@ qrt_create(const char *name, char *arena, int slots, int max)
 	rt->compacted     = FALSE;
 	rt->digest        = NULL;
 	rt->reset         = FALSE;
+	rt->leaf_id       = -1;
+	rt->shared        = NULL;
 	rt->can_route_urn = qrp_can_route_default;
 	rt->can_route     = qrp_can_route_default;
 
@@ -887,13 +1896,27 @@ qrt_free(struct routing_table *rt)
 {
 	g_assert(rt->refcnt == 0);
 
+	if (rt->leaf_id >= 0)
+		qidx_remove(rt);
+
+	if (rt->shared != NULL)
+		qrt_arena_unshare(rt, FALSE);
+
+	/*
+	 * A NULL arena means it was shared and is still used by other tables,
+	 * so its memory is not ours to account for.
+	 */
+
+	if (rt->arena != NULL) {
+		gnet_prop_set_guint32_val(PROP_QRP_MEMORY,
+		  GNET_PROPERTY(qrp_memory) -
+			(rt->compacted ? rt->slots / 8 : rt->slots));
+	}
+
 	atom_sha1_free_null(&rt->digest);
 	HFREE_NULL(rt->arena);
 	G_FREE_NULL(rt->name);
 
-	gnet_prop_set_guint32_val(PROP_QRP_MEMORY,
-	  GNET_PROPERTY(qrp_memory) - (rt->compacted ? rt->slots / 8 : rt->slots));
-
 	rt->magic = 0;				/* Prevent accidental reuse */
 	WFREE(rt);
 }
@@ -1009,9 +2032,24 @@ struct merge_context {
 	GSList *tables;				/* Leaf routing tables */
 	guchar *arena;				/* Working arena (not compacted) */
 	int slots;					/* Amount of slots used for merged table */
+	GHashTable *merged;			/* SHA1 atoms of shared arenas merged */
 };
 
-static struct merge_context *merge_ctx;
+static struct merge_context *merge_ctx;
+
+/**
+ * Free SHA1 atom key from the set of merged shared arenas.
+ */
+static void
+merged_free_kv(gpointer key, gpointer unused_value, gpointer unused_udata)
+{
+	const struct sha1 *digest = key;
+
+	(void) unused_value;
+	(void) unused_udata;
+
+	atom_sha1_free(digest);
+}
 
 /**
  * Free merge context.
@@ -1034,6 +2072,12 @@ merge_context_free(gpointer p)
 	}
 	gm_slist_free_null(&ctx->tables);
 
+	if (ctx->merged != NULL) {
+		g_hash_table_foreach(ctx->merged, merged_free_kv, NULL);
+		g_hash_table_destroy(ctx->merged);
+		ctx->merged = NULL;
+	}
+
 	HFREE_NULL(ctx->arena);
 	ctx->magic = 0;
 	WFREE(ctx);
@@ -1251,11 +2295,24 @@ mrg_step_merge_one(struct bgtask *unused_h, gpointer u, int ticks)
 		/*
 		 * If we're the only referer to this table, it means the node is
 		 * dead and therefore this table should be skipped.
+		 *
+		 * Identical tables share the same arena: merging it once is enough
+		 * since "x OR x = x".
 		 */
 
 		if (rt->refcnt > 1) {
-			merge_table_into_arena(rt, ctx->arena, ctx->slots);
-			ticks_used++;
+			const struct qrt_arena *qa = rt->shared;
+
+			if (qa != NULL && gm_hash_table_contains(ctx->merged, qa->digest)) {
+				gnet_stats_count_general(GNR_QRP_MERGE_DUPS_SKIPPED, 1);
+			} else {
+				merge_table_into_arena(rt, ctx->arena, ctx->slots);
+				ticks_used++;
+				if (qa != NULL) {
+					const struct sha1 *digest = atom_sha1_get(qa->digest);
+					gm_hash_table_insert_const(ctx->merged, digest, NULL);
+				}
+			}
 		}
 
 		qrt_unref(rt);
@@ -1318,6 +2375,7 @@ mrg_compute(bgdone_cb_t done_cb)
 
 	WALLOC0(ctx);
 	ctx->magic = MERGE_MAGIC;
+	ctx->merged = g_hash_table_new(sha1_hash, sha1_eq);
 	merge_ctx = ctx;
 
 	merge_comp = bg_task_create("Leaf QRT merging",
@@ -1435,17 +2493,21 @@ qrp_add_file(const shared_file_t *sf, GHashTable *words)
 		word_len = strlen(word);
 
 		/*
-		 * Record word if we haven't seen it yet.
+		 * Record word if we haven't seen it yet, and count the amount
+		 * of files holding it, for incremental table updates.
 		 */
 
-		if (g_hash_table_lookup(words, word)) {
-			continue;
-		} else {
-			gpointer p;
-			size_t n = 1 + word_len;
+		{
+			gpointer key, value;
+
+			if (g_hash_table_lookup_extended(words, word, &key, &value)) {
+				g_hash_table_insert(words, key,
+					uint_to_pointer(pointer_to_uint(value) + 1));
+				continue;
+			}
 
-			p = wcopy(word, n);
-			g_hash_table_insert(words, p, (gpointer) n);
+			key = wcopy(word, 1 + word_len);
+			g_hash_table_insert(words, key, uint_to_pointer(1));
 		}
 
 		if (GNET_PROPERTY(qrp_debug) > 8)
@@ -1465,7 +2527,7 @@ free_word(gpointer key, gpointer value, gpointer unused_udata)
 {
 	(void) unused_udata;
 	g_assert(value);
-	wfree(key, (size_t) value);
+	wfree(key, 1 + strlen(key));
 }
 
 struct unique_substrings {		/* User data for unique_subtr() callback */
@@ -1488,29 +2550,22 @@ insert_substr(struct unique_substrings *u, const char *word)
 }
 
 /**
- * Iteration callback on the hashtable containing keywords.
+ * Invoke `cb' on all the substrings of `word' that we insert in the QRP,
+ * all anchored at the start, whose length range from 3 to the word length.
  */
 static void
-unique_substr(gpointer key, gpointer unused_value, gpointer udata)
+qrp_substrings_foreach(const char *word,
+	void (*cb)(const char *substr, void *udata), void *udata)
 {
-	struct unique_substrings *u = udata;
-	const char *word = key;
 	char *s;
 	size_t len, size, i;
 
-	(void) unused_value;
-
-	/*
-	 * Add all unique (i.e. not already seen) substrings from word, all
-	 * anchored at the start, whose length range from 3 to the word length.
-	 */
-
 	len = strlen(word);
 	size = len + 1;
 	s = wcopy(word, size);
 
 	for (i = 0; i <= QRP_MAX_CUT_CHARS; i++) {
-		insert_substr(u, s);
+		(*cb)(s, udata);
 
 		while (len > QRP_MIN_WORD_LENGTH) {
 			guint retlen;
@@ -1527,6 +2582,27 @@ unique_substr(gpointer key, gpointer unused_value, gpointer udata)
 	WFREE_NULL(s, size);
 }
 
+static void
+insert_substr_cb(const char *word, void *udata)
+{
+	insert_substr(udata, word);
+}
+
+/**
+ * Iteration callback on the hashtable containing keywords.
+ */
+static void
+unique_substr(gpointer key, gpointer unused_value, gpointer udata)
+{
+	(void) unused_value;
+
+	/*
+	 * Add all unique (i.e. not already seen) substrings from word.
+	 */
+
+	qrp_substrings_foreach(key, insert_substr_cb, udata);
+}
+
 /**
  * Create a list of all unique substrings at least QRP_MIN_WORD_LENGTH long,
  * from words held in `ht'.
@@ -1680,8 +2756,12 @@ qrp_step_substring(struct bgtask *unused_h, gpointer u, int unused_ticks)
 	g_assert(ctx->magic == QRP_MAGIC);
 	g_assert(ctx->words != NULL);
 
+	/*
+	 * Words are kept until the table size is known, to prepare for the
+	 * incremental updates of the table.
+	 */
+
 	ctx->sl_substrings = unique_substrings(ctx->words, &ctx->substrings);
-	qrp_dispose_words(&ctx->words);
 
 	if (GNET_PROPERTY(qrp_debug) > 1)
 		g_debug("QRP unique subwords: %d", ctx->substrings);
@@ -1809,6 +2889,13 @@ qrp_step_compute(struct bgtask *h, gpointer u, int unused_ticks)
 		gnet_prop_set_guint32_val(PROP_QRP_CONFLICT_RATIO,
 			(guint32) conflict_ratio);
 
+		/*
+		 * Whether or not the table changes, this is now the reference for
+		 * all subsequent incremental updates.
+		 */
+
+		qrp_incremental_reset(&ctx->words, bits);
+
 		/*
 		 * If we had already a table, compare it to the one we just built.
 		 * If they are identical, discard the new one.
@@ -2216,6 +3303,278 @@ qrp_merge_routing_table(struct bgtask *unused_h, gpointer unused_c,
 	qrp_update_routing_table();
 }
 
+/***
+ *** Incremental maintenance of the local table.
+ ***
+ *** After each full computation, we keep the words making up our library
+ *** along with the amount of files holding each of them, and for every slot
+ *** of the local table the amount of (word, substring) pairs hashing there.
+ *** Adding or removing a single file then updates the table in O(words in
+ *** that file), and the new table is diffed against the one we last sent.
+ ***/
+
+#define QRP_INCREMENTAL_DELAY	1000	/**< ms, to batch successive changes */
+
+static struct qrp_incremental {
+	GHashTable *words;		/**< Word -> amount of files holding it */
+	guint32 *counts;		/**< Amount of substrings hashed in each slot */
+	int bits;				/**< Table size, in bits */
+	int filled;				/**< Amount of slots with a non-zero count */
+	cevent_t *install_ev;	/**< Pending installation of updated table */
+} qinc;
+
+static void
+qrp_incremental_count_substr(const char *substr, void *unused_udata)
+{
+	guint idx = qrp_hash(substr, qinc.bits);
+
+	(void) unused_udata;
+
+	if (0 == qinc.counts[idx]++)
+		qinc.filled++;
+}
+
+static void
+qrp_incremental_uncount_substr(const char *substr, void *unused_udata)
+{
+	guint idx = qrp_hash(substr, qinc.bits);
+
+	(void) unused_udata;
+	g_assert(qinc.counts[idx] > 0);
+
+	if (0 == --qinc.counts[idx])
+		qinc.filled--;
+}
+
+static void
+qrp_incremental_count_word(gpointer key, gpointer unused_value,
+	gpointer unused_udata)
+{
+	(void) unused_value;
+	(void) unused_udata;
+
+	qrp_substrings_foreach(key, qrp_incremental_count_substr, NULL);
+}
+
+/**
+ * Forget about the incremental state: the next library change will have
+ * to go through a full computation.
+ */
+static void
+qrp_incremental_close(void)
+{
+	cq_cancel(&qinc.install_ev);
+	qrp_dispose_words(&qinc.words);
+	HFREE_NULL(qinc.counts);
+	qinc.bits = qinc.filled = 0;
+}
+
+/**
+ * Record the state of a fully computed table with `bits' bits, built from
+ * the words referenced by `words_ptr', which we take ownership of.
+ */
+static void
+qrp_incremental_reset(GHashTable **words_ptr, int bits)
+{
+	g_assert(words_ptr != NULL);
+	g_assert(*words_ptr != NULL);
+	g_assert(bits >= MIN_TABLE_BITS && bits <= MAX_TABLE_BITS);
+
+	qrp_incremental_close();
+
+	qinc.words = *words_ptr;
+	*words_ptr = NULL;
+	qinc.bits = bits;
+	qinc.counts = halloc0((1 << bits) * sizeof qinc.counts[0]);
+
+	g_hash_table_foreach(qinc.words, qrp_incremental_count_word, NULL);
+
+	if (GNET_PROPERTY(qrp_debug) > 1)
+		g_debug("QRP incremental state: %u words, %d/%d slots filled",
+			g_hash_table_size(qinc.words), qinc.filled, 1 << bits);
+}
+
+/**
+ * Install a new local table built from the incremental state, and propagate
+ * it as if it came from a full computation.
+ */
+static void
+qrp_incremental_install(cqueue_t *unused_cq, gpointer unused_obj)
+{
+	struct routing_table *rt;
+	int slots = 1 << qinc.bits;
+	char *arena;
+	int i;
+
+	(void) unused_cq;
+	(void) unused_obj;
+
+	qinc.install_ev = NULL;
+
+	/*
+	 * A full computation in progress will supersede our state anyway.
+	 */
+
+	if (qrp_comp != NULL || NULL == qinc.counts)
+		return;
+
+	arena = halloc(slots);
+
+	for (i = 0; i < slots; i++)
+		arena[i] = 0 == qinc.counts[i] ? LOCAL_INFINITY : 1;
+
+	if (local_table != NULL && qrt_eq(local_table, arena, slots)) {
+		if (GNET_PROPERTY(qrp_debug) > 1)
+			g_debug("QRP incremental update left table unchanged");
+		HFREE_NULL(arena);
+		return;
+	}
+
+	rt = qrt_create("Local table", arena, slots, LOCAL_INFINITY);
+
+	if (local_table != NULL)
+		qrt_unref(local_table);
+	local_table = qrt_ref(rt);
+
+	if (routing_patch != NULL) {
+		qrt_patch_unref(routing_patch);
+		routing_patch = NULL;
+	}
+
+	gnet_prop_set_guint32_val(PROP_QRP_SLOTS_FILLED, (guint32) qinc.filled);
+	gnet_prop_set_guint32_val(PROP_QRP_FILL_RATIO,
+		(guint32) (100.0 * qinc.filled / slots));
+
+	if (GNET_PROPERTY(qrp_debug) > 1)
+		g_debug("QRP incremental update: %d/%d slots filled",
+			qinc.filled, slots);
+
+	/*
+	 * Same as qrp_step_install_leaf(), or merge with our leaves' tables
+	 * when running as an ultra node.
+	 */
+
+	if (settings_is_ultra()) {
+		qrp_update_routing_table();
+	} else {
+		install_routing_table(local_table);
+		install_merged_table(NULL);
+		qrt_patch_compute(routing_table, &routing_patch);
+		node_qrt_changed(routing_table);
+	}
+}
+
+/**
+ * Account for the words of a shared file being added (`delta' is +1)
+ * or removed (`delta' is -1).
+ *
+ * @return TRUE if the change was recorded, FALSE if a full computation is
+ * required to update the table.
+ */
+static gboolean
+qrp_incremental_update(const shared_file_t *sf, int delta)
+{
+	word_vec_t *wovec;
+	guint wocnt, i;
+	gboolean ok = TRUE;
+
+	g_assert(sf != NULL);
+	g_assert(1 == delta || -1 == delta);
+
+	/*
+	 * Can't proceed if we have no reference state yet, or if a full
+	 * computation is already running.
+	 */
+
+	if (NULL == qinc.words || qrp_comp != NULL)
+		return FALSE;
+
+	wocnt = word_vec_make(shared_file_name_canonic(sf), &wovec);
+
+	for (i = 0; i < wocnt; i++) {
+		const char *word = wovec[i].word;
+		gpointer key, value;
+		guint count = 0;
+
+		if (g_hash_table_lookup_extended(qinc.words, word, &key, &value))
+			count = pointer_to_uint(value);
+
+		if (delta > 0) {
+			if (0 == count) {
+				key = wcopy(word, 1 + strlen(word));
+				qrp_substrings_foreach(word,
+					qrp_incremental_count_substr, NULL);
+			}
+			g_hash_table_insert(qinc.words, key, uint_to_pointer(count + 1));
+		} else if (0 == count) {
+			ok = FALSE;			/* File was not part of the table */
+			break;
+		} else if (1 == count) {
+			g_hash_table_remove(qinc.words, key);
+			qrp_substrings_foreach(key, qrp_incremental_uncount_substr, NULL);
+			wfree(key, 1 + strlen(key));
+		} else {
+			g_hash_table_insert(qinc.words, key, uint_to_pointer(count - 1));
+		}
+	}
+
+	word_vec_free(wovec, wocnt);
+
+	/*
+	 * An inconsistent state cannot be trusted for further updates.
+	 *
+	 * If the table became too full for its size, a full computation
+	 * will pick a larger table.
+	 */
+
+	if (!ok) {
+		qrp_incremental_close();
+		return FALSE;
+	}
+
+	if (
+		qinc.bits < MAX_TABLE_BITS &&
+		100 * qinc.filled > MIN_SPARSE_RATIO * (1 << qinc.bits)
+	)
+		return FALSE;
+
+	if (NULL == qinc.install_ev) {
+		qinc.install_ev = cq_main_insert(QRP_INCREMENTAL_DELAY,
+			qrp_incremental_install, NULL);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Record a new shared file in the local table, without recomputing it.
+ *
+ * @return TRUE if done, FALSE if a full table computation is required.
+ */
+gboolean
+qrp_file_added(const shared_file_t *sf)
+{
+	if (GNET_PROPERTY(qrp_debug) > 1)
+		g_debug("QRP incrementally adding \"%s\"", shared_file_name_canonic(sf));
+
+	return qrp_incremental_update(sf, +1);
+}
+
+/**
+ * Remove a formerly shared file from the local table, without recomputing it.
+ *
+ * @return TRUE if done, FALSE if a full table computation is required.
+ */
+gboolean
+qrp_file_removed(const shared_file_t *sf)
+{
+	if (GNET_PROPERTY(qrp_debug) > 1)
+		g_debug("QRP incrementally removing \"%s\"",
+			shared_file_name_canonic(sf));
+
+	return qrp_incremental_update(sf, -1);
+}
+
 /**
  * Called when the current peermode has changed.
  */
@@ -3471,7 +4830,7 @@ qrt_apply_patch8(struct qrt_receive *qrcv, const guchar *data, int len,
 	const struct qrp_patch *patch)
 {
 	struct routing_table *rt = qrcv->table;
-	int i;
+	int i, n;
 
 	g_assert(qrcv->table != NULL);
 
@@ -3487,27 +4846,40 @@ qrt_apply_patch8(struct qrt_receive *qrcv, const guchar *data, int len,
 		return FALSE;
 
 	g_assert(qrcv->current_index + len <= rt->slots);
-	
+
 	/*
-	 * Compute the amount of entries per byte, and the initial reading mask.
+	 * The only possibilities for the patch are:
+	 *
+	 * . A negative value, to bring the slot value from infinity to 1.
+	 * . A null value for no change.
+	 * . A positive value to bring the slot back to infinity.
+	 *
+	 * In reality, for leaf<->ultrapeer QRT, what matters is presence.
+	 * We consider everything that is less to infinity as being
+	 * present, and therefore forget about the "hops-away" semantics
+	 * of the QRT slot value.
+	 *
+	 * Slots are patched one at a time until we reach an arena byte
+	 * boundary, then 8 at a time.
 	 */
 
-	for (i = 0; i < len; i++) {
-		/*
-		 * The only possibilities for the patch are:
-		 *
-		 * . A negative value, to bring the slot value from infinity to 1.
-		 * . A null value for no change.
-		 * . A positive value to bring the slot back to infinity.
-		 *
-		 * In reality, for leaf<->ultrapeer QRT, what matters is presence.
-		 * We consider everything that is less to infinity as being
-		 * present, and therefore forget about the "hops-away" semantics
-		 * of the QRT slot value.
-		 */
-		
-		qrt_patch_slot(rt, qrcv->current_index++, data[i]);
+	i = 0;
+
+	while (i < len && 0 != (qrcv->current_index & 0x7))
+		qrt_patch_slot(rt, qrcv->current_index++, data[i++]);
+
+	n = (len - i) / 8;
+
+	if (n != 0) {
+		rt->set_count += (*qrp_engine->patch8)(
+							&rt->arena[qrcv->current_index >> 3], &data[i], n);
+		qrcv->current_index += n * 8;
+		i += n * 8;
 	}
+
+	while (i < len)
+		qrt_patch_slot(rt, qrcv->current_index++, data[i++]);
+
 	qrcv->current_slot = qrcv->current_index - 1;
 
 	return TRUE;
@@ -3529,7 +4901,7 @@ qrt_apply_patch4(struct qrt_receive *qrcv, const guchar *data, int len,
 	const struct qrp_patch *patch)
 {
 	struct routing_table *rt = qrcv->table;
-	int i;
+	int i, n;
 
 	g_assert(qrcv->table != NULL);
 
@@ -3545,31 +4917,38 @@ qrt_apply_patch4(struct qrt_receive *qrcv, const guchar *data, int len,
 		return FALSE;
 
 	g_assert(qrcv->current_index + len * 2 <= rt->slots);
-	
+
 	/*
-	 * Compute the amount of entries per byte, and the initial reading mask.
+	 * Each patch byte contains 2 slots, processed as in qrt_apply_patch8():
+	 * one at a time until we reach an arena byte boundary, then 8 slots
+	 * (4 patch bytes) at a time.
 	 */
 
-	for (i = 0; i < len; i++) {
-		guint8 v = data[i];	/* Patch byte contains `epb' slots */
+	i = 0;
+
+	while (i < len && 0 != (qrcv->current_index & 0x7)) {
+		guint8 v = data[i++];
 
-		/*
-		 * The only possibilities for the patch are:
-		 *
-		 * . A negative value, to bring the slot value from infinity to 1.
-		 * . A null value for no change.
-		 * . A positive value to bring the slot back to infinity.
-		 *
-		 * In reality, for leaf<->ultrapeer QRT, what matters is presence.
-		 * We consider everything that is less to infinity as being
-		 * present, and therefore forget about the "hops-away" semantics
-		 * of the QRT slot value.
-		 */
-	
 		qrt_patch_slot(rt, qrcv->current_index++, v & 0xf0);
 		qrt_patch_slot(rt, qrcv->current_index++, (v << 4) & 0xf0);
+	}
+
+	n = (len - i) / 4;
+
+	if (n != 0) {
+		rt->set_count += (*qrp_engine->patch4)(
+							&rt->arena[qrcv->current_index >> 3], &data[i], n);
+		qrcv->current_index += n * 8;
+		i += n * 4;
+	}
 
+	while (i < len) {
+		guint8 v = data[i++];
+
+		qrt_patch_slot(rt, qrcv->current_index++, v & 0xf0);
+		qrt_patch_slot(rt, qrcv->current_index++, (v << 4) & 0xf0);
 	}
+
 	qrcv->current_slot = qrcv->current_index - 1;
 
 	return TRUE;
@@ -3746,6 +5125,8 @@ qrt_handle_reset(
 	rt->compacted = TRUE;		/* We'll compact it on the fly */
 	rt->digest = NULL;
 	rt->reset = TRUE;
+	rt->leaf_id = -1;
+	rt->shared = NULL;
 
 	qrcv->table = rt;
 	qrcv->shrink_factor = 1;		/* Assume none for now */
@@ -3891,6 +5272,14 @@ qrt_handle_patch(
 		qrcv->table->set_count = 0;
 		qrcv->patch = qrt_apply_patch; /* Default handler. */
 
+		/*
+		 * The table is going to be patched in place: until the whole
+		 * sequence is processed, route through the table itself.
+		 */
+
+		if (qrcv->table->leaf_id >= 0)
+			qidx_remove(qrcv->table);
+
 		switch (qrcv->entry_bits) {
 		case 8:
 			if (qrcv->shrink_factor == 1)
@@ -3952,6 +5341,13 @@ qrt_handle_patch(
 		g_assert(rt != NULL);
 		g_assert(rt->compacted);	/* 8 bits per byte, table is compacted */
 
+		/*
+		 * A shared arena is read-only: get a private copy before patching.
+		 */
+
+		if (rt->shared != NULL)
+			qrt_arena_unshare(rt, TRUE);
+
 		rt->arena = hrealloc(rt->arena, rt->slots / 8);
 	}
 
@@ -4095,8 +5491,11 @@ qrt_handle_patch(
 		else
 			node_qrt_patched(n, rt);
 
-		if (NODE_IS_LEAF(n))
+		if (NODE_IS_LEAF(n)) {
+			qrt_arena_share(rt);
+			qidx_add(rt);
 			qrp_leaf_changed();
+		}
 
 		if (GNET_PROPERTY(qrp_debug) > 4)
 			(void) qrt_dump(rt, GNET_PROPERTY(qrp_debug) > 19);
@@ -4216,6 +5615,8 @@ qrp_init(void)
 
 	test_hash();
 
+	qrt_arenas = g_hash_table_new(sha1_hash, sha1_eq);
+
 	/*
 	 * Install the periodic monitoring callback.
 	 */
@@ -4249,6 +5650,9 @@ qrp_close(void)
 	if (merged_table)
 		qrt_unref(merged_table);
 
+	qidx_close();
+	qrt_arena_close();
+	qrp_incremental_close();
 	HFREE_NULL(buffer.arena);
 }
 
@@ -4561,6 +5965,7 @@ qrt_build_query_target(
 	const GSList *sl;
 	gboolean sha1_query;
 	gboolean whats_new;
+	gboolean indexed;
 
 	g_assert(qhvec != NULL);
 	g_assert(hops >= 0);
@@ -4585,6 +5990,12 @@ qrt_build_query_target(
 
 	sha1_query = qhvec_has_urn(qhvec);
 
+	/*
+	 * Evaluate the query against all the indexed leaf tables at once.
+	 */
+
+	indexed = !whats_new && qidx_evaluate(qhvec);
+
 	/*
 	 * We need to special case processing of queries with TTL=1 so that they
 	 * get set to ultra peers that support last-hop QRP only if they can
@@ -4596,6 +6007,7 @@ qrt_build_query_target(
 		struct gnutella_node *dn = sl->data;
 		struct routing_table *rt = dn->recv_query_table;
 		gboolean is_leaf;
+		gboolean exact = FALSE;
 
 		if (!NODE_IS_WRITABLE(dn))
 			continue;
@@ -4643,7 +6055,19 @@ qrt_build_query_target(
 
 		node_inc_qrp_query(dn);			/* We have a QRT, mark we try routing */
 
-		if (!(qhvec->has_urn ?
+		/*
+		 * The leaf index is exact for tables not larger than its own
+		 * resolution, otherwise it only filters out leaves that cannot
+		 * route the query.
+		 */
+
+		if (indexed && rt->leaf_id >= 0) {
+			if (!bit_array_get(qidx.result, rt->leaf_id))
+				continue;
+			exact = rt->bits <= QIDX_BITS;
+		}
+
+		if (!exact && !(qhvec->has_urn ?
 			  rt->can_route_urn(qhvec, rt) :
 			  rt->can_route(qhvec, rt)))
 			continue;
@@ -71,6 +71,7 @@ typedef struct query_hashvec query_hashvec_t;
 
 void qrp_init(void);
 void qrp_close(void);
+void qrp_check(void);
 
 void qrp_leaf_changed(void);
 void qrp_peermode_changed(void);
@@ -79,6 +80,8 @@ void qrp_prepare_computation(void);
 void qrp_add_file(const struct shared_file *sf, GHashTable *words);
 void qrp_finalize_computation(GHashTable *words);
 void qrp_dispose_words(GHashTable **h_ptr);
+gboolean qrp_file_added(const struct shared_file *sf);
+gboolean qrp_file_removed(const struct shared_file *sf);
 
 struct qrt_update *qrt_update_create(struct gnutella_node *n,
 						struct routing_table *);
@@ -140,22 +140,15 @@ rx_inflate_init(rxdrv_t *rx, gconstpointer args)
 	const struct rx_inflate_args *rargs = args;
 	struct attr *attr;
 	z_streamp inz;
-	int ret;
 
 	rx_check(rx);
 	g_assert(rargs->cb != NULL);
 
-	WALLOC(inz);
-	inz->zalloc = zlib_alloc_func;
-	inz->zfree = zlib_free_func;
-	inz->opaque = NULL;
-
-	ret = inflateInit(inz);
+	inz = zlib_inflate_get(MAX_WBITS);
 
-	if (ret != Z_OK) {
-		WFREE(inz);
-		g_warning("unable to initialize decompressor for peer %s: %s",
-			gnet_host_to_string(&rx->host), zlib_strerror(ret));
+	if (NULL == inz) {
+		g_warning("unable to initialize decompressor for peer %s",
+			gnet_host_to_string(&rx->host));
 		return NULL;
 	}
 
@@ -176,16 +169,10 @@ static void
 rx_inflate_destroy(rxdrv_t *rx)
 {
 	struct attr *attr = rx->opaque;
-	int ret;
 
 	g_assert(attr->inz);
 
-	ret = inflateEnd(attr->inz);
-	if (ret != Z_OK)
-		g_warning("while freeing decompressor for peer %s: %s",
-			gnet_host_to_string(&rx->host), zlib_strerror(ret));
-
-	WFREE(attr->inz);
+	zlib_stream_release(&attr->inz);
 	WFREE(attr);
 }
 
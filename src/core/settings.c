@@ -76,6 +76,7 @@
 #include "lib/dbstore.h"
 #include "lib/debug.h"
 #include "lib/eval.h"
+#include "lib/evperf.h"
 #include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/getgateway.h"
@@ -88,7 +89,9 @@
 #include "lib/parse.h"
 #include "lib/random.h"
 #include "lib/sha1.h"
+#include "lib/stall.h"
 #include "lib/tm.h"
+#include "lib/tpool.h"
 #include "lib/vmm.h"
 #include "lib/zalloc.h"
 
@@ -2236,6 +2239,50 @@ inputevt_debug_changed(property_t prop)
     return FALSE;
 }
 
+static gboolean
+evloop_profiling_changed(property_t prop)
+{
+	gboolean enabled;
+
+	gnet_prop_get_boolean_val(prop, &enabled);
+	evperf_set_enabled(enabled);
+
+    return FALSE;
+}
+
+static gboolean
+stall_threshold_changed(property_t prop)
+{
+	guint32 val;
+
+	gnet_prop_get_guint32_val(prop, &val);
+	stall_set_threshold(val);
+
+    return FALSE;
+}
+
+static gboolean
+tpool_debug_changed(property_t prop)
+{
+	guint32 val;
+
+	gnet_prop_get_guint32_val(prop, &val);
+	tpool_set_debug(val);
+
+    return FALSE;
+}
+
+static gboolean
+tpool_threads_changed(property_t prop)
+{
+	guint32 val;
+
+	gnet_prop_get_guint32_val(prop, &val);
+	tpool_set_threads(val);
+
+    return FALSE;
+}
+
 static gboolean
 omalloc_debug_changed(property_t prop)
 {
@@ -2900,6 +2947,26 @@ static prop_map_t property_map[] = {
 		query_answer_partials_changed,
 		FALSE,
 	},
+	{
+		PROP_EVLOOP_PROFILING,
+		evloop_profiling_changed,
+		TRUE,
+	},
+	{
+		PROP_STALL_THRESHOLD,
+		stall_threshold_changed,
+		TRUE,
+	},
+	{
+		PROP_TPOOL_DEBUG,
+		tpool_debug_changed,
+		TRUE,
+	},
+	{
+		PROP_TPOOL_THREADS,
+		tpool_threads_changed,
+		TRUE,
+	},
 };
 
 /***
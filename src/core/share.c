@@ -36,6 +36,10 @@
 
 #include "common.h"
 
+#ifdef HAS_INOTIFY
+#include <sys/inotify.h>
+#endif
+
 #include "share.h"
 #include "extensions.h"
 #include "downloads.h"
@@ -55,6 +59,7 @@
 #include "search.h"
 #include "settings.h"
 #include "spam.h"
+#include "tth_cache.h"
 #include "upload_stats.h"
 #include "uploads.h"
 
@@ -66,13 +71,17 @@
 #include "lib/atoms.h"
 #include "lib/bg.h"
 #include "lib/cq.h"
+#include "lib/dirwalk.h"
 #include "lib/endian.h"
+#include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/glib-missing.h"
 #include "lib/halloc.h"
 #include "lib/hashlist.h"
+#include "lib/inputevt.h"
 #include "lib/listener.h"
 #include "lib/mime_type.h"
+#include "lib/random.h"
 #include "lib/str.h"
 #include "lib/tm.h"
 #include "lib/utf8.h"
@@ -140,6 +149,7 @@ static GHashTable *extensions;	/* Shared filename extensions */
 static GSList *shared_dirs;
 static hash_list_t *partial_files;
 static cevent_t *share_qrp_rebuild_ev;
+static gboolean share_qrp_full_rebuild;	/* QRP must be fully recomputed */
 
 /*
  * These variables are recreated by each library scanning.
@@ -157,6 +167,7 @@ static GHashTable *file_basenames;
 static search_table_t *partial_table;
 static shared_file_t **file_table;			/* Sorted by mtime */
 static shared_file_t **sorted_file_table;	/* Sorted by name */
+static GHashTable *share_paths;				/* File path (atom) => shared file */
 
 static struct recursive_scan *recursive_scan_context;
 static gboolean share_rebuilding;
@@ -365,6 +376,13 @@ shared_file_deindex(shared_file_t *sf)
 	}
 	sf->flags &= ~SHARE_F_BASENAME;
 
+	if (
+		share_paths != NULL &&
+		sf == g_hash_table_lookup(share_paths, sf->file_path)
+	) {
+		g_hash_table_remove(share_paths, sf->file_path);
+	}
+
 	/*
 	 * The shared file might not be referenced by the current file_table
 	 * either because it hasn't been build yet or because of a rescan.
@@ -557,6 +575,265 @@ done:
 	return sf;
 }
 
+/***
+ *** Cache of library query results.
+ ***
+ *** The same queries reach us from many neighbours within a short period of
+ *** time, so we remember the files matched by the library for each query.
+ *** Entries are invalidated when the library is rebuilt, and expire after
+ *** some time so that we do not always serve the same subset of files when
+ *** more than QCACHE_MAX_MATCHES files match.
+ ***/
+
+#define QCACHE_MAX_MATCHES	512			/**< Max matches remembered per query */
+#define QCACHE_MAX_MEMORY	(1024 * 1024)	/**< Max memory used by cache */
+#define QCACHE_LIFETIME		60			/**< Lifetime of entries, in seconds */
+
+/**
+ * A cached query result.
+ */
+struct qcache_entry {
+	char *query;				/**< Canonized query (halloc'ed) */
+	shared_file_t **files;		/**< Files matched (referenced) */
+	time_t stamp;				/**< When entry was created */
+	unsigned generation;		/**< Library generation of the result */
+	int count;					/**< Amount of files matched */
+};
+
+/**
+ * Context used to collect the matches of a query.
+ */
+struct qcache_collect {
+	st_search_callback callback;	/**< User callback */
+	gpointer user_data;				/**< User callback argument */
+	shared_file_t **files;			/**< Files matched */
+	int max_res;					/**< Max results accepted by user */
+	int count;						/**< Amount of files matched */
+	int accepted;					/**< Amount accepted by user callback */
+};
+
+static hash_list_t *qcache;				/**< LRU of qcache_entry */
+static size_t qcache_memory;			/**< Memory used by cached entries */
+static unsigned share_generation;		/**< Bumped when library changes */
+
+static guint
+qcache_entry_hash(gconstpointer key)
+{
+	const struct qcache_entry *qe = key;
+
+	return g_str_hash(qe->query);
+}
+
+static int
+qcache_entry_eq(gconstpointer a, gconstpointer b)
+{
+	const struct qcache_entry *qa = a, *qb = b;
+
+	return 0 == strcmp(qa->query, qb->query);
+}
+
+static size_t
+qcache_entry_size(const struct qcache_entry *qe)
+{
+	return sizeof *qe + strlen(qe->query) + 1 + qe->count * sizeof qe->files[0];
+}
+
+/**
+ * Free cache entry, releasing the files it references.
+ */
+static void
+qcache_entry_free(void *data)
+{
+	struct qcache_entry *qe = data;
+	int i;
+
+	g_assert(qcache_memory >= qcache_entry_size(qe));
+
+	qcache_memory -= qcache_entry_size(qe);
+
+	for (i = 0; i < qe->count; i++)
+		shared_file_unref(&qe->files[i]);
+
+	HFREE_NULL(qe->files);
+	HFREE_NULL(qe->query);
+	WFREE(qe);
+}
+
+/**
+ * Remove cache entry.
+ */
+static void
+qcache_remove(struct qcache_entry *qe)
+{
+	hash_list_remove(qcache, qe);
+	qcache_entry_free(qe);
+}
+
+/**
+ * Drop all cached results.
+ */
+static void
+qcache_clear(void)
+{
+	struct qcache_entry *qe;
+
+	while (NULL != (qe = hash_list_shift(qcache)))
+		qcache_entry_free(qe);
+
+	g_assert(0 == qcache_memory);
+}
+
+/**
+ * Record matched files for the query, evicting the least recently used
+ * entries as needed.
+ *
+ * @param query		the canonized query, taken over by the cache
+ * @param files		the matched files (references taken over by the cache)
+ * @param count		amount of matched files
+ */
+static void
+qcache_insert(char *query, shared_file_t **files, int count)
+{
+	struct qcache_entry *qe;
+
+	WALLOC(qe);
+	qe->query = query;
+	qe->files = count > 0 ? hcopy(files, count * sizeof files[0]) : NULL;
+	qe->count = count;
+	qe->stamp = tm_time();
+	qe->generation = share_generation;
+
+	qcache_memory += qcache_entry_size(qe);
+	hash_list_append(qcache, qe);
+
+	while (qcache_memory > QCACHE_MAX_MEMORY) {
+		struct qcache_entry *old = hash_list_head(qcache);
+
+		g_assert(old != NULL);
+		qcache_remove(old);
+	}
+}
+
+/**
+ * Lookup valid cached result for the canonized query.
+ */
+static struct qcache_entry *
+qcache_lookup(const char *query)
+{
+	struct qcache_entry key, *qe;
+	const void *orig;
+
+	key.query = deconstify_gchar(query);
+
+	if (!hash_list_find(qcache, &key, &orig))
+		return NULL;
+
+	qe = deconstify_gpointer(orig);
+
+	if (
+		qe->generation != share_generation ||
+		delta_time(tm_time(), qe->stamp) > QCACHE_LIFETIME
+	) {
+		qcache_remove(qe);
+		return NULL;
+	}
+
+	hash_list_moveto_tail(qcache, qe);
+	return qe;
+}
+
+/**
+ * Search callback collecting all the matches, while feeding the user
+ * callback until it accepted enough results.
+ */
+static gboolean
+qcache_collect_match(gpointer context, gpointer data)
+{
+	struct qcache_collect *col = context;
+	shared_file_t *sf = data;
+
+	g_assert(col->count < QCACHE_MAX_MATCHES);
+
+	col->files[col->count++] = shared_file_ref(sf);
+
+	if (col->accepted < col->max_res && (*col->callback)(col->user_data, sf))
+		col->accepted++;
+
+	return TRUE;		/* Counts as a match for st_search() */
+}
+
+/**
+ * Search the library, using cached results when available.
+ *
+ * @return the amount of files accepted by the callback.
+ */
+static int
+qcache_search(const char *query,
+	st_search_callback callback, gpointer user_data,
+	int max_res, query_hashvec_t *qhv)
+{
+	struct qcache_entry *qe;
+	struct qcache_collect col;
+	char *canonic;
+	int i, n = 0;
+
+	canonic = UNICODE_CANONIZE(query);
+	qe = qcache_lookup(canonic);
+
+	if (qe != NULL) {
+		gnet_stats_count_general(GNR_LOCAL_QUERY_CACHE_HITS, 1);
+
+		/*
+		 * Start at a random offset, as st_search() does, so that repeated
+		 * queries get different results when there are many matches.
+		 */
+
+		if (qe->count > 0) {
+			int offset = random_u32() % qe->count;
+
+			for (i = 0; i < qe->count && n < max_res; i++) {
+				shared_file_t *sf = qe->files[(i + offset) % qe->count];
+
+				if (!(sf->flags & SHARE_F_INDEXED))
+					continue;		/* Removed from library since */
+
+				if ((*callback)(user_data, sf))
+					n++;
+			}
+		}
+
+		st_fill_qhv(query, qhv);	/* Side effect of st_search() */
+		goto done;
+	}
+
+	gnet_stats_count_general(GNR_LOCAL_QUERY_CACHE_MISSES, 1);
+
+	col.callback = callback;
+	col.user_data = user_data;
+	col.max_res = max_res;
+	col.count = 0;
+	col.accepted = 0;
+	col.files = halloc(QCACHE_MAX_MATCHES * sizeof col.files[0]);
+
+	st_search(search_table, query, qcache_collect_match, &col,
+		QCACHE_MAX_MATCHES, qhv);
+
+	n = col.accepted;
+
+	if (canonic == query)
+		canonic = h_strdup(query);
+
+	qcache_insert(canonic, col.files, col.count);
+	canonic = NULL;			/* Taken over by cache */
+	HFREE_NULL(col.files);
+
+done:
+	if (canonic != query)
+		HFREE_NULL(canonic);
+
+	return n;
+}
+
 void
 shared_files_match(const char *query,
 	st_search_callback callback, gpointer user_data,
@@ -569,7 +846,7 @@ shared_files_match(const char *query,
 	 * First search from the library.
 	 */
 
-	n = st_search(search_table, query, callback, user_data, max_res, qhv);
+	n = qcache_search(query, callback, user_data, max_res, qhv);
 	gnet_stats_count_general(GNR_LOCAL_HITS, n);
 
 	remain = max_res - n;
@@ -979,22 +1256,26 @@ get_relative_path(const char *base_dir, const char *pathname)
 }
 
 /**
- * Verify that a file extension is valid for sharing
+ * Verify that a file extension is listed in the supplied set.
  *
+ * This does not modify anything, so it can be used from a thread provided
+ * the set is not modified concurrently.
+ *
+ * @param exts		The set of shared extensions, may be NULL.
  * @param filename  The name of the file to check.
  * @return TRUE if the file should be shared, FALSE if not.
  */
 static gboolean
-shared_file_valid_extension(const char *filename)
+shared_extension_listed(GHashTable *exts, const char *filename)
 {
 	const char *filename_ext;
 
-	if (!extensions)
+	if (!exts)
 		return FALSE;
 
 	if (
-		1 == g_hash_table_size(extensions) &&
-		g_hash_table_lookup(extensions, "--all--")
+		1 == g_hash_table_size(exts) &&
+		g_hash_table_lookup(exts, "--all--")
     ) {
 		/*
 		 * An extension "--all--" matches all files, even those that don't
@@ -1017,7 +1298,7 @@ shared_file_valid_extension(const char *filename)
 		 * All valid extensions start with '.'.  Matching is case-insensitive
 		 */
 
-		if (g_hash_table_lookup(extensions, filename_ext)) {
+		if (g_hash_table_lookup(exts, filename_ext)) {
 			return TRUE;
 		}
 	}
@@ -1025,6 +1306,18 @@ shared_file_valid_extension(const char *filename)
 	return FALSE;
 }
 
+/**
+ * Verify that a file extension is valid for sharing
+ *
+ * @param filename  The name of the file to check.
+ * @return TRUE if the file should be shared, FALSE if not.
+ */
+static gboolean
+shared_file_valid_extension(const char *filename)
+{
+	return shared_extension_listed(extensions, filename);
+}
+
 /**
  * @param relative_path The relative path of the file or NULL.
  * @param pathname The absolute pathname of the file.
@@ -1168,6 +1461,14 @@ directory_is_unshareable(const char *dir)
 	return FALSE;	/* No objection */
 }
 
+struct share_index;
+
+static void share_dir_free(void *data);
+static void share_index_free(struct share_index **si_ptr);
+static void share_watch_dir(const char *dir);
+static void share_watch_reset(void);
+static void share_watch_close(void);
+
 enum recursive_scan_magic { RECURSIVE_SCAN_MAGIC = 0x16926d87U };
 
 struct recursive_scan {
@@ -1181,6 +1482,10 @@ struct recursive_scan {
 	slist_t *sub_dirs;			/* list of g_malloc()ed strings */
 	slist_t *shared_files;		/* list of struct shared_file */
 	slist_t *partial_files;		/* list of struct shared_file */
+	slist_t *dirs;				/* list of struct share_dir */
+	struct share_index *index;	/* library index being loaded */
+	dirwalk_t *walk;			/* concurrent directory reader */
+	struct recursive_scan_filter *filter;	/* entry filter for the reader */
 	slist_iter_t *iter;			/* list iterator */
 	GHashTable *words;			/* records words making up filenames, for QRP */
 	GHashTable *basenames;		/* known file basenames */
@@ -1193,6 +1498,9 @@ struct recursive_scan {
 	guint64 bytes_scanned;		/* size of the library */
 	int idx;					/* iterating index */
 	int ticks;					/* ticks used */
+	unsigned use_index:1;		/* try to load library index */
+	unsigned loaded:1;			/* library was loaded from index */
+	unsigned walk_started:1;	/* concurrent reading was attempted */
 };
 
 static inline void
@@ -1218,6 +1526,7 @@ recursive_scan_new(const GSList *base_dirs)
 	ctx->sub_dirs = slist_new();
 	ctx->shared_files = slist_new();
 	ctx->partial_files = slist_new();
+	ctx->dirs = slist_new();
 	ctx->words = g_hash_table_new(g_str_hash, g_str_equal);
 	ctx->basenames = g_hash_table_new(g_str_hash, g_str_equal);
 	for (iter = base_dirs; NULL != iter; iter = g_slist_next(iter)) {
@@ -1261,6 +1570,111 @@ do_hfree(void *p)
 	hfree(p);
 }
 
+/**
+ * A directory being read concurrently.
+ */
+struct recursive_scan_dir {
+	const char *base_dir;		/* string atom */
+	const char *relative_path;	/* string atom */
+};
+
+static void
+recursive_scan_walk_dir_free(void *data)
+{
+	struct recursive_scan_dir *rd = data;
+
+	atom_str_free_null(&rd->base_dir);
+	atom_str_free_null(&rd->relative_path);
+	WFREE(rd);
+}
+
+/**
+ * Snapshot of the settings used to filter entries in the threads reading
+ * directories, which must not look at the live ones.
+ */
+struct recursive_scan_filter {
+	GHashTable *extensions;		/* shared extensions, halloc()ed strings */
+	unsigned ignore_links:1;	/* all symbolic links are ignored */
+};
+
+static void
+recursive_scan_filter_copy_ext(gpointer key,
+	gpointer unused_value, gpointer data)
+{
+	GHashTable *exts = data;
+	char *ext = h_strdup(key);
+
+	(void) unused_value;
+	g_hash_table_insert(exts, ext, ext);
+}
+
+static void
+recursive_scan_filter_free_ext(gpointer key,
+	gpointer unused_value, gpointer unused_data)
+{
+	(void) unused_value;
+	(void) unused_data;
+	hfree(key);
+}
+
+/**
+ * Take a snapshot of the current settings for filtering entries.
+ */
+static struct recursive_scan_filter *
+recursive_scan_filter_make(void)
+{
+	struct recursive_scan_filter *f;
+
+	WALLOC0(f);
+	if (extensions != NULL) {
+		f->extensions = g_hash_table_new(ascii_strcase_hash, ascii_strcase_eq);
+		g_hash_table_foreach(extensions,
+			recursive_scan_filter_copy_ext, f->extensions);
+	}
+	f->ignore_links = GNET_PROPERTY(scan_ignore_symlink_dirs) &&
+		GNET_PROPERTY(scan_ignore_symlink_regfiles);
+
+	return f;
+}
+
+static void
+recursive_scan_filter_free(struct recursive_scan_filter **f_ptr)
+{
+	struct recursive_scan_filter *f = *f_ptr;
+
+	if (f != NULL) {
+		if (f->extensions != NULL) {
+			g_hash_table_foreach(f->extensions,
+				recursive_scan_filter_free_ext, NULL);
+			gm_hash_table_destroy_null(&f->extensions);
+		}
+		WFREE(f);
+		*f_ptr = NULL;
+	}
+}
+
+/**
+ * Entry filter, run by the threads reading directories.
+ *
+ * Regular files whose extension is not shared and ignored symbolic links
+ * are discarded before being stat()ed, when their type is known.
+ *
+ * @return FALSE to skip the entry.
+ */
+static gboolean
+recursive_scan_walk_filter(const char *name, mode_t mode, void *data)
+{
+	const struct recursive_scan_filter *f = data;
+
+	if (S_ISLNK(mode))
+		return !f->ignore_links;
+
+	if (S_ISREG(mode))
+		return shared_extension_listed(f->extensions, name);
+
+	return TRUE;
+}
+
 static void
 recursive_scan_free(struct recursive_scan **ctx_ptr)
 {
@@ -1278,12 +1692,16 @@ recursive_scan_free(struct recursive_scan **ctx_ptr)
 		}
 
 		recursive_scan_closedir(ctx);
+		dirwalk_free(&ctx->walk, recursive_scan_walk_dir_free);
+		recursive_scan_filter_free(&ctx->filter);
 
 		slist_free_all(&ctx->base_dirs, (slist_destroy_cb) atom_str_free);
 		slist_free_all(&ctx->sub_dirs, do_hfree);
 		slist_free_all(&ctx->shared_files, recursive_sf_unref);
 		slist_free_all(&ctx->partial_files, recursive_sf_unref);
+		slist_free_all(&ctx->dirs, share_dir_free);
 		slist_iter_free(&ctx->iter);
+		share_index_free(&ctx->index);
 
 		gm_hash_table_destroy_null(&ctx->basenames);
 		st_free(&ctx->search_tb);
@@ -1326,72 +1744,582 @@ recursive_scan_context_free(void *data)
 	ctx->task = NULL;
 }
 
+/***
+ *** Persistent library index.
+ ***
+ *** After each full scan, we save the list of shared files along with the
+ *** image of the search table built from them.  At startup, if none of the
+ *** scanned directories changed since, we can install the library from that
+ *** index without walking the directories and rebuilding the search table,
+ *** which would otherwise delay the answering of queries for a long time
+ *** on large libraries.
+ ***
+ *** Modifications of existing files do not change the modification time of
+ *** their directory, but these are detected lazily when serving the file or
+ *** checking whether its SHA1 is up-to-date, exactly as between rescans.
+ ***/
+
+#define SHARE_INDEX_FILE		"library_index"
+#define SHARE_INDEX_VERSION		1
+#define SHARE_INDEX_BYTE_ORDER	0x01020304U
+
+static const char share_index_magic[8] = "GTKGLIDX";
+
 /**
- * Free up memory used by the shared library.
+ * Set to FALSE once the first scan was launched: the index is only used at
+ * startup, an explicit rescan always walks the directories.
  */
-static void
-share_free(void)
-{
-	GSList *sl;
-
-	st_free(&search_table);
-	gm_hash_table_destroy_null(&file_basenames);
+static gboolean share_index_usable = TRUE;
 
-	for (sl = shared_files; sl; sl = g_slist_next(sl)) {
-		shared_file_t *sf = sl->data;
-
-		shared_file_check(sf);
-		shared_file_unref(&sf);
-	}
-	gm_slist_free_null(&shared_files);
+/**
+ * A scanned directory, along with its modification time when we started
+ * reading it, or -1 if it could not be accessed.
+ */
+struct share_dir {
+	const char *path;			/**< Directory path (atom) */
+	time_t mtime;				/**< Modification time, -1 if absent */
+};
 
-	HFREE_NULL(file_table);
-	HFREE_NULL(sorted_file_table);
-}
+struct share_index_header {
+	char magic[8];
+	guint32 version;
+	guint32 byte_order;
+	guint32 dirs;				/**< Amount of directory records */
+	guint32 files;				/**< Amount of file records */
+};
 
 /**
- * Sort function - shared files by ascending mtime (oldest first). 
+ * Context used while loading the index.
  */
-static int
-shared_file_sort_by_mtime(const void *f1, const void *f2)
-{
-	const shared_file_t * const *sfp1 = f1, * const *sfp2 = f2;
-	const shared_file_t *sf1 = *sfp1, *sf2 = *sfp2;
-	time_t t1, t2;
+struct share_index {
+	void *image;				/**< The mapped index file */
+	size_t len;					/**< Length of image */
+	const char *p;				/**< Parsing position in image */
+	guint32 dirs;				/**< Amount of directory records */
+	guint32 files;				/**< Amount of file records */
+	guint32 done;				/**< Amount of records processed */
+	shared_file_t **loaded;		/**< Files loaded, in search table order */
+};
 
-	/* We don't use shared_file_check() here because it would be
-	 * the dominating factor for the sorting time. */
-	g_assert(SHARED_FILE_MAGIC == sf1->magic);
-	g_assert(SHARED_FILE_MAGIC == sf2->magic);
+static void
+share_dir_free(void *data)
+{
+	struct share_dir *sd = data;
 
-	t1 = sf1->mtime;
-	t2 = sf2->mtime;
-	return CMP(t1, t2);
+	atom_str_free_null(&sd->path);
+	WFREE(sd);
 }
 
-static inline int
-cmp_strings(const char *a, const char *b)
+/**
+ * Record that directory is being scanned.
+ *
+ * This must be called before reading the directory, so that any later
+ * change will be noticed.
+ */
+static void
+share_index_record_dir(struct recursive_scan *ctx, const char *dir)
 {
-	if (a && b) {
-		return a == b ? 0 : strcmp(a, b);
-	} else {
-		return a ? 1 : (b ? -1 : 0);
-	}
+	struct share_dir *sd;
+	filestat_t sb;
+
+	WALLOC(sd);
+	sd->path = atom_str_get(dir);
+	sd->mtime = (0 == stat(dir, &sb) && S_ISDIR(sb.st_mode)) ?
+		sb.st_mtime : (time_t) -1;
+	slist_append(ctx->dirs, sd);
 }
 
 /**
- * Sort function - shared files by name lexicographic order.
+ * @return configuration fingerprint, to make sure the index was built
+ * with the same settings.  Must be freed with hfree().
  */
-static int
-shared_file_sort_by_name(const void *f1, const void *f2)
+static char *
+share_index_fingerprint(void)
 {
-	const shared_file_t * const *sfp1 = f1, * const *sfp2 = f2;
-	const shared_file_t *sf1 = *sfp1, *sf2 = *sfp2;
-	int ret;
+	return h_strdup_printf("%s\n%s\n%d%d%d",
+		EMPTY_STRING(GNET_PROPERTY(shared_dirs_paths)),
+		EMPTY_STRING(GNET_PROPERTY(scan_extensions)),
+		GNET_PROPERTY(scan_ignore_symlink_dirs) ? 1 : 0,
+		GNET_PROPERTY(scan_ignore_symlink_regfiles) ? 1 : 0,
+		GNET_PROPERTY(search_results_expose_relative_paths) ? 1 : 0);
+}
 
-	/* We don't use shared_file_check() here because it would be
-	 * the dominating factor for the sorting time. */
-	g_assert(SHARED_FILE_MAGIC == sf1->magic);
+static void
+share_index_put_string(FILE *f, const char *s)
+{
+	fwrite(EMPTY_STRING(s), 1, strlen(EMPTY_STRING(s)) + 1, f);
+}
+
+static void
+share_index_put_u32(FILE *f, guint32 v)
+{
+	fwrite(&v, sizeof v, 1, f);
+}
+
+static void
+share_index_put_u64(FILE *f, guint64 v)
+{
+	fwrite(&v, sizeof v, 1, f);
+}
+
+static void
+share_index_save_dir(gpointer data, gpointer udata)
+{
+	const struct share_dir *sd = data;
+	FILE *f = udata;
+
+	share_index_put_u64(f, (gint64) sd->mtime);
+	share_index_put_string(f, sd->path);
+}
+
+static void
+share_index_save_file(const shared_file_t *sf, gpointer udata)
+{
+	FILE *f = udata;
+
+	share_index_put_u64(f, sf->file_size);
+	share_index_put_u64(f, (gint64) sf->mtime);
+	share_index_put_u32(f, sf->file_index);
+	share_index_put_u32(f, sf->sort_index);
+	share_index_put_string(f, sf->file_path);
+	share_index_put_string(f, sf->relative_path);
+}
+
+/**
+ * Save the library index for the installed library.
+ *
+ * @param dirs		the directories scanned to build the library
+ */
+static void
+share_index_save(const slist_t *dirs)
+{
+	struct share_index_header h;
+	file_path_t fp;
+	char *fingerprint;
+	FILE *f;
+
+	file_path_set(&fp, settings_config_dir(), SHARE_INDEX_FILE);
+	f = file_config_open_write("library index", &fp);
+	if (NULL == f)
+		return;
+
+	ZERO(&h);
+	memcpy(h.magic, share_index_magic, sizeof h.magic);
+	h.version = SHARE_INDEX_VERSION;
+	h.byte_order = SHARE_INDEX_BYTE_ORDER;
+	h.dirs = slist_length(dirs);
+	h.files = st_count(search_table);
+
+	fwrite(&h, sizeof h, 1, f);
+	fingerprint = share_index_fingerprint();
+	share_index_put_string(f, fingerprint);
+	HFREE_NULL(fingerprint);
+
+	slist_foreach(dirs, share_index_save_dir, f);
+	st_foreach(search_table, share_index_save_file, f);
+
+	/* The search table image must be aligned on 4 bytes */
+	while (ftell(f) & 3)
+		fputc(0, f);
+
+	if (!st_save(search_table, f) || ferror(f)) {
+		g_warning("could not write library index: %s", g_strerror(errno));
+		fclose(f);
+		return;
+	}
+
+	if (file_config_close(f, &fp) && GNET_PROPERTY(share_debug)) {
+		g_debug("SHARE saved library index (%u director%s, %u file%s)",
+			h.dirs, 1 == h.dirs ? "y" : "ies",
+			h.files, 1 == h.files ? "" : "s");
+	}
+}
+
+/**
+ * Release the image of the library index.
+ */
+static void
+share_index_unmap(void *image, size_t len)
+{
+#if defined(HAS_MMAP) && !defined(MINGW32)
+	if (-1 == munmap(image, len))
+		g_warning("munmap() of library index failed: %s", g_strerror(errno));
+#else
+	(void) len;
+	hfree(image);
+#endif
+}
+
+/**
+ * Map the library index in memory.
+ *
+ * @return pointer to the start of the image, NULL if unavailable.
+ */
+static void *
+share_index_map(size_t *len_ptr)
+{
+	char *path;
+	filestat_t sb;
+	void *image = NULL;
+	size_t len;
+	int fd;
+
+	path = make_pathname(settings_config_dir(), SHARE_INDEX_FILE);
+	fd = file_open_missing(path, O_RDONLY);
+	if (fd < 0)
+		goto done;
+
+	if (-1 == fstat(fd, &sb)) {
+		g_warning("can't stat \"%s\": %s", path, g_strerror(errno));
+		goto done;
+	}
+
+	if (
+		sb.st_size < (fileoffset_t) sizeof(struct share_index_header) ||
+		(filesize_t) sb.st_size > (filesize_t) MAX_INT_VAL(size_t)
+	)
+		goto done;
+
+	len = sb.st_size;
+
+#if defined(HAS_MMAP) && !defined(MINGW32)
+	image = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == image) {
+		g_warning("can't mmap() \"%s\": %s", path, g_strerror(errno));
+		image = NULL;
+	}
+#else
+	{
+		size_t n = 0;
+
+		image = halloc(len);
+		while (n < len) {
+			ssize_t r = read(fd, ptr_add_offset(image, n), len - n);
+			if (r <= 0) {
+				g_warning("can't read \"%s\": %s", path,
+					0 == r ? "truncated file" : g_strerror(errno));
+				HFREE_NULL(image);
+				break;
+			}
+			n += r;
+		}
+	}
+#endif
+
+	if (image != NULL)
+		*len_ptr = len;
+
+done:
+	if (fd >= 0)
+		close(fd);
+	HFREE_NULL(path);
+	return image;
+}
+
+static gboolean
+share_index_get(struct share_index *si, void *dest, size_t len)
+{
+	const char *end = const_ptr_add_offset(si->image, si->len);
+
+	if (UNSIGNED(end - si->p) < len)
+		return FALSE;
+
+	memcpy(dest, si->p, len);
+	si->p += len;
+	return TRUE;
+}
+
+static const char *
+share_index_get_string(struct share_index *si)
+{
+	const char *end = const_ptr_add_offset(si->image, si->len);
+	const char *s = si->p, *nul;
+
+	nul = memchr(s, '\0', end - s);
+	if (NULL == nul)
+		return NULL;
+
+	si->p = nul + 1;
+	return s;
+}
+
+/**
+ * Free loading context, releasing the image unless it was taken over
+ * by the search table.
+ */
+static void
+share_index_free(struct share_index **si_ptr)
+{
+	struct share_index *si = *si_ptr;
+
+	if (si != NULL) {
+		if (si->image != NULL)
+			share_index_unmap(si->image, si->len);
+		HFREE_NULL(si->loaded);
+		WFREE(si);
+		*si_ptr = NULL;
+	}
+}
+
+/**
+ * Open the library index and check its header.
+ *
+ * @return loading context, NULL if the index cannot be used.
+ */
+static struct share_index *
+share_index_open(void)
+{
+	struct share_index *si;
+	struct share_index_header h;
+	const char *fingerprint;
+	char *expected;
+	gboolean ok;
+
+	WALLOC0(si);
+	si->image = share_index_map(&si->len);
+	si->p = si->image;
+
+	if (NULL == si->image || !share_index_get(si, &h, sizeof h))
+		goto failed;
+
+	/*
+	 * Each directory record takes at least 9 bytes, each file 26 bytes.
+	 */
+
+	if (
+		0 != memcmp(h.magic, share_index_magic, sizeof h.magic) ||
+		h.version != SHARE_INDEX_VERSION ||
+		h.byte_order != SHARE_INDEX_BYTE_ORDER ||
+		h.dirs > si->len / 9 || h.files > si->len / 26
+	)
+		goto failed;
+
+	fingerprint = share_index_get_string(si);
+	expected = share_index_fingerprint();
+	ok = fingerprint != NULL && 0 == strcmp(fingerprint, expected);
+	HFREE_NULL(expected);
+
+	if (!ok) {
+		if (GNET_PROPERTY(share_debug))
+			g_debug("SHARE library index built with other settings");
+		goto failed;
+	}
+
+	si->dirs = h.dirs;
+	si->files = h.files;
+	return si;
+
+failed:
+	share_index_free(&si);
+	return NULL;
+}
+
+/**
+ * Check that the next recorded directory did not change.
+ */
+static gboolean
+share_index_check_dir(struct share_index *si)
+{
+	const char *path;
+	guint64 mtime;
+	filestat_t sb;
+	gboolean present;
+
+	if (!share_index_get(si, &mtime, sizeof mtime))
+		return FALSE;
+
+	path = share_index_get_string(si);
+	if (NULL == path)
+		return FALSE;
+
+	share_watch_dir(path);
+	present = 0 == stat(path, &sb) && S_ISDIR(sb.st_mode);
+
+	if ((time_t) -1 == (time_t) mtime ? present :
+		(!present || sb.st_mtime != (time_t) mtime)
+	) {
+		if (GNET_PROPERTY(share_debug))
+			g_debug("SHARE library index outdated: \"%s\" changed", path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Load the next recorded file, adding it to the scanned library.
+ */
+static gboolean
+share_index_load_file(struct share_index *si, struct recursive_scan *ctx)
+{
+	const char *path, *relative_path;
+	guint64 size, mtime;
+	guint32 file_index, sort_index;
+	shared_file_t *sf;
+	filestat_t sb;
+
+	if (
+		!share_index_get(si, &size, sizeof size) ||
+		!share_index_get(si, &mtime, sizeof mtime) ||
+		!share_index_get(si, &file_index, sizeof file_index) ||
+		!share_index_get(si, &sort_index, sizeof sort_index) ||
+		NULL == (path = share_index_get_string(si)) ||
+		NULL == (relative_path = share_index_get_string(si))
+	)
+		return FALSE;
+
+	/*
+	 * Rejecting a file would break the mapping between the search table
+	 * image and the files: the index is then unusable.
+	 */
+
+	ZERO(&sb);
+	sb.st_mode = S_IFREG;
+	sb.st_size = size;
+	sb.st_mtime = mtime;
+
+	sf = share_scan_add_file('\0' == relative_path[0] ? NULL : relative_path,
+			path, &sb);
+	if (NULL == sf)
+		return FALSE;
+
+	/*
+	 * Remember the indices the file had, so that the file tables can be
+	 * restored without sorting.
+	 */
+
+	sf->file_index = file_index;
+	sf->sort_index = sort_index;
+
+	g_assert(si->done >= si->dirs);
+	g_assert(si->done - si->dirs < si->files);
+
+	si->loaded[si->done - si->dirs] = sf;
+	ctx->shared = g_slist_prepend(ctx->shared, shared_file_ref(sf));
+	ctx->bytes_scanned += sf->file_size;
+	upload_stats_enforce_local_filename(sf);
+
+	return TRUE;
+}
+
+/**
+ * Fill table with the shared files in the order recorded in the library
+ * index, either by file index or by sort index.
+ *
+ * @return TRUE if the table could be filled, FALSE if the recorded order is
+ * unusable, in which case the table is left empty.
+ */
+static gboolean
+share_index_restore_order(const GSList *shared,
+	shared_file_t **table, size_t count, gboolean sorted)
+{
+	const GSList *sl;
+
+	for (sl = shared; sl; sl = g_slist_next(sl)) {
+		shared_file_t *sf = sl->data;
+		guint32 pos = sorted ? sf->sort_index : sf->file_index;
+
+		if (0 == pos || pos > count || table[pos - 1] != NULL) {
+			memset(table, 0, count * sizeof table[0]);
+			return FALSE;
+		}
+		table[pos - 1] = sf;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Discard partially loaded index, reverting to a regular scan.
+ */
+static void
+share_index_abort(struct recursive_scan *ctx)
+{
+	GSList *sl;
+
+	if (GNET_PROPERTY(share_debug))
+		g_debug("SHARE cannot use library index, scanning directories");
+
+	for (sl = ctx->shared; sl; sl = g_slist_next(sl)) {
+		shared_file_t *sf = sl->data;
+
+		shared_file_check(sf);
+		shared_file_unref(&sf);
+	}
+	gm_slist_free_null(&ctx->shared);
+
+	share_index_free(&ctx->index);
+	ctx->bytes_scanned = 0;
+	ctx->use_index = FALSE;
+}
+
+/**
+ * Free up memory used by the shared library.
+ */
+static void
+share_free(void)
+{
+	GSList *sl;
+
+	st_free(&search_table);
+	gm_hash_table_destroy_null(&file_basenames);
+	gm_hash_table_destroy_null(&share_paths);
+
+	for (sl = shared_files; sl; sl = g_slist_next(sl)) {
+		shared_file_t *sf = sl->data;
+
+		shared_file_check(sf);
+		shared_file_unref(&sf);
+	}
+	gm_slist_free_null(&shared_files);
+
+	HFREE_NULL(file_table);
+	HFREE_NULL(sorted_file_table);
+}
+
+/**
+ * Sort function - shared files by ascending mtime (oldest first). 
+ */
+static int
+shared_file_sort_by_mtime(const void *f1, const void *f2)
+{
+	const shared_file_t * const *sfp1 = f1, * const *sfp2 = f2;
+	const shared_file_t *sf1 = *sfp1, *sf2 = *sfp2;
+	time_t t1, t2;
+
+	/* We don't use shared_file_check() here because it would be
+	 * the dominating factor for the sorting time. */
+	g_assert(SHARED_FILE_MAGIC == sf1->magic);
+	g_assert(SHARED_FILE_MAGIC == sf2->magic);
+
+	t1 = sf1->mtime;
+	t2 = sf2->mtime;
+	return CMP(t1, t2);
+}
+
+static inline int
+cmp_strings(const char *a, const char *b)
+{
+	if (a && b) {
+		return a == b ? 0 : strcmp(a, b);
+	} else {
+		return a ? 1 : (b ? -1 : 0);
+	}
+}
+
+/**
+ * Sort function - shared files by name lexicographic order.
+ */
+static int
+shared_file_sort_by_name(const void *f1, const void *f2)
+{
+	const shared_file_t * const *sfp1 = f1, * const *sfp2 = f2;
+	const shared_file_t *sf1 = *sfp1, *sf2 = *sfp2;
+	int ret;
+
+	/* We don't use shared_file_check() here because it would be
+	 * the dominating factor for the sorting time. */
+	g_assert(SHARED_FILE_MAGIC == sf1->magic);
 	g_assert(SHARED_FILE_MAGIC == sf2->magic);
 
 	if (GNET_PROPERTY(search_results_expose_relative_paths)) {
@@ -1417,6 +2345,9 @@ recursive_scan_opendir(struct recursive_scan *ctx, const char * const dir)
 	if (directory_is_unshareable(dir))
 		return;
 
+	share_watch_dir(dir);
+	share_index_record_dir(ctx, dir);
+
 	/**
 	 * FIXME: On Windows FindFirstFile/FindNextFile/FindClose
 	 *		  must be used to get the Unicode filenames.		
@@ -1613,14 +2544,330 @@ recursive_scan_next_dir(struct recursive_scan *ctx)
 	}
 }
 
-static bgret_t
-recursive_scan_step_compute(struct bgtask *bt, void *data, int ticks)
+/***
+ *** Concurrent reading of the shared directories.
+ ***
+ *** When threads can be used, directories are read and their entries
+ *** stat()ed by worker threads, which keeps several requests outstanding.
+ *** We only process the entries they return, applying the same rules as
+ *** recursive_scan_readdir() and queueing the sub-directories to read.
+ *** The scanning task sleeps whilst the threads have nothing to return.
+ ***/
+
+/**
+ * Called when the concurrent reader has entries for us.
+ */
+static void
+recursive_scan_walk_notify(void *arg)
 {
-	struct recursive_scan *ctx = data;
+	struct recursive_scan *ctx = arg;
 
 	recursive_scan_check(ctx);
 
-	ctx->ticks = 0;
+	if (ctx->task != NULL)
+		bg_task_wakeup(ctx->task);
+}
+
+/**
+ * Queue directory for concurrent reading.
+ */
+static void
+recursive_scan_walk_add(struct recursive_scan *ctx,
+	const char *dir, const char *base_dir)
+{
+	struct recursive_scan_dir *rd;
+
+	recursive_scan_check(ctx);
+	g_assert(ctx->walk != NULL);
+
+	g_return_if_fail('\0' != dir[0]);
+	g_return_if_fail(is_absolute_path(base_dir));
+	g_return_if_fail(is_absolute_path(dir));
+
+	if (directory_is_unshareable(dir))
+		return;
+
+	share_watch_dir(dir);
+	share_index_record_dir(ctx, dir);
+
+	WALLOC(rd);
+	rd->base_dir = atom_str_get(base_dir);
+	rd->relative_path = GNET_PROPERTY(search_results_expose_relative_paths) ?
+		get_relative_path(base_dir, dir) : NULL;
+
+	if (GNET_PROPERTY(share_debug) > 5)
+		g_debug("SHARE scanning directory \"%s\"", dir);
+
+	dirwalk_add(ctx->walk, dir, rd);
+}
+
+/**
+ * Start reading the shared directories concurrently, if possible.
+ */
+static void
+recursive_scan_walk_start(struct recursive_scan *ctx)
+{
+	const char *dir;
+
+	recursive_scan_check(ctx);
+	g_assert(NULL == ctx->walk);
+
+	ctx->walk = dirwalk_new(GNET_PROPERTY(scan_threads),
+					recursive_scan_walk_notify, ctx);
+	if (NULL == ctx->walk)
+		return;
+
+	ctx->filter = recursive_scan_filter_make();
+	dirwalk_set_filter(ctx->walk, recursive_scan_walk_filter, ctx->filter);
+
+	if (GNET_PROPERTY(share_debug) > 1) {
+		g_debug("SHARE reading directories with %u thread%s",
+			GNET_PROPERTY(scan_threads),
+			1 == GNET_PROPERTY(scan_threads) ? "" : "s");
+	}
+
+	while (NULL != (dir = slist_shift(ctx->base_dirs))) {
+		recursive_scan_walk_add(ctx, dir, dir);
+		atom_str_free(dir);
+	}
+}
+
+/**
+ * Process an entry read concurrently.
+ */
+static void
+recursive_scan_walk_entry(struct recursive_scan *ctx,
+	const struct dirwalk_entry *e)
+{
+	const struct recursive_scan_dir *rd = e->udata;
+	char *fullpath;
+
+	if (GNET_PROPERTY(share_debug) > 19)
+		g_debug("SHARE considering entry \"%s\"", e->name);
+
+	if (
+		e->link &&
+		GNET_PROPERTY(scan_ignore_symlink_dirs) &&
+		GNET_PROPERTY(scan_ignore_symlink_regfiles)
+	) {
+		if (GNET_PROPERTY(share_debug) > 15) {
+			g_debug("SHARE to-be-ignored symlink, discarding \"%s\"",
+				e->name);
+		}
+		return;
+	}
+
+	fullpath = make_pathname(e->dir, e->name);
+
+	if (e->error != 0) {
+		if (e->link) {
+			g_warning("broken symlink %s: %s", fullpath, g_strerror(e->error));
+		} else {
+			g_warning("stat() failed %s: %s", fullpath, g_strerror(e->error));
+		}
+		goto finish;
+	}
+
+	if (e->link) {
+		if (
+			S_ISDIR(e->sb.st_mode) &&
+			GNET_PROPERTY(scan_ignore_symlink_dirs)
+		) {
+			if (GNET_PROPERTY(share_debug) > 15)
+				g_debug("SHARE discarding symlink dir \"%s\"", e->name);
+			goto finish;
+		}
+		if (
+			S_ISREG(e->sb.st_mode) &&
+			GNET_PROPERTY(scan_ignore_symlink_regfiles)
+		) {
+			if (GNET_PROPERTY(share_debug) > 15)
+				g_debug("SHARE discarding symlink file \"%s\"", e->name);
+			goto finish;
+		}
+	}
+
+	if (S_ISDIR(e->sb.st_mode)) {
+		recursive_scan_walk_add(ctx, fullpath, rd->base_dir);
+	} else if (S_ISREG(e->sb.st_mode)) {
+		shared_file_t *sf;
+
+		if (!shared_file_valid_extension(e->name)) {
+			if (GNET_PROPERTY(share_debug) > 15) {
+				g_debug("SHARE unshared extension, discarding \"%s\"",
+					e->name);
+			}
+			goto finish;
+		}
+
+		if (GNET_PROPERTY(share_debug) > 10)
+			g_debug("SHARE adding file \"%s\"", e->name);
+
+		sf = share_scan_add_file(rd->relative_path, fullpath, &e->sb);
+		if (sf) {
+			slist_append(ctx->shared_files, shared_file_ref(sf));
+		}
+	} else if (GNET_PROPERTY(share_debug)) {
+		g_warning("skipping file of unknown type \"%s\" in \"%s\"",
+			e->name, e->dir);
+	}
+
+finish:
+	HFREE_NULL(fullpath);
+}
+
+/**
+ * Process the entries read concurrently.
+ */
+static bgret_t
+recursive_scan_walk(struct bgtask *bt, struct recursive_scan *ctx, int ticks)
+{
+	struct dirwalk_entry e;
+
+	ctx->ticks = 0;
+
+	while (ctx->ticks < ticks) {
+		switch (dirwalk_next(ctx->walk, &e)) {
+		case DIRWALK_ENTRY:
+			recursive_scan_walk_entry(ctx, &e);
+			ctx->ticks++;
+			break;
+		case DIRWALK_DIR_END:
+			if (e.error != 0) {
+				g_warning("can't open directory %s: %s",
+					e.dir, g_strerror(e.error));
+			} else if (GNET_PROPERTY(share_debug) > 6) {
+				g_debug("SHARE leaving directory \"%s\"", e.dir);
+			}
+			recursive_scan_walk_dir_free(e.udata);
+			break;
+		case DIRWALK_AGAIN:
+			bg_task_sleep(bt);		/* Until notified of new entries */
+			goto more;
+		case DIRWALK_DONE:
+			dirwalk_free(&ctx->walk, NULL);
+			recursive_scan_filter_free(&ctx->filter);
+			bg_task_ticks_used(bt, ctx->ticks);
+			return BGR_NEXT;
+		}
+	}
+
+more:
+	bg_task_ticks_used(bt, ctx->ticks);
+	return BGR_MORE;
+}
+
+/**
+ * Load the library from the persistent index, if allowed and still valid.
+ * Otherwise, the next steps will scan the directories as usual.
+ */
+static bgret_t
+recursive_scan_step_load_index(struct bgtask *bt, void *data, int ticks)
+{
+	struct recursive_scan *ctx = data;
+	struct share_index *si;
+	search_table_t *st;
+
+	recursive_scan_check(ctx);
+
+	ctx->ticks = 0;
+
+	if (!ctx->use_index)
+		goto next;
+
+	if (NULL == ctx->index) {
+		ctx->index = share_index_open();
+		if (NULL == ctx->index)
+			goto fallback;
+		if (ctx->index->files != 0) {
+			ctx->index->loaded =
+				halloc0(ctx->index->files * sizeof ctx->index->loaded[0]);
+		}
+	}
+
+	si = ctx->index;
+
+	while (si->done < si->dirs) {
+		if (ctx->ticks++ >= ticks)
+			return BGR_MORE;
+
+		if (!share_index_check_dir(si))
+			goto fallback;
+
+		ctx->ticks += 10;	/* stat() is heavier work */
+		si->done++;
+	}
+
+	while (si->done < si->dirs + si->files) {
+		if (ctx->ticks++ >= ticks)
+			return BGR_MORE;
+
+		if (!share_index_load_file(si, ctx))
+			goto fallback;
+
+		si->done++;
+	}
+
+	/*
+	 * The search table image follows the file records, aligned on 4 bytes.
+	 */
+
+	st = st_load(si->image, si->len,
+			(ptr_diff(si->p, si->image) + 3) & ~((size_t) 3),
+			(const shared_file_t **) si->loaded, si->files,
+			share_index_unmap);
+
+	if (NULL == st)
+		goto fallback;
+
+	/*
+	 * The image is now held by the search table, which will release it.
+	 */
+
+	g_assert(NULL == ctx->search_tb);
+
+	ctx->search_tb = st;
+	ctx->files_scanned = si->files;
+	ctx->loaded = TRUE;
+	si->image = NULL;
+	share_index_free(&ctx->index);
+
+	if (GNET_PROPERTY(share_debug))
+		g_debug("SHARE loaded library index (%lu file%s)",
+			(unsigned long) ctx->files_scanned,
+			1 == ctx->files_scanned ? "" : "s");
+
+	goto next;
+
+fallback:
+	share_index_abort(ctx);
+
+next:
+	bg_task_ticks_used(bt, ctx->ticks);
+	return BGR_NEXT;
+}
+
+static bgret_t
+recursive_scan_step_compute(struct bgtask *bt, void *data, int ticks)
+{
+	struct recursive_scan *ctx = data;
+
+	recursive_scan_check(ctx);
+
+	if (ctx->loaded) {
+		bg_task_ticks_used(bt, 0);
+		return BGR_NEXT;
+	}
+
+	if (!ctx->walk_started) {
+		ctx->walk_started = TRUE;
+		recursive_scan_walk_start(ctx);
+	}
+
+	if (ctx->walk != NULL)
+		return recursive_scan_walk(bt, ctx, ticks);
+
+	ctx->ticks = 0;
 	do {
 		if (recursive_scan_next_dir(ctx)) {
 			bg_task_ticks_used(bt, ctx->ticks);
@@ -1640,6 +2887,9 @@ recursive_scan_step_compute_done(struct bgtask *bt, void *data, int ticks)
 	recursive_scan_check(ctx);
 	(void) ticks;
 
+	if (ctx->loaded)
+		goto done;
+
 	g_assert(NULL == ctx->shared);
 	g_assert(NULL == ctx->search_tb);
 
@@ -1647,6 +2897,7 @@ recursive_scan_step_compute_done(struct bgtask *bt, void *data, int ticks)
 	ctx->bytes_scanned = 0;
 	ctx->search_tb = st_create();
 
+done:
 	bg_task_ticks_used(bt, 0);
 	return BGR_NEXT;
 }
@@ -1707,6 +2958,17 @@ recursive_scan_step_build_file_table(struct bgtask *bt, void *data, int ticks)
 
 	ctx->files = halloc0(ctx->files_scanned * sizeof ctx->files[0]);
 
+	/*
+	 * When loaded from the library index, files already know their index.
+	 */
+
+	if (
+		ctx->loaded &&
+		share_index_restore_order(ctx->shared,
+			ctx->files, ctx->files_scanned, FALSE)
+	)
+		goto next;
+
 	for (i = 0, sl = ctx->shared; sl; sl = g_slist_next(sl)) {
 		shared_file_t *sf = sl->data;
 
@@ -1815,6 +3077,16 @@ recursive_scan_step_build_sorted_table(struct bgtask *bt, void *data, int ticks)
 	if (0 == ctx->files_scanned)
 		goto next;
 
+	if (ctx->loaded) {
+		ctx->sorted = halloc0(ctx->files_scanned * sizeof ctx->sorted[0]);
+		if (
+			share_index_restore_order(ctx->shared,
+				ctx->sorted, ctx->files_scanned, TRUE)
+		)
+			goto next;
+		HFREE_NULL(ctx->sorted);
+	}
+
 	ctx->sorted = hcopy(ctx->files, ctx->files_scanned * sizeof ctx->files[0]);
 
 	qsort(ctx->sorted, ctx->files_scanned, sizeof ctx->sorted[0],
@@ -1867,6 +3139,13 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 
 	share_free();
 
+	/*
+	 * Cached query results refer to the old library.
+	 */
+
+	share_generation++;
+	qcache_clear();
+
 	search_table = ctx->search_tb;
 	file_basenames = ctx->basenames;
 	shared_files = ctx->shared;
@@ -1874,6 +3153,7 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 	sorted_file_table = ctx->sorted;
 	files_scanned = ctx->files_scanned;
 	bytes_scanned = ctx->bytes_scanned;
+	share_paths = g_hash_table_new(NULL, NULL);
 
 	/*
 	 * Now that we installed the shared files, we can mark the entries as
@@ -1885,6 +3165,7 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 
 		shared_file_check(sf);
 		sf->flags |= SHARE_F_INDEXED | SHARE_F_BASENAME;
+		g_hash_table_insert(share_paths, deconstify_gchar(sf->file_path), sf);
 	}
 
 	/*
@@ -1912,6 +3193,24 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 	return BGR_NEXT;
 }
 
+/**
+ * Save the library index after a full scan, for the next startup.
+ */
+static bgret_t
+recursive_scan_step_save_index(struct bgtask *bt, void *data, int ticks)
+{
+	struct recursive_scan *ctx = data;
+
+	recursive_scan_check(ctx);
+	(void) ticks;
+
+	if (!ctx->loaded)
+		share_index_save(ctx->dirs);
+
+	bg_task_ticks_used(bt, files_scanned / 100);
+	return BGR_NEXT;
+}
+
 static bgret_t
 recursive_scan_step_request_sha1(struct bgtask *bt, void *data, int ticks)
 {
@@ -2137,6 +3436,7 @@ recursive_scan_create_task(struct recursive_scan *ctx)
 
 	if (NULL == ctx->task) {
 		static const bgstep_cb_t steps[] = {
+			recursive_scan_step_load_index,
 			recursive_scan_step_compute,
 			recursive_scan_step_compute_done,
 			recursive_scan_step_build_search_table,
@@ -2145,6 +3445,7 @@ recursive_scan_create_task(struct recursive_scan *ctx)
 			recursive_scan_step_update_scan_timing,
 			recursive_scan_step_build_sorted_table,
 			recursive_scan_step_install_shared,
+			recursive_scan_step_save_index,
 			recursive_scan_step_request_sha1,
 			recursive_scan_step_load_partials,
 			recursive_scan_step_build_partial_table,
@@ -2162,7 +3463,7 @@ recursive_scan_create_task(struct recursive_scan *ctx)
 }
 
 static void
-share_update_qrp_create_task(struct recursive_scan *ctx)
+share_update_qrp_create_task(struct recursive_scan *ctx, gboolean full)
 {
 	recursive_scan_check(ctx);
 
@@ -2176,10 +3477,28 @@ share_update_qrp_create_task(struct recursive_scan *ctx)
 			recursive_scan_step_finalize,
 		};
 
-		ctx->task = bg_task_create("QRP update",
-							steps, G_N_ELEMENTS(steps),
-			  				ctx, recursive_scan_context_free,
-							NULL, NULL);
+		static const bgstep_cb_t partial_steps[] = {
+			recursive_scan_step_load_partials,
+			recursive_scan_step_build_partial_table,
+			recursive_scan_step_install_partials,
+		};
+
+		/*
+		 * When the QRP table was already updated incrementally, we only
+		 * need to rebuild the partial table.
+		 */
+
+		if (full) {
+			ctx->task = bg_task_create("QRP update",
+								steps, G_N_ELEMENTS(steps),
+								ctx, recursive_scan_context_free,
+								NULL, NULL);
+		} else {
+			ctx->task = bg_task_create("partial table update",
+								partial_steps, G_N_ELEMENTS(partial_steps),
+								ctx, recursive_scan_context_free,
+								NULL, NULL);
+		}
 	}
 }
 
@@ -2191,8 +3510,12 @@ void
 share_scan(void)
 {
 	recursive_scan_free(&recursive_scan_context);
+	share_watch_reset();
 	recursive_scan_context = recursive_scan_new(shared_dirs);
+	recursive_scan_context->use_index = share_index_usable;
+	share_index_usable = FALSE;
 	share_rebuilding = TRUE;
+	share_qrp_full_rebuild = FALSE;
 	gnet_prop_set_boolean_val(PROP_LIBRARY_REBUILDING, TRUE);
 	gnet_prop_set_timestamp_val(PROP_LIBRARY_RESCAN_STARTED, tm_time_exact());
 	recursive_scan_create_task(recursive_scan_context);
@@ -2216,7 +3539,9 @@ share_update_qrp(void)
 
 	recursive_scan_free(&recursive_scan_context);
 	recursive_scan_context = recursive_scan_new(NULL);
-	share_update_qrp_create_task(recursive_scan_context);
+	share_update_qrp_create_task(recursive_scan_context,
+		share_qrp_full_rebuild);
+	share_qrp_full_rebuild = FALSE;
 
 	return TRUE;
 }
@@ -2253,11 +3578,15 @@ G_GNUC_COLD void
 share_close(void)
 {
 	recursive_scan_free(&recursive_scan_context);
+	share_watch_close();
+	qcache_clear();
+	hash_list_free(&qcache);
 	share_special_close();
 	free_extensions();
 	share_free();
 	shared_dirs_free();
 	huge_close();
+	tth_cache_close();
 	qrp_close();
 	oob_proxy_close();
 	oob_close();
@@ -2838,15 +4167,41 @@ share_qrp_rebuild(cqueue_t *unused_cq, void *unused_data)
 
 /**
  * Request asynchronous partial file table (for pattern matching) and QRP
- * table rebuild if necessary.
+ * table rebuild after file `sf' was added or removed.
+ *
+ * The QRP table is updated incrementally when possible, only the partial
+ * file table being then rebuilt.
  */
 static void
-share_qrp_rebuild_if_needed(void)
+share_qrp_changed(const shared_file_t *sf, gboolean added)
 {
-	if (NULL == share_qrp_rebuild_ev && share_can_answer_partials())
+	/*
+	 * A running task may have already collected the partial files, and
+	 * a pending full recomputation must not see incremental changes.
+	 */
+
+	if (
+		share_qrp_full_rebuild ||
+		(recursive_scan_context != NULL && recursive_scan_context->task) ||
+		!(added ? qrp_file_added(sf) : qrp_file_removed(sf))
+	)
+		share_qrp_full_rebuild = TRUE;
+
+	if (NULL == share_qrp_rebuild_ev)
 		share_qrp_rebuild_ev = cq_main_insert(1000, share_qrp_rebuild, NULL);
 }
 
+/**
+ * Request asynchronous partial file table and QRP table rebuild if
+ * necessary, after partial file `sf' was added or removed.
+ */
+static void
+share_qrp_rebuild_if_needed(const shared_file_t *sf, gboolean added)
+{
+	if (share_can_answer_partials())
+		share_qrp_changed(sf, added);
+}
+
 /**
  * Records partial file entry.
  */
@@ -2866,7 +4221,7 @@ share_add_partial(const shared_file_t *sf)
 	 * for instance at startup or when many new files are downloaded.
 	 */
 
-	share_qrp_rebuild_if_needed();
+	share_qrp_rebuild_if_needed(sf, TRUE);
 
 	if (GNET_PROPERTY(share_debug) > 1)
 		g_debug("SHARE added partial file \"%s\"", shared_file_path(sf));
@@ -2887,7 +4242,7 @@ share_remove_partial(const shared_file_t *sf)
 	 * We removed a partial file, we need to rebuild the QRP table.
 	 */
 
-	share_qrp_rebuild_if_needed();
+	share_qrp_rebuild_if_needed(sf, FALSE);
 
 	if (GNET_PROPERTY(share_debug) > 1)
 		g_debug("SHARE removed partial file \"%s\"", shared_file_path(sf));
@@ -2900,48 +4255,679 @@ share_remove_partial(const shared_file_t *sf)
 void
 share_update_matching_information(void)
 {
+	share_qrp_full_rebuild = TRUE;
+
 	if (NULL == share_qrp_rebuild_ev)
 		share_qrp_rebuild_ev = cq_main_insert(1, share_qrp_rebuild, NULL);
 }
 
+/***
+ *** Incremental library updates.
+ ***
+ *** When the kernel can notify us of the changes made in the shared
+ *** directories, we monitor all the directories we scanned and apply the
+ *** files created, modified, removed or renamed there to the installed
+ *** library, instead of waiting for the next full rescan.
+ ***
+ *** Changes we cannot track reliably, such as directories appearing or
+ *** disappearing, or events lost by the kernel, trigger a full rescan.
+ *** Without kernel support, the library is only updated by full rescans.
+ ***/
+
+#ifdef HAS_INOTIFY
+
+#define SHARE_WATCH_DELAY		2000	/**< ms: coalescing of changes */
+#define SHARE_WATCH_RESCAN_DELAY 10000	/**< ms: before launching rescan */
+
+#define SHARE_WATCH_MASK \
+	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | \
+	 IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static int share_watch_fd = -1;			/**< inotify file descriptor */
+static unsigned share_watch_id;			/**< I/O event handler */
+static GHashTable *share_watch_dirs;	/**< Watch descriptor => dir (atom) */
+static GHashTable *share_watch_pending;	/**< Changed path => dir (atoms) */
+static cevent_t *share_watch_ev;		/**< Processing of changes */
+static gboolean share_watch_rescan;		/**< Whether full rescan is needed */
+
 /**
- * Initialization of the sharing library.
+ * Context for applying changes to the library.
  */
-G_GNUC_COLD void
-share_init(void)
-{
-	size_t i;
+struct share_watch_update {
+	slist_t *added;				/**< New shared files */
+	size_t removed;				/**< Amount of files removed */
+};
 
-	huge_init();
-	qrp_init();
-	qhit_init();
-	oob_init();
-	oob_proxy_init();
-	share_special_init();
+static void share_watch_process(cqueue_t *unused_cq, void *unused_data);
 
-	/*
-	 * We allocate an empty search_table, which will be de-allocated when we
-	 * call share_scan().  Why do we do this?  Because it ensures the table
-	 * is correctly setup empty, until we do call share_scan() for the first
-	 * time (the call is delayed until the GUI is up).
-	 *
-	 * Since we will start processing network packets, we will have a race
-	 * condition window if we get a Query message before having started
-	 * the share_scan().  Creating the table right now prevents adding an
-	 * extra test at the top of st_search().
-	 *		--RAM, 15/08/2002.
-	 */
+static void
+share_watch_free_kv(gpointer key, gpointer value, gpointer unused_udata)
+{
+	(void) unused_udata;
 
-	search_table = st_create();
+	atom_str_free(key);
+	if (value != NULL)
+		atom_str_free(value);
+}
 
-	/*
-	 * Intialize partial file querying structures (so that queries can
-	 * be applied to partial files).
-	 */
+static void
+share_watch_free_dir_kv(gpointer unused_key, gpointer value,
+	gpointer unused_udata)
+{
+	(void) unused_key;
+	(void) unused_udata;
+
+	atom_str_free(value);
+}
+
+/**
+ * Stop monitoring the shared directories.
+ */
+static void
+share_watch_close(void)
+{
+	inputevt_remove(&share_watch_id);
+	fd_close(&share_watch_fd);
+	cq_cancel(&share_watch_ev);
+
+	if (share_watch_dirs != NULL) {
+		g_hash_table_foreach(share_watch_dirs, share_watch_free_dir_kv, NULL);
+		gm_hash_table_destroy_null(&share_watch_dirs);
+	}
+	if (share_watch_pending != NULL) {
+		g_hash_table_foreach(share_watch_pending, share_watch_free_kv, NULL);
+		gm_hash_table_destroy_null(&share_watch_pending);
+	}
+	share_watch_rescan = FALSE;
+}
+
+/**
+ * Plan a full rescan of the library, once things settle down.
+ */
+static void
+share_watch_need_rescan(const char *reason, const char *dir)
+{
+	if (share_watch_rescan)
+		return;
+
+	if (GNET_PROPERTY(share_debug)) {
+		if (NULL == dir) {
+			g_debug("SHARE %s, will rescan library", reason);
+		} else {
+			g_debug("SHARE %s \"%s\", will rescan library", reason, dir);
+		}
+	}
+
+	share_watch_rescan = TRUE;
+	cq_cancel(&share_watch_ev);
+	share_watch_ev = cq_main_insert(SHARE_WATCH_RESCAN_DELAY,
+		share_watch_process, NULL);
+}
+
+/**
+ * Record that a file may have changed in directory `dir'.
+ */
+static void
+share_watch_changed(const char *dir, const char *name)
+{
+	const char *path;
+	char *pathname;
+
+	pathname = make_pathname(dir, name);
+	path = atom_str_get(pathname);
+	HFREE_NULL(pathname);
+
+	if (gm_hash_table_contains(share_watch_pending, path)) {
+		atom_str_free(path);
+	} else {
+		g_hash_table_insert(share_watch_pending, deconstify_gchar(path),
+			deconstify_gchar(atom_str_get(dir)));
+	}
+
+	if (NULL == share_watch_ev) {
+		share_watch_ev = cq_main_insert(SHARE_WATCH_DELAY,
+			share_watch_process, NULL);
+	}
+}
+
+/**
+ * Handle a single inotify event.
+ */
+static void
+share_watch_event(const struct inotify_event *ev)
+{
+	const char *dir;
+
+	if (IN_Q_OVERFLOW & ev->mask) {
+		share_watch_need_rescan("lost changes in shared directories", NULL);
+		return;
+	}
+
+	dir = g_hash_table_lookup(share_watch_dirs, int_to_pointer(ev->wd));
+	if (NULL == dir)
+		return;
+
+	/*
+	 * The watch was removed by the kernel because the directory is gone.
+	 * Its parent has reported the removal, if we monitored it.
+	 */
+
+	if (IN_IGNORED & ev->mask) {
+		g_hash_table_remove(share_watch_dirs, int_to_pointer(ev->wd));
+		atom_str_free(dir);
+		return;
+	}
+
+	if ((IN_DELETE_SELF | IN_MOVE_SELF) & ev->mask) {
+		share_watch_need_rescan("moved or removed directory", dir);
+		return;
+	}
+
+	/*
+	 * Hidden entries are not shared, as in recursive_scan_readdir().
+	 */
+
+	if (0 == ev->len || '\0' == ev->name[0] || '.' == ev->name[0])
+		return;
+
+	if (IN_ISDIR & ev->mask) {
+		share_watch_need_rescan("new or removed directory in", dir);
+		return;
+	}
+
+	share_watch_changed(dir, ev->name);
+}
+
+/**
+ * I/O callback invoked when inotify events are available.
+ */
+static void
+share_watch_read(void *unused_data, int fd, inputevt_cond_t cond)
+{
+	union {
+		struct inotify_event ev;
+		char buf[8192];
+	} u;
+
+	(void) unused_data;
+
+	if (INPUT_EVENT_EXCEPTION & cond) {
+		g_warning("%s(): exception on inotify descriptor", G_STRFUNC);
+		goto failed;
+	}
+
+	for (;;) {
+		ssize_t r;
+		size_t i;
+
+		r = read(fd, u.buf, sizeof u.buf);
+		if ((ssize_t) -1 == r) {
+			if (is_temporary_error(errno))
+				break;
+			g_warning("%s(): read() failed: %s", G_STRFUNC, g_strerror(errno));
+			goto failed;
+		}
+		if (0 == r)
+			break;
+
+		for (i = 0; i + sizeof u.ev <= UNSIGNED(r); /* empty */) {
+			const struct inotify_event *ev = (void *) &u.buf[i];
+
+			share_watch_event(ev);
+			i += sizeof *ev + ev->len;
+		}
+	}
+	return;
+
+failed:
+	share_watch_close();
+}
+
+/**
+ * Start monitoring the shared directories, discarding former watches.
+ *
+ * Called when a full scan is started: it will add all the directories it
+ * walks through, and changes noted during the scan will be applied once
+ * the new library is installed.
+ */
+static void
+share_watch_reset(void)
+{
+	share_watch_close();
+
+	share_watch_fd = inotify_init();
+	if (share_watch_fd < 0) {
+		g_warning("cannot monitor shared directories: inotify_init() failed: %s",
+			g_strerror(errno));
+		return;
+	}
+
+	fd_set_nonblocking(share_watch_fd);
+	set_close_on_exec(share_watch_fd);
+
+	share_watch_dirs = g_hash_table_new(NULL, NULL);
+	share_watch_pending = g_hash_table_new(NULL, NULL);
+	share_watch_id = inputevt_add(share_watch_fd, INPUT_EVENT_RX,
+		share_watch_read, NULL);
+}
+
+/**
+ * Monitor changes in directory.
+ *
+ * This must be called before reading the directory, so that any later
+ * change will be noticed.
+ */
+static void
+share_watch_dir(const char *dir)
+{
+	const char *old;
+	int wd;
+
+	if (share_watch_fd < 0)
+		return;
+
+	wd = inotify_add_watch(share_watch_fd, dir, SHARE_WATCH_MASK);
+	if (wd < 0) {
+		if (ENOENT == errno || ENOTDIR == errno || EACCES == errno)
+			return;		/* Directory not shared anyway */
+
+		/*
+		 * We would miss changes in some directories.
+		 */
+
+		g_warning("cannot monitor shared directory \"%s\": %s", dir,
+			g_strerror(errno));
+		if (ENOSPC == errno) {
+			g_warning("raise the fs.inotify.max_user_watches kernel setting "
+				"to monitor all the shared directories");
+		}
+		share_watch_close();
+		return;
+	}
+
+	if (GNET_PROPERTY(share_debug) > 5)
+		g_debug("SHARE monitoring directory \"%s\"", dir);
+
+	/*
+	 * The same directory can be reached through symbolic links, in which
+	 * case the kernel gives back the existing watch descriptor.
+	 */
+
+	old = g_hash_table_lookup(share_watch_dirs, int_to_pointer(wd));
+	g_hash_table_insert(share_watch_dirs, int_to_pointer(wd),
+		deconstify_gchar(atom_str_get(dir)));
+	if (old != NULL)
+		atom_str_free(old);
+}
+
+/**
+ * Find the shared directory under which a path lies.
+ *
+ * @return the shared directory, NULL if path is no longer shared.
+ */
+static const char *
+share_watch_base_dir(const char *path)
+{
+	const GSList *sl;
+	const char *base = NULL;
+	size_t base_len = 0;
+
+	for (sl = shared_dirs; sl; sl = g_slist_next(sl)) {
+		const char *dir = sl->data;
+		const char *s = is_strprefix(path, dir);
+		size_t len = strlen(dir);
+
+		if (
+			s != NULL && len > base_len &&
+			(is_dir_separator(s[0]) || is_dir_separator(dir[len - 1]))
+		) {
+			base = dir;
+			base_len = len;
+		}
+	}
+
+	return base;
+}
+
+/**
+ * Check whether path is a file we could share, as recursive_scan_readdir()
+ * would do.
+ */
+static gboolean
+share_watch_stat(const char *path, filestat_t *sb)
+{
+	if (lstat(path, sb))
+		return FALSE;
+
+	if (S_ISLNK(sb->st_mode)) {
+		if (GNET_PROPERTY(scan_ignore_symlink_regfiles))
+			return FALSE;
+		if (stat(path, sb))
+			return FALSE;
+	}
+
+	return S_ISREG(sb->st_mode);
+}
+
+/**
+ * Remove file from the installed library.
+ */
+static void
+share_watch_remove_file(shared_file_t *sf)
+{
+	shared_file_check(sf);
+	g_assert(SHARE_F_INDEXED & sf->flags);
+
+	if (GNET_PROPERTY(share_debug) > 1)
+		g_debug("SHARE removing \"%s\" from library", sf->file_path);
+
+	share_qrp_changed(sf, FALSE);
+	st_remove_item(search_table, sf);
+	bytes_scanned -= MIN(bytes_scanned, sf->file_size);
+
+	/*
+	 * The file stays referenced by ``shared_files'' until the next rescan,
+	 * but it is no longer reachable.
+	 */
+
+	shared_file_remove(sf);
+}
+
+/**
+ * Add new file to the installed library.
+ *
+ * It gets the next file index, like the newest file would after a rescan.
+ */
+static void
+share_watch_add_file(shared_file_t *sf, struct share_watch_update *upd)
+{
+	guint val;
+
+	shared_file_check(sf);
+
+	if (GNET_PROPERTY(share_debug) > 1)
+		g_debug("SHARE adding \"%s\" to library", sf->file_path);
+
+	files_scanned++;
+	bytes_scanned += sf->file_size;
+
+	file_table = hrealloc(file_table, files_scanned * sizeof file_table[0]);
+	file_table[files_scanned - 1] = sf;
+	sf->file_index = files_scanned;
+
+	shared_files = g_slist_prepend(shared_files, shared_file_ref(sf));
+	st_insert_item(search_table, sf->name_canonic, sf);
+	g_hash_table_insert(share_paths, deconstify_gchar(sf->file_path), sf);
+
+	val = pointer_to_uint(g_hash_table_lookup(file_basenames, sf->name_nfc));
+	val = (val != 0) ? FILENAME_CLASH : sf->file_index;
+	g_hash_table_insert(file_basenames, deconstify_gchar(sf->name_nfc),
+		uint_to_pointer(val));
+
+	sf->flags |= SHARE_F_INDEXED | SHARE_F_BASENAME;
+	upload_stats_enforce_local_filename(sf);
+	slist_append(upd->added, sf);
+}
+
+/**
+ * Bring the library in sync with the current state of a changed path.
+ *
+ * @return TRUE so that the entry is removed from the pending changes.
+ */
+static gboolean
+share_watch_update_path(gpointer key, gpointer value, gpointer udata)
+{
+	struct share_watch_update *upd = udata;
+	const char *path = key, *dir = value;
+	const char *base;
+	shared_file_t *sf;
+	filestat_t sb;
+	gboolean present;
+
+	base = share_watch_base_dir(path);
+	present = base != NULL && share_watch_stat(path, &sb);
+	sf = g_hash_table_lookup(share_paths, path);
+
+	if (sf != NULL) {
+		if (
+			present &&
+			sf->file_size == (filesize_t) sb.st_size &&
+			sf->mtime == sb.st_mtime
+		)
+			goto done;		/* Unchanged */
+
+		share_watch_remove_file(sf);
+		upd->removed++;
+	}
+
+	if (present) {
+		const char *relative_path = NULL;
+
+		if (GNET_PROPERTY(search_results_expose_relative_paths))
+			relative_path = get_relative_path(base, dir);
+
+		sf = share_scan_add_file(relative_path, path, &sb);
+		if (sf != NULL)
+			share_watch_add_file(sf, upd);
+
+		atom_str_free_null(&relative_path);
+	}
+
+done:
+	share_watch_free_kv(key, value, NULL);
+	return TRUE;
+}
+
+/**
+ * Hash list iterator to give partial files an index beyond the library.
+ */
+static void
+share_watch_renumber_partial(gpointer data, gpointer udata)
+{
+	shared_file_t *sf = data;
+	guint *n = udata;
+
+	sf->file_index = files_scanned + ++(*n);
+}
+
+/**
+ * Rebuild the table sorted by name once files were added.
+ */
+static void
+share_watch_resort(struct share_watch_update *upd, size_t old_count)
+{
+	shared_file_t **added, **sorted;
+	size_t i, j, count;
+	guint n;
+
+	count = slist_length(upd->added);
+	added = halloc(count * sizeof added[0]);
+	for (i = 0; i < count; i++)
+		added[i] = slist_shift(upd->added);
+
+	qsort(added, count, sizeof added[0], shared_file_sort_by_name);
+
+	/*
+	 * Merge the new files with the ones still in the table, which is
+	 * already sorted, and renumber the sort indices.
+	 */
+
+	sorted = halloc0(files_scanned * sizeof sorted[0]);
+
+	for (i = j = n = 0; i < old_count || j < count; /* empty */) {
+		shared_file_t *sf;
+
+		if (i < old_count && NULL == sorted_file_table[i]) {
+			i++;
+			continue;
+		}
+
+		if (
+			j >= count ||
+			(i < old_count &&
+				shared_file_sort_by_name(&sorted_file_table[i], &added[j]) <= 0)
+		) {
+			sf = sorted_file_table[i++];
+		} else {
+			sf = added[j++];
+		}
+
+		g_assert(n < files_scanned);
+		sorted[n++] = sf;
+		sf->sort_index = n;
+	}
+
+	HFREE_NULL(sorted_file_table);
+	sorted_file_table = sorted;
+
+	/*
+	 * Partial files are numbered after the library files, see
+	 * recursive_scan_step_update_qrp().
+	 */
+
+	n = 0;
+	hash_list_foreach(partial_files, share_watch_renumber_partial, &n);
+
+	/*
+	 * Now that the files have their final indices, we can request their
+	 * SHA1 and insert them into the QRP table.
+	 */
+
+	for (j = 0; j < count; j++) {
+		request_sha1(added[j]);
+		share_qrp_changed(added[j], TRUE);
+	}
+
+	HFREE_NULL(added);
+}
+
+/**
+ * Callout queue callback to apply the pending changes to the library.
+ */
+static void
+share_watch_process(cqueue_t *unused_cq, void *unused_data)
+{
+	struct share_watch_update upd;
+	size_t old_count;
+
+	(void) unused_cq;
+	(void) unused_data;
+
+	share_watch_ev = NULL;
+
+	/*
+	 * Wait until the running scan or QRP computation is over.  Changes
+	 * made during a scan are applied to the library it installs.
+	 */
+
+	if (recursive_scan_context != NULL && recursive_scan_context->task != NULL) {
+		share_watch_ev = cq_main_insert(SHARE_WATCH_DELAY,
+			share_watch_process, NULL);
+		return;
+	}
+
+	if (share_watch_rescan) {
+		share_scan();
+		return;
+	}
+
+	g_return_if_fail(search_table != NULL && share_paths != NULL);
+
+	ZERO(&upd);
+	upd.added = slist_new();
+	old_count = files_scanned;
+
+	g_hash_table_foreach_remove(share_watch_pending,
+		share_watch_update_path, &upd);
+
+	if (0 == upd.removed && 0 == slist_length(upd.added))
+		goto done;
+
+	if (GNET_PROPERTY(share_debug)) {
+		g_debug("SHARE library updated: %lu file%s added, %lu removed",
+			(unsigned long) slist_length(upd.added),
+			1 == slist_length(upd.added) ? "" : "s",
+			(unsigned long) upd.removed);
+	}
+
+	if (slist_length(upd.added) > 0)
+		share_watch_resort(&upd, old_count);
+
+	/*
+	 * Cached query results refer to the former library.
+	 */
+
+	share_generation++;
+	qcache_clear();
+	gcu_gui_update_files_scanned();
+
+done:
+	slist_free(&upd.added);
+}
+
+#else	/* !HAS_INOTIFY */
+
+static void
+share_watch_reset(void)
+{
+	/* Changes in the shared directories are only seen by rescans */
+}
+
+static void
+share_watch_dir(const char *unused_dir)
+{
+	(void) unused_dir;
+}
+
+static void
+share_watch_close(void)
+{
+	/* Nothing to do */
+}
+
+#endif	/* HAS_INOTIFY */
+
+/**
+ * Initialization of the sharing library.
+ */
+G_GNUC_COLD void
+share_init(void)
+{
+	size_t i;
+
+	tth_cache_init();
+	huge_init();
+	qrp_init();
+	qhit_init();
+	oob_init();
+	oob_proxy_init();
+	share_special_init();
+
+	/*
+	 * We allocate an empty search_table, which will be de-allocated when we
+	 * call share_scan().  Why do we do this?  Because it ensures the table
+	 * is correctly setup empty, until we do call share_scan() for the first
+	 * time (the call is delayed until the GUI is up).
+	 *
+	 * Since we will start processing network packets, we will have a race
+	 * condition window if we get a Query message before having started
+	 * the share_scan().  Creating the table right now prevents adding an
+	 * extra test at the top of st_search().
+	 *		--RAM, 15/08/2002.
+	 */
+
+	search_table = st_create();
+
+	/*
+	 * Intialize partial file querying structures (so that queries can
+	 * be applied to partial files).
+	 */
 
 	partial_files = hash_list_new(pointer_hash_func, NULL);
 	partial_table = st_create();
 
+	qcache = hash_list_new(qcache_entry_hash, qcache_entry_eq);
+
 	/*
 	 * Create the hash table yielding the media type flags from a MIME type.
 	 */
@@ -34,6 +34,11 @@
  * @date 2001-2003
  */
 
+/* Needed by glibc to declare recvmmsg() and sendmmsg() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "common.h"
 
 #ifdef I_NETDB
@@ -100,6 +105,56 @@
 #define RQST_LINE_LENGTH	256	/**< Reasonable estimate for request line */
 #define SOCK_UDP_RECV_BUF	131072	/**< 128K - Large to avoid loosing dgrams */
 #define MAX_UDP_RECV_LOOP	128		/**< Max messages read from UDP queue */
+#define UDP_RECV_BATCH		16		/**< Datagrams read per recvmmsg() */
+#define UDP_SEND_BATCH		32		/**< Datagrams sent per sendmmsg() */
+#define UDP_SEND_ARENA		(64 * 1024)	/**< Room for batched datagrams */
+
+#if defined(HAS_RECVMMSG) && defined(CMSG_LEN) && defined(CMSG_SPACE)
+#define USE_RECVMMSG
+#endif
+
+/**
+ * Buffers to read several datagrams with a single recvmmsg() call.
+ */
+struct udp_rbatch {
+#ifdef USE_RECVMMSG
+	struct mmsghdr msg[UDP_RECV_BATCH];
+	iovec_t iov[UDP_RECV_BATCH];
+	socket_addr_t from[UDP_RECV_BATCH];
+	union {
+		struct cmsghdr hdr;
+		size_t align;
+		char bytes[CMSG_SPACE(512)];
+	} cmsg[UDP_RECV_BATCH];
+	char *arena;					/**< UDP_RECV_BATCH datagram buffers */
+#else
+	int unused;
+#endif	/* USE_RECVMMSG */
+};
+
+/**
+ * Datagrams pending emission with a single sendmmsg() call.
+ */
+struct udp_wbatch {
+#ifdef HAS_SENDMMSG
+	struct mmsghdr msg[UDP_SEND_BATCH];
+	iovec_t iov[UDP_SEND_BATCH];
+	socket_addr_t to[UDP_SEND_BATCH];
+	bio_source_t *bio[UDP_SEND_BATCH];	/**< Source to charge, if any */
+	unsigned count;					/**< Amount of pending datagrams */
+	size_t used;					/**< Bytes used in the arena */
+	unsigned event_id;				/**< Set when waiting for writability */
+	char arena[UDP_SEND_ARENA];		/**< Copy of the datagrams */
+#else
+	int unused;
+#endif	/* HAS_SENDMMSG */
+};
+
+static unsigned udp_batch_depth;	/**< Nesting of socket_udp_batch_begin() */
+static GSList *sl_udp_batched;		/**< UDP sockets with pending datagrams */
+
+static void socket_udp_flush(struct gnutella_socket *s);
+static void socket_udp_discard(struct gnutella_socket *s);
 
 enum {
 	SOCK_ADNS_PENDING	= 1 << 0,	/**< Don't free() the socket too early */
@@ -1350,8 +1405,21 @@ socket_free(struct gnutella_socket *s)
 		bws_sock_connect_timeout(s->type);
 
 	if (s->flags & SOCK_F_UDP) {
-		if (s->resource.udp != NULL) {
-			WFREE_NULL(s->resource.udp->socket_addr, sizeof(socket_addr_t));
+		struct udpctx *udp = s->resource.udp;
+
+		if (udp != NULL) {
+			if (udp->wbatch != NULL) {
+				socket_udp_flush(s);
+				socket_udp_discard(s);
+				WFREE(udp->wbatch);
+			}
+			if (udp->rbatch != NULL) {
+#ifdef USE_RECVMMSG
+				HFREE_NULL(udp->rbatch->arena);
+#endif
+				WFREE(udp->rbatch);
+			}
+			WFREE_NULL(udp->socket_addr, sizeof(socket_addr_t));
 			WFREE(s->resource.udp);
 		}
 	}
@@ -2328,6 +2396,77 @@ socket_udp_extract_dst_addr(const struct msghdr *msg, host_addr_t *dst_addr)
 }
 #endif	/* CMSG_FIRSTHDR && CMSG_NXTHDR */
 
+/**
+ * Process the datagram held in the socket buffer.
+ *
+ * @param s			the UDP socket
+ * @param from_addr	the address of the sender
+ * @param r			the length of the datagram
+ * @param truncated	whether the datagram was truncated
+ * @param dst_addr	if non-NULL, the address to which the datagram was sent
+ *
+ * @return length of datagram, -1 with errno set if the sender is bogus.
+ */
+static ssize_t
+socket_udp_process(struct gnutella_socket *s, const socket_addr_t *from_addr,
+	ssize_t r, gboolean truncated, const host_addr_t *dst_addr)
+{
+	g_assert((size_t) r <= s->buf_size);
+
+	/*
+	 * We're too low level to account for the proper bandwidth here as we
+	 * want to distinguish between UDP Gnutella traffic and DHT traffic.
+	 *
+	 * This will be done in udp_receieved() which we're about to call.
+	 */
+
+	s->pos = r;
+
+	/*
+	 * Record remote address.
+	 */
+
+	s->addr = socket_addr_get_addr(from_addr);
+	s->port = socket_addr_get_port(from_addr);
+
+	if (!is_host_addr(s->addr)) {
+		gnet_stats_count_general(GNR_UDP_BOGUS_SOURCE_IP, 1);
+		bws_udp_count_read(r, FALSE);	/* Assume not from DHT */
+		errno = EINVAL;
+		return (ssize_t) -1;
+	}
+
+	if (dst_addr != NULL) {
+		static host_addr_t last_addr;
+
+		settings_addr_changed(*dst_addr, s->addr);
+
+		/*
+		 * Show the destination address only when it differs from
+		 * the last seen or if the debug level is higher than 1.
+		 */
+
+		if (
+			GNET_PROPERTY(socket_debug) > 1 ||
+			!host_addr_equal(last_addr, *dst_addr)
+		) {
+			last_addr = *dst_addr;
+			if (GNET_PROPERTY(socket_debug))
+				g_debug("socket_udp_process(): dst_addr=%s",
+					host_addr_to_string(*dst_addr));
+		}
+	}
+
+	/*
+	 * Signal reception of a datagram to the UDP layer.
+	 *
+	 * Note: for the Gnutella datagram socket this is udp_received().
+	 */
+
+	(*s->resource.udp->data_ind)(s, truncated);
+	return r;
+}
+
 /**
  * Someone is sending us a datagram.
  */
@@ -2417,61 +2556,92 @@ socket_udp_accept(struct gnutella_socket *s)
 	if ((ssize_t) -1 == r)
 		return (ssize_t) -1;
 
-	g_assert((size_t) r <= s->buf_size);
+	gnet_stats_count_general(GNR_UDP_READ_SYSCALLS, 1);
+	gnet_stats_count_general(GNR_UDP_READ_DATAGRAMS, 1);
 
-	/*
-	 * We're too low level to account for the proper bandwidth here as we
-	 * want to distinguish between UDP Gnutella traffic and DHT traffic.
-	 *
-	 * This will be done in udp_receieved() which we're about to call.
-	 */
+	return socket_udp_process(s, from_addr, r, truncated,
+		has_dst_addr ? &dst_addr : NULL);
+}
 
-	s->pos = r;
+#ifdef USE_RECVMMSG
+/**
+ * Read several datagrams with a single system call and process them.
+ *
+ * @param s		the UDP socket
+ * @param rd	where the total amount of bytes read is written
+ *
+ * @return the amount of datagrams read, -1 on error with errno set.
+ */
+static int
+socket_udp_accept_batch(struct gnutella_socket *s, size_t *rd)
+{
+	struct udpctx *udp;
+	struct udp_rbatch *rb;
+	int i, n;
 
-	/*
-	 * Record remote address.
-	 */
+	socket_check(s);
+	g_assert(s->flags & SOCK_F_UDP);
+	g_assert(s->type == SOCK_TYPE_UDP);
+	g_assert(s->buf_size >= SOCK_LBUFSZ);
+	g_assert(rd != NULL);
 
-	s->addr = socket_addr_get_addr(from_addr);
-	s->port = socket_addr_get_port(from_addr);
+	udp = s->resource.udp;
 
-	if (!is_host_addr(s->addr)) {
-		gnet_stats_count_general(GNR_UDP_BOGUS_SOURCE_IP, 1);
-		bws_udp_count_read(r, FALSE);	/* Assume not from DHT */
-		errno = EINVAL;
-		return (ssize_t) -1;
+	if (NULL == udp->rbatch) {
+		WALLOC0(udp->rbatch);
+		udp->rbatch->arena = halloc(UDP_RECV_BATCH * SOCK_LBUFSZ);
 	}
+	rb = udp->rbatch;
 
-	if (has_dst_addr) {
-		static host_addr_t last_addr;
+	for (i = 0; i < UDP_RECV_BATCH; i++) {
+		static const struct msghdr zero_msg;
+		struct msghdr *msg = &rb->msg[i].msg_hdr;
 
-		settings_addr_changed(dst_addr, s->addr);
+		iovec_set_base(&rb->iov[i], &rb->arena[i * SOCK_LBUFSZ]);
+		iovec_set_len(&rb->iov[i], SOCK_LBUFSZ);
 
-		/*
-		 * Show the destination address only when it differs from
-		 * the last seen or if the debug level is higher than 1.
-		 */
-
-		if (
-			GNET_PROPERTY(socket_debug) > 1 ||
-			!host_addr_equal(last_addr, dst_addr)
-		) {
-			last_addr = dst_addr;
-			if (GNET_PROPERTY(socket_debug))
-				g_debug("socket_udp_accept(): dst_addr=%s",
-					host_addr_to_string(dst_addr));
-		}
+		*msg = zero_msg;
+		msg->msg_namelen = socket_addr_init(&rb->from[i], s->net);
+		msg->msg_name = socket_addr_get_sockaddr(&rb->from[i]);
+		msg->msg_iov = &rb->iov[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = rb->cmsg[i].bytes;
+		msg->msg_controllen = sizeof rb->cmsg[i].bytes;
+		rb->msg[i].msg_len = 0;
 	}
 
-	/*
-	 * Signal reception of a datagram to the UDP layer.
-	 *
-	 * Note: for the Gnutella datagram socket this is udp_received().
-	 */
+	n = recvmmsg(s->file_desc, rb->msg, UDP_RECV_BATCH, MSG_DONTWAIT, NULL);
 
-	(*s->resource.udp->data_ind)(s, truncated);
-	return r;
+	if (-1 == n)
+		return -1;
+
+	gnet_stats_count_general(GNR_UDP_READ_SYSCALLS, 1);
+	gnet_stats_count_general(GNR_UDP_READ_DATAGRAMS, n);
+
+	*rd = 0;
+
+	for (i = 0; i < n; i++) {
+		const struct msghdr *msg = &rb->msg[i].msg_hdr;
+		size_t len = MIN(rb->msg[i].msg_len, SOCK_LBUFSZ);
+		gboolean truncated, has_dst_addr = FALSE;
+		host_addr_t dst_addr;
+
+		truncated = 0 != (MSG_TRUNC & msg->msg_flags);
+
+		if (!GNET_PROPERTY(force_local_ip))
+			has_dst_addr = socket_udp_extract_dst_addr(msg, &dst_addr);
+
+		/* The data indication callback expects the datagram in s->buf */
+		memcpy(s->buf, &rb->arena[i * SOCK_LBUFSZ], len);
+
+		*rd += len;
+		(void) socket_udp_process(s, &rb->from[i], len, truncated,
+			has_dst_addr ? &dst_addr : NULL);
+	}
+
+	return n;
 }
+#endif	/* USE_RECVMMSG */
 
 /**
  * Someone is sending us a datagram.
@@ -2509,10 +2679,39 @@ socket_udp_event(gpointer data, int unused_source, inputevt_cond_t cond)
 
 	i = 0;
 	rd = 0;
+
+	/*
+	 * Replies generated whilst processing the received datagrams are
+	 * queued and sent in batches at the end of the loop.
+	 */
+
+	socket_udp_batch_begin();
+
 	do {
 		ssize_t r;
 
-		r = socket_udp_accept(s);
+#ifdef USE_RECVMMSG
+		if (
+			GNET_PROPERTY(udp_batched_io) &&
+			!(s->flags & SOCK_F_SINGLE)
+		) {
+			size_t bytes;
+			int n;
+
+			n = socket_udp_accept_batch(s, &bytes);
+			if (-1 == n) {
+				r = -1;
+			} else {
+				r = bytes;
+				i += n - 1;		/* Incremented below for the last one */
+				if (n < UDP_RECV_BATCH)
+					avail = r;	/* Drained the socket queue */
+			}
+		} else
+#endif	/* USE_RECVMMSG */
+		{
+			r = socket_udp_accept(s);
+		}
 
 		if ((ssize_t) -1 == r) {
 			/* ECONNRESET is meaningless with UDP but happens on Windows */
@@ -2544,6 +2743,8 @@ socket_udp_event(gpointer data, int unused_source, inputevt_cond_t cond)
 
 	} while (i < MAX_UDP_RECV_LOOP);
 
+	socket_udp_batch_end();
+
 	if (i > 16 && GNET_PROPERTY(socket_debug)) {
 		tm_now_exact(&end);
 		g_debug(
@@ -3786,6 +3987,345 @@ socket_plain_readv(struct wrap_io *wio, iovec_t *iov, int iovcnt)
 	return s_readv(s->file_desc, iov, iovcnt);
 }
 
+#ifdef HAS_SENDMMSG
+/**
+ * Remove `n' datagrams from the batch, starting at index `i', moving the
+ * following ones down.
+ */
+static void
+socket_udp_remove(struct udp_wbatch *wb, unsigned i, unsigned n)
+{
+	char *start, *end;
+	size_t offset;
+	unsigned k;
+
+	g_assert(i <= wb->count);
+	g_assert(n <= wb->count - i);
+
+	if (0 == n)
+		return;
+
+	if (0 == i && n == wb->count) {
+		wb->count = 0;
+		wb->used = 0;
+		return;
+	}
+
+	start = iovec_base(&wb->iov[i]);
+	end = &wb->arena[wb->used];
+	if (i + n < wb->count)
+		end = iovec_base(&wb->iov[i + n]);
+	offset = end - start;
+	g_assert(offset <= wb->used);
+
+	memmove(start, end, &wb->arena[wb->used] - end);
+	wb->used -= offset;
+
+	for (k = i + n; k < wb->count; k++) {
+		unsigned j = k - n;
+
+		wb->to[j] = wb->to[k];
+		wb->bio[j] = wb->bio[k];
+		iovec_set_base(&wb->iov[j], (char *) iovec_base(&wb->iov[k]) - offset);
+		iovec_set_len(&wb->iov[j], iovec_len(&wb->iov[k]));
+		wb->msg[j] = wb->msg[k];
+		wb->msg[j].msg_hdr.msg_name = socket_addr_get_sockaddr(&wb->to[j]);
+		wb->msg[j].msg_hdr.msg_iov = &wb->iov[j];
+	}
+
+	wb->count -= n;
+}
+
+/**
+ * Refund the originating I/O source of the datagram at index `i' in the
+ * batch, which is dropped without having been written.
+ */
+static void
+socket_udp_refund(struct udp_wbatch *wb, unsigned i)
+{
+	g_assert(i < wb->count);
+
+	if (wb->bio[i] != NULL)
+		bio_unsent(wb->bio[i], iovec_len(&wb->iov[i]));
+}
+
+/**
+ * Called when a UDP socket with datagrams left over by a previous flush
+ * becomes writable again.
+ */
+static void
+socket_udp_writable(gpointer data, int unused_source,
+	inputevt_cond_t unused_cond)
+{
+	struct gnutella_socket *s = data;
+
+	(void) unused_source;
+	(void) unused_cond;
+
+	socket_check(s);
+	socket_udp_flush(s);
+}
+#endif	/* HAS_SENDMMSG */
+
+/**
+ * Send all the datagrams pending in the batch of the UDP socket.
+ *
+ * Bandwidth was charged to the originating I/O source of each datagram
+ * when it was queued, and is refunded for those that fail.  When the
+ * kernel cannot take more datagrams, the remaining ones are kept and sent
+ * again as soon as the socket becomes writable.
+ */
+static void
+socket_udp_flush(struct gnutella_socket *s)
+#ifdef HAS_SENDMMSG
+{
+	struct udp_wbatch *wb;
+	unsigned i = 0;
+
+	socket_check(s);
+	g_assert(s->flags & SOCK_F_UDP);
+
+	wb = s->resource.udp->wbatch;
+	if (NULL == wb || 0 == wb->count)
+		return;
+
+	while (i < wb->count) {
+		int n;
+
+		n = sendmmsg(s->file_desc, &wb->msg[i], wb->count - i, MSG_DONTWAIT);
+		gnet_stats_count_general(GNR_UDP_WRITE_SYSCALLS, 1);
+
+		if (-1 == n) {
+			if (is_temporary_error(errno)) {
+				if (GNET_PROPERTY(udp_debug) > 1) {
+					g_debug("sendmmsg() deferred %u datagram%s: %s",
+						wb->count - i, 1 == wb->count - i ? "" : "s",
+						g_strerror(errno));
+				}
+				break;
+			}
+
+			/*
+			 * The first message of the batch failed, skip it and move on
+			 * with the others.
+			 */
+
+			if (GNET_PROPERTY(udp_debug)) {
+				g_warning("sendmmsg() failed: %s (%s)",
+					symbolic_errno(errno), g_strerror(errno));
+			}
+			socket_udp_refund(wb, i);
+			i++;
+			continue;
+		}
+
+		gnet_stats_count_general(GNR_UDP_WRITE_DATAGRAMS, n);
+		i += n;
+	}
+
+	socket_udp_remove(wb, 0, i);
+
+	if (0 == wb->count) {
+		sl_udp_batched = g_slist_remove(sl_udp_batched, s);
+		inputevt_remove(&wb->event_id);
+	} else if (0 == wb->event_id) {
+		wb->event_id = inputevt_add(s->file_desc, INPUT_EVENT_WX,
+			socket_udp_writable, s);
+	}
+}
+#else	/* !HAS_SENDMMSG */
+{
+	(void) s;
+}
+#endif	/* HAS_SENDMMSG */
+
+/**
+ * Drop the datagrams still pending in the batch of the UDP socket, which
+ * is about to be closed.
+ */
+static void
+socket_udp_discard(struct gnutella_socket *s)
+#ifdef HAS_SENDMMSG
+{
+	struct udp_wbatch *wb;
+
+	socket_check(s);
+
+	wb = s->resource.udp->wbatch;
+	if (NULL == wb)
+		return;
+
+	if (wb->count != 0) {
+		unsigned i;
+
+		gnet_stats_count_general(GNR_UDP_WRITE_BATCH_LOST, wb->count);
+		if (GNET_PROPERTY(udp_debug)) {
+			g_warning("closing UDP socket lost %u datagram%s",
+				wb->count, 1 == wb->count ? "" : "s");
+		}
+		for (i = 0; i < wb->count; i++)
+			socket_udp_refund(wb, i);
+		sl_udp_batched = g_slist_remove(sl_udp_batched, s);
+		socket_udp_remove(wb, 0, wb->count);
+	}
+	inputevt_remove(&wb->event_id);
+}
+#else	/* !HAS_SENDMMSG */
+{
+	(void) s;
+}
+#endif	/* HAS_SENDMMSG */
+
+/**
+ * Drop the datagrams queued by the I/O source `bio', which is being removed,
+ * refunding the bandwidth they were charged.
+ */
+void
+socket_udp_forget(struct bio_source *bio)
+#ifdef HAS_SENDMMSG
+{
+	GSList *sl, *next;
+
+	for (sl = sl_udp_batched; sl != NULL; sl = next) {
+		struct gnutella_socket *s = sl->data;
+		struct udp_wbatch *wb = s->resource.udp->wbatch;
+		unsigned i = 0, lost = 0;
+
+		next = g_slist_next(sl);
+
+		while (i < wb->count) {
+			if (wb->bio[i] == bio) {
+				socket_udp_refund(wb, i);
+				socket_udp_remove(wb, i, 1);
+				lost++;
+			} else {
+				i++;
+			}
+		}
+
+		if (0 == lost)
+			continue;
+
+		gnet_stats_count_general(GNR_UDP_WRITE_BATCH_LOST, lost);
+
+		if (0 == wb->count) {
+			sl_udp_batched = g_slist_remove(sl_udp_batched, s);
+			inputevt_remove(&wb->event_id);
+		}
+	}
+}
+#else	/* !HAS_SENDMMSG */
+{
+	(void) bio;
+}
+#endif	/* HAS_SENDMMSG */
+
+/**
+ * Start a section within which datagrams sent on UDP sockets are queued
+ * so that they can be sent with a single system call.
+ *
+ * Sections can be nested, the datagrams being sent when the outermost
+ * section is ended by socket_udp_batch_end().
+ */
+void
+socket_udp_batch_begin(void)
+{
+	udp_batch_depth++;
+}
+
+/**
+ * End a section started by socket_udp_batch_begin(), sending all the
+ * pending datagrams when leaving the outermost section.
+ */
+void
+socket_udp_batch_end(void)
+{
+	GSList *sl, *next;
+
+	g_assert(udp_batch_depth > 0);
+
+	if (0 != --udp_batch_depth)
+		return;
+
+	/*
+	 * Sockets whose datagrams could not all be sent remain in the list
+	 * until they become writable again.
+	 */
+
+	for (sl = sl_udp_batched; sl != NULL; sl = next) {
+		next = g_slist_next(sl);
+		socket_udp_flush(sl->data);
+	}
+}
+
+#ifdef HAS_SENDMMSG
+/**
+ * Queue datagram for sending at the end of the current batch section.
+ *
+ * The batch is flushed first when it is full, or when datagrams from a
+ * previous flush are still waiting for the socket to become writable.
+ *
+ * @return 1 if the datagram was queued, 0 if it must be sent right away,
+ * -1 with errno set to EAGAIN if it can be neither queued nor sent.
+ */
+static int
+socket_udp_enqueue(struct gnutella_socket *s,
+	const socket_addr_t *addr, socklen_t len, gconstpointer buf, size_t size)
+{
+	struct udpctx *udp;
+	struct udp_wbatch *wb;
+	struct msghdr *msg;
+
+	if (0 == udp_batch_depth || !GNET_PROPERTY(udp_batched_io))
+		return 0;
+
+	if (!(s->flags & SOCK_F_UDP) || size > UDP_SEND_ARENA)
+		return 0;
+
+	udp = s->resource.udp;
+	if (NULL == udp->wbatch)
+		WALLOC0(udp->wbatch);
+	wb = udp->wbatch;
+
+	if (
+		wb->event_id != 0 ||
+		wb->count >= UDP_SEND_BATCH ||
+		size > UDP_SEND_ARENA - wb->used
+	) {
+		socket_udp_flush(s);
+		if (wb->event_id != 0) {
+			errno = VAL_EAGAIN;
+			return -1;
+		}
+	}
+
+	g_assert(wb->count < UDP_SEND_BATCH);
+	g_assert(size <= UDP_SEND_ARENA - wb->used);
+
+	if (0 == wb->count)
+		sl_udp_batched = g_slist_prepend(sl_udp_batched, s);
+
+	memcpy(&wb->arena[wb->used], buf, size);
+	wb->to[wb->count] = *addr;
+	wb->bio[wb->count] = bio_sendto_deferred();
+	iovec_set_base(&wb->iov[wb->count], &wb->arena[wb->used]);
+	iovec_set_len(&wb->iov[wb->count], size);
+
+	msg = &wb->msg[wb->count].msg_hdr;
+	ZERO(msg);
+	msg->msg_name = socket_addr_get_sockaddr(&wb->to[wb->count]);
+	msg->msg_namelen = len;
+	msg->msg_iov = &wb->iov[wb->count];
+	msg->msg_iovlen = 1;
+	wb->msg[wb->count].msg_len = 0;
+
+	wb->used += size;
+	wb->count++;
+
+	return 1;
+}
+#endif	/* HAS_SENDMMSG */
+
 static ssize_t
 socket_plain_sendto(
 	struct wrap_io *wio, const gnet_host_t *to, gconstpointer buf, size_t size)
@@ -3805,9 +4345,33 @@ socket_plain_sendto(
 	}
 
 	len = socket_addr_set(&addr, ha, gnet_host_get_port(to));
+
+#ifdef HAS_SENDMMSG
+	/*
+	 * A queued datagram is reported as sent: it will be written when the
+	 * batch is flushed, or dropped only if the socket is closed or its
+	 * I/O source removed first.  Its bandwidth is therefore charged now by
+	 * bio_sendto() and refunded if it is dropped.
+	 */
+
+	switch (socket_udp_enqueue(s, &addr, len, buf, size)) {
+	case 1:
+		return size;
+	case -1:
+		return -1;
+	default:
+		break;
+	}
+#endif	/* HAS_SENDMMSG */
+
 	ret = sendto(s->file_desc, buf, size, 0,
 			socket_addr_get_const_sockaddr(&addr), len);
 
+	if ((ssize_t) -1 != ret) {
+		gnet_stats_count_general(GNR_UDP_WRITE_SYSCALLS, 1);
+		gnet_stats_count_general(GNR_UDP_WRITE_DATAGRAMS, 1);
+	}
+
 	if ((ssize_t) -1 == ret && GNET_PROPERTY(udp_debug)) {
 		int e = errno;
 
@@ -65,6 +65,7 @@ struct socket_tls_ctx {
 
 struct sockaddr;
 struct udpctx;
+struct bio_source;
 
 /*
  * Connection directions.
@@ -143,6 +144,8 @@ typedef void (*socket_udp_data_ind_t)(
 struct udpctx {
 	void *socket_addr;					/**< To get reception address */
 	socket_udp_data_ind_t data_ind;		/**< Callback on datagram reception */
+	struct udp_rbatch *rbatch;			/**< Batched reception buffers */
+	struct udp_wbatch *wbatch;			/**< Batched emission buffers */
 };
 
 static inline void
@@ -233,6 +236,9 @@ struct gnutella_socket *socket_udp_listen(const host_addr_t, guint16,
 	socket_udp_data_ind_t data_ind);
 struct gnutella_socket *socket_local_listen(const char *pathname);
 void socket_set_single(struct gnutella_socket *s, gboolean on);
+void socket_udp_batch_begin(void);
+void socket_udp_batch_end(void);
+void socket_udp_forget(struct bio_source *bio);
 
 void socket_evt_set(struct gnutella_socket *s,
 	inputevt_cond_t cond, inputevt_handler_t handler, gpointer data);
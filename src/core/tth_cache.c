@@ -27,19 +27,27 @@
  *
  * Caching of tigertree data.
  *
- * The tigertree data for each shared file is stored in a file in the directory
- * GTK_GNUTELLA_DIR/tth_cache/ in raw binary form. For example, if the root
- * hash is 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ, the tigertree data is
- * stored in
- * $GTK_GNUTELLA_DIR/tth_cache/5E/DB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ.
- * This avoids storing too many files per directory.
- * 
+ * The tigertree leaves of each shared file are stored in a database
+ * (normally GTK_GNUTELLA_DIR/gnet-db/tth_cache.{dir,pag,dat}), keyed by the
+ * root hash. The SDBM back-end packs small trees in its pages and the larger
+ * ones in its ".dat" file, so there is no longer one file per tree, and the
+ * space of removed trees is reclaimed by shrinking the database, which is
+ * done at startup and once a day.
+ *
  * Only the leaves at TTH_MAX_DEPTH or above are stored. The root hash and the
  * nodes at each level between above these leaves can be calculated from the
  * leaves.
  *
  * If the depth is 1 (root only), nothing is stored.
  *
+ * Older versions stored the tigertree data for each shared file in a file
+ * in the directory GTK_GNUTELLA_DIR/tth_cache/ in raw binary form. For
+ * example, if the root hash is 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ,
+ * the tigertree data was stored in
+ * $GTK_GNUTELLA_DIR/tth_cache/5E/DB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ.
+ * These files are moved into the database in the background, a few at
+ * a time, and are looked up directly if needed before being moved.
+ *
  * @author Christian Biere
  * @date 2007
  */
@@ -49,7 +57,16 @@
 #include "settings.h"
 #include "tth_cache.h"
 
+#include "if/gnet_property.h"
+#include "if/gnet_property_priv.h"
+
 #include "lib/atoms.h"
+#include "lib/base32.h"
+#include "lib/concat.h"
+#include "lib/cq.h"
+#include "lib/dbmw.h"
+#include "lib/dbstore.h"
+#include "lib/dirwalk.h"
 #include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/halloc.h"
@@ -60,11 +77,26 @@
 
 #include "lib/override.h"       /* Must be the last header included */
 
-#if defined(S_IROTH)
-#define TTH_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) /* 0644 */
-#else
-#define TTH_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP) /* 0640 */
-#endif
+#define TTH_DB_CACHE_SIZE	8		/**< Amount of trees cached */
+#define TTH_SYNC_PERIOD		(60 * 1000)			/**< ms: 1 minute */
+#define TTH_SHRINK_PERIOD	(24 * 3600 * 1000)	/**< ms: 1 day */
+#define TTH_MIGRATE_PERIOD	1000	/**< ms: legacy files moving period */
+#define TTH_MIGRATE_BATCH	64		/**< Legacy files moved per period */
+
+static dbmw_t *db_tth;
+static char db_tth_base[] = "tth_cache";
+static char db_tth_what[] = "TTH leaves";
+
+static cperiodic_t *tth_cache_sync_ev;
+static cperiodic_t *tth_cache_shrink_ev;
+
+static dirwalk_t *tth_cache_legacy;		/**< Non-NULL whilst migrating */
+static cperiodic_t *tth_cache_migrate_ev;
+static unsigned long tth_cache_migrated;
+
+/**
+ ** Legacy storage, one file per tree.
+ **/
 
 static const char *
 tth_cache_directory(void)
@@ -90,65 +122,237 @@ tth_cache_pathname(const struct tth *tth)
 			&hash[0], G_DIR_SEPARATOR, &hash[2]);
 }
 
-static int
-tth_cache_file_create(const struct tth *tth)
+static size_t
+tth_cache_leave_count(const struct tth *tth, const filestat_t *sb)
 {
-	char *pathname;
-	int accmode;
+	g_return_val_if_fail(tth, 0);
+	g_return_val_if_fail(sb, 0);
+
+	if (!S_ISREG(sb->st_mode)) {
+		g_warning("tth_cache_leave_count(%s): Not a regular file",
+			tth_base32(tth));
+		return 0;
+	}
+	if (
+		sb->st_size % TTH_RAW_SIZE ||
+		sb->st_size < TTH_RAW_SIZE ||
+		sb->st_size > TTH_MAX_LEAVES * TTH_RAW_SIZE
+	) {
+		g_warning("tth_cache_leave_count(%s): Bad filesize %s",
+			tth_base32(tth), fileoffset_t_to_string(sb->st_size));
+		return 0;
+	}
+
+	return sb->st_size / TTH_RAW_SIZE;
+}
+
+/**
+ * Move the legacy file holding the leaves of a tree into the database.
+ *
+ * The file is removed, even when its content is invalid.
+ *
+ * @return TRUE if the leaves were moved into the database.
+ */
+static gboolean
+tth_cache_legacy_move(const struct tth *tth, const char *pathname)
+{
+	struct tth *leaves = NULL;
+	size_t n_leaves = 0;
 	int fd;
 
-	g_return_val_if_fail(tth, -1);
+	fd = file_open_missing(pathname, O_RDONLY);
+	if (fd < 0)
+		return FALSE;
 
-	accmode = O_WRONLY | O_TRUNC;
-	pathname = tth_cache_pathname(tth);
-	fd = file_create_missing(pathname, accmode, TTH_FILE_MODE);
-	if (fd < 0 && ENOENT == errno) {
-		char *dir = filepath_directory(pathname);
-		if (0 == create_directory(dir, DEFAULT_DIRECTORY_MODE)) {
-			fd = file_create(pathname, accmode, TTH_FILE_MODE);
+	{
+		filestat_t sb;
+
+		if (fstat(fd, &sb)) {
+			g_warning("tth_cache_legacy_move(%s): fstat() failed: %s",
+				tth_base32(tth), g_strerror(errno));
+		} else {
+			n_leaves = tth_cache_leave_count(tth, &sb);
 		}
-		HFREE_NULL(dir);
 	}
-	HFREE_NULL(pathname);
-	return fd;
+
+	if (n_leaves > 0) {
+		size_t size;
+		ssize_t ret;
+
+		STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+
+		size = TTH_RAW_SIZE * n_leaves;
+		leaves = halloc(size);
+		ret = read(fd, &leaves[0].data, size);
+		if ((size_t) ret != size) {
+			n_leaves = 0;
+		}
+	}
+	fd_forget_and_close(&fd);
+
+	if (n_leaves > 1) {
+		struct tth root;
+
+		root = tt_root_hash(leaves, n_leaves);
+		if (tth_eq(tth, &root)) {
+			tth_cache_insert(tth, leaves, n_leaves);
+			tth_cache_migrated++;
+		} else {
+			n_leaves = 0;
+		}
+	}
+	HFREE_NULL(leaves);
+
+	if (-1 == unlink(pathname)) {
+		g_warning("tth_cache_legacy_move(%s): cannot unlink \"%s\": %s",
+			tth_base32(tth), pathname, g_strerror(errno));
+	}
+
+	return n_leaves > 1;
 }
 
-static int
-tth_cache_file_open(const struct tth *tth)
+/**
+ * Look whether the tree was not yet moved from its legacy file, moving it
+ * into the database if found.
+ *
+ * @return TRUE if the leaves were moved into the database.
+ */
+static gboolean
+tth_cache_legacy_lookup(const struct tth *tth)
 {
 	char *pathname;
-	int fd;
+	gboolean moved;
 
-	g_return_val_if_fail(tth, -1);
+	if (NULL == tth_cache_legacy)
+		return FALSE;
 
 	pathname = tth_cache_pathname(tth);
-	fd = file_open_missing(pathname, O_RDONLY);
+	moved = tth_cache_legacy_move(tth, pathname);
 	HFREE_NULL(pathname);
-	return fd;
+
+	return moved;
 }
 
-static gboolean
-tth_cache_file_exists(const struct tth *tth)
+/**
+ * Process a legacy file found whilst walking the legacy directories.
+ */
+static void
+tth_cache_legacy_entry(const struct dirwalk_entry *e)
 {
-	gboolean ret;
+	char hash[TTH_BASE32_SIZE + 1];
+	struct tth tth;
 	char *pathname;
 
-	g_return_val_if_fail(tth, FALSE);
+	pathname = make_pathname(e->dir, e->name);
+
+	/*
+	 * The root hash is split between the directory and file names.
+	 */
+
+	concat_strings(hash, sizeof hash,
+		filepath_basename(e->dir), e->name, (void *) 0);
+
+	if (
+		TTH_BASE32_SIZE == strlen(hash) &&
+		TTH_RAW_SIZE == base32_decode(tth.data, sizeof tth.data,
+							hash, TTH_BASE32_SIZE)
+	) {
+		tth_cache_legacy_move(&tth, pathname);
+	} else {
+		g_warning("ignoring unexpected \"%s\" in legacy TTH cache", pathname);
+	}
 
-	pathname = tth_cache_pathname(tth);
-	ret = file_exists(pathname);
 	HFREE_NULL(pathname);
-	return ret;
 }
 
+/**
+ * End the migration of the legacy files.
+ */
+static void
+tth_cache_legacy_done(void)
+{
+	dirwalk_free(&tth_cache_legacy, NULL);
+	cq_periodic_remove(&tth_cache_migrate_ev);
+
+	if (-1 == rmdir(tth_cache_directory()) && ENOENT != errno) {
+		g_warning("cannot remove legacy TTH cache \"%s\": %s",
+			tth_cache_directory(), g_strerror(errno));
+	}
+
+	g_info("moved %lu tigertree%s into the TTH leaves database",
+		tth_cache_migrated, 1 == tth_cache_migrated ? "" : "s");
+}
+
+/**
+ * Callout queue periodic event to move legacy files into the database.
+ */
+static gboolean
+tth_cache_migrate(void *unused_obj)
+{
+	unsigned n = 0;
+
+	(void) unused_obj;
+
+	while (n < TTH_MIGRATE_BATCH) {
+		struct dirwalk_entry e;
+
+		switch (dirwalk_next(tth_cache_legacy, &e)) {
+		case DIRWALK_ENTRY:
+			if (e.error != 0) {
+				break;
+			} else if (S_ISDIR(e.sb.st_mode) && NULL == e.udata) {
+				char *path = make_pathname(e.dir, e.name);
+				dirwalk_add(tth_cache_legacy, path, int_to_pointer(1));
+				HFREE_NULL(path);
+			} else if (S_ISREG(e.sb.st_mode) && e.udata != NULL) {
+				tth_cache_legacy_entry(&e);
+				n++;
+			}
+			break;
+		case DIRWALK_DIR_END:
+			if (e.udata != NULL)
+				(void) rmdir(e.dir);		/* Sub-directory now empty */
+			break;
+		case DIRWALK_AGAIN:
+			return TRUE;		/* Keep calling */
+		case DIRWALK_DONE:
+			tth_cache_legacy_done();
+			return FALSE;		/* Periodic event was removed */
+		}
+	}
+
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Start moving the legacy files into the database, if any.
+ */
+static void
+tth_cache_legacy_init(void)
+{
+	if (!is_directory(tth_cache_directory()))
+		return;
+
+	tth_cache_legacy = dirwalk_new(1, NULL, NULL);
+	if (NULL == tth_cache_legacy)
+		return;		/* No threads, legacy files are left in place */
+
+	dirwalk_add(tth_cache_legacy, tth_cache_directory(), NULL);
+	tth_cache_migrate_ev = cq_periodic_main_add(TTH_MIGRATE_PERIOD,
+		tth_cache_migrate, NULL);
+}
+
+/**
+ ** Database storage.
+ **/
+
 void
 tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
 {
-	int fd;
-	
 	g_return_if_fail(tth);
 	g_return_if_fail(leaves);
 	g_return_if_fail(n_leaves >= 1);
+	g_return_if_fail(n_leaves <= TTH_MAX_LEAVES);
 
 	{
 		struct tth root;
@@ -160,47 +364,50 @@ tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
 	if (1 == n_leaves)
 		return;
 
-	fd = tth_cache_file_create(tth);
-	if (fd >= 0) {
-		size_t size;
-		ssize_t ret;
+	STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
 
-		STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
-			
-		size = TTH_RAW_SIZE * n_leaves;
-		ret = write(fd, leaves, size);
-		if ((ssize_t) -1 == ret) {
-			g_warning("tth_cache_insert(): write() failed: %s",
-				g_strerror(errno));
-		} else if ((size_t) ret != size) {
-			g_warning("tth_cache_insert(): incomplete write()");
-		}
-		fd_forget_and_close(&fd);
+	dbmw_write(db_tth, tth->data,
+		deconstify_gpointer(leaves), TTH_RAW_SIZE * n_leaves);
+
+	if (dbmw_has_ioerr(db_tth)) {
+		g_warning("tth_cache_insert(%s): %s",
+			tth_base32(tth), dbmw_strerror(db_tth));
 	}
 }
 
-static size_t
-tth_cache_leave_count(const struct tth *tth, const filestat_t *sb)
+/**
+ * Fetch the leaves of a tree from the database.
+ *
+ * The returned data are only valid until the next operation on the
+ * database.
+ *
+ * @return the leaves, NULL if not found, with their count in n_leaves.
+ */
+static const struct tth *
+tth_cache_read(const struct tth *tth, size_t *n_leaves)
 {
-	g_return_val_if_fail(tth, 0);
-	g_return_val_if_fail(sb, 0);
+	const struct tth *leaves;
+	size_t len;
 
-	if (!S_ISREG(sb->st_mode)) {
-		g_warning("tth_cache_leave_count(%s): Not a regular file",
-			tth_base32(tth));
-		return 0;
+	leaves = dbmw_read(db_tth, tth->data, &len);
+	if (NULL == leaves && tth_cache_legacy_lookup(tth)) {
+		leaves = dbmw_read(db_tth, tth->data, &len);
 	}
-	if (
-		sb->st_size % TTH_RAW_SIZE ||
-		sb->st_size < TTH_RAW_SIZE ||
-		sb->st_size > TTH_MAX_LEAVES * TTH_RAW_SIZE
-	) {
-		g_warning("tth_cache_leave_count(%s): Bad filesize %s",
-			tth_base32(tth), fileoffset_t_to_string(sb->st_size));
-		return 0;
+
+	if (NULL == leaves) {
+		*n_leaves = 0;
+		return NULL;
 	}
 
-	return sb->st_size / TTH_RAW_SIZE;
+	if (0 != len % TTH_RAW_SIZE || len < TTH_RAW_SIZE) {
+		g_warning("tth_cache_read(%s): Bad length %lu",
+			tth_base32(tth), (unsigned long) len);
+		*n_leaves = 0;
+		return NULL;
+	}
+
+	*n_leaves = len / TTH_RAW_SIZE;
+	return leaves;
 }
 
 /**
@@ -215,20 +422,7 @@ tth_cache_lookup(const struct tth *tth, filesize_t filesize)
 
 	expected = tt_good_node_count(filesize);
 	if (expected > 1) {
-		filestat_t sb;
-		char *pathname;
-
-		pathname = tth_cache_pathname(tth);
-		if (stat(pathname, &sb)) {
-			leave_count = 0;
-			if (ENOENT != errno) {
-				g_warning("tth_cache_lookup(%s): stat() failed: %s",
-					tth_base32(tth), g_strerror(errno));
-			}
-		} else {
-			leave_count = tth_cache_leave_count(tth, &sb);
-		}
-		HFREE_NULL(pathname);
+		(void) tth_cache_read(tth, &leave_count);
 	} else {
 		leave_count = 1;
 	}
@@ -238,52 +432,29 @@ tth_cache_lookup(const struct tth *tth, filesize_t filesize)
 void
 tth_cache_remove(const struct tth *tth)
 {
-	char *pathname;
-
 	g_return_if_fail(tth);
 
-	pathname = tth_cache_pathname(tth);
-	unlink(pathname);
-	HFREE_NULL(pathname);
+	dbmw_delete(db_tth, tth->data);
 }
 
 static size_t
 tth_cache_get_leaves(const struct tth *tth,
 	struct tth leaves[TTH_MAX_LEAVES], size_t n)
 {
-	int fd, num_leaves = 0;
+	const struct tth *cached;
+	size_t n_leaves;
 
 	g_return_val_if_fail(tth, 0);
 	g_return_val_if_fail(leaves, 0);
 
-	fd = tth_cache_file_open(tth);
-	if (fd >= 0) {
-		filestat_t sb;
+	cached = tth_cache_read(tth, &n_leaves);
+	if (NULL == cached)
+		return 0;
 
-		if (fstat(fd, &sb)) {
-			g_warning("tth_cache_get_leaves(%s): fstat() failed: %s",
-				tth_base32(tth), g_strerror(errno));
-		} else {
-			size_t n_leaves;
-		
-			n_leaves = tth_cache_leave_count(tth, &sb);
-			n_leaves = MIN(n, n_leaves);
-			if (n_leaves > 0) {
-				size_t size;
-				ssize_t ret;
-
-				STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
-
-				size = TTH_RAW_SIZE * n_leaves;
-				ret = read(fd, &leaves[0].data, size);
-				if ((size_t) ret == size) {
-					num_leaves = n_leaves;
-				}
-			}
-		}
-		fd_forget_and_close(&fd);
-	}
-	return num_leaves;
+	n_leaves = MIN(n, n_leaves);
+	memcpy(leaves, cached, n_leaves * TTH_RAW_SIZE);
+
+	return n_leaves;
 }
 
 size_t
@@ -329,7 +500,7 @@ tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
 		}
 	}
 
-	if (tth_cache_file_exists(tth)) {
+	if (dbmw_exists(db_tth, tth->data)) {
 		g_warning("tth_cache_get_tree(): Removing corrupted tigertree for %s",
 			tth_base32(tth));
 		tth_cache_remove(tth);
@@ -337,16 +508,77 @@ tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
 	return 0;
 }
 
+/**
+ * Reclaim the space of the removed trees.
+ */
+static void
+tth_cache_shrink_db(void)
+{
+	if (GNET_PROPERTY(tigertree_debug)) {
+		g_debug("TTH cache holds %lu tree%s",
+			(unsigned long) dbmw_count(db_tth),
+			1 == dbmw_count(db_tth) ? "" : "s");
+	}
+
+	dbstore_shrink(db_tth);
+}
+
+/**
+ * Callout queue periodic event to compact the persistent DB.
+ */
+static gboolean
+tth_cache_shrink(void *unused_obj)
+{
+	(void) unused_obj;
+
+	tth_cache_shrink_db();
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Callout queue periodic event to synchronize persistent DB.
+ */
+static gboolean
+tth_cache_sync(void *unused_obj)
+{
+	(void) unused_obj;
+
+	dbstore_sync_flush(db_tth);
+	return TRUE;		/* Keep calling */
+}
+
 void
 tth_cache_init(void)
 {
-	/* NOTHING */
+	dbstore_kv_t kv = { TTH_RAW_SIZE, NULL,
+		TTH_MAX_LEAVES * TTH_RAW_SIZE, 0 };
+	dbstore_packing_t packing = { NULL, NULL, NULL };
+
+	db_tth = dbstore_open(db_tth_what, settings_gnet_db_dir(),
+		db_tth_base, kv, packing, TTH_DB_CACHE_SIZE, tth_hash, tth_eq,
+		FALSE);
+
+	tth_cache_shrink_db();
+	tth_cache_legacy_init();
+
+	tth_cache_sync_ev = cq_periodic_main_add(TTH_SYNC_PERIOD,
+		tth_cache_sync, NULL);
+	tth_cache_shrink_ev = cq_periodic_main_add(TTH_SHRINK_PERIOD,
+		tth_cache_shrink, NULL);
 }
 
 void
 tth_cache_close(void)
 {
-	/* NOTHING */
+	if (tth_cache_legacy != NULL) {
+		dirwalk_free(&tth_cache_legacy, NULL);
+		cq_periodic_remove(&tth_cache_migrate_ev);
+	}
+	cq_periodic_remove(&tth_cache_sync_ev);
+	cq_periodic_remove(&tth_cache_shrink_ev);
+
+	dbstore_close(db_tth, settings_gnet_db_dir(), db_tth_base);
+	db_tth = NULL;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -39,6 +39,8 @@
 
 #include "tx.h"
 #include "tx_deflate.h"
+#include "bsched.h"
+#include "gnet_stats.h"
 #include "hosts.h"
 #include "settings.h"
 #include "sockets.h"
@@ -46,6 +48,7 @@
 #include "if/gnet_property_priv.h"
 
 #include "lib/endian.h"
+#include "lib/tm.h"
 #include "lib/walloc.h"
 #include "lib/zlib_util.h"
 #include "lib/override.h"		/* Must be the last header included */
@@ -65,6 +68,19 @@
 #define BUFFER_COUNT	2
 #define BUFFER_NAGLE	200		/**< 200 ms */
 
+/*
+ * The compression level of each link is periodically adapted to trade
+ * CPU for bandwidth: when the CPU is busy or compression is expensive,
+ * we compress less, whereas we compress more when the output bandwidth
+ * is saturated and the data compresses well.
+ */
+
+#define DEFLATE_ADAPT_PERIOD	5000	/**< ms, level adjustment period */
+#define DEFLATE_ADAPT_MIN		8192	/**< Minimum input to adapt level */
+#define DEFLATE_CPU_HIGH		200		/**< ns/byte, compression too costly */
+#define DEFLATE_CPU_LOW			50		/**< ns/byte, room to compress more */
+#define DEFLATE_POOR_RATIO		0.95	/**< Output/input: data incompressible */
+
 struct buffer {
 	char *arena;				/**< Buffer arena */
 	char *end;					/**< First byte outside buffer */
@@ -91,6 +107,16 @@ struct attr {
 	tx_closed_t closed;			/**< Callback to invoke when layer closed */
 	gpointer closed_arg;		/**< Argument for closing routine */
 	gboolean nagle;				/**< Whether to use Nagle or not */
+	struct {
+		cperiodic_t	*ev;		/**< Periodic level adjustment */
+		bsched_bws_t bws;		/**< Scheduler used by the link */
+		int			level;		/**< Current compression level */
+		int			base;		/**< Compression level when unloaded */
+		size_t		in;			/**< Bytes compressed during period */
+		size_t		out;		/**< Bytes produced during period */
+		unsigned long usecs;	/**< Time spent compressing during period */
+		unsigned	flowc;		/**< Flow-control events during period */
+	} adapt;
 	struct {
 		gboolean	enabled;	/**< Whether to use gzip encapsulation */
 		guint32		size;		/**< Payload size counter for gzip */
@@ -315,6 +341,7 @@ retry:
 
 		written = old_avail - outz->avail_out;
 		b->wptr += written;
+		attr->adapt.out += written;
 
 		if (NULL != attr->cb->add_tx_deflated)
 			attr->cb->add_tx_deflated(tx->owner, written);
@@ -330,6 +357,7 @@ retry:
 	if (0 == outz->avail_out) {
 		if (attr->send_idx >= 0) {				/* Send buffer not sent yet */
 			attr->flags |= DF_FLOWC|DF_FLUSH;	/* Enter flow control */
+			attr->adapt.flowc++;
 
 			if (GNET_PROPERTY(tx_debug) > 4) {
 				g_debug("compressing TX stack for peer %s enters FLOWC/FLUSH",
@@ -471,7 +499,16 @@ deflate_add(txdrv_t *tx, gconstpointer data, int len)
 		 * that we have more room available for the output.
 		 */
 
-		ret = deflate(outz, flush_started ? Z_SYNC_FLUSH : 0);
+		if (attr->adapt.ev != NULL) {
+			tm_t start, end;
+
+			tm_now_exact(&start);
+			ret = deflate(outz, flush_started ? Z_SYNC_FLUSH : 0);
+			tm_now_exact(&end);
+			attr->adapt.usecs += tm_elapsed_us(&end, &start);
+		} else {
+			ret = deflate(outz, flush_started ? Z_SYNC_FLUSH : 0);
+		}
 
 		if (Z_OK != ret) {
 			attr->flags |= DF_SHUTDOWN;
@@ -494,6 +531,9 @@ deflate_add(txdrv_t *tx, gconstpointer data, int len)
 		if (NULL != attr->cb->add_tx_deflated)
 			attr->cb->add_tx_deflated(tx->owner, old_avail - outz->avail_out);
 
+		attr->adapt.in += added - old_added;
+		attr->adapt.out += old_avail - outz->avail_out;
+
 		if (attr->gzip.enabled) {
 			size_t r;
 
@@ -512,6 +552,7 @@ deflate_add(txdrv_t *tx, gconstpointer data, int len)
 		if (0 == outz->avail_out) {
 			if (attr->send_idx >= 0) {
 				attr->flags |= DF_FLOWC;	/* Enter flow control */
+				attr->adapt.flowc++;
 
 				if (GNET_PROPERTY(tx_debug) > 4) {
 					g_debug("compressing TX stack for peer %s enters FLOWC",
@@ -679,6 +720,123 @@ deflate_service(gpointer data)
 	}
 }
 
+/**
+ * Change the compression level of the stream.
+ *
+ * Changing the compression function may require that zlib compresses the
+ * pending input with the former level, so we give it the room left in the
+ * filling buffer.
+ *
+ * @return TRUE if the level was changed.
+ */
+static gboolean
+deflate_set_level(txdrv_t *tx, int level)
+{
+	struct attr *attr = tx->opaque;
+	z_streamp outz = attr->outz;
+	struct buffer *b = &attr->buf[attr->fill_idx];
+	size_t written;
+	int ret;
+
+	g_assert(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION);
+
+	if (b->wptr >= b->end)
+		return FALSE;
+
+	outz->next_out = cast_to_gpointer(b->wptr);
+	outz->avail_out = b->end - b->wptr;
+	outz->avail_in = 0;
+
+	ret = zlib_deflate_params(outz, level);
+
+	written = ptr_diff(outz->next_out, b->wptr);
+	b->wptr = cast_to_gpointer(outz->next_out);
+	attr->adapt.out += written;
+
+	if (written != 0) {
+		if (NULL != attr->cb->add_tx_deflated)
+			attr->cb->add_tx_deflated(tx->owner, written);
+		if (!(attr->flags & DF_NAGLE))
+			deflate_nagle_start(tx);
+	}
+
+	if (Z_OK != ret) {
+		if (GNET_PROPERTY(tx_debug) > 1) {
+			g_debug("TX deflate: (%s) cannot switch to level %d: %s",
+				gnet_host_to_string(&tx->host), level, zlib_strerror(ret));
+		}
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Periodic callback adjusting the compression level of the link, based
+ * on the CPU time spent compressing, the saturation of the outgoing
+ * bandwidth and the achieved compression ratio.
+ */
+static gboolean
+deflate_adapt(gpointer data)
+{
+	txdrv_t *tx = data;
+	struct attr *attr = tx->opaque;
+	int level = attr->adapt.level;
+	unsigned long ns_per_byte;
+	double ratio;
+	gboolean saturated;
+
+	if (NULL != attr->cb->deflate_stats) {
+		attr->cb->deflate_stats(tx->owner,
+			attr->adapt.level, attr->adapt.usecs);
+	}
+
+	if (attr->adapt.in < DEFLATE_ADAPT_MIN)
+		goto reset;			/* Not enough traffic to draw conclusions */
+
+	if ((attr->flags & DF_SHUTDOWN) || (tx->flags & (TX_CLOSING | TX_ERROR)))
+		goto reset;
+
+	ns_per_byte = (guint64) attr->adapt.usecs * 1000 / attr->adapt.in;
+	ratio = (double) attr->adapt.out / attr->adapt.in;
+	saturated = attr->adapt.flowc != 0 || bsched_saturated(attr->adapt.bws);
+
+	if (GNET_PROPERTY(overloaded_cpu) || ns_per_byte > DEFLATE_CPU_HIGH) {
+		level--;
+	} else if (ratio >= DEFLATE_POOR_RATIO) {
+		level--;			/* Not worth spending CPU on this traffic */
+	} else if (saturated) {
+		if (ns_per_byte < DEFLATE_CPU_LOW)
+			level++;
+	} else if (level < attr->adapt.base) {
+		level++;			/* Back to default when load goes away */
+	} else if (level > attr->adapt.base) {
+		level--;
+	}
+
+	level = CLAMP(level, Z_BEST_SPEED, Z_BEST_COMPRESSION);
+
+	if (level != attr->adapt.level && deflate_set_level(tx, level)) {
+		if (GNET_PROPERTY(tx_debug) > 1) {
+			g_debug("TX deflate: (%s) level %d -> %d "
+				"(%lu ns/byte, ratio %.2f%s%s)",
+				gnet_host_to_string(&tx->host), attr->adapt.level, level,
+				ns_per_byte, ratio, saturated ? ", saturated" : "",
+				GNET_PROPERTY(overloaded_cpu) ? ", CPU overloaded" : "");
+		}
+		gnet_stats_count_general(level > attr->adapt.level ?
+			GNR_TX_DEFLATE_LEVEL_RAISED : GNR_TX_DEFLATE_LEVEL_LOWERED, 1);
+		attr->adapt.level = level;
+	}
+
+reset:
+	attr->adapt.in = attr->adapt.out = 0;
+	attr->adapt.usecs = 0;
+	attr->adapt.flowc = 0;
+
+	return TRUE;		/* Keep calling */
+}
+
 /***
  *** Polymorphic routines.
  ***/
@@ -694,17 +852,12 @@ tx_deflate_init(txdrv_t *tx, gpointer args)
 	struct attr *attr;
 	struct tx_deflate_args *targs = args;
 	z_streamp outz;
-	int ret;
+	int base_level;
 	int i;
 
 	g_assert(tx);
 	g_assert(NULL != targs->cb);
 
-	WALLOC(outz);
-	outz->zalloc = zlib_alloc_func;
-	outz->zfree = zlib_free_func;
-	outz->opaque = NULL;
-
 	/*
 	 * Reduce memory requirements for deflation when running as an ultrapeer.
 	 *
@@ -723,6 +876,11 @@ tx_deflate_init(txdrv_t *tx, gpointer args)
 	 * depending on the nature of the traffic, of course).
 	 *
 	 *		--RAM, 2009-04-09
+	 *
+	 * Traffic sent by ultra peers to their leaves is mostly made of the few
+	 * queries that pass their QRP tables, so when asked to, we use an even
+	 * smaller profile for these, with window_bits = 12 and mem_level = 4,
+	 * which is 16 KiB + 8 KiB = 24 KiB.
 	 */
 
 	{
@@ -736,20 +894,25 @@ tx_deflate_init(txdrv_t *tx, gpointer args)
 			level = Z_DEFAULT_COMPRESSION;
 		}
 
+		if (targs->reduced) {
+			window_bits = MIN(window_bits, 12);
+			mem_level = MIN(mem_level, 4);
+		}
+
 		g_assert(window_bits >= 8 && window_bits <= MAX_WBITS);
 		g_assert(mem_level >= 1 && mem_level <= MAX_MEM_LEVEL);
 		g_assert(level == Z_DEFAULT_COMPRESSION ||
 			(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION));
 
-		ret = deflateInit2(outz, level, Z_DEFLATED,
-				targs->gzip ? (-window_bits) : window_bits, mem_level,
-				Z_DEFAULT_STRATEGY);
+		outz = zlib_deflate_get(level,
+				targs->gzip ? (-window_bits) : window_bits, mem_level);
+
+		base_level = Z_DEFAULT_COMPRESSION == level ? 6 : level;
 	}
 
-	if (Z_OK != ret) {
-		g_warning("unable to initialize compressor for peer %s: %s",
-			gnet_host_to_string(&tx->host), zlib_strerror(ret));
-		WFREE(outz);
+	if (NULL == outz) {
+		g_warning("unable to initialize compressor for peer %s",
+			gnet_host_to_string(&tx->host));
 		return NULL;
 	}
 
@@ -766,6 +929,17 @@ tx_deflate_init(txdrv_t *tx, gpointer args)
 	attr->tm_ev = NULL;
 	attr->unflushed = 0;
 
+	attr->adapt.bws = targs->bws;
+	attr->adapt.level = attr->adapt.base = base_level;
+	attr->adapt.in = attr->adapt.out = 0;
+	attr->adapt.usecs = 0;
+	attr->adapt.flowc = 0;
+	attr->adapt.ev = BSCHED_BWS_INVALID == targs->bws ? NULL :
+		cq_periodic_add(attr->cq, DEFLATE_ADAPT_PERIOD, deflate_adapt, tx);
+
+	if (NULL != attr->cb->deflate_stats)
+		attr->cb->deflate_stats(tx->owner, base_level, 0);
+
 	for (i = 0; i < BUFFER_COUNT; i++) {
 		struct buffer *b = &attr->buf[i];
 
@@ -816,7 +990,6 @@ tx_deflate_destroy(txdrv_t *tx)
 {
 	struct attr *attr = tx->opaque;
 	int i;
-	int ret;
 
 	g_assert(attr->outz);
 
@@ -825,18 +998,9 @@ tx_deflate_destroy(txdrv_t *tx)
 		wfree(b->arena, attr->buffer_size);
 	}
 
-	/*
-	 * We ignore Z_DATA_ERROR errors (discarded data, probably).
-	 */
-
-	ret = deflateEnd(attr->outz);
-
-	if (Z_OK != ret && Z_DATA_ERROR != ret)
-		g_warning("while freeing compressor for peer %s: %s",
-			gnet_host_to_string(&tx->host), zlib_strerror(ret));
-
-	WFREE(attr->outz);
+	zlib_stream_release(&attr->outz);
 	cq_cancel(&attr->tm_ev);
+	cq_periodic_remove(&attr->adapt.ev);
 	WFREE(attr);
 }
 
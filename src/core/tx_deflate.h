@@ -37,6 +37,7 @@
 #include "common.h"
 
 #include "tx.h"
+#include "if/core/bsched.h"
 #include "lib/cq.h"
 
 const struct txdrv_ops *tx_deflate_get_ops(void);
@@ -47,6 +48,7 @@ const struct txdrv_ops *tx_deflate_get_ops(void);
 struct tx_deflate_cb {
 	void (*add_tx_deflated)(gpointer owner, int amount);
 	void (*shutdown)(gpointer owner, const char *reason, ...);
+	void (*deflate_stats)(gpointer owner, int level, unsigned long usecs);
 };
 
 /**
@@ -59,6 +61,8 @@ struct tx_deflate_args {
 	size_t buffer_flush;		/**< Flush after that many bytes */
 	gboolean nagle;				/**< Whether to use Nagle or not */
 	gboolean gzip;				/**< Whether to use gzip encapsulation */
+	bsched_bws_t bws;			/**< Output scheduler, to adapt level */
+	gboolean reduced;			/**< Use reduced memory profile */
 };
 
 #endif	/* _core_tx_deflate_h_ */
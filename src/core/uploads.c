@@ -106,6 +106,7 @@
 #include "lib/override.h"	/* Must be the last header included */
 
 #define READ_BUF_SIZE	(64 * 1024)	/**< Read buffer size, if no sendfile(2) */
+#define UPLOAD_READAHEAD (512 * 1024)	/**< Read-ahead window */
 #define BW_OUT_MIN		256			/**< Minimum bandwidth to enable uploads */
 #define IO_PRE_STALL	10			/**< Pre-stalling warning */
 #define IO_RTT_STALL	15			/**< Watch for RTT larger than that */
@@ -3377,6 +3378,7 @@ upload_tx_error(gpointer obj, const char *reason, ...)
 static const struct tx_deflate_cb upload_tx_deflate_cb = {
 	NULL,				/* add_tx_deflated */
 	upload_tx_error,	/* shutdown */
+	NULL,				/* deflate_stats */
 };
 
 static void
@@ -4156,8 +4158,12 @@ upload_request_for_shared_file(struct upload *u, const header_t *header)
 		return FALSE;
 	}
 
-	if (!u->head_only)
+	if (!u->head_only) {
 		parq_upload_busy(u, u->parq_ul);
+		file_object_hint(u->file, FILE_OBJECT_SEQUENTIAL,
+			u->skip, u->end - u->skip + 1);
+		u->ahead = u->dropped = u->skip;
+	}
 
 	/*
 	 * PARQ ID, emitted if needed.
@@ -5080,6 +5086,37 @@ upload_handle_exception(struct upload *u, inputevt_cond_t cond)
 	return FALSE;
 }
 
+/**
+ * Have the kernel fetch the data we are about to send in the background,
+ * and release the data we sent so that serving large files does not
+ * evict more useful data from the page cache.
+ *
+ * Data is only released when nobody else has the file opened, otherwise
+ * the pages are likely to be needed again shortly.
+ */
+static void
+upload_hint(struct upload *u)
+{
+	g_assert(u->file != NULL);
+
+	if (
+		u->ahead <= u->end &&
+		u->ahead - MIN(u->ahead, u->pos) < UPLOAD_READAHEAD / 2
+	) {
+		filesize_t from = MAX(u->ahead, u->pos);
+		filesize_t to = MIN(u->end + 1, u->pos + UPLOAD_READAHEAD);
+
+		file_object_hint(u->file, FILE_OBJECT_WILLNEED, from, to - from);
+		u->ahead = to;
+	}
+
+	if (u->pos > u->dropped && u->pos - u->dropped >= UPLOAD_READAHEAD) {
+		file_object_hint(u->file, FILE_OBJECT_DONTNEED,
+			u->dropped, u->pos - u->dropped);
+		u->dropped = u->pos;
+	}
+}
+
 /**
  * Called when output source can accept more data.
  */
@@ -5110,6 +5147,7 @@ upload_writable(gpointer obj, int unused_source, inputevt_cond_t cond)
 	g_assert(amount > 0);
 
 	using_sendfile = use_sendfile(u);
+	upload_hint(u);
 
 	if (using_sendfile) {
 		fileoffset_t pos, before;			/**< For sendfile() sanity checks */
@@ -112,6 +112,8 @@ struct upload {
 	filesize_t skip;			/**< First byte to send, inclusive */
 	filesize_t end;				/**< Last byte to send, inclusive */
 	filesize_t pos;				/**< Read position in file we're sending */
+	filesize_t ahead;			/**< End of range hinted for read-ahead */
+	filesize_t dropped;			/**< End of range evicted from the cache */
 	filesize_t sent;			/**< Bytes sent in this request */
 	filesize_t total_requested;	/**< Total amount of bytes requested */
 	filesize_t downloaded;		/**< What they claim as downloaded so far */
@@ -27,6 +27,18 @@
  *
  * Hash verification.
  *
+ * Files are hashed either by a background task running on the main thread,
+ * or when threads are available, by a pool of threads shared by all the
+ * verification tasks.  In the latter case, each task has one "lane" per
+ * thread, each lane being itself a verification context hashing a file.
+ * The lanes are given to the callbacks, so that they can access the state
+ * of the file being processed as usual.
+ *
+ * Threads only read the file and update the digests, by slices so that
+ * the main thread can invoke the progress callback, which can abort the
+ * hashing.  Everything else happens on the main thread, which is notified
+ * of completed slices through a pipe.
+ *
  * @author Raphael Manfredi
  * @date 2002-2003
  */
@@ -41,16 +53,34 @@
 
 #include "lib/atoms.h"
 #include "lib/bg.h"
-#include "lib/compat_misc.h"
+#include "lib/compat_pio.h"
+#include "lib/fd.h"
 #include "lib/halloc.h"
 #include "lib/hashlist.h"
 #include "lib/file.h"
+#include "lib/inputevt.h"
 #include "lib/tm.h"
 #include "lib/walloc.h"
 
 #include "lib/override.h"	/* Must be the last header included */
 
 #define HASH_BUF_SIZE		(128 * 1024) /**< Size of the reading buffer */
+#define VERIFY_SLICE		(1024 * 1024) /**< Amount hashed by a thread */
+#define VERIFY_READAHEAD	(4 * 1024 * 1024) /**< Read-ahead window */
+
+#if defined(USE_GLIB2) && defined(G_THREADS_ENABLED) && !defined(MINGW32)
+#define VERIFY_THREADS
+#endif
+
+/**
+ * State of a lane with respect to the thread pool.
+ */
+enum verify_lane_state {
+	VERIFY_LANE_IDLE = 0,		/**< Not submitted to the threads */
+	VERIFY_LANE_QUEUED,			/**< Waiting for a thread */
+	VERIFY_LANE_RUNNING,		/**< Being processed by a thread */
+	VERIFY_LANE_DONE			/**< Slice processed, main thread notified */
+};
 
 enum verify_magic { VERIFY_MAGIC = 0x2dc84379U };
 
@@ -61,11 +91,16 @@ struct verify {
 	enum verify_magic magic;	/**< Magic number. */
 	hash_list_t *files_to_hash;
 	struct bgtask *task;
-	struct verify_hash hash;
+	const struct verify_hash *hash[VERIFY_HASH_MAX];	/**< Digests computed */
+	void *state[VERIFY_HASH_MAX];	/**< Computation state of each digest */
+	size_t hash_count;			/**< Amount of digests computed */
+	char *name;					/**< Digest names, joined with "+" */
 	struct file_object *file;	/**< The file object to access the file. */
 	filesize_t offset;			/**< Current offset into the file. */
 	filesize_t start;			/**< Start offset of range to verify. */
 	filesize_t end;				/**< End offset of range to verify . */
+	filesize_t ahead;			/**< End of range hinted for read-ahead */
+	filesize_t dropped;			/**< End of range evicted from the cache */
 	time_t started;				/**< Start time, to determine comp. rate */
 	char *buffer;				/**< Read buffer */
 	size_t buffer_size;			/**< Size of buffer in bytes. */
@@ -73,6 +108,21 @@ struct verify {
 	verify_callback	callback;	/**< User-specified callback function. */
 	void *user_data;			/**< User-specified callback parameter. */
 	enum verify_status status;	/**< Used for callback multiplexing. */
+
+	/* Threaded hashing */
+	struct verify **lanes;		/**< Lanes hashing files concurrently */
+	unsigned lane_count;		/**< Amount of lanes */
+	struct verify *owner;		/**< For a lane, the task owning it */
+	struct verify *next;		/**< Next lane in pool lists (locked) */
+	enum verify_lane_state lane_state;	/**< (locked) */
+	int fd;						/**< File descriptor read by the thread */
+	size_t sliced;				/**< Amount hashed by the last slice */
+	int error;					/**< errno from the last slice, 0 if none */
+	gboolean hash_failed;		/**< Digest update failed in last slice */
+	gboolean eof;				/**< Hit end of file in last slice */
+	unsigned busy:1;			/**< Lane is hashing a file */
+	unsigned lanes_tried:1;		/**< Creation of lanes was attempted */
+	unsigned uncached:1;		/**< Evict hashed data from the page cache */
 };
 
 static inline void
@@ -85,25 +135,66 @@ verify_check(const struct verify * const ctx)
 static inline void
 verify_hash_init(const struct verify * const ctx)
 {
-	ctx->hash.init(ctx->end - ctx->start);
+	size_t i;
+
+	for (i = 0; i < ctx->hash_count; i++) {
+		ctx->hash[i]->init(ctx->state[i], ctx->end - ctx->start);
+	}
 }
 
+/**
+ * Feed the data read to all the digests, so that the file is read once.
+ *
+ * @return 0 if OK, non-zero on error.
+ */
 static inline int
 verify_hash_update(const struct verify * const ctx, const void *data, size_t n)
 {
-	return ctx->hash.update(data, n);
+	size_t i;
+
+	for (i = 0; i < ctx->hash_count; i++) {
+		if (0 != ctx->hash[i]->update(ctx->state[i], data, n))
+			return -1;
+	}
+	return 0;
 }
 
 static inline int
 verify_hash_final(const struct verify * const ctx)
 {
-	return ctx->hash.final();
+	size_t i;
+
+	for (i = 0; i < ctx->hash_count; i++) {
+		if (0 != ctx->hash[i]->final(ctx->state[i]))
+			return -1;
+	}
+	return 0;
 }
 
 static inline const char *
 verify_hash_name(const struct verify * const ctx)
 {
-	return ctx->hash.name();
+	return ctx->name;
+}
+
+/**
+ * The callback function may call this to obtain the computation state
+ * of a given digest, from which the digest can be extracted.
+ *
+ * @return the state of the digest, NULL if not computed by this task.
+ */
+void *
+verify_hash_state(const struct verify *ctx, const struct verify_hash *hash)
+{
+	size_t i;
+
+	verify_check(ctx);
+
+	for (i = 0; i < ctx->hash_count; i++) {
+		if (hash == ctx->hash[i])
+			return ctx->state[i];
+	}
+	return NULL;
 }
 
 enum verify_file_magic { VERIFY_FILE_MAGIC = 0x063ac7adU };
@@ -234,6 +325,20 @@ verify_hashed(const struct verify *ctx)
 	return ctx->offset - ctx->start;
 }
 
+/**
+ * Whether data hashed by the task should be evicted from the page cache
+ * once processed, for tasks going through large amounts of data that
+ * will not be read again soon.
+ */
+void
+verify_set_uncached(struct verify *ctx, gboolean uncached)
+{
+	verify_check(ctx);
+	g_assert(NULL == ctx->owner);
+
+	ctx->uncached = uncached ? 1 : 0;
+}
+
 /**
  * The callback function may call this to obtain the amount of seconds
  * since hashing of the current file started.
@@ -281,36 +386,74 @@ verify_item_equal(gconstpointer p, gconstpointer q)
 			a->user_data == b->user_data;
 }
 
+/**
+ * Create a verification task computing several digests in a single pass
+ * over the data.
+ *
+ * @param hashes	the digests to compute
+ * @param n			amount of digests, at most VERIFY_HASH_MAX
+ */
 struct verify *
-verify_new(const struct verify_hash *hash)
+verify_new_multi(const struct verify_hash * const *hashes, size_t n)
 {
 	static const struct verify zero_ctx;
 	struct verify *ctx;
+	size_t i;
 
-	g_assert(hash);
+	g_assert(hashes);
+	g_assert(n > 0 && n <= VERIFY_HASH_MAX);
 
 	WALLOC(ctx);
 	*ctx = zero_ctx;
 	ctx->magic = VERIFY_MAGIC;
 	ctx->buffer_size = HASH_BUF_SIZE;
 	ctx->buffer = halloc(ctx->buffer_size);
-	ctx->hash = *hash;
+
+	for (i = 0; i < n; i++) {
+		const struct verify_hash *hash = hashes[i];
+
+		g_assert(hash);
+
+		ctx->hash[i] = hash;
+		ctx->state[i] = hash->new();
+
+		if (0 == i) {
+			ctx->name = h_strdup(hash->name());
+		} else {
+			char *name = h_strconcat(ctx->name, "+", hash->name(), (void *) 0);
+			HFREE_NULL(ctx->name);
+			ctx->name = name;
+		}
+	}
+	ctx->hash_count = n;
+
 	ctx->files_to_hash = hash_list_new(verify_item_hash, verify_item_equal);
 	return ctx;
 }
 
+struct verify *
+verify_new(const struct verify_hash *hash)
+{
+	return verify_new_multi(&hash, 1);
+}
+
+static void verify_lanes_free(struct verify *ctx);
+
 void
 verify_free(struct verify **ptr)
 {
 	struct verify *ctx = *ptr;
 
-	if (ptr) {
+	if (ctx) {
+		size_t i;
+
 		verify_check(ctx);
 
 		if (ctx->task) {
 			bg_task_cancel(ctx->task);
 			ctx->task = NULL;
 		}
+		verify_lanes_free(ctx);
 		if (VERIFY_INVALID != ctx->status) {
 			verify_shutdown(ctx);
 		}
@@ -325,6 +468,10 @@ verify_free(struct verify **ptr)
 		}
 		file_object_release(&ctx->file);
 		HFREE_NULL(ctx->buffer);
+		for (i = 0; i < ctx->hash_count; i++) {
+			ctx->hash[i]->free(ctx->state[i]);
+		}
+		HFREE_NULL(ctx->name);
 		ctx->magic = 0;
 		WFREE(ctx);
 		*ptr = NULL;
@@ -353,6 +500,63 @@ verify_context_free(void *data)
 	}
 }
 
+/**
+ * Start hashing file, with the item being freed.
+ *
+ * @return TRUE if file was opened and hashing can proceed.
+ */
+static gboolean
+verify_open(struct verify *ctx, struct verify_file *item)
+{
+	verify_check(ctx);
+	verify_file_check(item);
+	g_assert(NULL == ctx->file);
+
+	ctx->user_data = item->user_data;
+	ctx->callback = item->callback;
+	ctx->start = item->offset;
+	ctx->end = item->offset + item->amount;
+	ctx->offset = ctx->start;
+
+	if (verify_start(ctx)) {
+		ctx->file = file_object_open(item->pathname, O_RDONLY);
+		if (NULL == ctx->file) {
+			int fd;
+
+			fd = file_absolute_open(item->pathname, O_RDONLY, 0);
+			if (fd >= 0) {
+				ctx->file = file_object_new(fd, item->pathname, O_RDONLY);
+			}
+		}
+		if (NULL == ctx->file) {
+			g_warning("failed to open \"%s\" for %s hashing: %s",
+				item->pathname, verify_hash_name(ctx), g_strerror(errno));
+		}
+	} else {
+		if (GNET_PROPERTY(verify_debug)) {
+			g_debug("discarding request of %s digest for %s",
+				verify_hash_name(ctx), item->pathname);
+		}
+	}
+	verify_file_free(&item);
+
+	if (NULL == ctx->file) {
+		verify_failure(ctx);
+		return FALSE;
+	}
+
+	if (GNET_PROPERTY(verify_debug)) {
+		g_debug("verifying %s digest for %s",
+			verify_hash_name(ctx), file_object_get_pathname(ctx->file));
+	}
+	verify_hash_init(ctx);
+	file_object_hint(ctx->file, FILE_OBJECT_SEQUENTIAL,
+		ctx->start, ctx->end - ctx->start);
+	ctx->ahead = ctx->dropped = ctx->start;
+	ctx->started = tm_time_exact();
+	return TRUE;
+}
+
 static void
 verify_next_file(struct verify *ctx)
 {
@@ -362,55 +566,44 @@ verify_next_file(struct verify *ctx)
 
 	item = ctx->files_to_hash ? hash_list_shift(ctx->files_to_hash) : NULL;
 	if (item) {
-		verify_file_check(item);
+		(void) verify_open(ctx, item);
+	}
+}
 
-		ctx->user_data = item->user_data;
-		ctx->callback = item->callback;
-		ctx->start = item->offset;
-		ctx->end = item->offset + item->amount;
-		ctx->offset = ctx->start;
+/**
+ * Tell the kernel what part of the file we are going to read next, so
+ * that it is fetched whilst we hash the current data, and optionally what
+ * part we are done with.
+ *
+ * The read-ahead window is refilled when less than half of it remains.
+ */
+static void
+verify_hint(struct verify *ctx)
+{
+	const struct verify *task = NULL == ctx->owner ? ctx : ctx->owner;
 
-		if (verify_start(ctx)) {
-			ctx->file = file_object_open(item->pathname, O_RDONLY);
-			if (NULL == ctx->file) {
-				int fd;
+	g_assert(ctx->file != NULL);
 
-				fd = file_absolute_open(item->pathname, O_RDONLY, 0);
-				if (fd >= 0) {
-					ctx->file = file_object_new(fd, item->pathname, O_RDONLY);
-				}
-			}
-			if (NULL == ctx->file) {
-				g_warning("failed to open \"%s\" for %s hashing: %s",
-					verify_hash_name(ctx), item->pathname, g_strerror(errno));
-			}
-		} else {
-			if (GNET_PROPERTY(verify_debug)) {
-				g_debug("discarding request of %s digest for %s",
-					verify_hash_name(ctx), item->pathname);
-			}
-		}
-		verify_file_free(&item);
+	if (
+		ctx->ahead < ctx->end &&
+		ctx->ahead - MIN(ctx->ahead, ctx->offset) < VERIFY_READAHEAD / 2
+	) {
+		filesize_t from = MAX(ctx->ahead, ctx->offset);
+		filesize_t to = MIN(ctx->end, ctx->offset + VERIFY_READAHEAD);
 
-		if (NULL == ctx->file) {
-			goto error;
-		}
+		file_object_hint(ctx->file, FILE_OBJECT_WILLNEED, from, to - from);
+		ctx->ahead = to;
 	}
 
-	if (ctx->file) {
-		if (GNET_PROPERTY(verify_debug)) {
-			g_debug("verifying %s digest for %s",
-				verify_hash_name(ctx), file_object_get_pathname(ctx->file));
-		}
-		verify_hash_init(ctx);
-		compat_fadvise_sequential(file_object_get_fd(ctx->file), 0, 0);
-		ctx->started = tm_time_exact();
+	if (
+		task->uncached && ctx->offset > ctx->dropped &&
+		(ctx->offset - ctx->dropped >= VERIFY_READAHEAD ||
+			ctx->offset == ctx->end)
+	) {
+		file_object_hint(ctx->file, FILE_OBJECT_DONTNEED,
+			ctx->dropped, ctx->offset - ctx->dropped);
+		ctx->dropped = ctx->offset;
 	}
-	return;
-
-error:
-	verify_failure(ctx);
-	file_object_release(&ctx->file);
 }
 
 static void
@@ -418,6 +611,8 @@ verify_final(struct verify *ctx)
 {
 	verify_check(ctx);
 
+	verify_hint(ctx);
+
 	if (ctx->offset != ctx->end) {
 		g_warning("file shrunk? \"%s\"", file_object_get_pathname(ctx->file));
 		verify_failure(ctx);
@@ -458,6 +653,7 @@ verify_update(struct verify *ctx)
 		verify_final(ctx);
 	} else {
 		ctx->offset += (size_t) r;
+		verify_hint(ctx);
 
 		if (verify_hash_update(ctx, ctx->buffer, r)) {
 			g_warning("%s computation error for %s",
@@ -519,6 +715,534 @@ verify_step_compute(struct bgtask *bt, void *data, int ticks)
 	}
 }
 
+/***
+ *** Threaded hashing.
+ ***/
+
+#ifdef VERIFY_THREADS
+
+/**
+ * The pool of hashing threads, shared by all the verification tasks.
+ */
+static struct verify_pool {
+	GMutex *lock;				/**< Protects lists and lane states */
+	GCond *work_cond;			/**< Signals new jobs to the threads */
+	GCond *done_cond;			/**< Signals completed jobs */
+	GThread **threads;			/**< The threads */
+	unsigned nthreads;			/**< Amount of running threads */
+	unsigned refcnt;			/**< Amount of tasks using the pool */
+	struct verify *jobs;		/**< Lanes waiting for a thread, FIFO */
+	struct verify *jobs_tail;	/**< Last waiting lane */
+	struct verify *done;		/**< Lanes done with their slice */
+	int fd[2];					/**< Notification pipe */
+	unsigned event_id;			/**< Input event for the pipe */
+	gboolean stop;				/**< Tells the threads to exit */
+} *verify_pool;
+
+/**
+ * Hash the next slice of the file.
+ *
+ * This runs in a hashing thread, so it must only use system calls and
+ * the digest update routines, which do not allocate memory.
+ */
+static void
+verify_slice(struct verify *lane)
+{
+	filesize_t offset = lane->offset;
+	size_t done = 0;
+
+	lane->error = 0;
+	lane->eof = FALSE;
+	lane->hash_failed = FALSE;
+
+	while (done < VERIFY_SLICE && offset < lane->end) {
+		size_t n = MIN(lane->end - offset, lane->buffer_size);
+		ssize_t r;
+
+		r = compat_pread(lane->fd, lane->buffer, n, offset);
+		if ((ssize_t) -1 == r) {
+			if (EINTR == errno)
+				continue;
+			lane->error = errno;
+			break;
+		} else if (0 == r) {
+			lane->eof = TRUE;
+			break;
+		}
+		if (verify_hash_update(lane, lane->buffer, r)) {
+			lane->hash_failed = TRUE;
+			break;
+		}
+		offset += r;
+		done += r;
+	}
+
+	lane->sliced = done;
+}
+
+/**
+ * Hashing thread main loop.
+ */
+static gpointer
+verify_thread(gpointer data)
+{
+	struct verify_pool *vp = data;
+
+	g_mutex_lock(vp->lock);
+
+	for (;;) {
+		struct verify *lane;
+
+		while (!vp->stop && NULL == vp->jobs)
+			g_cond_wait(vp->work_cond, vp->lock);
+		if (vp->stop)
+			break;
+
+		lane = vp->jobs;
+		vp->jobs = lane->next;
+		if (NULL == vp->jobs)
+			vp->jobs_tail = NULL;
+		lane->lane_state = VERIFY_LANE_RUNNING;
+		g_mutex_unlock(vp->lock);
+
+		verify_slice(lane);
+
+		g_mutex_lock(vp->lock);
+		lane->lane_state = VERIFY_LANE_DONE;
+		lane->next = vp->done;
+		vp->done = lane;
+		g_cond_broadcast(vp->done_cond);
+
+		/* A full pipe means the main thread has notifications pending */
+		while (-1 == write(vp->fd[1], "", 1) && EINTR == errno)
+			continue;
+	}
+
+	g_mutex_unlock(vp->lock);
+	return NULL;
+}
+
+/**
+ * Give lane to the hashing threads, to process its next slice.
+ */
+static void
+verify_lane_submit(struct verify *lane)
+{
+	struct verify_pool *vp = verify_pool;
+
+	verify_check(lane);
+	g_assert(lane->owner != NULL);
+	g_assert(lane->busy);
+	g_assert(vp != NULL);
+
+	g_mutex_lock(vp->lock);
+	g_assert(VERIFY_LANE_IDLE == lane->lane_state);
+	lane->lane_state = VERIFY_LANE_QUEUED;
+	lane->next = NULL;
+	if (vp->jobs_tail != NULL)
+		vp->jobs_tail->next = lane;
+	else
+		vp->jobs = lane;
+	vp->jobs_tail = lane;
+	g_cond_signal(vp->work_cond);
+	g_mutex_unlock(vp->lock);
+}
+
+/**
+ * Take lane back from the threads, waiting for its slice to be processed
+ * if it is being hashed.
+ */
+static void
+verify_lane_cancel(struct verify *lane)
+{
+	struct verify_pool *vp = verify_pool;
+
+	verify_check(lane);
+	g_assert(vp != NULL);
+
+	g_mutex_lock(vp->lock);
+
+	while (VERIFY_LANE_RUNNING == lane->lane_state)
+		g_cond_wait(vp->done_cond, vp->lock);
+
+	switch (lane->lane_state) {
+	case VERIFY_LANE_QUEUED:
+		{
+			struct verify *l, *prev = NULL;
+
+			for (l = vp->jobs; l != NULL; prev = l, l = l->next) {
+				if (lane == l) {
+					if (prev != NULL)
+						prev->next = l->next;
+					else
+						vp->jobs = l->next;
+					if (vp->jobs_tail == lane)
+						vp->jobs_tail = prev;
+					break;
+				}
+			}
+		}
+		break;
+	case VERIFY_LANE_DONE:
+		{
+			struct verify **lp;
+
+			for (lp = &vp->done; *lp != NULL; lp = &(*lp)->next) {
+				if (lane == *lp) {
+					*lp = lane->next;
+					break;
+				}
+			}
+		}
+		break;
+	case VERIFY_LANE_IDLE:
+	case VERIFY_LANE_RUNNING:
+		break;
+	}
+
+	lane->lane_state = VERIFY_LANE_IDLE;
+	lane->next = NULL;
+	g_mutex_unlock(vp->lock);
+}
+
+static void verify_dispatch(struct verify *ctx);
+
+/**
+ * Start hashing of item in lane.
+ *
+ * @return TRUE if the lane was given to the threads.
+ */
+static gboolean
+verify_lane_start(struct verify *lane, struct verify_file *item)
+{
+	verify_check(lane);
+
+	if (!verify_open(lane, item))
+		return FALSE;
+
+	if (lane->offset == lane->end) {
+		verify_final(lane);		/* Empty range, nothing to read */
+		return FALSE;
+	}
+
+	lane->fd = file_object_get_fd(lane->file);
+	verify_hint(lane);
+	verify_lane_submit(lane);
+	return TRUE;
+}
+
+/**
+ * Process lane whose slice was hashed by a thread.
+ */
+static void
+verify_lane_completed(struct verify *lane)
+{
+	verify_check(lane);
+	g_assert(lane->busy);
+	g_assert(lane->file != NULL);
+
+	lane->offset += lane->sliced;
+
+	if (lane->hash_failed) {
+		g_warning("%s computation error for %s",
+			verify_hash_name(lane), file_object_get_pathname(lane->file));
+		goto error;
+	}
+	if (lane->error != 0) {
+		g_warning("error while reading file: %s", g_strerror(lane->error));
+		goto error;
+	}
+	if (lane->eof || lane->offset == lane->end) {
+		verify_final(lane);
+		goto next;
+	}
+	if (!verify_progress(lane))
+		goto error;
+
+	verify_hint(lane);
+	verify_lane_submit(lane);
+	return;
+
+error:
+	verify_failure(lane);
+	file_object_release(&lane->file);
+next:
+	lane->fd = -1;
+	lane->busy = FALSE;
+	verify_dispatch(lane->owner);
+}
+
+/**
+ * Input callback invoked when hashing threads completed slices.
+ */
+static void
+verify_pool_completed(void *data, int unused_source,
+	inputevt_cond_t unused_cond)
+{
+	struct verify_pool *vp = data;
+	struct verify *done = NULL;
+	char buf[64];
+
+	(void) unused_source;
+	(void) unused_cond;
+
+	while (read(vp->fd[0], buf, sizeof buf) > 0)
+		continue;
+
+	g_mutex_lock(vp->lock);
+	while (vp->done != NULL) {
+		struct verify *lane = vp->done;
+
+		vp->done = lane->next;
+		lane->lane_state = VERIFY_LANE_IDLE;
+		lane->next = done;		/* Reverse, to process in completion order */
+		done = lane;
+	}
+	g_mutex_unlock(vp->lock);
+
+	while (done != NULL) {
+		struct verify *lane = done;
+
+		done = lane->next;
+		lane->next = NULL;
+		verify_lane_completed(lane);
+	}
+}
+
+/**
+ * Stop the hashing threads and free the pool.
+ */
+static void
+verify_pool_free(void)
+{
+	struct verify_pool *vp = verify_pool;
+	unsigned i;
+
+	g_assert(vp != NULL);
+	g_assert(NULL == vp->jobs);
+
+	g_mutex_lock(vp->lock);
+	vp->stop = TRUE;
+	g_cond_broadcast(vp->work_cond);
+	g_mutex_unlock(vp->lock);
+
+	for (i = 0; i < vp->nthreads; i++)
+		g_thread_join(vp->threads[i]);
+
+	inputevt_remove(&vp->event_id);
+	fd_close(&vp->fd[0]);
+	fd_close(&vp->fd[1]);
+	HFREE_NULL(vp->threads);
+	g_mutex_free(vp->lock);
+	g_cond_free(vp->work_cond);
+	g_cond_free(vp->done_cond);
+	WFREE(vp);
+	verify_pool = NULL;
+}
+
+/**
+ * Get a reference on the hashing thread pool, creating it if needed.
+ *
+ * @return the pool, NULL if files must be hashed by the main thread.
+ */
+static struct verify_pool *
+verify_pool_get(void)
+{
+	struct verify_pool *vp;
+	unsigned i, threads;
+	int fd[2];
+
+	if (verify_pool != NULL) {
+		verify_pool->refcnt++;
+		return verify_pool;
+	}
+
+	threads = GNET_PROPERTY(hash_threads);
+	if (0 == threads)
+		return NULL;
+
+	if (-1 == pipe(fd)) {
+		g_warning("%s(): cannot create pipe: %s", G_STRFUNC, g_strerror(errno));
+		return NULL;
+	}
+
+	WALLOC0(vp);
+	verify_pool = vp;
+	vp->fd[0] = fd[0];
+	vp->fd[1] = fd[1];
+	vp->lock = g_mutex_new();
+	vp->work_cond = g_cond_new();
+	vp->done_cond = g_cond_new();
+	vp->refcnt = 1;
+
+	for (i = 0; i < 2; i++) {
+		fd_set_nonblocking(vp->fd[i]);
+		set_close_on_exec(vp->fd[i]);
+	}
+	vp->event_id = inputevt_add(vp->fd[0], INPUT_EVENT_RX,
+		verify_pool_completed, vp);
+
+	vp->threads = halloc0(threads * sizeof vp->threads[0]);
+	for (i = 0; i < threads; i++) {
+		GError *error = NULL;
+
+		vp->threads[i] = g_thread_create(verify_thread, vp, TRUE, &error);
+		if (NULL == vp->threads[i]) {
+			g_warning("%s(): cannot create thread: %s", G_STRFUNC,
+				error != NULL ? error->message : "unknown error");
+			if (error != NULL)
+				g_error_free(error);
+			break;
+		}
+		vp->nthreads++;
+	}
+
+	if (0 == vp->nthreads) {
+		verify_pool_free();
+		return NULL;
+	}
+
+	if (GNET_PROPERTY(verify_debug)) {
+		g_debug("hashing files with %u thread%s",
+			vp->nthreads, 1 == vp->nthreads ? "" : "s");
+	}
+
+	return vp;
+}
+
+/**
+ * Release reference on the hashing thread pool.
+ */
+static void
+verify_pool_release(void)
+{
+	g_assert(verify_pool != NULL);
+	g_assert(verify_pool->refcnt > 0);
+
+	if (0 == --verify_pool->refcnt)
+		verify_pool_free();
+}
+
+/**
+ * Create lane for the task.
+ */
+static struct verify *
+verify_lane_new(struct verify *owner)
+{
+	static const struct verify zero_ctx;
+	struct verify *lane;
+	size_t i;
+
+	verify_check(owner);
+
+	WALLOC(lane);
+	*lane = zero_ctx;
+	lane->magic = VERIFY_MAGIC;
+	lane->owner = owner;
+	lane->fd = -1;
+	lane->buffer_size = HASH_BUF_SIZE;
+	lane->buffer = halloc(lane->buffer_size);
+	for (i = 0; i < owner->hash_count; i++) {
+		lane->hash[i] = owner->hash[i];
+		lane->state[i] = owner->hash[i]->new();
+	}
+	lane->hash_count = owner->hash_count;
+	lane->name = h_strdup(owner->name);
+	return lane;
+}
+
+/**
+ * Create the lanes of the task, one per hashing thread, if threads can
+ * be used.
+ */
+static void
+verify_lanes_create(struct verify *ctx)
+{
+	struct verify_pool *vp;
+	unsigned i;
+
+	verify_check(ctx);
+	g_assert(NULL == ctx->lanes);
+
+	vp = verify_pool_get();
+	if (NULL == vp)
+		return;
+
+	ctx->lane_count = vp->nthreads;
+	ctx->lanes = halloc(ctx->lane_count * sizeof ctx->lanes[0]);
+	for (i = 0; i < ctx->lane_count; i++) {
+		ctx->lanes[i] = verify_lane_new(ctx);
+	}
+}
+
+/**
+ * Free the lanes of the task, aborting the files being hashed.
+ */
+static void
+verify_lanes_free(struct verify *ctx)
+{
+	unsigned i;
+
+	verify_check(ctx);
+
+	if (NULL == ctx->lanes)
+		return;
+
+	for (i = 0; i < ctx->lane_count; i++) {
+		struct verify *lane = ctx->lanes[i];
+
+		verify_lane_cancel(lane);
+		verify_free(&lane);		/* Invokes shutdown callback if busy */
+	}
+	HFREE_NULL(ctx->lanes);
+	ctx->lane_count = 0;
+	verify_pool_release();
+}
+
+/**
+ * Give the queued files to the idle lanes, by order of priority.
+ */
+static void
+verify_dispatch(struct verify *ctx)
+{
+	unsigned i;
+
+	verify_check(ctx);
+
+	for (i = 0; i < ctx->lane_count; i++) {
+		struct verify *lane = ctx->lanes[i];
+
+		while (!lane->busy && hash_list_length(ctx->files_to_hash) > 0) {
+			struct verify_file *item = hash_list_shift(ctx->files_to_hash);
+
+			/* Lane is marked busy in case the callbacks enqueue files */
+			lane->busy = TRUE;
+			lane->busy = verify_lane_start(lane, item);
+		}
+	}
+}
+
+#else	/* !VERIFY_THREADS */
+
+static void
+verify_lanes_create(struct verify *ctx)
+{
+	(void) ctx;
+}
+
+static void
+verify_lanes_free(struct verify *ctx)
+{
+	(void) ctx;
+}
+
+static void
+verify_dispatch(struct verify *ctx)
+{
+	(void) ctx;
+}
+#endif	/* VERIFY_THREADS */
+
 static void
 verify_create_task(struct verify *ctx)
 {
@@ -581,7 +1305,21 @@ verify_enqueue(struct verify *ctx, int high_priority,
 			verify_hash_name(ctx), pathname);
 	}
 
-	verify_create_task(ctx);
+	/*
+	 * Whether threads are used is decided once, when the first file
+	 * is enqueued, since settings are not yet loaded at creation time.
+	 */
+
+	if (!ctx->lanes_tried) {
+		ctx->lanes_tried = TRUE;
+		verify_lanes_create(ctx);
+	}
+
+	if (ctx->lanes != NULL) {
+		verify_dispatch(ctx);
+	} else {
+		verify_create_task(ctx);
+	}
 	return inserted;
 }
 
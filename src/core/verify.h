@@ -54,15 +54,27 @@ struct verify;
 typedef gboolean (*verify_callback)(const struct verify *,
 										enum verify_status, void *user_data);
 
+/**
+ * A digest computed by a verification task.
+ *
+ * Each task creates its own computation state with new(), which is then
+ * given to all the other routines.
+ */
 struct verify_hash {
 	const char *	(*name)(void);
-	void 			(*init)(filesize_t amount);
-	int  			(*update)(const void *data, size_t size);
-	int 			(*final)(void);
+	void *			(*new)(void);
+	void			(*free)(void *state);
+	void 			(*init)(void *state, filesize_t amount);
+	int  			(*update)(void *state, const void *data, size_t size);
+	int 			(*final)(void *state);
 };
 
+#define VERIFY_HASH_MAX		4	/**< Max amount of digests for one task */
+
 struct verify *verify_new(const struct verify_hash *);
+struct verify *verify_new_multi(const struct verify_hash * const *, size_t n);
 void verify_free(struct verify **ptr);
+void *verify_hash_state(const struct verify *, const struct verify_hash *);
 
 int verify_enqueue(struct verify *, int high_priority,
 	const char *pathname, filesize_t offset, filesize_t filesize,
@@ -71,6 +83,7 @@ int verify_enqueue(struct verify *, int high_priority,
 enum verify_status verify_status(const struct verify *);
 filesize_t verify_hashed(const struct verify *);
 guint verify_elapsed(const struct verify *);
+void verify_set_uncached(struct verify *, gboolean uncached);
 
 #endif	/* _core_verify_h_ */
 
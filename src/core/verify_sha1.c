@@ -34,9 +34,14 @@
 #include "common.h"
 
 #include "verify.h"
+#include "verify_tth.h"
+
+#include "if/gnet_property.h"
+#include "if/gnet_property_priv.h"
 
 #include "lib/misc.h"
 #include "lib/sha1.h"
+#include "lib/walloc.h"
 
 #include "core/verify_sha1.h"
 
@@ -44,9 +49,13 @@
 
 static struct {
 	struct verify	*verify;
+	struct verify	*bitprint;	/**< Computes SHA-1 and TTH in one pass */
+} verify_sha1;
+
+struct verify_sha1_state {
 	SHA1Context		context;
 	struct sha1		digest;
-} verify_sha1;
+};
 
 static const char *
 verify_sha1_name(void)
@@ -54,36 +63,58 @@ verify_sha1_name(void)
 	return "SHA-1";
 }
 
+static void *
+verify_sha1_new(void)
+{
+	struct verify_sha1_state *vs;
+
+	WALLOC0(vs);
+	return vs;
+}
+
+static void
+verify_sha1_free(void *state)
+{
+	struct verify_sha1_state *vs = state;
+
+	WFREE(vs);
+}
+
 static void
-verify_sha1_reset(filesize_t amount)
+verify_sha1_reset(void *state, filesize_t amount)
 {
+	struct verify_sha1_state *vs = state;
 	int ret;
 
 	(void) amount;
-	ret = SHA1Reset(&verify_sha1.context);
+	ret = SHA1Reset(&vs->context);
 	g_assert(shaSuccess == ret);
 }
 
 static int
-verify_sha1_update(const void *data, size_t size)
+verify_sha1_update(void *state, const void *data, size_t size)
 {
+	struct verify_sha1_state *vs = state;
 	int ret;
 
-	ret = SHA1Input(&verify_sha1.context, data, size);
+	ret = SHA1Input(&vs->context, data, size);
 	return shaSuccess == ret ? 0 : -1;
 }
 
 static int
-verify_sha1_final(void)
+verify_sha1_final(void *state)
 {
+	struct verify_sha1_state *vs = state;
 	int ret;
 
-	ret = SHA1Result(&verify_sha1.context, &verify_sha1.digest);
+	ret = SHA1Result(&vs->context, &vs->digest);
 	return shaSuccess == ret ? 0 : -1;
 }
 
 static const struct verify_hash verify_hash_sha1 = {
 	verify_sha1_name,
+	verify_sha1_new,
+	verify_sha1_free,
 	verify_sha1_reset,
 	verify_sha1_update,
 	verify_sha1_final,
@@ -98,11 +129,33 @@ verify_sha1_enqueue(int high_priority,
 		pathname, 0, filesize, callback, user_data);
 }
 
+/**
+ * Enqueue file for the computation of both its SHA-1 and its TTH, reading
+ * the file only once.
+ *
+ * The callback can then use verify_sha1_digest() and the verify_tth_*()
+ * accessors to get the results.
+ */
+int
+verify_sha1_tth_enqueue(int high_priority,
+	const char *pathname, filesize_t filesize,
+	verify_callback callback, void *user_data)
+{
+	return verify_enqueue(verify_sha1.bitprint, high_priority,
+		pathname, 0, filesize, callback, user_data);
+}
+
 const struct sha1 *
 verify_sha1_digest(const struct verify *ctx)
 {
+	const struct verify_sha1_state *vs;
+
 	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
-	return &verify_sha1.digest;
+
+	vs = verify_hash_state(ctx, &verify_hash_sha1);
+	g_return_val_if_fail(vs != NULL, NULL);
+
+	return &vs->digest;
 }
 
 void
@@ -111,9 +164,26 @@ verify_sha1_init(void)
 	static int initialized;
 
 	if (!initialized) {
+		const struct verify_hash *bitprint[2];
+
 		initialized = TRUE;
 
+		bitprint[0] = &verify_hash_sha1;
+		bitprint[1] = verify_tth_hash();
+
 		verify_sha1.verify = verify_new(&verify_hash_sha1);
+		verify_sha1.bitprint =
+			verify_new_multi(bitprint, G_N_ELEMENTS(bitprint));
+
+		/* Library scans hash whole files that are not read back soon */
+		verify_set_uncached(verify_sha1.bitprint, TRUE);
+
+		if (GNET_PROPERTY(verify_debug)) {
+			double rate;
+			const char *engine = sha1_engine_info(&rate);
+
+			g_debug("SHA-1 hashing with %s engine (%.0f MiB/s)", engine, rate);
+		}
 	}
 }
 
@@ -121,6 +191,7 @@ void
 verify_sha1_close(void)
 {
 	verify_free(&verify_sha1.verify);
+	verify_free(&verify_sha1.bitprint);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -42,6 +42,10 @@ int verify_sha1_enqueue(int high_priority,
 	const char *pathname, filesize_t filesize,
 	verify_callback callback, void *user_data);
 
+int verify_sha1_tth_enqueue(int high_priority,
+	const char *pathname, filesize_t filesize,
+	verify_callback callback, void *user_data);
+
 const struct sha1 *verify_sha1_digest(const struct verify *);
 
 void verify_sha1_init(void);
@@ -53,14 +53,18 @@
 #include "lib/tigertree.h"
 #include "lib/tiger.h"
 #include "lib/tm.h"
+#include "lib/walloc.h"
 
 #include "lib/override.h"		/* Must be the last inclusion */
 
 static struct {
 	struct verify	*verify;
+} verify_tth;
+
+struct verify_tth_state {
 	TTH_CONTEXT		*context;
 	struct tth		digest;
-} verify_tth;
+};
 
 static const char *
 verify_tth_name(void)
@@ -68,52 +72,105 @@ verify_tth_name(void)
 	return "TTH";
 }
 
+static void *
+verify_tth_new(void)
+{
+	struct verify_tth_state *vt;
+
+	WALLOC0(vt);
+	vt->context = halloc(tt_size());
+	return vt;
+}
+
+static void
+verify_tth_free(void *state)
+{
+	struct verify_tth_state *vt = state;
+
+	HFREE_NULL(vt->context);
+	WFREE(vt);
+}
+
 static void
-verify_tth_reset(filesize_t size)
+verify_tth_reset(void *state, filesize_t size)
 {
-	tt_init(verify_tth.context, size);
+	struct verify_tth_state *vt = state;
+
+	tt_init(vt->context, size);
 }
 
 static int
-verify_tth_update(const void *data, size_t size)
+verify_tth_update(void *state, const void *data, size_t size)
 {
-	tt_update(verify_tth.context, data, size);
+	struct verify_tth_state *vt = state;
+
+	tt_update(vt->context, data, size);
 	return 0;
 }
 
 static int
-verify_tth_final(void)
+verify_tth_final(void *state)
 {
-	tt_digest(verify_tth.context, &verify_tth.digest);
+	struct verify_tth_state *vt = state;
+
+	tt_digest(vt->context, &vt->digest);
 	return 0;
 }
 
 static const struct verify_hash verify_hash_tth = {
 	verify_tth_name,
+	verify_tth_new,
+	verify_tth_free,
 	verify_tth_reset,
 	verify_tth_update,
 	verify_tth_final,
 };
 
+/**
+ * @return the TTH digest, for tasks computing several digests at once.
+ */
+const struct verify_hash *
+verify_tth_hash(void)
+{
+	return &verify_hash_tth;
+}
+
+/**
+ * @return the TTH computation state of a completed verification, NULL
+ * if that task did not compute the TTH.
+ */
+static const struct verify_tth_state *
+verify_tth_state(const struct verify *ctx)
+{
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
+	return verify_hash_state(ctx, &verify_hash_tth);
+}
+
 const struct tth *
 verify_tth_digest(const struct verify *ctx)
 {
-	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
-	return &verify_tth.digest;
+	const struct verify_tth_state *vt = verify_tth_state(ctx);
+
+	g_return_val_if_fail(vt != NULL, NULL);
+	return &vt->digest;
 }
 
 const struct tth *
 verify_tth_leaves(const struct verify *ctx)
 {
-	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
-	return tt_leaves(verify_tth.context);
+	const struct verify_tth_state *vt = verify_tth_state(ctx);
+
+	g_return_val_if_fail(vt != NULL, NULL);
+	return tt_leaves(vt->context);
 }
 
 size_t
 verify_tth_leave_count(const struct verify *ctx)
 {
-	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, 0);
-	return tt_leave_count(verify_tth.context);
+	const struct verify_tth_state *vt = verify_tth_state(ctx);
+
+	g_return_val_if_fail(vt != NULL, 0);
+	return tt_leave_count(vt->context);
 }
 
 void
@@ -124,8 +181,15 @@ verify_tth_init(void)
 	if (!initialized) {
 		initialized = TRUE;
 
-		verify_tth.context = halloc(tt_size());
 		verify_tth.verify = verify_new(&verify_hash_tth);
+
+		if (GNET_PROPERTY(verify_debug)) {
+			double rate;
+			const char *engine = tiger_engine_info(&rate);
+
+			g_debug("TTH leaves hashing with %s engine (%.0f MiB/s)",
+				engine, rate);
+		}
 	}
 }
 
@@ -136,7 +200,6 @@ void
 verify_tth_close(void)
 {
 	verify_free(&verify_tth.verify);
-	HFREE_NULL(verify_tth.context);
 }
 
 static gboolean 
@@ -47,6 +47,8 @@ gboolean verify_tth_prepend(const char *pathname,
 		filesize_t offset, filesize_t amount,
 		verify_callback callback, void *user_data);
 
+const struct verify_hash *verify_tth_hash(void);
+
 const struct tth *verify_tth_digest(const struct verify *);
 const struct tth *verify_tth_leaves(const struct verify *);
 size_t verify_tth_leave_count(const struct verify *);
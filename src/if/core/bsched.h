@@ -70,6 +70,8 @@ typedef struct bio_source {
 	guint bw_last_bps;				/**< B/w used last period (bps) */
 	guint bw_fast_ema;				/**< Fast EMA of actual bandwidth used */
 	guint bw_slow_ema;				/**< Slow EMA of actual bandwidth used */
+	guint bw_tick_start;			/**< Value of bw_actual at last refill */
+	int bw_credit;					/**< Credit for refill period (pacing) */
 } bio_source_t;
 
 /*
@@ -80,6 +82,8 @@ typedef struct bio_source {
 #define BIO_F_WRITE			0x00000002	/**< Writing source */
 #define BIO_F_ACTIVE		0x00000004	/**< Source active since b/w scheduled */
 #define BIO_F_USED			0x00000008	/**< Source used this period */
+#define BIO_F_TICKED		0x00000010	/**< Source used since last refill */
+#define BIO_F_BACKLOG		0x00000020	/**< Source capped since last refill */
 
 #define BIO_F_RW			(BIO_F_READ|BIO_F_WRITE)
 
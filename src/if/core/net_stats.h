@@ -313,6 +313,22 @@ typedef enum {
 	GNR_DHT_SUCCESSFUL_PUSH_PROXY_LOOKUPS,
 	GNR_DHT_SUCCESSFUL_NODE_PUSH_ENTRY_LOOKUPS,
 	GNR_DHT_SEEDING_OF_ORPHAN,
+	GNR_QRP_SHARED_TABLE_HITS,
+	GNR_QRP_SHARED_TABLE_MISSES,
+	GNR_QRP_SHARED_ARENAS,
+	GNR_QRP_MERGE_DUPS_SKIPPED,
+	GNR_LOCAL_QUERY_CACHE_HITS,
+	GNR_LOCAL_QUERY_CACHE_MISSES,
+	GNR_FILE_HINT_SEQUENTIAL,
+	GNR_FILE_HINT_WILLNEED_BYTES,
+	GNR_FILE_HINT_DONTNEED_BYTES,
+	GNR_TX_DEFLATE_LEVEL_RAISED,
+	GNR_TX_DEFLATE_LEVEL_LOWERED,
+	GNR_UDP_READ_SYSCALLS,
+	GNR_UDP_READ_DATAGRAMS,
+	GNR_UDP_WRITE_SYSCALLS,
+	GNR_UDP_WRITE_DATAGRAMS,
+	GNR_UDP_WRITE_BATCH_LOST,
 	
 	GNR_TYPE_COUNT /* number of general stats */
 } gnr_stats_t;
@@ -232,6 +232,8 @@ typedef struct gnet_node_status {
 	guint64   tx_written;		/**< Bytes written by the TX stack */
     gboolean tx_compressed;     /**< Is TX traffic compressed */
     float   tx_compression_ratio; /**< TX compression ratio */
+	guint64   tx_deflate_usecs;	/**< Time spent compressing TX (us) */
+	int       tx_deflate_level;	/**< Current TX compression level */
     guint32  tx_bps;			/**< TX traffic rate */
 
 	guint64   rx_given;			/**< Bytes fed to the RX stack (from bottom) */
@@ -1000,6 +1000,32 @@ gboolean gnet_property_variable_log_bad_gnutella     = FALSE;
 static const gboolean gnet_property_variable_log_bad_gnutella_default = FALSE;
 gboolean gnet_property_variable_log_spam_query_hit     = FALSE;
 static const gboolean gnet_property_variable_log_spam_query_hit_default = FALSE;
+guint32  gnet_property_variable_scan_threads     = 4;
+static const guint32  gnet_property_variable_scan_threads_default = 4;
+guint32  gnet_property_variable_hash_threads     = 2;
+static const guint32  gnet_property_variable_hash_threads_default = 2;
+gboolean gnet_property_variable_gnet_deflate_leaf_reduced     = TRUE;
+static const gboolean gnet_property_variable_gnet_deflate_leaf_reduced_default = TRUE;
+gboolean gnet_property_variable_udp_batched_io     = TRUE;
+static const gboolean gnet_property_variable_udp_batched_io_default = TRUE;
+gboolean gnet_property_variable_bw_pacing     = TRUE;
+static const gboolean gnet_property_variable_bw_pacing_default = TRUE;
+guint32  gnet_property_variable_bw_weight_gnet_tcp     = 4;
+static const guint32  gnet_property_variable_bw_weight_gnet_tcp_default = 4;
+guint32  gnet_property_variable_bw_weight_gnet_udp     = 4;
+static const guint32  gnet_property_variable_bw_weight_gnet_udp_default = 4;
+guint32  gnet_property_variable_bw_weight_http     = 2;
+static const guint32  gnet_property_variable_bw_weight_http_default = 2;
+guint32  gnet_property_variable_bw_weight_dht     = 1;
+static const guint32  gnet_property_variable_bw_weight_dht_default = 1;
+gboolean gnet_property_variable_evloop_profiling     = FALSE;
+static const gboolean gnet_property_variable_evloop_profiling_default = FALSE;
+guint32  gnet_property_variable_stall_threshold     = 0;
+static const guint32  gnet_property_variable_stall_threshold_default = 0;
+guint32  gnet_property_variable_tpool_debug     = 0;
+static const guint32  gnet_property_variable_tpool_debug_default = 0;
+guint32  gnet_property_variable_tpool_threads     = 4;
+static const guint32  gnet_property_variable_tpool_threads_default = 4;
 
 static prop_set_t *gnet_property;
 
@@ -9175,6 +9201,254 @@ gnet_prop_init(void) {
     gnet_property->props[428].data.boolean.def   = (void *) &gnet_property_variable_log_spam_query_hit_default;
     gnet_property->props[428].data.boolean.value = (void *) &gnet_property_variable_log_spam_query_hit;
 
+
+    /*
+     * PROP_SCAN_THREADS:
+     *
+     * General data:
+     */
+    gnet_property->props[429].name = "scan_threads";
+    gnet_property->props[429].desc = _("Amount of threads reading the shared directories concurrently during library scans. When set to 0, directories are read by the main thread.");
+    gnet_property->props[429].ev_changed = event_new("scan_threads_changed");
+    gnet_property->props[429].save = TRUE;
+    gnet_property->props[429].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[429].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[429].data.guint32.def   = (void *) &gnet_property_variable_scan_threads_default;
+    gnet_property->props[429].data.guint32.value = (void *) &gnet_property_variable_scan_threads;
+    gnet_property->props[429].data.guint32.choices = NULL;
+    gnet_property->props[429].data.guint32.max   = 64;
+    gnet_property->props[429].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_HASH_THREADS:
+     *
+     * General data:
+     */
+    gnet_property->props[430].name = "hash_threads";
+    gnet_property->props[430].desc = _("Amount of threads computing the SHA-1 and TTH digests of files. When set to 0, files are hashed by the main thread. Changes are taken into account at the next restart.");
+    gnet_property->props[430].ev_changed = event_new("hash_threads_changed");
+    gnet_property->props[430].save = TRUE;
+    gnet_property->props[430].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[430].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[430].data.guint32.def   = (void *) &gnet_property_variable_hash_threads_default;
+    gnet_property->props[430].data.guint32.value = (void *) &gnet_property_variable_hash_threads;
+    gnet_property->props[430].data.guint32.choices = NULL;
+    gnet_property->props[430].data.guint32.max   = 64;
+    gnet_property->props[430].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_GNET_DEFLATE_LEAF_REDUCED:
+     *
+     * General data:
+     */
+    gnet_property->props[431].name = "gnet_deflate_leaf_reduced";
+    gnet_property->props[431].desc = _("When running as an ultrapeer, compress traffic sent to leaves with a reduced window, to save memory on each leaf connection.");
+    gnet_property->props[431].ev_changed = event_new("gnet_deflate_leaf_reduced_changed");
+    gnet_property->props[431].save = TRUE;
+    gnet_property->props[431].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[431].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[431].data.boolean.def   = (void *) &gnet_property_variable_gnet_deflate_leaf_reduced_default;
+    gnet_property->props[431].data.boolean.value = (void *) &gnet_property_variable_gnet_deflate_leaf_reduced;
+
+
+    /*
+     * PROP_UDP_BATCHED_IO:
+     *
+     * General data:
+     */
+    gnet_property->props[432].name = "udp_batched_io";
+    gnet_property->props[432].desc = _("Whether to read and write several UDP datagrams per system call, when the system supports it.");
+    gnet_property->props[432].ev_changed = event_new("udp_batched_io_changed");
+    gnet_property->props[432].save = TRUE;
+    gnet_property->props[432].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[432].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[432].data.boolean.def   = (void *) &gnet_property_variable_udp_batched_io_default;
+    gnet_property->props[432].data.boolean.value = (void *) &gnet_property_variable_udp_batched_io;
+
+
+    /*
+     * PROP_BW_PACING:
+     *
+     * General data:
+     */
+    gnet_property->props[433].name = "bw_pacing";
+    gnet_property->props[433].desc = _("Whether bandwidth is handed out to the traffic shapers in small increments during the second instead of all at once, which smooths the traffic.  Unused bandwidth is then lent to other shapers according to their weight.");
+    gnet_property->props[433].ev_changed = event_new("bw_pacing_changed");
+    gnet_property->props[433].save = TRUE;
+    gnet_property->props[433].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[433].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[433].data.boolean.def   = (void *) &gnet_property_variable_bw_pacing_default;
+    gnet_property->props[433].data.boolean.value = (void *) &gnet_property_variable_bw_pacing;
+
+
+    /*
+     * PROP_BW_WEIGHT_GNET_TCP:
+     *
+     * General data:
+     */
+    gnet_property->props[434].name = "bw_weight_gnet_tcp";
+    gnet_property->props[434].desc = _("Relative weight of Gnutella TCP traffic when sharing unused bandwidth between traffic shapers.");
+    gnet_property->props[434].ev_changed = event_new("bw_weight_gnet_tcp_changed");
+    gnet_property->props[434].save = TRUE;
+    gnet_property->props[434].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[434].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[434].data.guint32.def   = (void *) &gnet_property_variable_bw_weight_gnet_tcp_default;
+    gnet_property->props[434].data.guint32.value = (void *) &gnet_property_variable_bw_weight_gnet_tcp;
+    gnet_property->props[434].data.guint32.choices = NULL;
+    gnet_property->props[434].data.guint32.max   = 100;
+    gnet_property->props[434].data.guint32.min   = 1;
+
+
+    /*
+     * PROP_BW_WEIGHT_GNET_UDP:
+     *
+     * General data:
+     */
+    gnet_property->props[435].name = "bw_weight_gnet_udp";
+    gnet_property->props[435].desc = _("Relative weight of Gnutella UDP traffic when sharing unused bandwidth between traffic shapers.");
+    gnet_property->props[435].ev_changed = event_new("bw_weight_gnet_udp_changed");
+    gnet_property->props[435].save = TRUE;
+    gnet_property->props[435].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[435].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[435].data.guint32.def   = (void *) &gnet_property_variable_bw_weight_gnet_udp_default;
+    gnet_property->props[435].data.guint32.value = (void *) &gnet_property_variable_bw_weight_gnet_udp;
+    gnet_property->props[435].data.guint32.choices = NULL;
+    gnet_property->props[435].data.guint32.max   = 100;
+    gnet_property->props[435].data.guint32.min   = 1;
+
+
+    /*
+     * PROP_BW_WEIGHT_HTTP:
+     *
+     * General data:
+     */
+    gnet_property->props[436].name = "bw_weight_http";
+    gnet_property->props[436].desc = _("Relative weight of HTTP traffic when sharing unused bandwidth between traffic shapers.");
+    gnet_property->props[436].ev_changed = event_new("bw_weight_http_changed");
+    gnet_property->props[436].save = TRUE;
+    gnet_property->props[436].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[436].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[436].data.guint32.def   = (void *) &gnet_property_variable_bw_weight_http_default;
+    gnet_property->props[436].data.guint32.value = (void *) &gnet_property_variable_bw_weight_http;
+    gnet_property->props[436].data.guint32.choices = NULL;
+    gnet_property->props[436].data.guint32.max   = 100;
+    gnet_property->props[436].data.guint32.min   = 1;
+
+
+    /*
+     * PROP_BW_WEIGHT_DHT:
+     *
+     * General data:
+     */
+    gnet_property->props[437].name = "bw_weight_dht";
+    gnet_property->props[437].desc = _("Relative weight of DHT traffic when sharing unused bandwidth between traffic shapers.");
+    gnet_property->props[437].ev_changed = event_new("bw_weight_dht_changed");
+    gnet_property->props[437].save = TRUE;
+    gnet_property->props[437].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[437].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[437].data.guint32.def   = (void *) &gnet_property_variable_bw_weight_dht_default;
+    gnet_property->props[437].data.guint32.value = (void *) &gnet_property_variable_bw_weight_dht;
+    gnet_property->props[437].data.guint32.choices = NULL;
+    gnet_property->props[437].data.guint32.max   = 100;
+    gnet_property->props[437].data.guint32.min   = 1;
+
+
+    /*
+     * PROP_EVLOOP_PROFILING:
+     *
+     * General data:
+     */
+    gnet_property->props[438].name = "evloop_profiling";
+    gnet_property->props[438].desc = _("Whether the time spent in each I/O handler, callout queue event and background task step, as well as the duration of main loop iterations, should be measured. This is what the shell perf command reports.");
+    gnet_property->props[438].ev_changed = event_new("evloop_profiling_changed");
+    gnet_property->props[438].save = TRUE;
+    gnet_property->props[438].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[438].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[438].data.boolean.def   = (void *) &gnet_property_variable_evloop_profiling_default;
+    gnet_property->props[438].data.boolean.value = (void *) &gnet_property_variable_evloop_profiling;
+
+
+    /*
+     * PROP_STALL_THRESHOLD:
+     *
+     * General data:
+     */
+    gnet_property->props[439].name = "stall_threshold";
+    gnet_property->props[439].desc = _("Report main loop iterations lasting longer than this amount of milliseconds, along with the stack captured while the loop was stalled. Set to 0 to disable stall detection.");
+    gnet_property->props[439].ev_changed = event_new("stall_threshold_changed");
+    gnet_property->props[439].save = TRUE;
+    gnet_property->props[439].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[439].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[439].data.guint32.def   = (void *) &gnet_property_variable_stall_threshold_default;
+    gnet_property->props[439].data.guint32.value = (void *) &gnet_property_variable_stall_threshold;
+    gnet_property->props[439].data.guint32.choices = NULL;
+    gnet_property->props[439].data.guint32.max   = 60000;
+    gnet_property->props[439].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_TPOOL_DEBUG:
+     *
+     * General data:
+     */
+    gnet_property->props[440].name = "tpool_debug";
+    gnet_property->props[440].desc = _("Debug level for the thread pool.");
+    gnet_property->props[440].ev_changed = event_new("tpool_debug_changed");
+    gnet_property->props[440].save = TRUE;
+    gnet_property->props[440].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[440].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[440].data.guint32.def   = (void *) &gnet_property_variable_tpool_debug_default;
+    gnet_property->props[440].data.guint32.value = (void *) &gnet_property_variable_tpool_debug;
+    gnet_property->props[440].data.guint32.choices = NULL;
+    gnet_property->props[440].data.guint32.max   = 20;
+    gnet_property->props[440].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_TPOOL_THREADS:
+     *
+     * General data:
+     */
+    gnet_property->props[441].name = "tpool_threads";
+    gnet_property->props[441].desc = _("Amount of worker threads running CPU-intensive jobs on behalf of the main thread. When set to 0, these jobs are run by the main thread.");
+    gnet_property->props[441].ev_changed = event_new("tpool_threads_changed");
+    gnet_property->props[441].save = TRUE;
+    gnet_property->props[441].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[441].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[441].data.guint32.def   = (void *) &gnet_property_variable_tpool_threads_default;
+    gnet_property->props[441].data.guint32.value = (void *) &gnet_property_variable_tpool_threads;
+    gnet_property->props[441].data.guint32.choices = NULL;
+    gnet_property->props[441].data.guint32.max   = 256;
+    gnet_property->props[441].data.guint32.min   = 0;
+
     gnet_property->byName = g_hash_table_new(g_str_hash, g_str_equal);
     for (n = 0; n < GNET_PROPERTY_NUM; n ++) {
         g_hash_table_insert(gnet_property->byName,
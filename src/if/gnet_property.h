@@ -465,6 +465,19 @@ typedef enum {
     PROP_LOG_GNUTELLA_ROUTING,
     PROP_LOG_BAD_GNUTELLA,
     PROP_LOG_SPAM_QUERY_HIT,
+    PROP_SCAN_THREADS,
+    PROP_HASH_THREADS,
+    PROP_GNET_DEFLATE_LEAF_REDUCED,
+    PROP_UDP_BATCHED_IO,
+    PROP_BW_PACING,
+    PROP_BW_WEIGHT_GNET_TCP,
+    PROP_BW_WEIGHT_GNET_UDP,
+    PROP_BW_WEIGHT_HTTP,
+    PROP_BW_WEIGHT_DHT,
+    PROP_EVLOOP_PROFILING,
+    PROP_STALL_THRESHOLD,
+    PROP_TPOOL_DEBUG,
+    PROP_TPOOL_THREADS,
     GNET_PROPERTY_END
 } gnet_property_t;
 
@@ -478,6 +478,19 @@ extern const gboolean gnet_property_variable_log_new_gnutella;
 extern const gboolean gnet_property_variable_log_gnutella_routing;
 extern const gboolean gnet_property_variable_log_bad_gnutella;
 extern const gboolean gnet_property_variable_log_spam_query_hit;
+extern const guint32  gnet_property_variable_scan_threads;
+extern const guint32  gnet_property_variable_hash_threads;
+extern const gboolean gnet_property_variable_gnet_deflate_leaf_reduced;
+extern const gboolean gnet_property_variable_udp_batched_io;
+extern const gboolean gnet_property_variable_bw_pacing;
+extern const guint32  gnet_property_variable_bw_weight_gnet_tcp;
+extern const guint32  gnet_property_variable_bw_weight_gnet_udp;
+extern const guint32  gnet_property_variable_bw_weight_http;
+extern const guint32  gnet_property_variable_bw_weight_dht;
+extern const gboolean gnet_property_variable_evloop_profiling;
+extern const guint32  gnet_property_variable_stall_threshold;
+extern const guint32  gnet_property_variable_tpool_debug;
+extern const guint32  gnet_property_variable_tpool_threads;
 
 
 prop_set_t *gnet_prop_init(void);
@@ -39,6 +39,7 @@
 
 #include "bg.h"
 #include "cq.h"
+#include "evperf.h"
 #include "misc.h"
 #include "tm.h"
 #include "walloc.h"
@@ -125,7 +126,8 @@ enum {
 	TASK_F_NOTICK	=	1 << 4,	/**< Do no recompute tick info */
 	TASK_F_SLEEPING	=	1 << 5,	/**< Task is sleeping */
 	TASK_F_RUNNABLE	=	1 << 6,	/**< Task is runnable */
-	TASK_F_DAEMON	=	1 << 7	/**< Task is a daemon */
+	TASK_F_DAEMON	=	1 << 7,	/**< Task is a daemon */
+	TASK_F_SLEEP	=	1 << 8	/**< Sleep once current step returns */
 };
 
 static inline void
@@ -968,6 +970,49 @@ bg_ticker_adjust_period(void)
 	}
 }
 
+/**
+ * Put the running task to sleep once its current step returns BGR_MORE,
+ * until bg_task_wakeup() is called.
+ *
+ * This is meant for steps waiting for an external event, which would
+ * otherwise be scheduled repeatedly just to find there is nothing to do.
+ */
+void
+bg_task_sleep(struct bgtask *bt)
+{
+	bg_task_check(bt);
+	g_assert(bt->flags & TASK_F_RUNNING);
+	g_assert(!(bt->flags & TASK_F_DAEMON));
+
+	bt->flags |= TASK_F_SLEEP;
+}
+
+/**
+ * Wake up task put to sleep by bg_task_sleep(), or cancel its pending
+ * sleep if the current step has not returned yet.
+ *
+ * Nothing is done if the task is not sleeping.
+ */
+void
+bg_task_wakeup(struct bgtask *bt)
+{
+	bg_task_check(bt);
+	g_assert(!(bt->flags & TASK_F_DAEMON));
+
+	if (bt->flags & TASK_F_EXITED)
+		return;
+
+	bt->flags &= ~TASK_F_SLEEP;
+
+	if (bt->flags & TASK_F_SLEEPING) {
+		if (bg_debug > 1)
+			g_debug("BGTASK waking up \"%s\"", bt->name);
+
+		bg_sched_wakeup(bt);
+		bg_ticker_adjust_period();
+	}
+}
+
 /**
  * Main task scheduling timer.
  */
@@ -1113,7 +1158,20 @@ bg_sched_timer(void *unused_arg)
 
 		g_assert(bt->step < bt->stepcnt);
 
-		ret = (*bt->stepvec[bt->step])(bt, bt->ucontext, ticks);
+		if (G_UNLIKELY(evperf_is_enabled())) {
+			bgstep_cb_t step = bt->stepvec[bt->step];
+			struct evperf_mark mark;
+
+			/*
+			 * Should the task exit via bg_task_exit(), the measure is lost.
+			 */
+
+			evperf_begin(&mark);
+			ret = (*step)(bt, bt->ucontext, ticks);
+			evperf_end(&mark, EVPERF_BGTASK, func_to_pointer(step));
+		} else {
+			ret = (*bt->stepvec[bt->step])(bt, bt->ucontext, ticks);
+		}
 
 		bg_task_switch(NULL, target);	/* Stop current task, update stats */
 		if (bg_debug > 0 && remain < bt->elapsed) {
@@ -1145,9 +1203,17 @@ bg_sched_timer(void *unused_arg)
 				bt->step++;
 				bt->tick_cost = 0.0;	/* Don't know cost of this new step */
 			}
+			bt->flags &= ~TASK_F_SLEEP;	/* Only honoured on BGR_MORE */
 			break;
 		case BGR_MORE:
 			bt->seqno++;
+			if (bt->flags & TASK_F_SLEEP) {
+				if (bg_debug > 1)
+					g_debug("BGTASK \"%s\" going to sleep", bt->name);
+
+				bt->flags &= ~TASK_F_SLEEP;
+				bg_sched_sleep(bt);
+			}
 			break;
 		case BGR_ERROR:
 			bt->exitcode = -1;		/* Fake an exit(-1) */
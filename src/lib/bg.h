@@ -121,6 +121,8 @@ void bg_daemon_enqueue(struct bgtask *h, gpointer item);
 void bg_task_cancel(struct bgtask *h);
 void bg_task_exit(struct bgtask *h, int code) G_GNUC_NORETURN;
 void bg_task_ticks_used(struct bgtask *h, int used);
+void bg_task_sleep(struct bgtask *h);
+void bg_task_wakeup(struct bgtask *h);
 bgsig_cb_t bg_task_signal(struct bgtask *h, bgsig_t sig, bgsig_cb_t handler);
 
 int bg_task_seqno(const struct bgtask *h);
@@ -237,4 +237,22 @@ compat_fadvise_dontneed(int fd, fileoffset_t offset, fileoffset_t size)
 #endif	/* HAS_POSIX_FADVISE */
 }
 
+/**
+ * Ask the kernel to start reading the given range in the background.
+ *
+ * Unlike readahead(2), this does not block the caller until the data
+ * has been brought into the page cache.
+ */
+void
+compat_fadvise_willneed(int fd, fileoffset_t offset, fileoffset_t size)
+{
+#ifdef HAS_POSIX_FADVISE
+	compat_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+#else
+	(void) fd;
+	(void) offset;
+	(void) size;
+#endif	/* HAS_POSIX_FADVISE */
+}
+
 /* vi: set ts=4 sw=4 cindent: */
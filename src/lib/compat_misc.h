@@ -44,6 +44,7 @@ gboolean compat_process_is_alive(pid_t pid);
 void compat_fadvise_sequential(int fd, fileoffset_t offset, fileoffset_t size);
 void compat_fadvise_noreuse(int fd, fileoffset_t offset, fileoffset_t size);
 void compat_fadvise_dontneed(int fd, fileoffset_t offset, fileoffset_t size);
+void compat_fadvise_willneed(int fd, fileoffset_t offset, fileoffset_t size);
 void *compat_memmem(const void *data, size_t data_size,
 		const void *pattern, size_t pattern_size);
 
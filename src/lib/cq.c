@@ -36,13 +36,19 @@
 
 #include "atoms.h"
 #include "cq.h"
+#include "evperf.h"
 #include "glib-missing.h"
 #include "misc.h"
+#include "pow2.h"
+#include "random.h"
 #include "tm.h"
 #include "walloc.h"
 #include "override.h"		/* Must be the last header included */
 
 static void cq_run_idle(cqueue_t *cq);
+static void cq_subqueue_catchup(cqueue_t *cq);
+static void cq_subqueue_rearm(cqueue_t *cq, const cevent_t *ev);
+static void cq_expire_profiled(cevent_t *ev);
 
 static const guint32 *cq_debug_ptr;
 static inline guint32 cq_debug(void) { return *cq_debug_ptr; }
@@ -54,8 +60,9 @@ enum cevent_magic { CEVENT_MAGIC = 0x40110172U };
  */
 struct cevent {
 	enum cevent_magic ce_magic;	/**< Magic number (must be at the top) */
-	struct cevent *ce_bnext;	/**< Next item in hash bucket */
-	struct cevent *ce_bprev;	/**< Prev item in hash bucket */
+	struct cevent *ce_bnext;	/**< Next item in wheel slot */
+	struct cevent *ce_bprev;	/**< Prev item in wheel slot */
+	struct cslot *ce_slot;		/**< Wheel slot where event is linked */
 	cqueue_t *ce_cq;			/**< Callout queue where event is registered */
 	cq_service_t ce_fn;			/**< Callback routine */
 	gpointer ce_arg;			/**< Argument to pass to said callback */
@@ -74,18 +81,25 @@ cevent_check(const struct cevent * const ce)
  *
  * Callout queue descriptor.
  *
- * A callout queue is really a sorted linked list of events that are to
- * happen in the near future, most recent coming first.
+ * A callout queue is really a set of events that are to happen in the near
+ * future.  Since there can be hundreds of thousands of them, insertion,
+ * cancellation and rescheduling must not depend on the amount of events
+ * already recorded.
  *
- * Naturally, the insertion/deletion of items has to be relatively efficient.
- * We don't want to go through all the items in the list to find the proper
- * position for insertion.
+ * To do that, events are kept in a hierarchical timing wheel.  Time is cut
+ * into slots of 2^WHEEL_RES units.  The wheel has WHEEL_LEVELS levels of
+ * WHEEL_SIZE slots each: level 0 holds the events due within the next
+ * WHEEL_SIZE time slots, one slot per time slot; level 1 holds the events
+ * due within the next WHEEL_SIZE^2 time slots, each of its slots covering
+ * WHEEL_SIZE time slots, and so on.  Linking an event is therefore merely
+ * appending it to the proper slot list, and unlinking it is a plain removal
+ * from a doubly-linked list.
  *
- * To do that, we maintain a parallel hash list of all the events, each event
- * being inserted in the bucket i, where i is computed by abs_time % size,
- * abs_time being the absolute time where the event is to be triggered
- * and size being the size of the hash list. All the items under the bucket
- * list are further sorted by increasing trigger time.
+ * Each time the level 0 wraps around, the next slot of level 1 is cascaded,
+ * i.e. its events are redistributed into level 0 where they now belong.
+ * The same happens between all the other levels.  A bitmap of non-empty
+ * slots lets cq_clock() jump directly to the next slot requiring attention,
+ * so that the cost of a clock run does not depend on the elapsed time.
  *
  * To be completely generic, the callout queue "absolute time" is a mere
  * unsigned long value. It can represent an amount of ms, or an amount of
@@ -94,11 +108,30 @@ cevent_check(const struct cevent * const ce)
  * regular intervals and giving it the "elasped time" since the last call.
  */
 
-struct chash {
-	cevent_t *ch_head;			/**< Bucket list head */
-	cevent_t *ch_tail;			/**< Bucket list tail */
+struct cslot {
+	cevent_t *cs_head;			/**< Slot list head */
+	cevent_t *cs_tail;			/**< Slot list tail */
 };
 
+/*
+ * The wheel time slot is 2^5 or 32 units.  This means our time resolution
+ * is at least 32 units: events whose trigger time falls within the same
+ * time slot are not sorted and simply fire in their insertion order.
+ *
+ * With 4 levels of 256 slots, the wheel covers 2^37 units, which is more
+ * than 4 years when the time unit is the millisecond.  Events further away
+ * than that are parked in the farthest slot and cascaded again from there.
+ */
+#define WHEEL_RES		5		/**< Log2 of time slot duration */
+#define WHEEL_BITS		8		/**< Log2 of amount of slots per level */
+#define WHEEL_LEVELS	4		/**< Amount of levels in the wheel */
+
+#define WHEEL_SIZE		(1U << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_SLOTS		(WHEEL_LEVELS * WHEEL_SIZE)
+#define WHEEL_SPAN		((cq_time_t) 1 << (WHEEL_LEVELS * WHEEL_BITS))
+#define WHEEL_MAPLEN	(WHEEL_SLOTS / 32)
+
 enum cqueue_magic  {
 	CQUEUE_MAGIC    = 0x140332ddU,
 	CSUBQUEUE_MAGIC = 0x64d037feU
@@ -108,15 +141,19 @@ struct cqueue {
 	enum cqueue_magic cq_magic;
 	tm_t cq_last_heartbeat;		/**< Real time of last heartbeat */
 	cq_time_t cq_time;			/**< "current time" */
+	cq_time_t cq_tick;			/**< Time slot reached by the wheel */
 	const char *cq_name;		/**< Queue name, for logging */
-	struct chash *cq_hash;		/**< Array of buckets for hash list */
-	struct chash *cq_current;	/**< Current bucket scanned in cq_clock() */
+	struct cslot *cq_wheel;		/**< Wheel slots, level after level */
+	struct cslot *cq_current;	/**< Expired events, during cq_clock() */
+	struct cslot cq_expired;	/**< Events being expired by cq_clock() */
 	GHashTable *cq_periodic;	/**< Periodic events registered */
 	GHashTable *cq_idle;		/**< Idle events registered */
+	guint32 cq_map[WHEEL_MAPLEN];	/**< Bitmap of non-empty wheel slots */
 	int cq_ticks;				/**< Number of cq_clock() calls processed */
 	int cq_items;				/**< Amount of recorded events */
-	int cq_last_bucket;			/**< Last bucket slot we were at */
 	int cq_period;				/**< Regular callout period, in ms */
+	int cq_sleep;				/**< Expected delay until next heartbeat */
+	unsigned cq_sleeping:1;		/**< Sub-queue heartbeat is deferred */
 };
 
 static inline void
@@ -126,18 +163,6 @@ cqueue_check(const struct cqueue * const cq)
 	g_assert(CQUEUE_MAGIC == cq->cq_magic || CSUBQUEUE_MAGIC == cq->cq_magic);
 }
 
-#define HASH_SIZE	2048		/**< Hash list size, must be a power of 2 */
-#define HASH_MASK	(HASH_SIZE - 1)
-
-/*
- * The hashing function divides the time by 2^5 or 32, to avoid cq_clock()
- * scanning too many hash buckets each time.  This means our time resolution
- * is at least 32 units.  If we increment cq_clock() with milliseconds, we
- * won't trigger any queue run unless at least 32 milliseconds have elapsed.
- */
-#define EV_HASH(x) (((x) >> 5) & HASH_MASK)
-#define EV_OVER(x) (((x) >> 5) & ~HASH_MASK)
-
 cqueue_t *callout_queue;
 
 /**
@@ -153,18 +178,20 @@ static cqueue_t *
 cq_initialize(cqueue_t *cq, const char *name, cq_time_t now, int period)
 {
 	/*
-	 * The cq_hash hash list is used to speed up insert/delete operations.
+	 * The cq_wheel slots are used to speed up insert/delete operations.
 	 */
 
 	cq->cq_magic = CQUEUE_MAGIC;
 	cq->cq_name = atom_str_get(name);
-	cq->cq_hash = g_malloc0(HASH_SIZE * sizeof *cq->cq_hash);
+	cq->cq_wheel = g_malloc0(WHEEL_SLOTS * sizeof *cq->cq_wheel);
 	cq->cq_items = 0;
 	cq->cq_ticks = 0;
 	cq->cq_time = now;
-	cq->cq_last_bucket = EV_HASH(now);
+	cq->cq_tick = now >> WHEEL_RES;
 	cq->cq_current = NULL;
 	cq->cq_period = period;
+	cq->cq_sleep = period;
+	tm_now_exact(&cq->cq_last_heartbeat);
 
 	cqueue_check(cq);
 	return cq;
@@ -215,15 +242,95 @@ cq_name(const cqueue_t *cq)
 	return cq->cq_name;
 }
 
+/**
+ * Flag wheel slot as holding events.
+ */
+static inline void
+cq_map_set(cqueue_t *cq, unsigned i)
+{
+	cq->cq_map[i >> 5] |= 1U << (i & 0x1f);
+}
+
+/**
+ * Flag wheel slot as being empty.
+ */
+static inline void
+cq_map_clear(cqueue_t *cq, unsigned i)
+{
+	cq->cq_map[i >> 5] &= ~(1U << (i & 0x1f));
+}
+
+/**
+ * Look for the next non-empty slot in a wheel level, moving forward from
+ * the given slot index and wrapping around.
+ *
+ * @param cq		the callout queue
+ * @param level		the wheel level to look at
+ * @param idx		the slot index to start from (excluded until wrapped)
+ *
+ * @return the distance to the next non-empty slot, between 1 and
+ * WHEEL_SIZE, or 0 if the whole level is empty.
+ */
+static unsigned
+cq_map_next(const cqueue_t *cq, unsigned level, unsigned idx)
+{
+	const guint32 *map = &cq->cq_map[level * (WHEEL_SIZE / 32)];
+	unsigned n = 1;
+
+	while (n <= WHEEL_SIZE) {
+		unsigned s = (idx + n) & WHEEL_MASK;
+		guint32 w = map[s >> 5] >> (s & 0x1f);
+
+		/*
+		 * Bits past ``idx'' in the last word were already looked at when
+		 * we started, hence the returned distance cannot exceed WHEEL_SIZE.
+		 */
+
+		if (w != 0)
+			return n + highest_bit_set(w & (~w + 1));
+
+		n += 32 - (s & 0x1f);
+	}
+
+	return 0;
+}
+
+/**
+ * Compute the wheel slot where an event triggering at the given time must
+ * be linked, based on how far it is from the current wheel time slot.
+ */
+static struct cslot *
+cq_wheel_slot(cqueue_t *cq, cq_time_t when)
+{
+	cq_time_t t = when >> WHEEL_RES;
+	cq_time_t delta;
+	unsigned level;
+
+	g_assert(t >= cq->cq_tick);
+
+	delta = t - cq->cq_tick;
+
+	if (delta >= WHEEL_SPAN) {
+		t = cq->cq_tick + WHEEL_SPAN - 1;
+		delta = WHEEL_SPAN - 1;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < (cq_time_t) 1 << ((level + 1) * WHEEL_BITS))
+			break;
+	}
+
+	return &cq->cq_wheel[level * WHEEL_SIZE +
+		((t >> (level * WHEEL_BITS)) & WHEEL_MASK)];
+}
+
 /**
  * Link event into the callout queue.
  */
 static void
 ev_link(cevent_t *ev)
 {
-	struct chash *ch;		/* Hashing bucket */
-	cq_time_t trigger;		/* Trigger time */
-	cevent_t *hev;			/* To loop through the hash bucket */
+	struct cslot *cs;		/* Wheel slot */
 	cqueue_t *cq;
 
 	cevent_check(ev);
@@ -232,83 +339,39 @@ ev_link(cevent_t *ev)
 	cqueue_check(cq);
 	g_assert(ev->ce_time > cq->cq_time || cq->cq_current);
 
-	trigger = ev->ce_time;
 	cq->cq_items++;
 
 	/*
 	 * Important corner case: we may be rescheduling an event BEFORE
-	 * the current clock time, in which case we must insert the event
-	 * in the current bucket, so it gets fired during the current
+	 * the current clock time, in which case we must append the event to
+	 * the list of expired events, so it gets fired during the current
 	 * cq_clock() run.
 	 */
 
-	if (trigger <= cq->cq_time)
-		ch = cq->cq_current;
-	else
-		ch = &cq->cq_hash[EV_HASH(trigger)];
-
-	g_assert(ch);
-
-	/*
-	 * If bucket is empty, the event is the new head.
-	 */
-
-	if (ch->ch_head == NULL) {
-		g_assert(ch->ch_tail == NULL);
-		ch->ch_tail = ch->ch_head = ev;
-		ev->ce_bnext = ev->ce_bprev = NULL;
-		return;
+	if (ev->ce_time <= cq->cq_time) {
+		cs = cq->cq_current;
+	} else {
+		cs = cq_wheel_slot(cq, ev->ce_time);
+		cq_map_set(cq, cs - cq->cq_wheel);
 	}
 
-	g_assert(ch->ch_tail);
-
-	/*
-	 * If item is larger than the tail, insert at the end right away.
-	 */
-
-	hev = ch->ch_tail;
-
-	g_assert(hev->ce_bnext == NULL);
-
-	if (trigger >= hev->ce_time) {
-		hev->ce_bnext = ev;
-		ev->ce_bnext = NULL;
-		ev->ce_bprev = hev;
-		ch->ch_tail = ev;
-		return;
-	}
+	g_assert(cs);
 
 	/*
-	 * If item is smaller than the head...
+	 * Slots are not sorted: append to the tail so that events scheduled
+	 * for the same time fire in the order they were inserted.
 	 */
 
-	hev = ch->ch_head;
+	ev->ce_slot = cs;
+	ev->ce_bnext = NULL;
+	ev->ce_bprev = cs->cs_tail;
 
-	g_assert(hev->ce_bprev == NULL);
-
-	if (trigger < hev->ce_time) {
-		hev->ce_bprev = ev;
-		ev->ce_bnext = hev;
-		ev->ce_bprev = NULL;
-		ch->ch_head = ev;
-		return;
-	}
-
-	/*
-	 * Insert before the first item whose trigger will come after ours.
-	 */
-
-	for (hev = hev->ce_bnext; hev; hev = hev->ce_bnext) {
-		if (trigger < hev->ce_time) {
-			hev->ce_bprev->ce_bnext = ev;
-			ev->ce_bprev = hev->ce_bprev;
-			hev->ce_bprev = ev;
-			ev->ce_bnext = hev;
-			return;
-		}
-	}
+	if (cs->cs_tail != NULL)
+		cs->cs_tail->ce_bnext = ev;
+	else
+		cs->cs_head = ev;
 
-	g_assert_not_reached();	/* Must have found an event to insert before */
+	cs->cs_tail = ev;
 }
 
 /**
@@ -317,32 +380,35 @@ ev_link(cevent_t *ev)
 static void
 ev_unlink(cevent_t *ev)
 {
-	struct chash *ch;			/* Hashing bucket */
+	struct cslot *cs;			/* Wheel slot */
 	cqueue_t *cq;
 
 	cevent_check(ev);
 	cq = ev->ce_cq;
 	cqueue_check(cq);
 
-	ch = &cq->cq_hash[EV_HASH(ev->ce_time)];
+	cs = ev->ce_slot;
 	cq->cq_items--;
 
-	/*
-	 * Unlinking the item is straigthforward, unlike insertion!
-	 */
-
-	if (ch->ch_head == ev)
-		ch->ch_head = ev->ce_bnext;
-	if (ch->ch_tail == ev)
-		ch->ch_tail = ev->ce_bprev;
+	g_assert(cs);
 
 	if (ev->ce_bprev)
 		ev->ce_bprev->ce_bnext = ev->ce_bnext;
+	else
+		cs->cs_head = ev->ce_bnext;
+
 	if (ev->ce_bnext)
 		ev->ce_bnext->ce_bprev = ev->ce_bprev;
+	else
+		cs->cs_tail = ev->ce_bprev;
+
+	if (NULL == cs->cs_head && cs != &cq->cq_expired)
+		cq_map_clear(cq, cs - cq->cq_wheel);
 
-	g_assert(ch->ch_head == NULL || ch->ch_head->ce_bprev == NULL);
-	g_assert(ch->ch_tail == NULL || ch->ch_tail->ce_bnext == NULL);
+	ev->ce_slot = NULL;
+
+	g_assert(cs->cs_head == NULL || cs->cs_head->ce_bprev == NULL);
+	g_assert(cs->cs_tail == NULL || cs->cs_tail->ce_bnext == NULL);
 }
 
 /**
@@ -369,6 +435,9 @@ cq_insert(cqueue_t *cq, int delay, cq_service_t fn, gpointer arg)
 	g_assert(fn);
 	g_assert(delay >= 0);
 
+	if (cq->cq_sleeping)
+		cq_subqueue_catchup(cq);
+
 	WALLOC(ev);
 	ev->ce_magic = CEVENT_MAGIC;
 	ev->ce_time = cq->cq_time + delay;
@@ -378,6 +447,9 @@ cq_insert(cqueue_t *cq, int delay, cq_service_t fn, gpointer arg)
 
 	ev_link(ev);
 
+	if (cq->cq_sleeping)
+		cq_subqueue_rearm(cq, ev);
+
 	return ev;
 }
 
@@ -435,19 +507,24 @@ cq_resched(cevent_t *ev, int delay)
 	g_assert(ev->ce_time > cq->cq_time || cq->cq_current);
 
 	/*
-	 * Events are sorted into the callout queue by trigger time, and are also
-	 * put into an hash list depending on that trigger time.
+	 * Events are put into a wheel slot depending on their trigger time.
 	 *
 	 * Therefore, since we are updating the trigger time, we need to remove
-	 * the event from the queue lists first, update the firing delay, and relink
+	 * the event from its slot first, update the firing delay, and relink
 	 * the event. It's possible that it will end up being relinked at the exact
 	 * same place, but determining that in advance would probably cost as much
 	 * as doing the unlink/link blindly anyway.
 	 */
 
+	if (cq->cq_sleeping)
+		cq_subqueue_catchup(cq);
+
 	ev_unlink(ev);
 	ev->ce_time = cq->cq_time + delay;
 	ev_link(ev);
+
+	if (cq->cq_sleeping)
+		cq_subqueue_rearm(cq, ev);
 }
 
 /**
@@ -499,91 +576,199 @@ cq_expire(cevent_t *ev)
 }
 
 /**
- * The heartbeat of our callout queue.
+ * Expire all the events held in the wheel slot, provided their trigger
+ * time has been reached.  Those due later are linked back into the wheel.
  *
- * Called to notify us about the elapsed "time" so that we can expire timeouts
- * and maintain our notion of "current time".
- *
- * NB: The time maintained by the callout queue is "virtual".  It's the
- * elapased delay given by regular calls to cq_clock() that define its unit.
- * For gtk-gnutella, the time unit is the millisecond.
+ * @return the amount of events triggered.
  */
-void
-cq_clock(cqueue_t *cq, int elapsed)
+static int
+cq_expire_slot(cqueue_t *cq, struct cslot *cs)
 {
-	int bucket;
-	int last_bucket;
-	struct chash *ch;
+	struct cslot *ex = &cq->cq_expired;
 	cevent_t *ev;
-	cq_time_t now;
 	int processed = 0;
 
-	cqueue_check(cq);
-	g_assert(elapsed >= 0);
-	g_assert(cq->cq_current == NULL);
-
-	cq->cq_ticks++;
-	cq->cq_time += elapsed;
-	now = cq->cq_time;
-
-	bucket = cq->cq_last_bucket;		/* Bucket we traversed last time */
-	ch = &cq->cq_hash[bucket];
-	last_bucket = EV_HASH(now);			/* Last bucket to traverse now */
+	g_assert(cq->cq_current == ex);
 
 	/*
-	 * If `elapsed' has overflowed the hash size, then we'll need to look at
-	 * all the buckets in the table (wrap around).
+	 * Move the whole slot to the list of expired events, which is where
+	 * events rescheduled in the past by the callbacks we trigger will also
+	 * be appended, so that they get fired during this run as well.
 	 */
 
-	if (EV_OVER(elapsed))
-		last_bucket = bucket;
+	if (cs->cs_head != NULL) {
+		for (ev = cs->cs_head; ev != NULL; ev = ev->ce_bnext)
+			ev->ce_slot = ex;
 
+		if (ex->cs_tail != NULL) {
+			ex->cs_tail->ce_bnext = cs->cs_head;
+			cs->cs_head->ce_bprev = ex->cs_tail;
+		} else {
+			ex->cs_head = cs->cs_head;
+		}
+		ex->cs_tail = cs->cs_tail;
+		cs->cs_head = cs->cs_tail = NULL;
+		cq_map_clear(cq, cs - cq->cq_wheel);
+	}
+
+	while (NULL != (ev = ex->cs_head)) {
+		if (ev->ce_time <= cq->cq_time) {
+			if (G_UNLIKELY(evperf_is_enabled()))
+				cq_expire_profiled(ev);
+			else
+				cq_expire(ev);
+			processed++;
+		} else {
+			ev_unlink(ev);
+			ev_link(ev);
+		}
+	}
+
+	return processed;
+}
+
+/**
+ * Cascade the current slot of a wheel level, redistributing its events
+ * into the lower levels.
+ */
+static void
+cq_wheel_cascade(cqueue_t *cq, unsigned level)
+{
+	struct cslot *cs;
+	cevent_t *ev;
+
+	cs = &cq->cq_wheel[level * WHEEL_SIZE +
+		((cq->cq_tick >> (level * WHEEL_BITS)) & WHEEL_MASK)];
+
+	while (NULL != (ev = cs->cs_head)) {
+		ev_unlink(ev);
+		ev_link(ev);
+	}
+}
+
+/**
+ * Compute the next wheel time slot that needs to be visited, i.e. either
+ * a level 0 slot holding events, or the start of a higher level slot that
+ * must be cascaded.
+ *
+ * @param cq		the callout queue
+ * @param target	the time slot we are moving to
+ *
+ * @return the next time slot to visit, capped to ``target''.
+ */
+static cq_time_t
+cq_wheel_next(const cqueue_t *cq, cq_time_t target)
+{
+	cq_time_t next = target;
+	unsigned level;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned shift = level * WHEEL_BITS;
+		cq_time_t base = cq->cq_tick >> shift;
+		unsigned d = cq_map_next(cq, level, base & WHEEL_MASK);
+
+		if (d != 0) {
+			cq_time_t when = (base + d) << shift;
+			next = MIN(next, when);
+		}
+	}
+
+	return next;
+}
+
+/**
+ * Compute a lower bound of the trigger time of the earliest event.
+ *
+ * @return the virtual time before which no event will trigger.
+ */
+static cq_time_t
+cq_next_time(const cqueue_t *cq)
+{
 	/*
-	 * Since the hashed time is a not a strictly monotonic function of time,
-	 * we have to rescan the last bucket, in case the earliest event have
-	 * expired now, before moving forward.
+	 * Events in the current level 0 slot have not triggered yet, but may
+	 * do so at any time now.
 	 */
 
-	cq->cq_current = ch;
+	if (cq->cq_wheel[cq->cq_tick & WHEEL_MASK].cs_head != NULL)
+		return cq->cq_time;
 
-	while ((ev = ch->ch_head) && ev->ce_time <= now) {
-		cq_expire(ev);
-		processed++;
-	}
+	return cq_wheel_next(cq, cq->cq_tick + WHEEL_SPAN) << WHEEL_RES;
+}
+
+/**
+ * Advance the queue time, triggering all the events which expire.
+ *
+ * @return the amount of events triggered.
+ */
+static int
+cq_advance(cqueue_t *cq, int elapsed)
+{
+	cq_time_t target;
+	int processed = 0;
+
+	g_assert(elapsed >= 0);
+	g_assert(cq->cq_current == NULL);
+
+	cq->cq_time += elapsed;
+	target = cq->cq_time >> WHEEL_RES;
+	cq->cq_current = &cq->cq_expired;
 
 	/*
-	 * If we don't have to move forward (elapsed is too small), we're done.
+	 * Since events in the current slot can be due later than the current
+	 * time, it must be scanned again before moving forward.  We then jump
+	 * from one slot of interest to the next, never looking at empty slots.
 	 */
 
-	if (cq->cq_last_bucket == last_bucket && !EV_OVER(elapsed))
-		goto done;
+	for (;;) {
+		unsigned level;
 
-	cq->cq_last_bucket = last_bucket;
+		processed += cq_expire_slot(cq,
+			&cq->cq_wheel[cq->cq_tick & WHEEL_MASK]);
 
-	do {
-		ch++;
-		if (++bucket >= HASH_SIZE) {
-			bucket = 0;
-			ch = cq->cq_hash;
-		}
+		if (cq->cq_tick >= target)
+			break;
 
-		/*
-		 * Since each bucket is sorted, we can stop our walkthrough as
-		 * soon as we reach an event scheduled after `now'.
-		 */
+		cq->cq_tick = cq_wheel_next(cq, target);
 
-		cq->cq_current = ch;
+		for (level = 1; level < WHEEL_LEVELS; level++) {
+			cq_time_t mask = ((cq_time_t) 1 << (level * WHEEL_BITS)) - 1;
 
-		while ((ev = ch->ch_head) && ev->ce_time <= now) {
-			cq_expire(ev);
-			processed++;
+			if (0 != (cq->cq_tick & mask))
+				break;
+
+			cq_wheel_cascade(cq, level);
 		}
+	}
 
-	} while (bucket != last_bucket);
+	g_assert(NULL == cq->cq_expired.cs_head);
 
-done:
 	cq->cq_current = NULL;
 
+	return processed;
+}
+
+/**
+ * The heartbeat of our callout queue.
+ *
+ * Called to notify us about the elapsed "time" so that we can expire timeouts
+ * and maintain our notion of "current time".
+ *
+ * NB: The time maintained by the callout queue is "virtual".  It's the
+ * elapased delay given by regular calls to cq_clock() that define its unit.
+ * For gtk-gnutella, the time unit is the millisecond.
+ */
+void
+cq_clock(cqueue_t *cq, int elapsed)
+{
+	int processed;
+
+	cqueue_check(cq);
+	g_assert(elapsed >= 0);
+	g_assert(cq->cq_current == NULL);
+
+	cq->cq_ticks++;
+	processed = cq_advance(cq, elapsed);
+
 	if (cq_debug() > 5) {
 		g_debug("CQ: %squeue \"%s\" triggered %d event%s (%d item%s)",
 			cq->cq_magic == CSUBQUEUE_MAGIC ? "sub" : "",
@@ -620,11 +805,11 @@ cq_heartbeat(cqueue_t *cq)
 
 	/*
 	 * If too much variation, or too little, maybe the clock was adjusted.
-	 * Assume a single period then.
+	 * Assume we were called when expected then, usually a single period.
 	 */
 
-	if (delay < 0 || delay > 10 * cq->cq_period)
-		delay = cq->cq_period;
+	if (delay < 0 || delay > 10 * MAX(cq->cq_period, cq->cq_sleep))
+		delay = cq->cq_sleep;
 
 	cq_clock(cq, delay);
 }
@@ -779,6 +964,37 @@ cq_periodic_trampoline(cqueue_t *cq, gpointer data)
 	}
 }
 
+/**
+ * Expire event, measuring the time spent in its callback for the event
+ * loop profiler.
+ */
+static void
+cq_expire_profiled(cevent_t *ev)
+{
+	struct evperf_mark mark;
+	const void *fn;
+
+	cevent_check(ev);
+
+	/*
+	 * Periodic events are accounted to their own callback, not to the
+	 * trampoline they all share.
+	 */
+
+	if (cq_periodic_trampoline == ev->ce_fn) {
+		const cperiodic_t *cp = ev->ce_arg;
+
+		cperiodic_check(cp);
+		fn = func_to_pointer(cp->event);
+	} else {
+		fn = func_to_pointer(ev->ce_fn);
+	}
+
+	evperf_begin(&mark);
+	cq_expire(ev);
+	evperf_end(&mark, EVPERF_CALLOUT, fn);
+}
+
 /**
  * Create a new periodic event, invoked every ``period'' milliseconds with
  * the supplied argument.
@@ -868,13 +1084,19 @@ cq_periodic_remove(cperiodic_t **cp_ptr)
  *** out of the main callout queue.
  ***
  *** The aim is to be able to have different scheduling periods for different
- *** activitie and not clutter the hash buckets of the main callout queue with
+ *** activitie and not clutter the wheel of the main callout queue with
  *** too many entries.
  ***
  *** Sub-systems making an heavy usage of callout events or which can
  *** accomodate from a larger time granularity could consider using a sub-queue.
+ ***
+ *** Sub-queues are tickless: when they have no idle events, their heartbeat
+ *** is deferred until their earliest event is due, so that a quiet sub-queue
+ *** does not need to be woken up every period.
  ***/
 
+#define CQ_SUBQUEUE_SLEEP_MAX	(3600 * 1000)	/**< 1 hour, in ms */
+
 /**
  * A sub-queue is structurally equivalent to a queue (when considering the
  * pure callout queue part).
@@ -891,6 +1113,123 @@ csubqueue_check(const struct csubqueue * const csq)
 	g_assert(CSUBQUEUE_MAGIC == csq->sub_cq.cq_magic);
 }
 
+/**
+ * Heartbeat of a sub-queue, invoked periodically from its parent queue.
+ *
+ * Unless the sub-queue has idle events to run, the next heartbeat is
+ * scheduled when its earliest event is due.
+ */
+static gboolean
+cq_subqueue_heartbeat(gpointer p)
+{
+	struct csubqueue *csq = p;
+	cqueue_t *cq;
+	int delay;
+
+	csubqueue_check(csq);
+
+	cq = &csq->sub_cq;
+	cq->cq_sleeping = FALSE;
+	cq_heartbeat(cq);
+
+	if (cq->cq_idle != NULL && 0 != g_hash_table_size(cq->cq_idle)) {
+		delay = cq->cq_period;
+	} else {
+		cq_time_t next = cq_next_time(cq);
+
+		if (next <= cq->cq_time + cq->cq_period)
+			delay = cq->cq_period;
+		else
+			delay = MIN(next - cq->cq_time, (cq_time_t) CQ_SUBQUEUE_SLEEP_MAX);
+	}
+
+	if (cq_debug() > 4 && delay != cq->cq_sleep) {
+		g_debug("CQ: subqueue \"%s\" next heartbeat in %d ms (%d item%s)",
+			cq->cq_name, delay, cq->cq_items, 1 == cq->cq_items ? "" : "s");
+	}
+
+	cq->cq_sleep = delay;
+	cq->cq_sleeping = booleanize(delay > cq->cq_period);
+	cq_periodic_resched(csq->heartbeat, delay);
+
+	return TRUE;
+}
+
+/**
+ * Bring the clock of a sleeping sub-queue up to date before an event is
+ * inserted or rescheduled, so that its delay is computed from the current
+ * time and not from the last heartbeat, which can be long past.
+ *
+ * Time is only advanced up to the earliest pending event, which is left for
+ * the next heartbeat to trigger.
+ */
+static void
+cq_subqueue_catchup(cqueue_t *cq)
+{
+	tm_t now, inc;
+	time_delta_t lag;
+	cq_time_t next;
+	int processed;
+
+	cqueue_check(cq);
+	g_assert(cq->cq_sleeping);
+	g_assert(NULL == cq->cq_current);
+
+	tm_now_exact(&now);
+	lag = tm_elapsed_ms(&now, &cq->cq_last_heartbeat);
+	next = cq_next_time(cq);
+
+	if (lag <= 0 || next <= cq->cq_time)
+		return;
+
+	if ((cq_time_t) lag >= next - cq->cq_time)
+		lag = next - cq->cq_time - 1;
+
+	if (0 == lag)
+		return;
+
+	processed = cq_advance(cq, lag);
+	g_assert(0 == processed);
+
+	inc.tv_sec = lag / 1000;
+	inc.tv_usec = (lag % 1000) * 1000;
+	tm_add(&cq->cq_last_heartbeat, &inc);
+	cq->cq_sleep = MAX(cq->cq_sleep - lag, cq->cq_period);
+}
+
+/**
+ * After an event was linked in a sleeping sub-queue, make sure the next
+ * heartbeat happens early enough to trigger it on time.
+ */
+static void
+cq_subqueue_rearm(cqueue_t *cq, const cevent_t *ev)
+{
+	struct csubqueue *csq = (struct csubqueue *) cq;
+	cperiodic_t *hb;
+	cq_time_t due;
+
+	csubqueue_check(csq);
+	g_assert(cq->cq_sleeping);
+
+	hb = csq->heartbeat;
+	cperiodic_check(hb);
+
+	/*
+	 * A NULL event means we are within the heartbeat, which will compute
+	 * the next sleeping time when it returns.
+	 */
+
+	if (NULL == hb->ev || ev->ce_time <= cq->cq_time)
+		return;
+
+	due = MAX(ev->ce_time - cq->cq_time, (cq_time_t) cq->cq_period);
+
+	if (due < cq_remaining(hb->ev)) {
+		cq->cq_sleep = due;
+		cq_periodic_resched(hb, due);
+	}
+}
+
 /**
  * Create a new callout queue subordinate to another.
  *
@@ -910,7 +1249,7 @@ cq_submake(const char *name, cqueue_t *parent, int period)
 	csq->sub_cq.cq_magic = CSUBQUEUE_MAGIC;
 
 	csq->heartbeat = cq_periodic_add(parent, period,
-		cq_heartbeat_trampoline, &csq->sub_cq);
+		cq_subqueue_heartbeat, csq);
 
 	csubqueue_check(csq);
 	cqueue_check(&csq->sub_cq);
@@ -1162,13 +1501,14 @@ cq_free(cqueue_t *cq)
 {
 	cevent_t *ev;
 	cevent_t *ev_next;
-	int i;
-	struct chash *ch;
+	unsigned i;
+	struct cslot *cs;
 
 	cqueue_check(cq);
+	g_assert(NULL == cq->cq_expired.cs_head);
 
-	for (ch = cq->cq_hash, i = 0; i < HASH_SIZE; i++, ch++) {
-		for (ev = ch->ch_head; ev; ev = ev_next) {
+	for (cs = cq->cq_wheel, i = 0; i < WHEEL_SLOTS; i++, cs++) {
+		for (ev = cs->cs_head; ev; ev = ev_next) {
 			ev_next = ev->ce_bnext;
 			ev->ce_magic = 0;
 			WFREE(ev);
@@ -1185,7 +1525,7 @@ cq_free(cqueue_t *cq)
 		gm_hash_table_destroy_null(&cq->cq_idle);
 	}
 
-	G_FREE_NULL(cq->cq_hash);
+	G_FREE_NULL(cq->cq_wheel);
 	atom_str_free_null(&cq->cq_name);
 
 	/*
@@ -1224,4 +1564,103 @@ cq_close(void)
 	cq_free_null(&callout_queue);
 }
 
+/***
+ *** Self-test.
+ ***/
+
+#define CQ_TEST_EVENTS	512		/**< Amount of events scheduled */
+
+struct cq_test_event {
+	cevent_t *ev;				/**< Scheduled event, NULL once fired */
+	cq_time_t when;				/**< Expected trigger time */
+};
+
+static cq_time_t cq_test_last;	/**< Previous time of test queue */
+static int cq_test_fired;		/**< Amount of test events triggered */
+
+static void
+cq_test_expired(cqueue_t *cq, gpointer data)
+{
+	struct cq_test_event *te = data;
+
+	g_assert(te->ev != NULL);
+	g_assert(te->when <= cq->cq_time);
+	g_assert(te->when > cq_test_last);
+
+	te->ev = NULL;
+	cq_test_fired++;
+}
+
+/**
+ * @return a random delay, spreading events over all the wheel levels.
+ */
+static int
+cq_test_delay(void)
+{
+	return 1 + random_value(1U << (4 + random_value(26)));
+}
+
+/**
+ * Stress-test the callout queue by scheduling, rescheduling and cancelling
+ * events spread over all the wheel levels, then advancing time by random
+ * amounts and checking that each event fires exactly when it should.
+ */
+G_GNUC_COLD void
+cq_test(void)
+{
+	struct cq_test_event *te;
+	cqueue_t *cq;
+	int i, expected = 0;
+
+	cq = cq_make("test", random_u32(), 1);
+	te = g_malloc0(CQ_TEST_EVENTS * sizeof te[0]);
+	cq_test_last = cq->cq_time;
+	cq_test_fired = 0;
+
+	for (i = 0; i < CQ_TEST_EVENTS; i++) {
+		int delay = cq_test_delay();
+
+		te[i].ev = cq_insert(cq, delay, cq_test_expired, &te[i]);
+		te[i].when = cq->cq_time + delay;
+	}
+
+	g_assert(CQ_TEST_EVENTS == cq_count(cq));
+
+	for (i = 0; i < CQ_TEST_EVENTS; i++) {
+		switch (i & 0x3) {
+		case 0:
+			cq_cancel(&te[i].ev);
+			break;
+		case 1:
+			{
+				int delay = cq_test_delay();
+
+				cq_resched(te[i].ev, delay);
+				te[i].when = cq->cq_time + delay;
+				g_assert(cq_remaining(te[i].ev) == (cq_time_t) delay);
+			}
+			/* FALL THROUGH */
+		default:
+			expected++;
+			break;
+		}
+	}
+
+	g_assert(expected == cq_count(cq));
+
+	while (cq_count(cq) != 0) {
+		cq_clock(cq, random_value(1U << random_value(24)));
+		cq_test_last = cq->cq_time;
+	}
+
+	g_assert(expected == cq_test_fired);
+
+	for (i = 0; i < CQ_TEST_EVENTS; i++) {
+		g_assert(NULL == te[i].ev);
+	}
+
+	G_FREE_NULL(te);
+	cq_free_null(&cq);
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -72,6 +72,7 @@ void cq_init(cq_invoke_t idle, const guint32 *debug);
 void cq_dispatch(void);
 void cq_halt(void);
 void cq_close(void);
+void cq_test(void);
 
 cqueue_t *cq_make(const char *name, cq_time_t now, int period);
 cqueue_t *cq_submake(const char *name, cqueue_t *parent, int period);
@@ -0,0 +1,814 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Concurrent reading of directories.
+ *
+ * Directories are read by a set of worker threads, each entry being
+ * stat()ed there, so that several requests can be outstanding when the
+ * file system is slow to answer, typically on cold caches or network
+ * file systems.
+ *
+ * Entries are returned in batches to the main thread, which consumes them
+ * with dirwalk_next() and decides what to do with each of them, including
+ * queueing the sub-directories to read with dirwalk_add().  The main thread
+ * never waits for the workers: dirwalk_next() returns immediately when no
+ * batch is available, and filled batches are signalled through an eventfd,
+ * or a pipe, monitored by inputevt, which triggers the notification
+ * callback supplied to dirwalk_new().
+ *
+ * Be extremely careful in the worker threads: gtk-gnutella was designed as
+ * a mono-threaded application so its regular routines are NOT thread-safe.
+ * The threads only use the batches pre-allocated by the main thread and
+ * plain system calls, plus the optional entry filter, which must be
+ * thread-safe.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#if defined(USE_GLIB2) && defined(G_THREADS_ENABLED) && !defined(MINGW32)
+#define DIRWALK_THREADS
+#endif
+
+#ifdef HAS_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#include "dirwalk.h"
+#include "fd.h"
+#include "halloc.h"
+#include "inputevt.h"
+#include "misc.h"
+#include "walloc.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#ifdef DIRWALK_THREADS
+
+#define DIRWALK_BATCH_SIZE	32768	/**< Size of entry data in a batch */
+#define DIRWALK_BATCHES		4		/**< Amount of batches per thread */
+
+/**
+ * A directory to read.
+ */
+struct dirwalk_job {
+	struct dirwalk_job *next;		/**< Next pending job (locked) */
+	struct dirwalk_job *live_prev;	/**< Previous live job (main thread) */
+	struct dirwalk_job *live_next;	/**< Next live job (main thread) */
+	char *path;						/**< Directory path */
+	void *udata;					/**< User data */
+};
+
+/**
+ * A directory entry within a batch.
+ */
+struct dirwalk_rec {
+	filestat_t sb;
+	int error;
+	unsigned link:1;
+	size_t len;						/**< Name length, trailing NUL excluded */
+	char name[1];					/**< Entry name, NUL-terminated */
+};
+
+#define DIRWALK_REC_SIZE(len) \
+	round_size_fast(MEM_ALIGNBYTES, offsetof(struct dirwalk_rec, name) + \
+		(len) + 1)
+
+/**
+ * A batch of entries from a directory.
+ */
+struct dirwalk_batch {
+	struct dirwalk_batch *next;		/**< Next in list (locked) */
+	struct dirwalk_job *job;		/**< Directory being read */
+	size_t used;					/**< Bytes used in data */
+	size_t offset;					/**< Reading offset (main thread) */
+	int error;						/**< Error when opening directory */
+	unsigned end:1;					/**< Last batch for directory */
+	union {
+		filestat_t align;
+		char data[DIRWALK_BATCH_SIZE];
+	} u;
+};
+
+enum dirwalk_magic { DIRWALK_MAGIC = 0x6ad3c01eU };
+
+struct dirwalk {
+	enum dirwalk_magic magic;
+	GMutex *lock;					/**< Protects fields marked "locked" */
+	GCond *work_cond;				/**< Signals new jobs */
+	GCond *free_cond;				/**< Signals free batches */
+	GThread **threads;				/**< Worker threads */
+	unsigned nthreads;				/**< Amount of worker threads */
+	struct dirwalk_batch **batches;	/**< All the batches */
+	unsigned nbatches;				/**< Amount of batches */
+	struct dirwalk_job *jobs;		/**< Pending jobs (locked) */
+	struct dirwalk_job *jobs_tail;	/**< Last pending job (locked) */
+	struct dirwalk_batch *free;		/**< Free batches (locked) */
+	struct dirwalk_batch *done;		/**< Filled batches (locked) */
+	struct dirwalk_batch *done_tail;/**< Last filled batch (locked) */
+	gboolean stop;					/**< Threads must exit (locked) */
+	struct dirwalk_batch *current;	/**< Batch being consumed */
+	struct dirwalk_job *live;		/**< Jobs whose end was not returned */
+	struct dirwalk_job *ended;		/**< Job whose end was just returned */
+	size_t outstanding;				/**< Amount of live jobs */
+	dirwalk_notify_cb_t notify;		/**< Called when batches are available */
+	void *notify_arg;				/**< Argument for notify callback */
+	dirwalk_filter_cb_t filter;		/**< Entry filter, run by the threads */
+	void *filter_data;				/**< Argument for the filter */
+	int fd[2];						/**< Notification descriptors */
+	unsigned event_id;				/**< Input event for fd[0] */
+};
+
+static inline void
+dirwalk_check(const struct dirwalk * const dw)
+{
+	g_assert(dw != NULL);
+	g_assert(DIRWALK_MAGIC == dw->magic);
+}
+
+/**
+ * Get a free batch for the job, waiting for one if needed.
+ *
+ * @return the batch, NULL if we must stop.
+ */
+static struct dirwalk_batch *
+dirwalk_get_batch(dirwalk_t *dw, struct dirwalk_job *job)
+{
+	struct dirwalk_batch *b;
+
+	g_mutex_lock(dw->lock);
+	while (!dw->stop && NULL == dw->free)
+		g_cond_wait(dw->free_cond, dw->lock);
+	b = dw->stop ? NULL : dw->free;
+	if (b != NULL)
+		dw->free = b->next;
+	g_mutex_unlock(dw->lock);
+
+	if (b != NULL) {
+		b->next = NULL;
+		b->job = job;
+		b->used = 0;
+		b->offset = 0;
+		b->error = 0;
+		b->end = FALSE;
+	}
+
+	return b;
+}
+
+/**
+ * Signal the main thread that filled batches are available.
+ */
+static void
+dirwalk_signal(dirwalk_t *dw)
+{
+#ifdef HAS_EVENTFD
+	static const guint64 one = 1;
+
+	while (-1 == write(dw->fd[1], &one, sizeof one) && EINTR == errno)
+		continue;
+#else
+	/* A full pipe means the main thread has notifications pending */
+	while (-1 == write(dw->fd[1], "", 1) && EINTR == errno)
+		continue;
+#endif
+}
+
+/**
+ * Hand a filled batch over to the main thread.
+ *
+ * The main thread is only signalled when the list of filled batches goes
+ * from empty to non-empty: it consumes the whole list anyway.
+ */
+static void
+dirwalk_post_batch(dirwalk_t *dw, struct dirwalk_batch *b)
+{
+	g_mutex_lock(dw->lock);
+	if (NULL == dw->done)
+		dirwalk_signal(dw);
+	if (dw->done_tail != NULL)
+		dw->done_tail->next = b;
+	else
+		dw->done = b;
+	dw->done_tail = b;
+	g_mutex_unlock(dw->lock);
+}
+
+/**
+ * Append entry to the batch.
+ *
+ * @return FALSE if there is no room left.
+ */
+static gboolean
+dirwalk_append(struct dirwalk_batch *b, const char *name,
+	const filestat_t *sb, int error, gboolean is_link)
+{
+	struct dirwalk_rec *r;
+	size_t len, size;
+
+	len = strlen(name);
+	size = DIRWALK_REC_SIZE(len);
+
+	if (size > sizeof b->u.data - b->used)
+		return FALSE;
+
+	r = (void *) &b->u.data[b->used];
+	r->sb = *sb;
+	r->error = error;
+	r->link = booleanize(is_link);
+	r->len = len;
+	memcpy(r->name, name, len + 1);
+	b->used += size;
+
+	return TRUE;
+}
+
+/**
+ * Get information about a directory entry, following symbolic links.
+ *
+ * @param dfd		the directory file descriptor, when fstatat() is available
+ * @param path		buffer holding the directory path, followed by a separator
+ * @param plen		length of the directory path in buffer
+ * @param name		the entry name
+ * @param sb		where information is written
+ * @param is_link	set to whether entry is a symbolic link
+ *
+ * @return 0 if OK, an errno code otherwise.
+ */
+static int
+dirwalk_stat(int dfd, char *path, size_t plen,
+	const char *name, filestat_t *sb, gboolean *is_link)
+{
+#ifdef HAS_FSTATAT
+	(void) path;
+	(void) plen;
+
+	if (fstatat(dfd, name, sb, AT_SYMLINK_NOFOLLOW))
+		return errno;
+
+	*is_link = S_ISLNK(sb->st_mode);
+	if (*is_link && fstatat(dfd, name, sb, 0))
+		return errno;
+#else	/* !HAS_FSTATAT */
+	size_t len = strlen(name);
+
+	(void) dfd;
+
+	if (plen + len >= MAX_PATH_LEN)
+		return ENAMETOOLONG;
+
+	memcpy(&path[plen], name, len + 1);
+
+	if (lstat(path, sb))
+		return errno;
+
+	*is_link = S_ISLNK(sb->st_mode);
+	if (*is_link && stat(path, sb))
+		return errno;
+#endif	/* HAS_FSTATAT */
+
+	return 0;
+}
+
+/**
+ * Read a whole directory, posting its entries to the main thread.
+ */
+static void
+dirwalk_read_dir(dirwalk_t *dw, struct dirwalk_job *job)
+{
+	struct dirwalk_batch *b;
+	struct dirent *de;
+	char path[MAX_PATH_LEN];
+	size_t plen;
+	int dfd = -1;
+	DIR *d;
+
+	b = dirwalk_get_batch(dw, job);
+	if (NULL == b)
+		return;
+
+	plen = strlen(job->path);
+	if (plen + 2 >= sizeof path) {
+		b->error = ENAMETOOLONG;
+		goto done;
+	}
+	memcpy(path, job->path, plen);
+	if (0 == plen || !is_dir_separator(path[plen - 1]))
+		path[plen++] = G_DIR_SEPARATOR;
+	path[plen] = '\0';
+
+#ifdef HAS_FSTATAT
+	dfd = open(job->path, O_RDONLY);
+	if (dfd < 0) {
+		b->error = errno;
+		goto done;
+	}
+	d = fdopendir(dfd);
+	if (NULL == d) {
+		b->error = errno;
+		close(dfd);
+		goto done;
+	}
+#else
+	d = opendir(job->path);
+	if (NULL == d) {
+		b->error = errno;
+		goto done;
+	}
+#endif	/* HAS_FSTATAT */
+
+	/*
+	 * Each thread reads its own DIR stream, hence readdir() is safe.
+	 */
+
+	while (NULL != (de = readdir(d))) {
+		const char *name = de->d_name;
+		filestat_t sb;
+		gboolean is_link = FALSE;
+		int error;
+
+		if ('.' == name[0])
+			continue;		/* Hidden file, or "." or ".." */
+
+		/*
+		 * Let the filter discard what it can from the name and the type,
+		 * when known, to avoid useless stat() calls.
+		 */
+
+		if (
+			dw->filter != NULL &&
+			!(*dw->filter)(name, dir_entry_mode(de), dw->filter_data)
+		)
+			continue;
+
+		ZERO(&sb);
+		error = dirwalk_stat(dfd, path, plen, name, &sb, &is_link);
+
+		if (!dirwalk_append(b, name, &sb, error, is_link)) {
+			dirwalk_post_batch(dw, b);
+			b = dirwalk_get_batch(dw, job);
+			if (NULL == b)
+				break;
+			dirwalk_append(b, name, &sb, error, is_link);
+		}
+	}
+
+	closedir(d);		/* Also closes dfd */
+
+done:
+	if (b != NULL) {
+		b->end = TRUE;
+		dirwalk_post_batch(dw, b);
+	}
+}
+
+/**
+ * Worker thread main loop.
+ */
+static gpointer
+dirwalk_thread(gpointer data)
+{
+	dirwalk_t *dw = data;
+
+	for (;;) {
+		struct dirwalk_job *job;
+
+		g_mutex_lock(dw->lock);
+		while (!dw->stop && NULL == dw->jobs)
+			g_cond_wait(dw->work_cond, dw->lock);
+		if (dw->stop) {
+			g_mutex_unlock(dw->lock);
+			break;
+		}
+		job = dw->jobs;
+		dw->jobs = job->next;
+		if (NULL == dw->jobs)
+			dw->jobs_tail = NULL;
+		g_mutex_unlock(dw->lock);
+
+		dirwalk_read_dir(dw, job);
+	}
+
+	return NULL;
+}
+
+/**
+ * Free job.
+ */
+static void
+dirwalk_job_free(struct dirwalk_job *job)
+{
+	HFREE_NULL(job->path);
+	WFREE(job);
+}
+
+/**
+ * Input callback invoked when filled batches are available.
+ */
+static void
+dirwalk_readable(void *data, int unused_source, inputevt_cond_t unused_cond)
+{
+	dirwalk_t *dw = data;
+
+	(void) unused_source;
+	(void) unused_cond;
+
+	dirwalk_check(dw);
+
+#ifdef HAS_EVENTFD
+	{
+		guint64 count;
+
+		while (-1 == read(dw->fd[0], &count, sizeof count) && EINTR == errno)
+			continue;
+	}
+#else
+	{
+		char buf[64];
+
+		while (read(dw->fd[0], buf, sizeof buf) > 0)
+			continue;
+	}
+#endif
+
+	if (dw->notify != NULL)
+		(*dw->notify)(dw->notify_arg);
+}
+
+/**
+ * Create a new directory walker.
+ *
+ * @param threads		amount of worker threads to use
+ * @param notify		if non-NULL, called when entries can be read
+ * @param arg			additional argument for the notify callback
+ *
+ * @return the walker, NULL if threads cannot be used, in which case the
+ * directories must be read from the main thread.
+ */
+dirwalk_t *
+dirwalk_new(unsigned threads, dirwalk_notify_cb_t notify, void *arg)
+{
+	dirwalk_t *dw;
+	unsigned i;
+
+	if (0 == threads)
+		return NULL;
+
+	WALLOC0(dw);
+	dw->magic = DIRWALK_MAGIC;
+	dw->notify = notify;
+	dw->notify_arg = arg;
+
+#ifdef HAS_EVENTFD
+	dw->fd[0] = dw->fd[1] = eventfd(0, 0);
+	if (-1 == dw->fd[0]) {
+		g_warning("%s(): cannot create eventfd: %s",
+			G_STRFUNC, g_strerror(errno));
+		WFREE(dw);
+		return NULL;
+	}
+#else
+	if (-1 == pipe(dw->fd)) {
+		g_warning("%s(): cannot create pipe: %s",
+			G_STRFUNC, g_strerror(errno));
+		WFREE(dw);
+		return NULL;
+	}
+#endif
+
+	for (i = 0; i < G_N_ELEMENTS(dw->fd); i++) {
+		fd_set_nonblocking(dw->fd[i]);
+		set_close_on_exec(dw->fd[i]);
+	}
+
+	dw->event_id = inputevt_add(dw->fd[0], INPUT_EVENT_RX,
+		dirwalk_readable, dw);
+
+	dw->lock = g_mutex_new();
+	dw->work_cond = g_cond_new();
+	dw->free_cond = g_cond_new();
+
+	dw->nbatches = threads * DIRWALK_BATCHES;
+	dw->batches = halloc(dw->nbatches * sizeof dw->batches[0]);
+	for (i = 0; i < dw->nbatches; i++) {
+		struct dirwalk_batch *b = halloc(sizeof *b);
+
+		b->next = dw->free;
+		dw->free = b;
+		dw->batches[i] = b;
+	}
+
+	dw->threads = halloc0(threads * sizeof dw->threads[0]);
+	for (i = 0; i < threads; i++) {
+		GError *error = NULL;
+
+		dw->threads[i] = g_thread_create(dirwalk_thread, dw, TRUE, &error);
+		if (NULL == dw->threads[i]) {
+			g_warning("%s(): cannot create thread: %s", G_STRFUNC,
+				error != NULL ? error->message : "unknown error");
+			if (error != NULL)
+				g_error_free(error);
+			break;
+		}
+		dw->nthreads++;
+	}
+
+	if (0 == dw->nthreads)
+		dirwalk_free(&dw, NULL);
+
+	return dw;
+}
+
+/**
+ * Stop the worker threads and free the walker, nullifying its pointer.
+ *
+ * @param dw_ptr	pointer to the walker
+ * @param cb		if non-NULL, called on the user data of each directory
+ *					whose end was not returned by dirwalk_next() yet
+ */
+void
+dirwalk_free(dirwalk_t **dw_ptr, dirwalk_free_cb_t cb)
+{
+	dirwalk_t *dw = *dw_ptr;
+	struct dirwalk_job *job;
+	unsigned i;
+
+	if (NULL == dw)
+		return;
+
+	dirwalk_check(dw);
+
+	g_mutex_lock(dw->lock);
+	dw->stop = TRUE;
+	g_cond_broadcast(dw->work_cond);
+	g_cond_broadcast(dw->free_cond);
+	g_mutex_unlock(dw->lock);
+
+	for (i = 0; i < dw->nthreads; i++)
+		g_thread_join(dw->threads[i]);
+
+	/*
+	 * All the threads are gone, we can release everything.
+	 */
+
+	while (NULL != (job = dw->live)) {
+		dw->live = job->live_next;
+		if (cb != NULL)
+			(*cb)(job->udata);
+		dirwalk_job_free(job);
+	}
+	if (dw->ended != NULL)
+		dirwalk_job_free(dw->ended);
+
+	for (i = 0; i < dw->nbatches; i++)
+		hfree(dw->batches[i]);
+	HFREE_NULL(dw->batches);
+	HFREE_NULL(dw->threads);
+
+	g_mutex_free(dw->lock);
+	g_cond_free(dw->work_cond);
+	g_cond_free(dw->free_cond);
+
+	inputevt_remove(&dw->event_id);
+	fd_close(&dw->fd[0]);
+#ifndef HAS_EVENTFD
+	fd_close(&dw->fd[1]);
+#endif
+
+	dw->magic = 0;
+	WFREE(dw);
+	*dw_ptr = NULL;
+}
+
+/**
+ * Install a filter, run by the worker threads on each entry before it is
+ * stat()ed.  This must be done before any directory is queued.
+ *
+ * @param dw		the walker
+ * @param filter	the filter, which must be thread-safe
+ * @param data		additional argument for the filter
+ */
+void
+dirwalk_set_filter(dirwalk_t *dw, dirwalk_filter_cb_t filter, void *data)
+{
+	dirwalk_check(dw);
+	g_assert(NULL == dw->live);
+
+	dw->filter = filter;
+	dw->filter_data = data;
+}
+
+/**
+ * Queue directory for reading.
+ *
+ * @param dw		the walker
+ * @param dir		the directory path
+ * @param udata		user data, returned with each entry of the directory
+ */
+void
+dirwalk_add(dirwalk_t *dw, const char *dir, void *udata)
+{
+	struct dirwalk_job *job;
+
+	dirwalk_check(dw);
+
+	WALLOC0(job);
+	job->path = h_strdup(dir);
+	job->udata = udata;
+
+	job->live_next = dw->live;
+	if (dw->live != NULL)
+		dw->live->live_prev = job;
+	dw->live = job;
+	dw->outstanding++;
+
+	g_mutex_lock(dw->lock);
+	if (dw->jobs_tail != NULL)
+		dw->jobs_tail->next = job;
+	else
+		dw->jobs = job;
+	dw->jobs_tail = job;
+	g_cond_signal(dw->work_cond);
+	g_mutex_unlock(dw->lock);
+}
+
+/**
+ * Recycle a consumed batch.
+ */
+static void
+dirwalk_recycle(dirwalk_t *dw, struct dirwalk_batch *b)
+{
+	g_mutex_lock(dw->lock);
+	b->next = dw->free;
+	dw->free = b;
+	g_cond_signal(dw->free_cond);
+	g_mutex_unlock(dw->lock);
+}
+
+/**
+ * Get the next directory entry read by the worker threads, without waiting.
+ *
+ * The returned information, and in particular the entry name, is only
+ * valid until the next call.  When DIRWALK_AGAIN is returned, the notify
+ * callback, if any, will be invoked once more entries are available.
+ *
+ * @param dw			the walker
+ * @param e				where the entry is returned
+ *
+ * @return DIRWALK_ENTRY if an entry was returned, DIRWALK_DIR_END when all
+ * the entries of a directory were returned (only the directory, user data
+ * and error fields are then filled), DIRWALK_AGAIN if nothing was read yet,
+ * DIRWALK_DONE when all the queued directories were processed.
+ */
+dirwalk_status_t
+dirwalk_next(dirwalk_t *dw, struct dirwalk_entry *e)
+{
+	dirwalk_check(dw);
+
+	if (dw->ended != NULL) {
+		dirwalk_job_free(dw->ended);
+		dw->ended = NULL;
+	}
+
+	for (;;) {
+		struct dirwalk_batch *b = dw->current;
+		struct dirwalk_job *job;
+		gboolean end;
+		int error;
+
+		if (NULL == b) {
+			if (0 == dw->outstanding)
+				return DIRWALK_DONE;
+
+			g_mutex_lock(dw->lock);
+			b = dw->done;
+			if (b != NULL) {
+				dw->done = b->next;
+				if (NULL == dw->done)
+					dw->done_tail = NULL;
+			}
+			g_mutex_unlock(dw->lock);
+
+			if (NULL == b)
+				return DIRWALK_AGAIN;
+
+			dw->current = b;
+		}
+
+		if (b->offset < b->used) {
+			const struct dirwalk_rec *r = (const void *) &b->u.data[b->offset];
+
+			b->offset += DIRWALK_REC_SIZE(r->len);
+
+			e->dir = b->job->path;
+			e->name = r->name;
+			e->udata = b->job->udata;
+			e->sb = r->sb;
+			e->error = r->error;
+			e->link = r->link;
+			return DIRWALK_ENTRY;
+		}
+
+		/*
+		 * Batch exhausted.
+		 */
+
+		job = b->job;
+		end = b->end;
+		error = b->error;
+		dw->current = NULL;
+		dirwalk_recycle(dw, b);
+
+		if (end) {
+			if (job->live_prev != NULL)
+				job->live_prev->live_next = job->live_next;
+			else
+				dw->live = job->live_next;
+			if (job->live_next != NULL)
+				job->live_next->live_prev = job->live_prev;
+			dw->outstanding--;
+			dw->ended = job;		/* Freed at next call */
+
+			ZERO(e);
+			e->dir = job->path;
+			e->udata = job->udata;
+			e->error = error;
+			return DIRWALK_DIR_END;
+		}
+	}
+}
+
+#else	/* !DIRWALK_THREADS */
+
+dirwalk_t *
+dirwalk_new(unsigned threads, dirwalk_notify_cb_t notify, void *arg)
+{
+	(void) threads;
+	(void) notify;
+	(void) arg;
+	return NULL;		/* Directories must be read by the main thread */
+}
+
+void
+dirwalk_free(dirwalk_t **dw_ptr, dirwalk_free_cb_t cb)
+{
+	(void) cb;
+	g_assert(NULL == *dw_ptr);
+}
+
+void
+dirwalk_set_filter(dirwalk_t *dw, dirwalk_filter_cb_t filter, void *data)
+{
+	(void) dw;
+	(void) filter;
+	(void) data;
+	g_assert_not_reached();
+}
+
+void
+dirwalk_add(dirwalk_t *dw, const char *dir, void *udata)
+{
+	(void) dw;
+	(void) dir;
+	(void) udata;
+	g_assert_not_reached();
+}
+
+dirwalk_status_t
+dirwalk_next(dirwalk_t *dw, struct dirwalk_entry *e)
+{
+	(void) dw;
+	(void) e;
+	g_assert_not_reached();
+	return DIRWALK_DONE;
+}
+
+#endif	/* DIRWALK_THREADS */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Concurrent reading of directories.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _dirwalk_h_
+#define _dirwalk_h_
+
+#include "common.h"
+
+typedef struct dirwalk dirwalk_t;
+
+/**
+ * A directory entry, as returned by dirwalk_next().
+ *
+ * Entries whose name starts with a '.' are never returned.
+ */
+struct dirwalk_entry {
+	const char *dir;		/**< Directory holding the entry */
+	const char *name;		/**< Name of the entry */
+	void *udata;			/**< User data supplied with the directory */
+	filestat_t sb;			/**< Entry information, symlinks followed */
+	int error;				/**< errno if entry could not be stat()ed */
+	unsigned link:1;		/**< Entry is a symbolic link */
+};
+
+/**
+ * Status returned by dirwalk_next().
+ */
+typedef enum {
+	DIRWALK_ENTRY = 0,		/**< Got an entry */
+	DIRWALK_DIR_END,		/**< End of directory, error set if unreadable */
+	DIRWALK_AGAIN,			/**< Nothing available yet */
+	DIRWALK_DONE			/**< All the directories were read */
+} dirwalk_status_t;
+
+typedef void (*dirwalk_free_cb_t)(void *udata);
+typedef void (*dirwalk_notify_cb_t)(void *arg);
+
+/**
+ * Entry filter, invoked from the worker threads before an entry is stat()ed.
+ *
+ * @param name		the entry name
+ * @param mode		the entry type as given by dir_entry_mode(), 0 if unknown
+ * @param data		the filter argument
+ *
+ * @return FALSE to skip the entry.
+ */
+typedef gboolean (*dirwalk_filter_cb_t)(const char *name, mode_t mode,
+	void *data);
+
+/*
+ * Public interface.
+ */
+
+dirwalk_t *dirwalk_new(unsigned threads,
+	dirwalk_notify_cb_t notify, void *arg);
+void dirwalk_free(dirwalk_t **dw_ptr, dirwalk_free_cb_t cb);
+void dirwalk_set_filter(dirwalk_t *dw, dirwalk_filter_cb_t filter, void *data);
+void dirwalk_add(dirwalk_t *dw, const char *dir, void *udata);
+dirwalk_status_t dirwalk_next(dirwalk_t *dw, struct dirwalk_entry *e);
+
+#endif	/* _dirwalk_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
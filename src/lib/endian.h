@@ -135,6 +135,20 @@ peek_le32(const void *p)
 	return v;
 }
 
+static inline G_GNUC_PURE guint64
+peek_le64(const void *p)
+{
+	const unsigned char *q = p;
+	guint64 v;
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+	memcpy(&v, q, sizeof v);
+#else
+	v = peek_le32(q) | ((guint64) peek_le32(&q[sizeof v / 2]) << 32);
+#endif
+	return v;
+}
+
 /*
  * The poke_* functions return a pointer to the next byte after the
  * written bytes.
@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Event loop profiling.
+ *
+ * Everything runs from the main loop: I/O handlers dispatched by inputevt,
+ * callout queue events and background task steps.  When the node stalls,
+ * we need to know which of these callbacks is to blame.
+ *
+ * When profiling is enabled, each callback invocation is bracketed by
+ * evperf_begin() and evperf_end(), which record the wall-clock and CPU time
+ * spent, accounted to the callback routine.  Timings are inclusive: the
+ * callout event running background tasks or a sub-queue heartbeat is
+ * charged with the time spent in the callbacks it triggers, which are
+ * also accounted for individually.
+ *
+ * The main loop also reports when it wakes up and when it is about to
+ * sleep again, so that we can compute a histogram of the time spent working
+ * during each iteration.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "evperf.h"
+#include "glib-missing.h"
+#include "misc.h"
+#include "pow2.h"
+#include "tm.h"
+#include "walloc.h"
+#include "override.h"		/* Must be the last header included */
+
+gboolean evperf_active;				/**< Whether profiling is enabled */
+
+static GHashTable *evperf_table;	/**< Callback routine -> evperf_info */
+static struct evperf_loop evperf_loop;
+static tm_t evperf_wake;			/**< Time at which loop woke up */
+static gboolean evperf_awake;		/**< Whether evperf_wake is valid */
+
+/**
+ * Enable or disable profiling.
+ *
+ * Collected statistics are kept when profiling is disabled, until
+ * evperf_reset() is called.
+ */
+void
+evperf_set_enabled(gboolean on)
+{
+	evperf_active = booleanize(on);
+	evperf_awake = FALSE;
+}
+
+/**
+ * Start measuring a callback invocation.
+ */
+void
+evperf_begin(struct evperf_mark *m)
+{
+	g_assert(m != NULL);
+
+	tm_now_exact(&m->wall);
+	m->cpu = tm_cputime(NULL, NULL);
+}
+
+/**
+ * Record the end of a callback invocation.
+ *
+ * @param m		the measurement started by evperf_begin()
+ * @param kind	the kind of callback
+ * @param fn	the callback routine, to which time is accounted
+ */
+void
+evperf_end(const struct evperf_mark *m, evperf_kind_t kind, const void *fn)
+{
+	struct evperf_info *info;
+	time_delta_t wall;
+	double cpu;
+	tm_t now;
+
+	g_assert(m != NULL);
+	g_assert(UNSIGNED(kind) < EVPERF_KIND_COUNT);
+
+	/*
+	 * Profiling may have been turned off by the callback itself.
+	 */
+
+	if (!evperf_active)
+		return;
+
+	tm_now_exact(&now);
+	wall = tm_elapsed_us(&now, &m->wall);
+	wall = MAX(wall, 0);
+	cpu = 1e6 * (tm_cputime(NULL, NULL) - m->cpu);
+	cpu = MAX(cpu, 0.0);
+
+	if (NULL == evperf_table)
+		evperf_table = g_hash_table_new(pointer_hash_func, NULL);
+
+	info = g_hash_table_lookup(evperf_table, fn);
+
+	if (NULL == info) {
+		WALLOC0(info);
+		info->fn = fn;
+		info->kind = kind;
+		gm_hash_table_insert_const(evperf_table, fn, info);
+	}
+
+	info->calls++;
+	info->wall += wall;
+	info->wall_max = MAX(info->wall_max, (guint64) wall);
+	info->cpu += (guint64) cpu;
+	info->cpu_max = MAX(info->cpu_max, (guint64) cpu);
+}
+
+/**
+ * Signals that the main loop woke up and starts dispatching events.
+ */
+void
+evperf_loop_wakeup(void)
+{
+	if (!evperf_active)
+		return;
+
+	tm_now_exact(&evperf_wake);
+	evperf_awake = TRUE;
+}
+
+/**
+ * Signals that the main loop is done with its current iteration and
+ * is about to wait for new events.
+ */
+void
+evperf_loop_sleep(void)
+{
+	time_delta_t busy;
+	unsigned slot;
+	tm_t now;
+
+	if (!evperf_active || !evperf_awake)
+		return;
+
+	tm_now_exact(&now);
+	busy = tm_elapsed_us(&now, &evperf_wake);
+	busy = MAX(busy, 0);
+	evperf_awake = FALSE;
+
+	slot = 0 == busy ? 0 : highest_bit_set64(busy);
+	slot = MIN(slot, EVPERF_HISTO_SLOTS - 1);
+
+	evperf_loop.iterations++;
+	evperf_loop.busy += busy;
+	evperf_loop.busy_max = MAX(evperf_loop.busy_max, (guint64) busy);
+	evperf_loop.histo[slot]++;
+}
+
+static void
+evperf_collect(gpointer unused_key, gpointer value, gpointer data)
+{
+	struct evperf_info **ptr = data;
+	const struct evperf_info *info = value;
+
+	(void) unused_key;
+
+	**ptr = *info;		/* Struct copy */
+	(*ptr)++;
+}
+
+/**
+ * qsort() callback for sorting by decreasing total wall-clock time.
+ */
+static int
+evperf_wall_cmp(const void *a, const void *b)
+{
+	const struct evperf_info *ia = a, *ib = b;
+
+	return CMP(ib->wall, ia->wall);
+}
+
+/**
+ * Fill supplied vector with the profiling information of the callbacks
+ * which consumed the most wall-clock time.
+ *
+ * @param vec		the vector to fill
+ * @param n			amount of entries in vector
+ *
+ * @return the amount of entries filled.
+ */
+size_t
+evperf_top(struct evperf_info *vec, size_t n)
+{
+	struct evperf_info *all, *p;
+	size_t count;
+
+	g_assert(vec != NULL || 0 == n);
+
+	if (NULL == evperf_table)
+		return 0;
+
+	count = g_hash_table_size(evperf_table);
+	if (0 == count)
+		return 0;
+
+	p = all = g_malloc(count * sizeof all[0]);
+	g_hash_table_foreach(evperf_table, evperf_collect, &p);
+	g_assert(ptr_diff(p, all) == count * sizeof all[0]);
+
+	qsort(all, count, sizeof all[0], evperf_wall_cmp);
+
+	n = MIN(n, count);
+	memcpy(vec, all, n * sizeof vec[0]);
+	G_FREE_NULL(all);
+
+	return n;
+}
+
+/**
+ * Fill supplied structure with the main loop iteration statistics.
+ */
+void
+evperf_loop_stats(struct evperf_loop *loop)
+{
+	g_assert(loop != NULL);
+
+	*loop = evperf_loop;		/* Struct copy */
+}
+
+/**
+ * @return short name for the kind of callbacks.
+ */
+const char *
+evperf_kind_to_string(evperf_kind_t kind)
+{
+	switch (kind) {
+	case EVPERF_INPUT:		return "I/O";
+	case EVPERF_CALLOUT:	return "CQ";
+	case EVPERF_BGTASK:		return "BG";
+	case EVPERF_KIND_COUNT:	break;
+	}
+
+	return "?";
+}
+
+static gboolean
+evperf_free_kv(gpointer unused_key, gpointer value, gpointer unused_data)
+{
+	struct evperf_info *info = value;
+
+	(void) unused_key;
+	(void) unused_data;
+
+	WFREE(info);
+	return TRUE;
+}
+
+/**
+ * Discard all the statistics collected so far.
+ */
+void
+evperf_reset(void)
+{
+	if (evperf_table != NULL)
+		g_hash_table_foreach_remove(evperf_table, evperf_free_kv, NULL);
+
+	ZERO(&evperf_loop);
+	evperf_awake = FALSE;
+}
+
+/**
+ * Final cleanup.
+ */
+void
+evperf_close(void)
+{
+	evperf_active = FALSE;
+	evperf_reset();
+	gm_hash_table_destroy_null(&evperf_table);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
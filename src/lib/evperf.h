@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Event loop profiling.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _evperf_h_
+#define _evperf_h_
+
+#include "common.h"
+
+#include "tm.h"
+
+/**
+ * Kind of callbacks being profiled.
+ */
+typedef enum evperf_kind {
+	EVPERF_INPUT = 0,		/**< I/O event handler, from inputevt */
+	EVPERF_CALLOUT,			/**< Callout queue event */
+	EVPERF_BGTASK,			/**< Background task step */
+
+	EVPERF_KIND_COUNT
+} evperf_kind_t;
+
+/**
+ * Measurement started by evperf_begin().
+ */
+struct evperf_mark {
+	tm_t wall;				/**< Wall-clock time at start */
+	double cpu;				/**< CPU time at start, in seconds */
+};
+
+/**
+ * Profiling information for a given callback, as returned by evperf_top().
+ */
+struct evperf_info {
+	const void *fn;			/**< Callback routine */
+	evperf_kind_t kind;		/**< Kind of callback */
+	guint64 calls;			/**< Amount of invocations */
+	guint64 wall;			/**< Total wall-clock time, in usecs */
+	guint64 wall_max;		/**< Max wall-clock time, in usecs */
+	guint64 cpu;			/**< Total CPU time, in usecs */
+	guint64 cpu_max;		/**< Max CPU time, in usecs */
+};
+
+#define EVPERF_HISTO_SLOTS	24	/**< Slot i counts [2^i, 2^(i+1)) usecs */
+
+/**
+ * Main loop iteration statistics, as returned by evperf_loop_stats().
+ */
+struct evperf_loop {
+	guint64 iterations;		/**< Amount of loop iterations measured */
+	guint64 busy;			/**< Total time spent working, in usecs */
+	guint64 busy_max;		/**< Longest iteration, in usecs */
+	guint64 histo[EVPERF_HISTO_SLOTS];	/**< Histogram of durations */
+};
+
+extern gboolean evperf_active;
+
+/**
+ * @return whether event loop profiling is enabled.
+ */
+static inline gboolean
+evperf_is_enabled(void)
+{
+	return evperf_active;
+}
+
+/*
+ * Public interface.
+ */
+
+void evperf_set_enabled(gboolean on);
+void evperf_begin(struct evperf_mark *m);
+void evperf_end(const struct evperf_mark *m,
+	evperf_kind_t kind, const void *fn);
+void evperf_loop_wakeup(void);
+void evperf_loop_sleep(void);
+size_t evperf_top(struct evperf_info *vec, size_t n);
+void evperf_loop_stats(struct evperf_loop *loop);
+const char *evperf_kind_to_string(evperf_kind_t kind);
+void evperf_reset(void);
+void evperf_close(void);
+
+#endif	/* _evperf_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
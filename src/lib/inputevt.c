@@ -66,6 +66,7 @@
 #undef HAS_EPOLL
 #undef HAS_KQUEUE
 #undef HAS_DEV_POLL
+#undef HAS_IO_URING
 
 /* The following lines are for test-compiling without MINGW */
 #if 0 && !defined(MINGW32)
@@ -106,13 +107,21 @@ typedef struct {
 #include <sys/devpoll.h>
 #endif /* HAS_DEV_POLL */
 
+#ifdef HAS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif /* HAS_IO_URING */
+
 #include "bit_array.h"
 #include "compat_poll.h"
+#include "evperf.h"
 #include "fd.h"
 #include "hashlist.h"
 #include "inputevt.h"
 #include "glib-missing.h"
 #include "misc.h"
+#include "stall.h"
 #include "tm.h"
 #include "walloc.h"
 #include "override.h"		/* Must be the last header included */
@@ -182,6 +191,7 @@ struct event {
 
 static const inputevt_handler_t zero_handler;
 static int (*default_poll_func)(GPollFD *, unsigned, int);
+static int inputevt_poll(GPollFD *gfds, unsigned n, int timeout_ms);
 
 struct poll_ctx {
 	inputevt_relay_t **relay;	/**< The relay contexts */
@@ -206,6 +216,11 @@ struct poll_ctx {
 	struct epoll_event *ep_arr;
 #endif	/* HAS_EPOLL */
 
+#ifdef HAS_IO_URING
+	struct uring *uring;		/**< The io_uring instance, if used */
+	struct event *ur_arr;		/**< Events harvested from the ring */
+#endif	/* HAS_IO_URING */
+
 	struct pollfd *pfd_arr;
 
 	/**
@@ -512,6 +527,412 @@ collect_events_with_devpoll(struct poll_ctx *ctx, int timeout_ms)
 }
 #endif	/* HAS_DEV_POLL */
 
+#ifdef HAS_IO_URING
+/*
+ * The io_uring backend arms a one-shot IORING_OP_POLL_ADD request for
+ * each monitored file descriptor.  Changes to the monitored conditions
+ * and the re-arming of the requests that completed are only queued in
+ * the submission ring, which is flushed with a single system call right
+ * before the main loop goes to sleep.  This saves one epoll_ctl() call
+ * per inputevt_add() or inputevt_remove().
+ *
+ * Each request carries the file descriptor and a generation number in its
+ * user data, so that completions of requests that were superseded since
+ * they were submitted are recognized and ignored.
+ */
+
+#define URING_ENTRIES		1024		/**< Submission ring size */
+#define URING_UDATA_IGNORE	((guint64) 1 << 63)	/**< Ignore completion */
+
+#ifndef IORING_SQ_CQ_OVERFLOW
+#define IORING_SQ_CQ_OVERFLOW	(1U << 1)	/* Linux 5.8, never set before */
+#endif
+
+#define URING_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define URING_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/**
+ * Polling state of a file descriptor.
+ */
+struct uring_fd {
+	guint32 gen;				/**< Generation of the armed request */
+	inputevt_cond_t cond;		/**< Monitored conditions */
+	unsigned armed:1;			/**< TRUE if a poll request is pending */
+	unsigned queued:1;			/**< TRUE if listed for re-arming */
+};
+
+/**
+ * An io_uring instance with its mapped rings.
+ */
+struct uring {
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned *sq_flags;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;				/**< NULL when sharing the SQ ring mapping */
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	unsigned sq_tail_local;		/**< Tail of the SQEs we filled */
+	struct uring_fd *fds;		/**< Indexed by file descriptor */
+	unsigned fds_count;			/**< Length of the "fds" array */
+	int *rearm;					/**< File descriptors to re-arm */
+	unsigned rearm_count;		/**< Amount of entries in "rearm" */
+	unsigned rearm_size;		/**< Length of the "rearm" array */
+};
+
+static inline int
+uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int
+uring_enter(int fd, unsigned to_submit, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, NULL, 0);
+}
+
+static inline guint64
+uring_udata(int fd, guint32 gen)
+{
+	return ((guint64) gen << 32) | (guint32) fd;
+}
+
+/**
+ * Submit all the queued requests to the kernel.
+ */
+static void
+uring_submit(struct poll_ctx *ctx)
+{
+	struct uring *u = ctx->uring;
+
+	while (u->sq_tail_local != URING_LOAD(u->sq_head)) {
+		int ret = uring_enter(ctx->master_fd,
+			u->sq_tail_local - URING_LOAD(u->sq_head), 0);
+
+		if (-1 == ret) {
+			if (EINTR == errno)
+				continue;
+			/* EAGAIN or EBUSY: retry after completions are reaped */
+			if (!is_temporary_error(errno) && EBUSY != errno)
+				g_warning("io_uring_enter() failed: %s", g_strerror(errno));
+			break;
+		}
+		if (0 == ret)
+			break;
+	}
+}
+
+/**
+ * Get a free submission entry, flushing the ring when it is full.
+ *
+ * @return the entry, NULL if the ring could not be flushed.
+ */
+static struct io_uring_sqe *
+uring_sqe_get(struct poll_ctx *ctx)
+{
+	struct uring *u = ctx->uring;
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (u->sq_tail_local - URING_LOAD(u->sq_head) >= u->sq_entries) {
+		uring_submit(ctx);
+		if (u->sq_tail_local - URING_LOAD(u->sq_head) >= u->sq_entries)
+			return NULL;
+	}
+
+	idx = u->sq_tail_local & u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	u->sq_array[idx] = idx;
+	u->sq_tail_local++;
+	URING_STORE(u->sq_tail, u->sq_tail_local);
+
+	return sqe;
+}
+
+static struct uring_fd *
+uring_fd_get(struct uring *u, int fd)
+{
+	g_assert(is_valid_fd(fd));
+
+	if (UNSIGNED(fd) >= u->fds_count) {
+		unsigned n = u->fds_count;
+
+		u->fds_count = MAX(UNSIGNED(fd) + 1, n << 1);
+		u->fds = g_realloc(u->fds, u->fds_count * sizeof u->fds[0]);
+		memset(&u->fds[n], 0, (u->fds_count - n) * sizeof u->fds[0]);
+	}
+
+	return &u->fds[fd];
+}
+
+/**
+ * Record that the poll request of a file descriptor must be (re-)armed.
+ */
+static void
+uring_rearm_later(struct uring *u, int fd)
+{
+	struct uring_fd *ufd = &u->fds[fd];
+
+	if (ufd->queued)
+		return;
+
+	if (u->rearm_count == u->rearm_size) {
+		u->rearm_size = 0 != u->rearm_size ? u->rearm_size << 1 : 64;
+		u->rearm = g_realloc(u->rearm, u->rearm_size * sizeof u->rearm[0]);
+	}
+	u->rearm[u->rearm_count++] = fd;
+	ufd->queued = TRUE;
+}
+
+/**
+ * Queue poll requests for all the file descriptors needing one and submit
+ * the pending requests.
+ */
+static void
+uring_flush(struct poll_ctx *ctx)
+{
+	struct uring *u = ctx->uring;
+	unsigned i;
+
+	for (i = 0; i < u->rearm_count; i++) {
+		int fd = u->rearm[i];
+		struct uring_fd *ufd = &u->fds[fd];
+		struct io_uring_sqe *sqe;
+
+		ufd->queued = FALSE;
+
+		if (ufd->armed || 0 == ufd->cond)
+			continue;
+
+		sqe = uring_sqe_get(ctx);
+		if (NULL == sqe) {
+			/* Keep the remaining ones for the next flush */
+			memmove(u->rearm, &u->rearm[i],
+				(u->rearm_count - i) * sizeof u->rearm[0]);
+			u->rearm_count -= i;
+			for (i = 0; i < u->rearm_count; i++)
+				u->fds[u->rearm[i]].queued = TRUE;
+			goto submit;
+		}
+
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll_events = 0
+			| (INPUT_EVENT_R & ufd->cond ? (POLLIN | POLLPRI) : 0)
+			| (INPUT_EVENT_W & ufd->cond ? POLLOUT : 0);
+		sqe->user_data = uring_udata(fd, ufd->gen);
+		ufd->armed = TRUE;
+	}
+	u->rearm_count = 0;
+
+submit:
+	uring_submit(ctx);
+}
+
+static int
+event_set_mask_with_uring(struct poll_ctx *ctx, int fd,
+	inputevt_cond_t old, inputevt_cond_t cur)
+{
+	struct uring *u = ctx->uring;
+	struct uring_fd *ufd;
+
+	old &= INPUT_EVENT_RW;
+	cur &= INPUT_EVENT_RW;
+	if (cur == old)
+		return 0;
+
+	ufd = uring_fd_get(u, fd);
+
+	if (ufd->armed) {
+		struct io_uring_sqe *sqe = uring_sqe_get(ctx);
+
+		if (NULL == sqe) {
+			errno = EAGAIN;
+			return -1;
+		}
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = uring_udata(fd, ufd->gen);
+		sqe->user_data = URING_UDATA_IGNORE;
+		ufd->armed = FALSE;
+	}
+
+	/*
+	 * Bumping the generation invalidates any completion of the previous
+	 * request that would still be sitting in the completion ring.
+	 */
+
+	ufd->gen++;
+	ufd->cond = cur;
+
+	if (0 != cur)
+		uring_rearm_later(u, fd);
+
+	return 0;
+}
+
+/**
+ * Have the kernel move the completions that overflowed the completion
+ * ring back into it, if any.
+ */
+static void
+uring_cq_overflow_flush(struct poll_ctx *ctx)
+{
+	struct uring *u = ctx->uring;
+
+	if (!(URING_LOAD(u->sq_flags) & IORING_SQ_CQ_OVERFLOW))
+		return;
+
+	while (
+		-1 == uring_enter(ctx->master_fd, 0, IORING_ENTER_GETEVENTS) &&
+		EINTR == errno
+	)
+		continue;
+}
+
+static int
+event_check_all_with_uring(struct poll_ctx *ctx)
+{
+	struct uring *u;
+	unsigned head, tail, start;
+	int n = 0;
+
+	g_assert(ctx);
+	g_assert(ctx->initialized);
+
+	u = ctx->uring;
+	uring_flush(ctx);
+
+	/*
+	 * Completions overflowing the ring are kept by the kernel until we
+	 * ask for them: they would never be seen, and their file descriptors
+	 * never re-armed, if we only harvested the ring.
+	 */
+
+again:
+	uring_cq_overflow_flush(ctx);
+
+	start = head = *u->cq_head;
+	tail = URING_LOAD(u->cq_tail);
+
+	while (head != tail && UNSIGNED(n) < ctx->num_ev) {
+		const struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+		guint64 udata = cqe->user_data;
+		struct uring_fd *ufd;
+		struct event *event;
+		int fd;
+
+		head++;
+
+		if (URING_UDATA_IGNORE & udata)
+			continue;
+
+		fd = (guint32) udata;
+		if (UNSIGNED(fd) >= u->fds_count)
+			continue;
+
+		ufd = &u->fds[fd];
+		if (ufd->gen != (guint32) (udata >> 32) || !ufd->armed)
+			continue;		/* Stale completion */
+
+		ufd->armed = FALSE;
+		uring_rearm_later(u, fd);
+
+		event = &ctx->ur_arr[n++];
+		event->fd = fd;
+		event->data_available = 0;
+
+		if (cqe->res < 0) {
+			event->condition = INPUT_EVENT_EXCEPTION | ufd->cond;
+		} else {
+			event->condition =
+				((POLLIN | POLLPRI | POLLHUP) & cqe->res ? INPUT_EVENT_R : 0)
+				| (POLLOUT & cqe->res ? INPUT_EVENT_W : 0)
+				| ((POLLERR | POLLNVAL) & cqe->res ?
+					INPUT_EVENT_EXCEPTION : 0);
+		}
+	}
+
+	URING_STORE(u->cq_head, head);
+
+	/*
+	 * Room was made in the ring, more overflowed completions can come in.
+	 */
+
+	if (
+		head != start && UNSIGNED(n) < ctx->num_ev &&
+		(URING_LOAD(u->sq_flags) & IORING_SQ_CQ_OVERFLOW)
+	)
+		goto again;
+
+	return n;
+}
+
+static struct event
+event_get_with_uring(const struct poll_ctx *ctx, unsigned idx)
+{
+	return ctx->ur_arr[idx];
+}
+
+/**
+ * Poll function used with io_uring: submits the queued requests and
+ * flushes overflowed completions before the main loop sleeps.
+ */
+static int
+poll_func_with_uring(GPollFD *gfds, unsigned n, int timeout_ms)
+{
+	struct poll_ctx *ctx = get_global_poll_ctx();
+	struct uring *u = ctx->uring;
+
+	if (
+		u->rearm_count != 0 ||
+		u->sq_tail_local != URING_LOAD(u->sq_head)
+	) {
+		uring_flush(ctx);
+	}
+
+	/*
+	 * Bring back completions that overflowed the ring, if any, otherwise
+	 * the ring descriptor may not be readable although events are pending.
+	 */
+
+	uring_cq_overflow_flush(ctx);
+
+	return inputevt_poll(gfds, n, timeout_ms);
+}
+
+static void
+uring_free(struct poll_ctx *ctx)
+{
+	struct uring *u = ctx->uring;
+
+	if (NULL == u)
+		return;
+
+	if (u->sqes != NULL && MAP_FAILED != (void *) u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != NULL && MAP_FAILED != u->cq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring != NULL && MAP_FAILED != u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_size);
+	G_FREE_NULL(u->fds);
+	G_FREE_NULL(u->rearm);
+	WFREE(u);
+	ctx->uring = NULL;
+}
+#endif	/* HAS_IO_URING */
+
 static int
 event_set_mask_with_poll(struct poll_ctx *ctx, int fd,
 	inputevt_cond_t old, inputevt_cond_t cur)
@@ -805,6 +1226,29 @@ inputevt_purge_removed(struct poll_ctx *ctx)
 	gm_slist_free_null(&ctx->removed);
 }
 
+/**
+ * Invoke the handler of the relay, measuring the time it takes when
+ * event loop profiling is enabled.
+ */
+static inline void
+inputevt_dispatch(const inputevt_relay_t *relay, inputevt_cond_t condition)
+{
+	if (G_UNLIKELY(evperf_is_enabled())) {
+		inputevt_handler_t handler = relay->handler;
+		struct evperf_mark mark;
+
+		/*
+		 * The relay may be zeroed by the handler, hence the copy.
+		 */
+
+		evperf_begin(&mark);
+		(*handler)(relay->data, relay->fd, condition);
+		evperf_end(&mark, EVPERF_INPUT, func_to_pointer(handler));
+	} else {
+		relay->handler(relay->data, relay->fd, condition);
+	}
+}
+
 static G_GNUC_HOT void
 inputevt_timer(struct poll_ctx *ctx)
 {
@@ -865,7 +1309,7 @@ inputevt_timer(struct poll_ctx *ctx)
 
 				if (relay->condition & event.condition) {
 					data_available = event.data_available;
-					relay->handler(relay->data, relay->fd, event.condition);
+					inputevt_dispatch(relay, event.condition);
 				}
 			}
 		}
@@ -912,7 +1356,7 @@ inputevt_timer(struct poll_ctx *ctx)
 
 				if (INPUT_EVENT_R & relay->condition) {
 					data_available = 0;
-					relay->handler(relay->data, relay->fd, INPUT_EVENT_R);
+					inputevt_dispatch(relay, INPUT_EVENT_R);
 				}
 			}
 		}
@@ -926,6 +1370,25 @@ inputevt_timer(struct poll_ctx *ctx)
 	}
 }
 
+/**
+ * Wait for events using the default poll function, letting the event loop
+ * profiler and the stall detector know where main loop iterations begin
+ * and end.
+ */
+static int
+inputevt_poll(GPollFD *gfds, unsigned n, int timeout_ms)
+{
+	int r;
+
+	evperf_loop_sleep();
+	stall_loop_sleep();
+	r = default_poll_func(gfds, n, timeout_ms);
+	stall_loop_wakeup();
+	evperf_loop_wakeup();
+
+	return r;
+}
+
 static gboolean
 dispatch_poll(GIOChannel *unused_source,
 	GIOCondition unused_cond, void *udata)
@@ -955,7 +1418,7 @@ poll_func(GPollFD *gfds, unsigned n, int timeout_ms)
 		dispatch_poll(NULL, 0, ctx);
 	}
 
-	r = default_poll_func(gfds, n, timeout_ms);
+	r = inputevt_poll(gfds, n, timeout_ms);
 
 #ifdef INPUTEVT_DEBUGGING
 	if (-1 == r) {
@@ -1106,6 +1569,13 @@ inputevt_add_source(inputevt_relay_t *relay)
 		}
 #endif	/* HAS_EPOLL */
 
+#ifdef HAS_IO_URING
+		{
+			size_t size = ctx->num_ev * sizeof ctx->ur_arr[0];
+			ctx->ur_arr = g_realloc(ctx->ur_arr, size);
+		}
+#endif	/* HAS_IO_URING */
+
 		{
 			size_t size = ctx->num_ev * sizeof ctx->pfd_arr[0];
 			ctx->pfd_arr = g_realloc(ctx->pfd_arr, size);
@@ -1226,7 +1696,7 @@ init_with_kqueue(struct poll_ctx *ctx)
 		return -1;
 	}
 
-	g_main_context_set_poll_func(NULL, default_poll_func);
+	g_main_context_set_poll_func(NULL, inputevt_poll);
 	ctx->master_fd = fd;
 	ctx->polling_method = "kqueue()";
 	ctx->collect_events = NULL; /* master fd can be polled */
@@ -1254,7 +1724,7 @@ init_with_devpoll(struct poll_ctx *ctx)
 		return -1;
 	}
 
-	g_main_context_set_poll_func(NULL, default_poll_func);
+	g_main_context_set_poll_func(NULL, inputevt_poll);
 	ctx->master_fd = fd;
 	ctx->polling_method = "/dev/poll";
 	ctx->collect_events = collect_events_with_devpoll;
@@ -1282,7 +1752,7 @@ init_with_epoll(struct poll_ctx *ctx)
 		return -1;
 	}
 
-	g_main_context_set_poll_func(NULL, default_poll_func);
+	g_main_context_set_poll_func(NULL, inputevt_poll);
 	ctx->master_fd = fd;
 	ctx->polling_method = "epoll()";
 	ctx->collect_events = NULL; /* master fd can be polled */
@@ -1299,6 +1769,115 @@ init_with_epoll(struct poll_ctx *ctx)
 }
 #endif	/* HAS_EPOLL */
 
+static int
+init_with_uring(struct poll_ctx *ctx)
+#ifdef HAS_IO_URING
+{
+	struct io_uring_params params;
+	struct uring *u;
+	int fd;
+
+	ZERO(&params);
+	fd = uring_setup(URING_ENTRIES, &params);
+
+	if (!is_valid_fd(fd)) {
+		if (ENOSYS != errno && EPERM != errno)
+			g_warning("io_uring_setup() failed: %s", g_strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * Without IORING_FEAT_NODROP, completions overflowing the completion
+	 * ring would be lost and the corresponding sockets never polled again.
+	 */
+
+	if (!(params.features & IORING_FEAT_NODROP)) {
+		if (inputevt_debug)
+			g_debug("io_uring lacks IORING_FEAT_NODROP, not using it");
+		close(fd);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	WALLOC0(u);
+	ctx->uring = u;
+	ctx->master_fd = get_non_stdio_fd(fd);
+
+	u->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		u->sq_ring_size = MAX(u->sq_ring_size, u->cq_ring_size);
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ctx->master_fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == u->sq_ring)
+		goto failed;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = NULL;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ctx->master_fd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == u->cq_ring)
+			goto failed;
+	}
+
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ctx->master_fd, IORING_OFF_SQES);
+	if (MAP_FAILED == (void *) u->sqes)
+		goto failed;
+
+	{
+		char *sq = u->sq_ring;
+		char *cq = NULL == u->cq_ring ? u->sq_ring : u->cq_ring;
+
+		u->sq_head = (unsigned *) (sq + params.sq_off.head);
+		u->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+		u->sq_array = (unsigned *) (sq + params.sq_off.array);
+		u->sq_flags = (unsigned *) (sq + params.sq_off.flags);
+		u->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+		u->sq_entries = *(unsigned *) (sq + params.sq_off.ring_entries);
+		u->cq_head = (unsigned *) (cq + params.cq_off.head);
+		u->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+		u->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+		u->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+		u->sq_tail_local = *u->sq_tail;
+	}
+
+	g_main_context_set_poll_func(NULL, poll_func_with_uring);
+	ctx->polling_method = "io_uring";
+	ctx->collect_events = NULL; /* master fd can be polled */
+	ctx->event_check_all = event_check_all_with_uring;
+	ctx->event_get = event_get_with_uring;
+	ctx->event_set_mask = event_set_mask_with_uring;
+	return 0;
+
+failed:
+	g_warning("mmap() of io_uring rings failed: %s", g_strerror(errno));
+	if (MAP_FAILED == u->sq_ring)
+		u->sq_ring = NULL;
+	if (MAP_FAILED == u->cq_ring)
+		u->cq_ring = NULL;
+	if (MAP_FAILED == (void *) u->sqes)
+		u->sqes = NULL;
+	uring_free(ctx);
+	fd_close(&ctx->master_fd);
+	return -1;
+}
+#else
+{
+	(void) ctx;
+	errno = ENOTSUP;
+	return -1;
+}
+#endif	/* HAS_IO_URING */
+
 static int
 init_with_poll(struct poll_ctx *ctx)
 {
@@ -1324,10 +1903,13 @@ init_with_poll(struct poll_ctx *ctx)
 
 /**
  * Performs module initialization.
- * @param use_poll If TRUE, kqueue(), epoll(), /dev/poll etc. won't be used.
+ *
+ * @param flags		INPUTEVT_F_POLL to use poll() instead of kqueue(), epoll(),
+ *					/dev/poll etc., INPUTEVT_F_URING to use io_uring when the
+ *					kernel supports it.
  */
 void
-inputevt_init(int use_poll)
+inputevt_init(unsigned flags)
 {
 	struct poll_ctx *ctx;
 
@@ -1340,7 +1922,11 @@ inputevt_init(int use_poll)
 
 	init_with_poll(ctx); /* Must be called first and provides the default */
 
-	if (!use_poll) {
+	if (INPUTEVT_F_POLL & flags) {
+		/* Stick to poll() */
+	} else if ((INPUTEVT_F_URING & flags) && 0 == init_with_uring(ctx)) {
+		/* Using io_uring */
+	} else {
 		if (init_with_kqueue(ctx)) {
 			if (init_with_epoll(ctx)) {
 				init_with_devpoll(ctx);
@@ -1438,6 +2024,10 @@ inputevt_close(void)
 	G_FREE_NULL(ctx->used_event_id);
 	G_FREE_NULL(ctx->relay);
 	G_FREE_NULL(ctx->pfd_arr);
+#ifdef HAS_IO_URING
+	uring_free(ctx);
+	G_FREE_NULL(ctx->ur_arr);
+#endif	/* HAS_IO_URING */
 	fd_close(&ctx->master_fd);
 	ctx->initialized = FALSE;
 }
@@ -63,11 +63,19 @@ typedef void (*inputevt_handler_t) (
 	inputevt_cond_t condition
 );
 
+/**
+ * Flags for inputevt_init().
+ */
+enum {
+	INPUTEVT_F_POLL		= 1 << 0,	/**< Use poll() only */
+	INPUTEVT_F_URING	= 1 << 1	/**< Use io_uring when available */
+};
+
 /*
  * Module initialization and cleanup functions.
  * These don't do anything and are not called (yet).
  */
-void inputevt_init(int use_poll);
+void inputevt_init(unsigned flags);
 void inputevt_close(void);
 void inputevt_dispatch(void);
 
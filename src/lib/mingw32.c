@@ -2498,7 +2498,6 @@ mingw_adns_init(void)
 	 * modify global variables from the ADNS thread! Dynamic memory
 	 * allocation is absolutely forbidden.
  	 */
-	g_thread_init(NULL);
 	mingw_gtkg_main_async_queue = g_async_queue_new();
 	mingw_gtkg_adns_async_queue = g_async_queue_new();
 
@@ -55,6 +55,14 @@
  *      implementation only works with messages with a length that is
  *      a multiple of the size of an 8-bit character.
  *
+ *  Block engines:
+ *      Whole 512-bit blocks are processed straight from the input
+ *      buffer by one of several engines: an unrolled scalar version,
+ *      one computing the message schedule with SSSE3 vectors and one
+ *      using the SHA extensions of x86 processors.  The engine is
+ *      selected at runtime amongst those the CPU supports, after they
+ *      all passed the known-answer tests.
+ *
  * @note
  * This file comes from RFC 3174. Inclusion in gtk-gnutella is:
  *
@@ -65,7 +73,25 @@
 #include "common.h"
 #include "endian.h"
 #include "sha1.h"
+#include "ascii.h"
+#include "debug.h"
+#include "halloc.h"
 #include "misc.h"			/* For RCSID */
+#include "tm.h"
+
+/*
+ * The accelerated engines are compiled with target-specific attributes so
+ * that the remainder of the file does not require any special CPU, and
+ * they are only used after checking the CPU supports them.
+ */
+#if \
+	(defined(__x86_64__) || defined(__i386__)) && \
+	(HAS_GCC(4, 9) || (defined(__clang__) && __clang_major__ >= 4))
+#define SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #include "override.h"		/* Must be the last header included */
 
 /**
@@ -75,8 +101,528 @@
                 (((word) << (bits)) | ((word) >> (32-(bits))))
 
 /* Local Function Prototyptes */
-void SHA1PadMessage(SHA1Context *);
-void SHA1ProcessMessageBlock(SHA1Context *);
+static void SHA1PadMessage(SHA1Context *);
+
+/***
+ *** SHA-1 block engines.
+ ***
+ *** An engine processes an arbitrary amount of consecutive 64-byte blocks
+ *** from memory that need not be aligned, updating the intermediate hash.
+ ***/
+
+typedef void (*sha1_blocks_t)(guint32 *hash, const void *data, size_t n);
+
+#define K1	0x5A827999U
+#define K2	0x6ED9EBA1U
+#define K3	0x8F1BBCDCU
+#define K4	0xCA62C1D6U
+
+/* Optimizing "(B & C) | (~B & D)" into "D ^ (B & (C ^ D))" */
+#define SHA1_F1(b, c, d)	((d) ^ ((b) & ((c) ^ (d))))
+#define SHA1_F2(b, c, d)	((b) ^ (c) ^ (d))
+/* Optimizing "(B & C) | (B & D) | (C & D)" into "(B & C) | (D & (B | C))" */
+#define SHA1_F3(b, c, d)	(((b) & (c)) | ((d) & ((b) | (c))))
+
+/*
+ * One round, with "x" being the message word plus the round constant.
+ *
+ * Instead of shifting all the working variables at each round, the
+ * callers rotate the names of the arguments, which lets the compiler
+ * keep everything in registers.
+ */
+#define SHA1_ROUND(f, x, a, b, c, d, e) do {				\
+	e += SHA1CircularShift(5, a) + SHA1_##f(b, c, d) + (x);	\
+	b = SHA1CircularShift(30, b);							\
+} while (0)
+
+/*
+ * The scalar engine only keeps the last 16 words of the message schedule,
+ * computing them as the rounds need them.
+ */
+#define SHA1_W(t)	W[(t) & 15]
+#define SHA1_SRC(t)	(SHA1_W(t) = peek_be32(&p[(t) * 4]))
+#define SHA1_MIX(t)	(SHA1_W(t) = SHA1CircularShift(1, \
+	SHA1_W((t) + 13) ^ SHA1_W((t) + 8) ^ SHA1_W((t) + 2) ^ SHA1_W(t)))
+
+/**
+ * Portable engine, fully unrolled.
+ */
+static G_GNUC_HOT void
+sha1_blocks_scalar(guint32 *hash, const void *data, size_t n)
+{
+	const unsigned char *p = data;
+	guint32 A, B, C, D, E;
+	guint32 W[16];
+
+	A = hash[0];
+	B = hash[1];
+	C = hash[2];
+	D = hash[3];
+	E = hash[4];
+
+	while (n-- != 0) {
+		SHA1_ROUND(F1, K1 + SHA1_SRC(0), A, B, C, D, E);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(1), E, A, B, C, D);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(2), D, E, A, B, C);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(3), C, D, E, A, B);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(4), B, C, D, E, A);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(5), A, B, C, D, E);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(6), E, A, B, C, D);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(7), D, E, A, B, C);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(8), C, D, E, A, B);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(9), B, C, D, E, A);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(10), A, B, C, D, E);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(11), E, A, B, C, D);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(12), D, E, A, B, C);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(13), C, D, E, A, B);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(14), B, C, D, E, A);
+		SHA1_ROUND(F1, K1 + SHA1_SRC(15), A, B, C, D, E);
+		SHA1_ROUND(F1, K1 + SHA1_MIX(16), E, A, B, C, D);
+		SHA1_ROUND(F1, K1 + SHA1_MIX(17), D, E, A, B, C);
+		SHA1_ROUND(F1, K1 + SHA1_MIX(18), C, D, E, A, B);
+		SHA1_ROUND(F1, K1 + SHA1_MIX(19), B, C, D, E, A);
+
+		SHA1_ROUND(F2, K2 + SHA1_MIX(20), A, B, C, D, E);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(21), E, A, B, C, D);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(22), D, E, A, B, C);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(23), C, D, E, A, B);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(24), B, C, D, E, A);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(25), A, B, C, D, E);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(26), E, A, B, C, D);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(27), D, E, A, B, C);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(28), C, D, E, A, B);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(29), B, C, D, E, A);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(30), A, B, C, D, E);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(31), E, A, B, C, D);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(32), D, E, A, B, C);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(33), C, D, E, A, B);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(34), B, C, D, E, A);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(35), A, B, C, D, E);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(36), E, A, B, C, D);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(37), D, E, A, B, C);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(38), C, D, E, A, B);
+		SHA1_ROUND(F2, K2 + SHA1_MIX(39), B, C, D, E, A);
+
+		SHA1_ROUND(F3, K3 + SHA1_MIX(40), A, B, C, D, E);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(41), E, A, B, C, D);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(42), D, E, A, B, C);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(43), C, D, E, A, B);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(44), B, C, D, E, A);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(45), A, B, C, D, E);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(46), E, A, B, C, D);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(47), D, E, A, B, C);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(48), C, D, E, A, B);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(49), B, C, D, E, A);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(50), A, B, C, D, E);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(51), E, A, B, C, D);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(52), D, E, A, B, C);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(53), C, D, E, A, B);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(54), B, C, D, E, A);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(55), A, B, C, D, E);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(56), E, A, B, C, D);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(57), D, E, A, B, C);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(58), C, D, E, A, B);
+		SHA1_ROUND(F3, K3 + SHA1_MIX(59), B, C, D, E, A);
+
+		SHA1_ROUND(F2, K4 + SHA1_MIX(60), A, B, C, D, E);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(61), E, A, B, C, D);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(62), D, E, A, B, C);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(63), C, D, E, A, B);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(64), B, C, D, E, A);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(65), A, B, C, D, E);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(66), E, A, B, C, D);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(67), D, E, A, B, C);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(68), C, D, E, A, B);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(69), B, C, D, E, A);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(70), A, B, C, D, E);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(71), E, A, B, C, D);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(72), D, E, A, B, C);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(73), C, D, E, A, B);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(74), B, C, D, E, A);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(75), A, B, C, D, E);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(76), E, A, B, C, D);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(77), D, E, A, B, C);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(78), C, D, E, A, B);
+		SHA1_ROUND(F2, K4 + SHA1_MIX(79), B, C, D, E, A);
+
+		A = hash[0] += A;
+		B = hash[1] += B;
+		C = hash[2] += C;
+		D = hash[3] += D;
+		E = hash[4] += E;
+
+		p += 64;
+	}
+}
+
+#ifdef SHA1_X86
+
+#define SHA1_ROL_EPI32(v, n) \
+	_mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+/**
+ * Engine computing the message schedule 4 words at a time with SSSE3,
+ * off the critical path of the rounds which are done by the scalar unit.
+ *
+ * Words 16 to 31 use the regular recurrence, the last lane of each vector
+ * being fixed afterwards since it depends on the first lane.  From word 32
+ * on, the equivalent recurrence W[t] = (W[t-6] ^ W[t-16] ^ W[t-28] ^
+ * W[t-32]) <<< 2 has no dependency within a vector.
+ */
+static G_GNUC_HOT void __attribute__((target("ssse3")))
+sha1_blocks_ssse3(guint32 *hash, const void *data, size_t n)
+{
+	const unsigned char *p = data;
+	const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+		4, 5, 6, 7, 0, 1, 2, 3);
+	__m128i K[4];
+	guint32 A, B, C, D, E;
+	guint32 wk[80] __attribute__((aligned(16)));
+
+	K[0] = _mm_set1_epi32(K1);
+	K[1] = _mm_set1_epi32(K2);
+	K[2] = _mm_set1_epi32(K3);
+	K[3] = _mm_set1_epi32(K4);
+
+	A = hash[0];
+	B = hash[1];
+	C = hash[2];
+	D = hash[3];
+	E = hash[4];
+
+	while (n-- != 0) {
+		__m128i W[20];
+		int i;
+
+		for (i = 0; i < 4; i++) {
+			W[i] = _mm_shuffle_epi8(
+				_mm_loadu_si128((const void *) &p[i * 16]), bswap);
+		}
+
+		for (i = 4; i < 8; i++) {
+			__m128i v, fix;
+
+			v = _mm_xor_si128(W[i - 4], _mm_alignr_epi8(W[i - 3], W[i - 4], 8));
+			v = _mm_xor_si128(v, W[i - 2]);
+			v = _mm_xor_si128(v, _mm_srli_si128(W[i - 1], 4));
+			v = SHA1_ROL_EPI32(v, 1);
+			fix = _mm_slli_si128(v, 12);
+			W[i] = _mm_xor_si128(v, SHA1_ROL_EPI32(fix, 1));
+		}
+
+		for (i = 8; i < 20; i++) {
+			__m128i v;
+
+			v = _mm_xor_si128(_mm_alignr_epi8(W[i - 1], W[i - 2], 8), W[i - 4]);
+			v = _mm_xor_si128(v, W[i - 7]);
+			v = _mm_xor_si128(v, W[i - 8]);
+			W[i] = SHA1_ROL_EPI32(v, 2);
+		}
+
+		for (i = 0; i < 20; i++) {
+			_mm_store_si128((void *) &wk[i * 4], _mm_add_epi32(W[i], K[i / 5]));
+		}
+
+		SHA1_ROUND(F1, wk[0], A, B, C, D, E);
+		SHA1_ROUND(F1, wk[1], E, A, B, C, D);
+		SHA1_ROUND(F1, wk[2], D, E, A, B, C);
+		SHA1_ROUND(F1, wk[3], C, D, E, A, B);
+		SHA1_ROUND(F1, wk[4], B, C, D, E, A);
+		SHA1_ROUND(F1, wk[5], A, B, C, D, E);
+		SHA1_ROUND(F1, wk[6], E, A, B, C, D);
+		SHA1_ROUND(F1, wk[7], D, E, A, B, C);
+		SHA1_ROUND(F1, wk[8], C, D, E, A, B);
+		SHA1_ROUND(F1, wk[9], B, C, D, E, A);
+		SHA1_ROUND(F1, wk[10], A, B, C, D, E);
+		SHA1_ROUND(F1, wk[11], E, A, B, C, D);
+		SHA1_ROUND(F1, wk[12], D, E, A, B, C);
+		SHA1_ROUND(F1, wk[13], C, D, E, A, B);
+		SHA1_ROUND(F1, wk[14], B, C, D, E, A);
+		SHA1_ROUND(F1, wk[15], A, B, C, D, E);
+		SHA1_ROUND(F1, wk[16], E, A, B, C, D);
+		SHA1_ROUND(F1, wk[17], D, E, A, B, C);
+		SHA1_ROUND(F1, wk[18], C, D, E, A, B);
+		SHA1_ROUND(F1, wk[19], B, C, D, E, A);
+
+		SHA1_ROUND(F2, wk[20], A, B, C, D, E);
+		SHA1_ROUND(F2, wk[21], E, A, B, C, D);
+		SHA1_ROUND(F2, wk[22], D, E, A, B, C);
+		SHA1_ROUND(F2, wk[23], C, D, E, A, B);
+		SHA1_ROUND(F2, wk[24], B, C, D, E, A);
+		SHA1_ROUND(F2, wk[25], A, B, C, D, E);
+		SHA1_ROUND(F2, wk[26], E, A, B, C, D);
+		SHA1_ROUND(F2, wk[27], D, E, A, B, C);
+		SHA1_ROUND(F2, wk[28], C, D, E, A, B);
+		SHA1_ROUND(F2, wk[29], B, C, D, E, A);
+		SHA1_ROUND(F2, wk[30], A, B, C, D, E);
+		SHA1_ROUND(F2, wk[31], E, A, B, C, D);
+		SHA1_ROUND(F2, wk[32], D, E, A, B, C);
+		SHA1_ROUND(F2, wk[33], C, D, E, A, B);
+		SHA1_ROUND(F2, wk[34], B, C, D, E, A);
+		SHA1_ROUND(F2, wk[35], A, B, C, D, E);
+		SHA1_ROUND(F2, wk[36], E, A, B, C, D);
+		SHA1_ROUND(F2, wk[37], D, E, A, B, C);
+		SHA1_ROUND(F2, wk[38], C, D, E, A, B);
+		SHA1_ROUND(F2, wk[39], B, C, D, E, A);
+
+		SHA1_ROUND(F3, wk[40], A, B, C, D, E);
+		SHA1_ROUND(F3, wk[41], E, A, B, C, D);
+		SHA1_ROUND(F3, wk[42], D, E, A, B, C);
+		SHA1_ROUND(F3, wk[43], C, D, E, A, B);
+		SHA1_ROUND(F3, wk[44], B, C, D, E, A);
+		SHA1_ROUND(F3, wk[45], A, B, C, D, E);
+		SHA1_ROUND(F3, wk[46], E, A, B, C, D);
+		SHA1_ROUND(F3, wk[47], D, E, A, B, C);
+		SHA1_ROUND(F3, wk[48], C, D, E, A, B);
+		SHA1_ROUND(F3, wk[49], B, C, D, E, A);
+		SHA1_ROUND(F3, wk[50], A, B, C, D, E);
+		SHA1_ROUND(F3, wk[51], E, A, B, C, D);
+		SHA1_ROUND(F3, wk[52], D, E, A, B, C);
+		SHA1_ROUND(F3, wk[53], C, D, E, A, B);
+		SHA1_ROUND(F3, wk[54], B, C, D, E, A);
+		SHA1_ROUND(F3, wk[55], A, B, C, D, E);
+		SHA1_ROUND(F3, wk[56], E, A, B, C, D);
+		SHA1_ROUND(F3, wk[57], D, E, A, B, C);
+		SHA1_ROUND(F3, wk[58], C, D, E, A, B);
+		SHA1_ROUND(F3, wk[59], B, C, D, E, A);
+
+		SHA1_ROUND(F2, wk[60], A, B, C, D, E);
+		SHA1_ROUND(F2, wk[61], E, A, B, C, D);
+		SHA1_ROUND(F2, wk[62], D, E, A, B, C);
+		SHA1_ROUND(F2, wk[63], C, D, E, A, B);
+		SHA1_ROUND(F2, wk[64], B, C, D, E, A);
+		SHA1_ROUND(F2, wk[65], A, B, C, D, E);
+		SHA1_ROUND(F2, wk[66], E, A, B, C, D);
+		SHA1_ROUND(F2, wk[67], D, E, A, B, C);
+		SHA1_ROUND(F2, wk[68], C, D, E, A, B);
+		SHA1_ROUND(F2, wk[69], B, C, D, E, A);
+		SHA1_ROUND(F2, wk[70], A, B, C, D, E);
+		SHA1_ROUND(F2, wk[71], E, A, B, C, D);
+		SHA1_ROUND(F2, wk[72], D, E, A, B, C);
+		SHA1_ROUND(F2, wk[73], C, D, E, A, B);
+		SHA1_ROUND(F2, wk[74], B, C, D, E, A);
+		SHA1_ROUND(F2, wk[75], A, B, C, D, E);
+		SHA1_ROUND(F2, wk[76], E, A, B, C, D);
+		SHA1_ROUND(F2, wk[77], D, E, A, B, C);
+		SHA1_ROUND(F2, wk[78], C, D, E, A, B);
+		SHA1_ROUND(F2, wk[79], B, C, D, E, A);
+
+		A = hash[0] += A;
+		B = hash[1] += B;
+		C = hash[2] += C;
+		D = hash[3] += D;
+		E = hash[4] += E;
+
+		p += 64;
+	}
+}
+
+/*
+ * Four rounds with the SHA extensions, "ein" holding E for these rounds
+ * and "eout" saving the state from which E is derived for the next ones.
+ */
+#define SHA1_NI_ROUNDS(f, ein, eout, m) do {	\
+	ein = _mm_sha1nexte_epu32(ein, m);			\
+	eout = abcd;								\
+	abcd = _mm_sha1rnds4_epu32(abcd, ein, f);	\
+} while (0)
+
+#define SHA1_NI_MSG1(a, b)	a = _mm_sha1msg1_epu32(a, b)
+#define SHA1_NI_MSG2(a, b)	a = _mm_sha1msg2_epu32(a, b)
+#define SHA1_NI_XOR(a, b)	a = _mm_xor_si128(a, b)
+
+/**
+ * Engine using the SHA extensions of x86 processors.
+ */
+static G_GNUC_HOT void __attribute__((target("sha,sse4.1,ssse3")))
+sha1_blocks_shani(guint32 *hash, const void *data, size_t n)
+{
+	const unsigned char *p = data;
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+		8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i abcd, e0, e1, m0, m1, m2, m3;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const void *) hash), 0x1B);
+	e0 = _mm_set_epi32(hash[4], 0, 0, 0);
+
+	while (n-- != 0) {
+		__m128i abcd_save = abcd, e0_save = e0;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const void *) &p[0]), bswap);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const void *) &p[16]), bswap);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const void *) &p[32]), bswap);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const void *) &p[48]), bswap);
+
+		/* Rounds 0-19 */
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		SHA1_NI_ROUNDS(0, e1, e0, m1);
+		SHA1_NI_MSG1(m0, m1);
+		SHA1_NI_ROUNDS(0, e0, e1, m2);
+		SHA1_NI_MSG1(m1, m2); SHA1_NI_XOR(m0, m2);
+		SHA1_NI_ROUNDS(0, e1, e0, m3);
+		SHA1_NI_MSG2(m0, m3); SHA1_NI_MSG1(m2, m3); SHA1_NI_XOR(m1, m3);
+		SHA1_NI_ROUNDS(0, e0, e1, m0);
+		SHA1_NI_MSG2(m1, m0); SHA1_NI_MSG1(m3, m0); SHA1_NI_XOR(m2, m0);
+
+		/* Rounds 20-39 */
+		SHA1_NI_ROUNDS(1, e1, e0, m1);
+		SHA1_NI_MSG2(m2, m1); SHA1_NI_MSG1(m0, m1); SHA1_NI_XOR(m3, m1);
+		SHA1_NI_ROUNDS(1, e0, e1, m2);
+		SHA1_NI_MSG2(m3, m2); SHA1_NI_MSG1(m1, m2); SHA1_NI_XOR(m0, m2);
+		SHA1_NI_ROUNDS(1, e1, e0, m3);
+		SHA1_NI_MSG2(m0, m3); SHA1_NI_MSG1(m2, m3); SHA1_NI_XOR(m1, m3);
+		SHA1_NI_ROUNDS(1, e0, e1, m0);
+		SHA1_NI_MSG2(m1, m0); SHA1_NI_MSG1(m3, m0); SHA1_NI_XOR(m2, m0);
+		SHA1_NI_ROUNDS(1, e1, e0, m1);
+		SHA1_NI_MSG2(m2, m1); SHA1_NI_MSG1(m0, m1); SHA1_NI_XOR(m3, m1);
+
+		/* Rounds 40-59 */
+		SHA1_NI_ROUNDS(2, e0, e1, m2);
+		SHA1_NI_MSG2(m3, m2); SHA1_NI_MSG1(m1, m2); SHA1_NI_XOR(m0, m2);
+		SHA1_NI_ROUNDS(2, e1, e0, m3);
+		SHA1_NI_MSG2(m0, m3); SHA1_NI_MSG1(m2, m3); SHA1_NI_XOR(m1, m3);
+		SHA1_NI_ROUNDS(2, e0, e1, m0);
+		SHA1_NI_MSG2(m1, m0); SHA1_NI_MSG1(m3, m0); SHA1_NI_XOR(m2, m0);
+		SHA1_NI_ROUNDS(2, e1, e0, m1);
+		SHA1_NI_MSG2(m2, m1); SHA1_NI_MSG1(m0, m1); SHA1_NI_XOR(m3, m1);
+		SHA1_NI_ROUNDS(2, e0, e1, m2);
+		SHA1_NI_MSG2(m3, m2); SHA1_NI_MSG1(m1, m2); SHA1_NI_XOR(m0, m2);
+
+		/* Rounds 60-79 */
+		SHA1_NI_ROUNDS(3, e1, e0, m3);
+		SHA1_NI_MSG2(m0, m3); SHA1_NI_MSG1(m2, m3); SHA1_NI_XOR(m1, m3);
+		SHA1_NI_ROUNDS(3, e0, e1, m0);
+		SHA1_NI_MSG2(m1, m0); SHA1_NI_MSG1(m3, m0); SHA1_NI_XOR(m2, m0);
+		SHA1_NI_ROUNDS(3, e1, e0, m1);
+		SHA1_NI_MSG2(m2, m1); SHA1_NI_XOR(m3, m1);
+		SHA1_NI_ROUNDS(3, e0, e1, m2);
+		SHA1_NI_MSG2(m3, m2);
+		SHA1_NI_ROUNDS(3, e1, e0, m3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+
+		p += 64;
+	}
+
+	_mm_storeu_si128((void *) hash, _mm_shuffle_epi32(abcd, 0x1B));
+	hash[4] = _mm_extract_epi32(e0, 3);
+}
+
+/**
+ * @return whether CPU supports SSSE3.
+ */
+static gboolean
+sha1_cpu_ssse3(void)
+{
+	unsigned eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return FALSE;
+
+	return booleanize(ecx & (1U << 9));
+}
+
+/**
+ * @return whether CPU supports the SHA extensions, and SSE4.1 we also use.
+ */
+static gboolean
+sha1_cpu_shani(void)
+{
+	unsigned eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return FALSE;
+
+	if (0 == (ecx & (1U << 19)) || 0 == (ecx & (1U << 9)))
+		return FALSE;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return FALSE;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	return booleanize(ebx & (1U << 29));
+}
+#endif	/* SHA1_X86 */
+
+/**
+ * Known block engines, by order of preference.
+ */
+static const struct sha1_engine {
+	const char *name;
+	sha1_blocks_t blocks;
+	gboolean (*supported)(void);
+} sha1_engines[] = {
+#ifdef SHA1_X86
+	{ "SHA-NI",	sha1_blocks_shani,	sha1_cpu_shani },
+	{ "SSSE3",	sha1_blocks_ssse3,	sha1_cpu_ssse3 },
+#endif
+	{ "scalar",	sha1_blocks_scalar,	NULL },
+};
+
+static void sha1_blocks_select(guint32 *hash, const void *data, size_t n);
+
+static sha1_blocks_t sha1_blocks = sha1_blocks_select;
+static const struct sha1_engine *sha1_engine;	/**< Selected by sha1_check() */
+static double sha1_engine_rate;					/**< Its throughput, in MiB/s */
+
+#define SHA1_BENCH_SIZE		65536	/**< Size of benchmark data */
+#define SHA1_BENCH_LOOPS	8		/**< Amount of hashing per engine */
+
+/**
+ * @return whether engine can be used on this CPU.
+ */
+static gboolean
+sha1_engine_supported(const struct sha1_engine *se)
+{
+	return NULL == se->supported || (*se->supported)();
+}
+
+/**
+ * Initial engine, installing the preferred supported engine on first use.
+ *
+ * This is needed because SHA-1 is used to seed the random numbers before
+ * sha1_check() has run.
+ */
+static void
+sha1_blocks_select(guint32 *hash, const void *data, size_t n)
+{
+	unsigned i;
+
+	for (i = 0; i < G_N_ELEMENTS(sha1_engines); i++) {
+		if (sha1_engine_supported(&sha1_engines[i])) {
+			sha1_blocks = sha1_engines[i].blocks;
+			break;
+		}
+	}
+
+	g_assert(sha1_blocks != sha1_blocks_select);
+
+	(*sha1_blocks)(hash, data, n);
+}
+
+/**
+ *  SHA1ProcessMessageBlock
+ *
+ *  Description:
+ *      This function will process the next 512 bits of the message
+ *      stored in the Message_Block array.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ */
+static inline void SHA1ProcessMessageBlock(SHA1Context *context)
+{
+    (*sha1_blocks)(context->Intermediate_Hash, context->Message_Block, 1);
+    context->Message_Block_Index = 0;
+}
 
 /**
  *  SHA1Reset
@@ -215,212 +761,52 @@ int SHA1Input(    SHA1Context    *context,
     {
          return context->Corrupted;
     }
-    while(length-- && !context->Corrupted)
+    if (length > (G_MAXUINT64 - context->Length) / 8)
     {
-    context->Message_Block[context->Message_Block_Index++] =
-                    (*message_array & 0xFF);
-
-    context->Length += 8;
-    if (context->Length < 8)
-    {
-            /* Message is too long */
-            context->Corrupted = 1;
+        /* Message is too long */
+        context->Corrupted = shaInputTooLong;
+        return shaInputTooLong;
     }
+    context->Length += (guint64) length * 8;
 
-    if (context->Message_Block_Index == 64)
+    /*
+     *  Complete any buffered block, then process whole blocks directly
+     *  from the input, only buffering the trailing bytes.
+     */
+    if (context->Message_Block_Index != 0)
     {
-        SHA1ProcessMessageBlock(context);
-    }
+        size_t n = MIN(length, 64U - context->Message_Block_Index);
 
-    message_array++;
-    }
-
-    return shaSuccess;
-}
+        memcpy(&context->Message_Block[context->Message_Block_Index],
+            message_array, n);
+        context->Message_Block_Index += n;
+        message_array += n;
+        length -= n;
 
-/**
- *  SHA1ProcessMessageBlock
- *
- *  Description:
- *      This function will process the next 512 bits of the message
- *      stored in the Message_Block array.
- *
- *  Parameters:
- *      None.
- *
- *  Returns:
- *      Nothing.
- *
- *  Comments:
- *      Many of the variable names in this code, especially the
- *      single character names, were used because those were the
- *      names used in the publication.
- *
- *
- */
-G_GNUC_HOT void SHA1ProcessMessageBlock(SHA1Context *context)
-{
-    const guint32 K[] =    {       /* Constants defined in SHA-1 */
-                            0x5A827999,
-                            0x6ED9EBA1,
-                            0x8F1BBCDC,
-                            0xCA62C1D6
-                            };
-    int          t;                 /* Loop counter              */
-    guint32      temp;              /* Temporary word value      */
-    guint32      W[80];             /* Word sequence             */
-    guint32      A, B, C, D, E;     /* Word buffers              */
-    guint32      *wp;               /* Pointer in word sequence	 */
+        if (context->Message_Block_Index == 64)
+        {
+            SHA1ProcessMessageBlock(context);
+        }
+    }
 
-    /*
-     *  Initialize the first 16 words in the array W
-     */
+    if (length >= 64)
+    {
+        size_t blocks = length / 64;
 
-#define INIT(x) \
-        W[x] = (context->Message_Block[(x) * 4] << 24) | \
-        	(context->Message_Block[(x) * 4 + 1] << 16) | \
-        	(context->Message_Block[(x) * 4 +2] << 8) | \
-        	(context->Message_Block[(x) * 4 +3])
-
-	/* Unrolling this loop saves time */
-	INIT(0);  INIT(1);  INIT(2);  INIT(3);
-	INIT(4);  INIT(5);  INIT(6);  INIT(7);
-	INIT(8);  INIT(9);  INIT(10); INIT(11);
-	INIT(12); INIT(13); INIT(14); INIT(15);
-
-#define CRUNCH \
-       *wp = SHA1CircularShift(1,wp[-3] ^ wp[-8] ^ wp[-14] ^ wp[-16])
-
-	wp = &W[16];
-	CRUNCH; wp++;		/* 16 */
-	CRUNCH; wp++;		/* 17 */
-	CRUNCH; wp++;		/* 18 */
-	CRUNCH; wp++;		/* 19 */
-
-	/* Fully unrolling this loop does NOT save time due to I-cache misses */
-    for (t = 20; t < 80; t += 10) {
-		CRUNCH; wp++;		/* t+0 */
-		CRUNCH; wp++;		/* t+1 */
-		CRUNCH; wp++;		/* t+2 */
-		CRUNCH; wp++;		/* t+3 */
-		CRUNCH; wp++;		/* t+4 */
-		CRUNCH; wp++;		/* t+5 */
-		CRUNCH; wp++;		/* t+6 */
-		CRUNCH; wp++;		/* t+7 */
-		CRUNCH; wp++;		/* t+8 */
-		CRUNCH; wp++;		/* t+9 */
+        (*sha1_blocks)(context->Intermediate_Hash, message_array, blocks);
+        message_array += blocks * 64;
+        length -= blocks * 64;
     }
 
-    A = context->Intermediate_Hash[0];
-    B = context->Intermediate_Hash[1];
-    C = context->Intermediate_Hash[2];
-    D = context->Intermediate_Hash[3];
-    E = context->Intermediate_Hash[4];
-
-	wp = &W[0];
-
-#define ROTATE(k, mix) \
-	temp = SHA1CircularShift(5,A) + (mix) + E + *wp++ + K[k]; \
-	E = D; D = C; \
-	C = SHA1CircularShift(30,B); \
-	B = A; A = temp
-
-	/* Optimizing "(B & C) | (~B & D)" into "D ^ (B & (C ^ D))" */
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-	ROTATE(0, D ^ (B & (C ^ D)));
-
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-	ROTATE(1, B ^ C ^ D);
-
-	/* Optimizing "(B & C) | (B & D)" into "B & (C | D)" */
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-	ROTATE(2, (B & (C | D)) | (C & D));
-
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-	ROTATE(3, B ^ C ^ D);
-
-    context->Intermediate_Hash[0] += A;
-    context->Intermediate_Hash[1] += B;
-    context->Intermediate_Hash[2] += C;
-    context->Intermediate_Hash[3] += D;
-    context->Intermediate_Hash[4] += E;
+    if (length != 0)
+    {
+        memcpy(context->Message_Block, message_array, length);
+        context->Message_Block_Index = length;
+    }
 
-    context->Message_Block_Index = 0;
+    return shaSuccess;
 }
 
-
 /**
  *  SHA1PadMessage
  *
@@ -444,7 +830,7 @@ G_GNUC_HOT void SHA1ProcessMessageBlock(SHA1Context *context)
  *
  */
 
-void SHA1PadMessage(SHA1Context *context)
+static void SHA1PadMessage(SHA1Context *context)
 {
     /*
      *  Check to see if the current message block is too small to hold
@@ -483,3 +869,164 @@ void SHA1PadMessage(SHA1Context *context)
 
     SHA1ProcessMessageBlock(context);
 }
+
+/**
+ * Hash data with given block engine.
+ */
+static void
+sha1_engine_hash(const struct sha1_engine *se,
+	const void *data, size_t len, size_t chunk, struct sha1 *digest)
+{
+	sha1_blocks_t saved = sha1_blocks;
+	SHA1Context ctx;
+	const char *p = data;
+
+	sha1_blocks = se->blocks;
+	SHA1Reset(&ctx);
+	while (len != 0) {
+		size_t n = MIN(len, chunk);
+		SHA1Input(&ctx, p, n);
+		p += n;
+		len -= n;
+	}
+	SHA1Result(&ctx, digest);
+	sha1_blocks = saved;
+}
+
+/**
+ * Runs the test cases from RFC 3174 through all the block engines the CPU
+ * supports, feeding the data in pieces of various sizes, then benchmarks
+ * them and selects the fastest one.
+ */
+G_GNUC_COLD void
+sha1_check(void)
+{
+	static const struct {
+		const char *s;
+		size_t repeat;
+		const char *r;
+	} tests[] = {
+		{ "abc", 1, "A9993E364706816ABA3E25717850C26C9CD0D89D" },
+		{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+			"84983E441C3BD26EBAAE4AA1F95129E5E54670F1" },
+		{ "a", 1000000, "34AA973CD4C4DAA4F61EEB2BDBAD27316534016F" },
+		{ "0123456701234567012345670123456701234567012345670123456701234567",
+			10, "DEA356A2CDDD90C7A7ECEDC5EBB563934F460452" },
+	};
+	static const size_t chunks[] = { 1, 3, 64, 1000, (size_t) -1 };
+	const struct sha1_engine *best = NULL;
+	double best_rate = 0.0;
+	char *buf;
+	unsigned i, j, k;
+
+	for (i = 0; i < G_N_ELEMENTS(sha1_engines); i++) {
+		const struct sha1_engine *se = &sha1_engines[i];
+
+		if (!sha1_engine_supported(se))
+			continue;
+
+		for (j = 0; j < G_N_ELEMENTS(tests); j++) {
+			size_t slen = strlen(tests[j].s);
+			size_t len = slen * tests[j].repeat;
+
+			buf = halloc(len + 1);
+
+			for (k = 0; k < G_N_ELEMENTS(chunks); k++) {
+				struct sha1 digest;
+				char hex[2 * SHA1_RAW_SIZE + 1];
+				char *data = &buf[k & 1];	/* Also test misaligned input */
+				size_t n;
+
+				/* Skip the slowest feeding on the longest input */
+				if (len > 1000 && chunks[k] < 64)
+					continue;
+
+				for (n = 0; n < tests[j].repeat; n++)
+					memcpy(&data[n * slen], tests[j].s, slen);
+
+				sha1_engine_hash(se, data, len, chunks[k], &digest);
+				bin_to_hex_buf(digest.data, sizeof digest.data,
+					hex, sizeof hex);
+
+				if (0 != ascii_strcasecmp(hex, tests[j].r)) {
+					g_warning("SHA-1 %s engine failed test #%u, chunk=%lu: %s",
+						se->name, j, (unsigned long) chunks[k], hex);
+					g_assert_not_reached();
+				}
+			}
+			HFREE_NULL(buf);
+		}
+	}
+
+	/*
+	 * All the supported engines are correct, pick the fastest.
+	 */
+
+	buf = halloc0(SHA1_BENCH_SIZE);
+
+	for (i = 0; i < G_N_ELEMENTS(sha1_engines); i++) {
+		const struct sha1_engine *se = &sha1_engines[i];
+		struct sha1 digest;
+		tm_t start, end;
+		double elapsed, rate;
+
+		if (!sha1_engine_supported(se))
+			continue;
+
+		tm_now_exact(&start);
+		for (k = 0; k < SHA1_BENCH_LOOPS; k++) {
+			sha1_engine_hash(se, buf, SHA1_BENCH_SIZE, SHA1_BENCH_SIZE,
+				&digest);
+		}
+		tm_now_exact(&end);
+
+		elapsed = tm_elapsed_f(&end, &start);
+		rate = SHA1_BENCH_SIZE * SHA1_BENCH_LOOPS /
+			MAX(elapsed, 1e-6) / (1024.0 * 1024.0);
+
+		if (common_dbg > 0) {
+			g_debug("SHA-1 %s engine: %.0f MiB/s", se->name, rate);
+		}
+
+		if (NULL == best || rate > best_rate) {
+			best = se;
+			best_rate = rate;
+		}
+	}
+
+	HFREE_NULL(buf);
+
+	g_assert(best != NULL);
+
+	sha1_blocks = best->blocks;
+	sha1_engine = best;
+	sha1_engine_rate = best_rate;
+}
+
+/**
+ * @return name of the block engine in use, along with its measured
+ * throughput in MiB/s if known (zero otherwise).
+ */
+const char *
+sha1_engine_info(double *rate)
+{
+	if (NULL == sha1_engine) {
+		unsigned i;
+
+		for (i = 0; i < G_N_ELEMENTS(sha1_engines); i++) {
+			if (sha1_engines[i].blocks == sha1_blocks)
+				break;
+		}
+		if (rate != NULL)
+			*rate = 0.0;
+		return i < G_N_ELEMENTS(sha1_engines) ?
+			sha1_engines[i].name : "unselected";
+	}
+
+	if (rate != NULL)
+		*rate = sha1_engine_rate;
+
+	return sha1_engine->name;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
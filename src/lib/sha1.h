@@ -79,5 +79,8 @@ int SHA1Reset(  SHA1Context *);
 int SHA1Input(  SHA1Context *, const void *, size_t);
 int SHA1Result( SHA1Context *, struct sha1 *Message_Digest);
 
+void sha1_check(void);
+const char *sha1_engine_info(double *rate);
+
 #endif /* _sha1_h_ */
 
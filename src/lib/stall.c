@@ -0,0 +1,622 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Main loop stall detection.
+ *
+ * Everything runs from the main loop, so a callback that takes too long
+ * prevents us from servicing I/O: when it lasts long enough, TCP peers time
+ * out and drop us.  Finding the culprits in production requires noticing
+ * the stall while it happens and capturing the stack of the main thread,
+ * which is stuck somewhere we would like to know about.
+ *
+ * The regular watchdogs from wd.c cannot help since they are driven by
+ * the callout queue, hence by the very loop we want to monitor.  Using an
+ * interval timer is not an option either: SIGALRM is already used to
+ * bound shutdown time, and spurious signals would interrupt system calls.
+ *
+ * Instead, the main loop notifies us each time it wakes up and each time
+ * it goes back to sleep in inputevt, and a separate watcher thread checks
+ * this heartbeat a few times per threshold period.  When the loop has been
+ * busy in the same iteration for longer than the configured threshold,
+ * the watcher sends SIGVTALRM to the main thread, whose handler captures
+ * the current stack into a pre-allocated ring buffer.  Another sample is
+ * taken each time the stall lasts for another threshold period, up to a
+ * limit.  The handler is installed with SA_RESTART, but as with any
+ * profiling signal, the few system calls which are never restarted (e.g.
+ * sleeping ones) can return early with EINTR when the main thread is stuck
+ * in them.
+ *
+ * When the loop finally returns to inputevt, the captured stacks are
+ * turned into atomic stack traces and aggregated per stall site, which is
+ * logged.  An aggregated report of the stall sites is logged periodically,
+ * and can also be requested with stall_top().
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#if defined(USE_GLIB2) && defined(G_THREADS_ENABLED) && \
+	!defined(MINGW32) && defined(SIGVTALRM)
+#define STALL_THREADS
+#include <pthread.h>
+#endif
+
+#include "stall.h"
+#include "cq.h"
+#include "glib-missing.h"
+#include "misc.h"
+#include "signal.h"
+#include "stacktrace.h"
+#include "stringify.h"
+#include "tm.h"
+#include "walloc.h"
+#include "override.h"		/* Must be the last header included */
+
+#define STALL_RING			32	/**< Max stacks captured per iteration */
+#define STALL_SAMPLES		8	/**< Max stacks captured per stall */
+#define STALL_CHECKS		4	/**< Heartbeat checks per threshold period */
+#define STALL_CHECK_MIN		5	/**< Minimum check period, in ms */
+#define STALL_REPORT_TOP	10	/**< Sites listed in aggregated report */
+#define STALL_REPORT_PERIOD	(3600 * 1000)	/**< Report period, in ms */
+
+/**
+ * Amount of frames to skip when capturing the stack from the signal
+ * handler: the handler itself, the signal trampoline and the signal frame
+ * set up by the kernel.
+ */
+#define STALL_SIG_FRAMES	3
+
+/**
+ * A stack captured by the signal handler.
+ */
+struct stall_sample {
+	struct stacktrace trace;	/**< Stack of the main thread */
+	unsigned ms;				/**< How long the loop had been stalled */
+};
+
+/**
+ * A stall site, aggregating the stalls during which the same stack
+ * was captured.
+ */
+struct stall_site {
+	struct stall_info info;		/**< Aggregated information */
+	unsigned last_stall;		/**< Stall number when last seen */
+};
+
+/*
+ * Variables shared with the signal handler or the watcher thread.
+ */
+
+static struct stall_sample stall_ring[STALL_RING];
+static volatile sig_atomic_t stall_head;	/**< Written by signal handler */
+static volatile sig_atomic_t stall_tail;	/**< Written by main thread */
+static volatile sig_atomic_t stall_sleeping = TRUE;	/**< Loop is waiting */
+static volatile sig_atomic_t stall_pending_ms;	/**< Duration of stall */
+static volatile unsigned stall_seq;			/**< Loop iteration, 0 if none */
+static volatile unsigned stall_threshold;	/**< Threshold, in ms */
+
+/*
+ * Variables only used by the main thread.
+ */
+
+static GHashTable *stall_sites;		/**< stackatom -> stall_site */
+static cperiodic_t *stall_report_ev;
+static tm_t stall_wake;				/**< When loop woke up */
+static unsigned stall_total;		/**< Amount of stalls detected */
+static unsigned stall_reported;		/**< Value of stall_total at last report */
+static gboolean stall_watching;		/**< Whether watcher thread is running */
+static gboolean stall_awake;		/**< Whether stall_wake is valid */
+static gboolean stall_closed;
+
+#ifdef STALL_THREADS
+static GThread *stall_thread;
+static GMutex *stall_lock;
+static GCond *stall_cond;
+static gboolean stall_stop;			/**< (locked) Tells watcher to exit */
+static pthread_t stall_main;		/**< The main thread */
+
+/**
+ * Signal handler, invoked on the main thread when the watcher notices
+ * the loop is stalled.
+ */
+static void
+stall_signal_handler(int signo)
+{
+	struct stall_sample *s;
+
+	(void) signo;
+
+	/*
+	 * The loop may have resumed since the watcher decided to send the
+	 * signal, in which case we would only capture the poll() call.
+	 */
+
+	if (stall_sleeping)
+		return;
+
+	if (stall_head - stall_tail >= STALL_RING)
+		return;
+
+	s = &stall_ring[stall_head % STALL_RING];
+	stacktrace_get_offset(&s->trace, STALL_SIG_FRAMES);
+	s->ms = stall_pending_ms;
+	stall_head++;
+}
+
+/**
+ * Watcher thread, monitoring the main loop heartbeat.
+ *
+ * The duration of a stall is measured from the first time the watcher
+ * sees the loop busy in a given iteration, so the reported figure is
+ * always an underestimation by at most one check period.
+ */
+static gpointer
+stall_watcher(gpointer unused_data)
+{
+	unsigned seq = 0, next = 0, samples = 0;
+	tm_t since, now;
+
+	(void) unused_data;
+
+	g_get_current_time(&since);
+	g_mutex_lock(stall_lock);
+
+	while (!stall_stop) {
+		unsigned threshold = stall_threshold;
+		GTimeVal end;
+		time_delta_t elapsed;
+
+		g_get_current_time(&end);
+		g_time_val_add(&end,
+			1000L * MAX(threshold / STALL_CHECKS, STALL_CHECK_MIN));
+		g_cond_timed_wait(stall_cond, stall_lock, &end);
+
+		if (stall_stop)
+			break;
+
+		g_get_current_time(&now);
+
+		/*
+		 * Loop waiting for events, or in a new iteration since last check:
+		 * restart measuring from now on.  The loop did not start yet when
+		 * its iteration number is zero, and we do not monitor the
+		 * initialization phase.
+		 */
+
+		if (stall_sleeping || stall_seq != seq || 0 == seq) {
+			seq = stall_seq;
+			since = now;
+			next = threshold;
+			samples = 0;
+			continue;
+		}
+
+		elapsed = tm_elapsed_ms(&now, &since);
+
+		if (elapsed >= (time_delta_t) next && samples < STALL_SAMPLES) {
+			stall_pending_ms = elapsed;
+			pthread_kill(stall_main, SIGVTALRM);
+			next += threshold;
+			samples++;
+		}
+	}
+
+	g_mutex_unlock(stall_lock);
+	return NULL;
+}
+
+/**
+ * Start the watcher thread.
+ *
+ * @return TRUE if the main loop is now being watched.
+ */
+static gboolean
+stall_watch(void)
+{
+	struct stacktrace trace;
+	GError *error = NULL;
+
+	if (NULL == stall_lock) {
+		stall_lock = g_mutex_new();
+		stall_cond = g_cond_new();
+	}
+
+	/*
+	 * Capture a stack before installing the handler, so that any lazy
+	 * initialization done by the unwinder happens outside signal context.
+	 */
+
+	stacktrace_get(&trace);
+	stall_main = pthread_self();
+	signal_set(SIGVTALRM, stall_signal_handler);
+
+	stall_stop = FALSE;
+	stall_thread = g_thread_create(stall_watcher, NULL, TRUE, &error);
+
+	if (NULL == stall_thread) {
+		g_warning("%s(): cannot create thread: %s", G_STRFUNC,
+			error != NULL ? error->message : "unknown error");
+		if (error != NULL)
+			g_error_free(error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Stop the watcher thread.
+ *
+ * The signal handler is left installed, in case a signal is still
+ * pending for the main thread.
+ */
+static void
+stall_unwatch(void)
+{
+	g_assert(stall_thread != NULL);
+
+	g_mutex_lock(stall_lock);
+	stall_stop = TRUE;
+	g_cond_signal(stall_cond);
+	g_mutex_unlock(stall_lock);
+
+	g_thread_join(stall_thread);
+	stall_thread = NULL;
+}
+
+/**
+ * Release thread resources.
+ */
+static void
+stall_unwatch_close(void)
+{
+	if (stall_lock != NULL) {
+		g_mutex_free(stall_lock);
+		g_cond_free(stall_cond);
+		stall_lock = NULL;
+		stall_cond = NULL;
+	}
+}
+#else	/* !STALL_THREADS */
+static gboolean
+stall_watch(void)
+{
+	static gboolean warned;
+
+	if (!warned) {
+		g_warning("main loop stall detection requires thread support");
+		warned = TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+stall_unwatch(void)
+{
+	g_assert_not_reached();
+}
+
+static void
+stall_unwatch_close(void)
+{
+	/* Nothing to do */
+}
+#endif	/* STALL_THREADS */
+
+/**
+ * Periodic callback logging the aggregated report if new stalls occurred.
+ */
+static gboolean
+stall_report_periodic(gpointer unused_data)
+{
+	(void) unused_data;
+
+	if (stall_reported != stall_total)
+		stall_report();
+
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Set the stall threshold.
+ *
+ * @param ms		threshold in milliseconds, 0 disabling stall detection
+ */
+void
+stall_set_threshold(unsigned ms)
+{
+	if (stall_closed)
+		return;
+
+	stall_threshold = ms;
+
+	if (0 == ms && stall_watching) {
+		stall_unwatch();
+		stall_watching = FALSE;
+		cq_periodic_remove(&stall_report_ev);
+	} else if (ms != 0 && !stall_watching) {
+		stall_watching = stall_watch();
+		stall_awake = FALSE;
+		if (stall_watching) {
+			stall_report_ev = cq_periodic_main_add(STALL_REPORT_PERIOD,
+				stall_report_periodic, NULL);
+		}
+	}
+}
+
+/**
+ * @return short name of the routine at the top of an atomic stack trace.
+ */
+static const char *
+stall_routine_name(const struct stackatom *where)
+{
+	return 0 == where->len ?
+		"??" : stacktrace_routine_name(where->stack[0], TRUE);
+}
+
+/**
+ * Aggregate the stacks captured during the stall which just ended.
+ */
+static void
+stall_process(void)
+{
+	unsigned ms = 0, n;
+	sig_atomic_t i;
+
+	if (stall_awake) {
+		tm_t now;
+
+		tm_now_exact(&now);
+		ms = MAX(0, tm_elapsed_ms(&now, &stall_wake));
+	}
+
+	n = stall_head - stall_tail;
+	for (i = stall_tail; i != stall_head; i++)
+		ms = MAX(ms, stall_ring[i % STALL_RING].ms);
+
+	stall_total++;
+
+	g_warning("main loop stalled for %u ms (%u stack sample%s)",
+		ms, n, 1 == n ? "" : "s");
+
+	if (NULL == stall_sites)
+		stall_sites = g_hash_table_new(pointer_hash_func, NULL);
+
+	while (stall_tail != stall_head) {
+		const struct stall_sample *s = &stall_ring[stall_tail % STALL_RING];
+		const struct stackatom *where = stacktrace_get_atom(&s->trace);
+		struct stall_site *site;
+		gboolean created = FALSE;
+
+		site = g_hash_table_lookup(stall_sites, where);
+
+		if (NULL == site) {
+			WALLOC0(site);
+			site->info.where = where;
+			gm_hash_table_insert_const(stall_sites, where, site);
+			created = TRUE;
+		}
+
+		site->info.samples++;
+
+		if (site->last_stall != stall_total) {
+			site->last_stall = stall_total;
+			site->info.stalls++;
+			site->info.total_ms += ms;
+			site->info.max_ms = MAX(site->info.max_ms, ms);
+			site->info.last = tm_time();
+		}
+
+		/*
+		 * Only dump the whole stack the first time we see a site, so that
+		 * recurring stalls do not flood the logs.
+		 */
+
+		if (created) {
+			g_warning("stalled for %u ms in new site:", s->ms);
+			stacktrace_atom_print(stderr, where);
+		} else {
+			g_warning("stalled for %u ms in %s (site seen in %u stall%s)",
+				s->ms, stall_routine_name(where),
+				site->info.stalls, 1 == site->info.stalls ? "" : "s");
+		}
+
+		stall_tail++;
+	}
+}
+
+/**
+ * Signals that the main loop woke up and starts dispatching events.
+ */
+void
+stall_loop_wakeup(void)
+{
+	if (!stall_watching)
+		return;
+
+	tm_now_exact(&stall_wake);
+	stall_awake = TRUE;
+
+	/*
+	 * The iteration number must be updated before clearing the sleeping
+	 * flag, since the watcher checks them in the reverse order.
+	 */
+
+	if (G_UNLIKELY(0 == ++stall_seq))
+		stall_seq = 1;
+	stall_sleeping = FALSE;
+}
+
+/**
+ * Signals that the main loop is done with its current iteration and
+ * is about to wait for new events.
+ */
+void
+stall_loop_sleep(void)
+{
+	stall_sleeping = TRUE;
+
+	if (stall_head != stall_tail)
+		stall_process();
+
+	stall_awake = FALSE;
+}
+
+static void
+stall_collect(gpointer unused_key, gpointer value, gpointer data)
+{
+	struct stall_info **ptr = data;
+	const struct stall_site *site = value;
+
+	(void) unused_key;
+
+	**ptr = site->info;		/* Struct copy */
+	(*ptr)++;
+}
+
+/**
+ * qsort() callback for sorting by decreasing total stall duration.
+ */
+static int
+stall_total_cmp(const void *a, const void *b)
+{
+	const struct stall_info *ia = a, *ib = b;
+
+	return CMP(ib->total_ms, ia->total_ms);
+}
+
+/**
+ * Fill supplied vector with the stall sites which accounted for the
+ * longest stall durations.
+ *
+ * @param vec		the vector to fill
+ * @param n			amount of entries in vector
+ *
+ * @return the amount of entries filled.
+ */
+size_t
+stall_top(struct stall_info *vec, size_t n)
+{
+	struct stall_info *all, *p;
+	size_t count;
+
+	g_assert(vec != NULL || 0 == n);
+
+	if (NULL == stall_sites)
+		return 0;
+
+	count = g_hash_table_size(stall_sites);
+	if (0 == count)
+		return 0;
+
+	p = all = g_malloc(count * sizeof all[0]);
+	g_hash_table_foreach(stall_sites, stall_collect, &p);
+	g_assert(ptr_diff(p, all) == count * sizeof all[0]);
+
+	qsort(all, count, sizeof all[0], stall_total_cmp);
+
+	n = MIN(n, count);
+	memcpy(vec, all, n * sizeof vec[0]);
+	G_FREE_NULL(all);
+
+	return n;
+}
+
+/**
+ * @return amount of main loop stalls detected so far.
+ */
+unsigned
+stall_count(void)
+{
+	return stall_total;
+}
+
+/**
+ * Log the aggregated report of the stall sites.
+ */
+void
+stall_report(void)
+{
+	struct stall_info vec[STALL_REPORT_TOP];
+	size_t i, n;
+
+	stall_reported = stall_total;
+	n = stall_top(vec, G_N_ELEMENTS(vec));
+
+	g_message("%u main loop stall%s detected, top %lu site%s:",
+		stall_total, 1 == stall_total ? "" : "s",
+		(unsigned long) n, 1 == n ? "" : "s");
+
+	for (i = 0; i < n; i++) {
+		const struct stall_info *info = &vec[i];
+
+		g_message("#%lu: %u stall%s, %s ms total, %u ms max, last %s ago:",
+			(unsigned long) i + 1, info->stalls, 1 == info->stalls ? "" : "s",
+			uint64_to_string(info->total_ms), info->max_ms,
+			compact_time(delta_time(tm_time(), info->last)));
+		stacktrace_atom_print(stderr, info->where);
+	}
+}
+
+static gboolean
+stall_free_kv(gpointer unused_key, gpointer value, gpointer unused_data)
+{
+	struct stall_site *site = value;
+
+	(void) unused_key;
+	(void) unused_data;
+
+	WFREE(site);
+	return TRUE;
+}
+
+/**
+ * Final cleanup.
+ *
+ * Called at the beginning of the shutdown sequence, which does not run
+ * from the main loop and may legitimately take a while.
+ */
+void
+stall_close(void)
+{
+	stall_set_threshold(0);
+	stall_closed = TRUE;
+	stall_unwatch_close();
+
+	if (stall_reported != stall_total)
+		stall_report();
+
+	if (stall_sites != NULL) {
+		g_hash_table_foreach_remove(stall_sites, stall_free_kv, NULL);
+		gm_hash_table_destroy_null(&stall_sites);
+	}
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Main loop stall detection.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _stall_h_
+#define _stall_h_
+
+#include "common.h"
+
+struct stackatom;
+
+/**
+ * Aggregated information about a stall site, as returned by stall_top().
+ */
+struct stall_info {
+	const struct stackatom *where;	/**< Stack captured while stalled */
+	guint64 samples;				/**< Amount of times stack was captured */
+	guint64 total_ms;				/**< Total duration of stalls, in ms */
+	unsigned stalls;				/**< Amount of stalls seen at this site */
+	unsigned max_ms;				/**< Longest stall, in ms */
+	time_t last;					/**< Time of last stall */
+};
+
+/*
+ * Public interface.
+ */
+
+void stall_set_threshold(unsigned ms);
+void stall_loop_wakeup(void);
+void stall_loop_sleep(void);
+size_t stall_top(struct stall_info *vec, size_t n);
+unsigned stall_count(void);
+void stall_report(void);
+void stall_close(void);
+
+#endif	/* _stall_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -49,7 +49,10 @@
 #include "endian.h"
 #include "misc.h"
 #include "base32.h"
+#include "debug.h"
+#include "halloc.h"
 #include "tiger.h"
+#include "tm.h"
 #include "override.h"		/* Must be the last header included */
 
 /* NOTE that this code is NOT FULLY OPTIMIZED for any  */
@@ -237,7 +240,332 @@ tiger(gconstpointer data, guint64 length, char hash[24])
   }
 }
 
-/* vi: set ai et sts=2 sw=2 cindent: */
+/***
+ *** Multi-lane hashing of Tiger tree leaves.
+ ***
+ *** Tiger is bound by the latency of its S-box lookups, each round depending
+ *** on the result of the previous one.  Hashing several independent leaves
+ *** with their rounds interleaved lets the CPU overlap these lookups.
+ ***/
+
+#if PASSES != 3
+#error "multi-lane Tiger only supports 3 passes"
+#endif
+
+#define TIGER_LANES_MAX		8		/**< Max amount of leaves hashed at once */
+#define TIGER_LEAF_SIZE		1024	/**< Data in a leaf, after the 0x00 byte */
+#define TIGER_LEAF_BLOCKS	(TIGER_LEAF_SIZE / 64)
+
+#define TIGER_BENCH_SIZE	(64 * TIGER_LEAF_SIZE)	/**< Benchmark data */
+#define TIGER_BENCH_LOOPS	8		/**< Amount of runs per engine */
+
+/*
+ * The lanes need to be fully unrolled so that their state is kept in
+ * registers rather than in the arrays.
+ */
+#if HAS_GCC(8, 0)
+#define TIGER_UNROLL	_Pragma("GCC unroll 8")
+#else
+#define TIGER_UNROLL
+#endif
+
+#define lanes_round(a,b,c,i,mul) \
+  TIGER_UNROLL for (l = 0; l < lanes; l++) { \
+    c[l] ^= x[l][i]; \
+    a[l] -= t1[(c[l] >> (0*8)) & 0xFF] ^ t2[(c[l] >> (2*8)) & 0xFF] ^ \
+      t3[(c[l] >> (4*8)) & 0xFF] ^ t4[(c[l] >> (6*8)) & 0xFF]; \
+    b[l] += t4[(c[l] >> (1*8)) & 0xFF] ^ t3[(c[l] >> (3*8)) & 0xFF] ^ \
+      t2[(c[l] >> (5*8)) & 0xFF] ^ t1[(c[l] >> (7*8)) & 0xFF]; \
+    b[l] *= mul; \
+  }
+
+#define lanes_pass(a,b,c,mul) \
+  lanes_round(a,b,c,0,mul) \
+  lanes_round(b,c,a,1,mul) \
+  lanes_round(c,a,b,2,mul) \
+  lanes_round(a,b,c,3,mul) \
+  lanes_round(b,c,a,4,mul) \
+  lanes_round(c,a,b,5,mul) \
+  lanes_round(a,b,c,6,mul) \
+  lanes_round(b,c,a,7,mul)
+
+#define lanes_key_schedule \
+  TIGER_UNROLL for (l = 0; l < lanes; l++) { \
+    guint64 *w = x[l]; \
+    w[0] -= w[7] ^ U64_FROM_2xU32(0xA5A5A5A5UL, 0xA5A5A5A5UL); \
+    w[1] ^= w[0]; \
+    w[2] += w[1]; \
+    w[3] -= w[2] ^ ((~w[1]) << 19); \
+    w[4] ^= w[3]; \
+    w[5] += w[4]; \
+    w[6] -= w[5] ^ ((~w[4]) >> 23); \
+    w[7] ^= w[6]; \
+    w[0] += w[7]; \
+    w[1] -= w[0] ^ ((~w[7]) << 19); \
+    w[2] ^= w[1]; \
+    w[3] += w[2]; \
+    w[4] -= w[3] ^ ((~w[2]) >> 23); \
+    w[5] ^= w[4]; \
+    w[6] += w[5]; \
+    w[7] -= w[6] ^ U64_FROM_2xU32(0x01234567UL, 0x89ABCDEFUL); \
+  }
+
+/**
+ * Compress one block for each lane.
+ *
+ * This is always inlined with a constant amount of lanes, so that the
+ * compiler can unroll the loops on the lanes.
+ */
+static inline ALWAYS_INLINE void
+tiger_compress_lanes(guint64 x[][8], guint64 state[][3], const unsigned lanes)
+{
+  guint64 a[TIGER_LANES_MAX], b[TIGER_LANES_MAX], c[TIGER_LANES_MAX];
+  guint64 aa[TIGER_LANES_MAX], bb[TIGER_LANES_MAX], cc[TIGER_LANES_MAX];
+  unsigned l;
+
+  for (l = 0; l < lanes; l++) {
+    aa[l] = a[l] = state[l][0];
+    bb[l] = b[l] = state[l][1];
+    cc[l] = c[l] = state[l][2];
+  }
+
+  lanes_pass(a,b,c,5)
+  lanes_key_schedule
+  lanes_pass(c,a,b,7)
+  lanes_key_schedule
+  lanes_pass(b,c,a,9)
+
+  for (l = 0; l < lanes; l++) {
+    state[l][0] = a[l] ^ aa[l];
+    state[l][1] = b[l] - bb[l];
+    state[l][2] = c[l] + cc[l];
+  }
+}
+
+/**
+ * Hash consecutive leaves, one per lane.
+ */
+static inline ALWAYS_INLINE void
+tiger_leaves_lanes(const char *data, struct tth *hashes, const unsigned lanes)
+{
+  guint64 x[TIGER_LANES_MAX][8], state[TIGER_LANES_MAX][3];
+  unsigned i, j, l;
+
+  for (l = 0; l < lanes; l++) {
+    state[l][0] = U64_FROM_2xU32(0x01234567UL, 0x89ABCDEFUL);
+    state[l][1] = U64_FROM_2xU32(0xFEDCBA98UL, 0x76543210UL);
+    state[l][2] = U64_FROM_2xU32(0xF096A5B4UL, 0xC3B2E187UL);
+  }
+
+  /*
+   * The hashed message is the 0x00 byte followed by the leaf data,
+   * so the words of the message start one byte before those of the data.
+   */
+
+  for (i = 0; i < TIGER_LEAF_BLOCKS; i++) {
+    TIGER_UNROLL for (l = 0; l < lanes; l++) {
+      const char *d = &data[l * TIGER_LEAF_SIZE + i * 64];
+
+      x[l][0] = 0 == i ? peek_le64(d) << 8 : peek_le64(d - 1);
+      TIGER_UNROLL for (j = 1; j < 8; j++) {
+        x[l][j] = peek_le64(&d[j * 8] - 1);
+      }
+    }
+    tiger_compress_lanes(x, state, lanes);
+  }
+
+  /*
+   * Last block: last data byte, padding and message length in bits.
+   */
+
+  for (l = 0; l < lanes; l++) {
+    const char *d = &data[l * TIGER_LEAF_SIZE];
+
+    x[l][0] = peek_u8(&d[TIGER_LEAF_SIZE - 1]) | (0x01U << 8);
+    for (j = 1; j < 7; j++) {
+      x[l][j] = 0;
+    }
+    x[l][7] = (guint64) (1 + TIGER_LEAF_SIZE) << 3;
+  }
+  tiger_compress_lanes(x, state, lanes);
+
+  for (l = 0; l < lanes; l++) {
+    for (j = 0; j < 3; j++) {
+      poke_le64(&hashes[l].data[j * 8], state[l][j]);
+    }
+  }
+}
+
+static G_GNUC_HOT void
+tiger_leaves_x1(const char *data, struct tth *hashes)
+{
+  tiger_leaves_lanes(data, hashes, 1);
+}
+
+static G_GNUC_HOT void
+tiger_leaves_x2(const char *data, struct tth *hashes)
+{
+  tiger_leaves_lanes(data, hashes, 2);
+}
+
+static G_GNUC_HOT void
+tiger_leaves_x4(const char *data, struct tth *hashes)
+{
+  tiger_leaves_lanes(data, hashes, 4);
+}
+
+static G_GNUC_HOT void
+tiger_leaves_x8(const char *data, struct tth *hashes)
+{
+  tiger_leaves_lanes(data, hashes, 8);
+}
+
+/**
+ * Leaf hashing engines, hashing a fixed amount of leaves.
+ */
+static const struct tiger_engine {
+  const char *name;
+  void (*leaves)(const char *data, struct tth *hashes);
+  unsigned lanes;
+} tiger_engines[] = {
+  { "1-lane",	tiger_leaves_x1,	1 },
+  { "2-lane",	tiger_leaves_x2,	2 },
+  { "4-lane",	tiger_leaves_x4,	4 },
+  { "8-lane",	tiger_leaves_x8,	8 },
+};
+
+static const struct tiger_engine *tiger_engine = &tiger_engines[2];
+static double tiger_engine_rate;	/**< Measured throughput, in MiB/s */
+
+/**
+ * Compute the Tiger hashes of consecutive Tiger tree leaves.
+ *
+ * Each leaf is made of TIGER_LEAF_SIZE bytes of data, and its hash is the
+ * Tiger hash of the 0x00 byte followed by these data, as done by tt_block().
+ *
+ * @param data		the data of the leaves, without their 0x00 prefix
+ * @param count		amount of leaves
+ * @param hashes	where the hashes of the leaves are written
+ */
+void
+tiger_leaves(gconstpointer data, size_t count, struct tth *hashes)
+{
+  const struct tiger_engine *te = tiger_engine;
+  const char *p = data;
+
+  while (count >= te->lanes) {
+    (*te->leaves)(p, hashes);
+    p += te->lanes * TIGER_LEAF_SIZE;
+    hashes += te->lanes;
+    count -= te->lanes;
+  }
+
+  while (count-- != 0) {
+    tiger_leaves_x1(p, hashes);
+    p += TIGER_LEAF_SIZE;
+    hashes++;
+  }
+}
+
+/**
+ * @return name of the leaf hashing engine, along with its throughput in
+ * MiB/s as measured by tiger_check().
+ */
+const char *
+tiger_engine_info(double *rate)
+{
+  if (rate != NULL)
+    *rate = tiger_engine_rate;
+
+  return tiger_engine->name;
+}
+
+/**
+ * Check the leaf hashing engines against tiger(), then benchmark them and
+ * select the fastest one.
+ */
+static G_GNUC_COLD void
+tiger_leaves_check(void)
+{
+  char *buf, *leaf;
+  struct tth hashes[TIGER_LANES_MAX + 1];
+  double best_rate = 0.0;
+  const struct tiger_engine *best = NULL;
+  unsigned i, j, k;
+
+  buf = halloc(TIGER_BENCH_SIZE);
+  leaf = halloc(1 + TIGER_LEAF_SIZE);
+
+  for (i = 0; i < TIGER_BENCH_SIZE; i++) {
+    buf[i] = i * 2654435761U >> 13;
+  }
+
+  /*
+   * Misaligned data, more leaves than lanes to exercise the tail.
+   */
+
+  for (i = 0; i < G_N_ELEMENTS(tiger_engines); i++) {
+    tiger_engine = &tiger_engines[i];
+    tiger_leaves(&buf[1], G_N_ELEMENTS(hashes), hashes);
+
+    for (j = 0; j < G_N_ELEMENTS(hashes); j++) {
+      char hash[24];
+
+      leaf[0] = 0x00;
+      memcpy(&leaf[1], &buf[1 + j * TIGER_LEAF_SIZE], TIGER_LEAF_SIZE);
+      tiger(leaf, 1 + TIGER_LEAF_SIZE, hash);
+
+      if (0 != memcmp(hash, hashes[j].data, sizeof hash)) {
+        g_warning("%s Tiger leaf engine failed on leaf #%u",
+          tiger_engines[i].name, j);
+        g_assert_not_reached();
+      }
+    }
+  }
+
+  for (i = 0; i < G_N_ELEMENTS(tiger_engines); i++) {
+    struct tth out[TIGER_BENCH_SIZE / TIGER_LEAF_SIZE];
+    double elapsed = 0.0, rate;
+
+    tiger_engine = &tiger_engines[i];
+
+    /*
+     * Keep the fastest run, the others having likely been disturbed
+     * by other processes.
+     */
+
+    for (k = 0; k < TIGER_BENCH_LOOPS; k++) {
+      tm_t start, end;
+      double e;
+
+      tm_now_exact(&start);
+      tiger_leaves(buf, G_N_ELEMENTS(out), out);
+      tm_now_exact(&end);
+
+      e = tm_elapsed_f(&end, &start);
+      if (0 == k || e < elapsed)
+        elapsed = e;
+    }
+
+    rate = TIGER_BENCH_SIZE / MAX(elapsed, 1e-6) / (1024.0 * 1024.0);
+
+    if (common_dbg > 0) {
+      g_debug("Tiger %s leaf engine: %.0f MiB/s",
+        tiger_engines[i].name, rate);
+    }
+
+    if (NULL == best || rate > best_rate) {
+      best = &tiger_engines[i];
+      best_rate = rate;
+    }
+  }
+
+  HFREE_NULL(buf);
+  HFREE_NULL(leaf);
+
+  tiger_engine = best;
+  tiger_engine_rate = best_rate;
+}
 /**
  * Runs some test cases to check whether the implementation of the tiger
  * hash algorithm is alright.
@@ -277,6 +605,8 @@ tiger_check(void)
 			g_assert_not_reached();
 		}
 	}
+
+	tiger_leaves_check();
 }
 
-/* vi: set ts=4 sw=4 cindent: */
+/* vi: set ai et sts=2 sw=2 cindent: */
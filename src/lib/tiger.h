@@ -36,8 +36,12 @@
 
 #include "common.h"
 
+struct tth;
+
 void tiger_check(void);
 void tiger(gconstpointer data, guint64 length, char hash[24]);
+void tiger_leaves(gconstpointer data, size_t count, struct tth *hashes);
+const char *tiger_engine_info(double *rate);
 
 #endif /* _tiger_h_ */
 /* vi: set ts=4 sw=4 cindent: */
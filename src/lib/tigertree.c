@@ -94,6 +94,10 @@
  * longer than 2^64 in size), havoc may ensue. */
 #define TTH_STACKSIZE	(TIGERSIZE * 56)
 
+/* amount of blocks hashed at once by tiger_leaves() when the input
+ * holds several full blocks */
+#define TTH_BATCH		32
+
 enum {
 	TTH_F_INITIALIZED	= 1 << 0,
 	TTH_F_FINISHED		= 1 << 1
@@ -271,19 +275,20 @@ tt_collapse(TTH_CONTEXT *ctx)
 	}
 }
 
+/**
+ * Push the hash of the next block onto the stack.
+ */
 static void
-tt_block(TTH_CONTEXT *ctx)
+tt_leaf(TTH_CONTEXT *ctx, const struct tth *hash)
 {
 	g_assert(ctx);
 
-	tiger(ctx->block.bytes, ctx->block_fill, ctx->stack[ctx->si].data);
+	ctx->stack[ctx->si] = *hash;
 	if (ctx->bpl == 1) {
-		ctx->leaves[ctx->li] = ctx->stack[ctx->si];
+		ctx->leaves[ctx->li] = *hash;
 		ctx->li++;
 	}
 
-	ctx->block_fill = 1;
-
 	ctx->si++;
 	ctx->n++;
 
@@ -294,6 +299,41 @@ tt_block(TTH_CONTEXT *ctx)
 	tt_collapse(ctx);
 }
 
+static void
+tt_block(TTH_CONTEXT *ctx)
+{
+	struct tth hash;
+
+	g_assert(ctx);
+
+	tiger(ctx->block.bytes, ctx->block_fill, hash.data);
+	ctx->block_fill = 1;
+	tt_leaf(ctx, &hash);
+}
+
+/**
+ * Hash full blocks straight from the user data, several at a time.
+ *
+ * @return amount of bytes consumed, a multiple of TTH_BLOCKSIZE.
+ */
+static size_t
+tt_blocks(TTH_CONTEXT *ctx, const char *data, size_t size)
+{
+	struct tth hashes[TTH_BATCH];
+	size_t count, i;
+
+	g_assert(1 == ctx->block_fill);
+
+	count = MIN(size / TTH_BLOCKSIZE, G_N_ELEMENTS(hashes));
+	tiger_leaves(data, count, hashes);
+
+	for (i = 0; i < count; i++) {
+		tt_leaf(ctx, &hashes[i]);
+	}
+
+	return count * TTH_BLOCKSIZE;
+}
+
 static void
 tt_finish(TTH_CONTEXT *ctx)
 {
@@ -399,8 +439,21 @@ tt_update(TTH_CONTEXT *ctx, const void *data, size_t size)
 	g_assert(size == 0 || NULL != data);
 
 	while (size > 0) {
-		size_t n = sizeof ctx->block.bytes - ctx->block_fill;
+		size_t n;
+
+		/*
+		 * When the block buffer is empty and there are full blocks to hash,
+		 * bypass the buffer and let tiger_leaves() hash them in parallel.
+		 */
+
+		if (1 == ctx->block_fill && size >= TTH_BLOCKSIZE) {
+			n = tt_blocks(ctx, block, size);
+			block += n;
+			size -= n;
+			continue;
+		}
 
+		n = sizeof ctx->block.bytes - ctx->block_fill;
 		n = MIN(n, size);
 		memmove(&ctx->block.bytes[ctx->block_fill], block, n);
 		ctx->block_fill += n;
@@ -0,0 +1,935 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Thread pool.
+ *
+ * The main thread runs everything, which leaves all the other cores idle
+ * when there is CPU-intensive work to do.  This module lets the main thread
+ * hand off such work to a set of worker threads.
+ *
+ * Users create a named job queue with tpool_queue_make() and submit jobs
+ * to it with tpool_submit().  A job is made of a work routine, which is run
+ * by one of the worker threads, and of a completion callback, which is
+ * invoked afterwards on the main thread.  Workers pick the pending job with
+ * the highest priority, on a first-come first-served basis within the same
+ * priority level.  All the queues share the same workers, hence low priority
+ * jobs can be delayed indefinitely by a constant flow of higher priority ones.
+ *
+ * Completed jobs are handed back to the main thread through an eventfd,
+ * or a pipe when eventfd() is not available, which is monitored by inputevt
+ * like any other I/O source.  Workers only signal the descriptor when the
+ * list of completed jobs was empty, so a burst of completions costs a single
+ * wakeup of the main loop.
+ *
+ * A job can be cancelled until its completion callback is invoked: if it
+ * did not start yet it is simply discarded, otherwise its completion
+ * callback will not be invoked.  Long-running jobs can use
+ * tpool_job_cancelled() to stop early.
+ *
+ * When threads are not available or when the amount of workers is set to 0,
+ * jobs are run by the main thread, one per main loop iteration, and the
+ * completion callbacks are invoked the same way.
+ *
+ * Each queue keeps statistics about the jobs it handled: amount of jobs
+ * and time spent waiting for a thread and running.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#if defined(USE_GLIB2) && defined(G_THREADS_ENABLED) && !defined(MINGW32)
+#define TPOOL_THREADS
+#endif
+
+#ifdef HAS_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#include "tpool.h"
+#include "atoms.h"
+#include "fd.h"
+#include "inputevt.h"
+#include "stringify.h"
+#include "tm.h"
+#include "walloc.h"
+#include "override.h"		/* Must be the last header included */
+
+#define TPOOL_THREADS_MAX	256		/**< Maximum amount of workers */
+
+enum tpool_queue_magic { TPOOL_QUEUE_MAGIC = 0x4b1e6c2dU };
+enum tpool_job_magic { TPOOL_JOB_MAGIC = 0x1d9a7f53U };
+
+/**
+ * Job states.
+ */
+enum tpool_job_state {
+	TPOOL_JOB_PENDING = 0,		/**< Waiting for a worker */
+	TPOOL_JOB_RUNNING,			/**< Being run by a worker */
+	TPOOL_JOB_DONE				/**< Run, awaiting delivery to main thread */
+};
+
+/**
+ * A job queue.
+ *
+ * Fields marked "locked" can be accessed by the workers and are protected
+ * by the pool lock, the others are only used by the main thread.
+ */
+struct tpool_queue {
+	enum tpool_queue_magic magic;
+	const char *name;				/**< Queue name (atom) */
+	struct tpool_queue *next;		/**< Next queue in pool */
+	struct tpool_stats stats;		/**< Statistics, "locked" counters */
+};
+
+/**
+ * A job.
+ */
+struct tpool_job {
+	enum tpool_job_magic magic;
+	tpool_queue_t *queue;			/**< Queue to which job was submitted */
+	tpool_work_t work;				/**< Work routine */
+	tpool_done_t done;				/**< Completion callback */
+	void *data;						/**< User data */
+	struct tpool_job *prev;			/**< (locked) Previous in list */
+	struct tpool_job *next;			/**< (locked) Next in list */
+	tm_t queued;					/**< When job was submitted */
+	tm_t started;					/**< When job started to run */
+	tm_t ended;						/**< When job ended */
+	tpool_prio_t prio;				/**< Job priority */
+	enum tpool_job_state state;		/**< (locked) */
+	volatile gboolean cancelled;	/**< Set by main thread on cancel */
+};
+
+static inline void
+tpool_queue_check(const struct tpool_queue * const q)
+{
+	g_assert(q != NULL);
+	g_assert(TPOOL_QUEUE_MAGIC == q->magic);
+}
+
+static inline void
+tpool_job_check(const struct tpool_job * const job)
+{
+	g_assert(job != NULL);
+	g_assert(TPOOL_JOB_MAGIC == job->magic);
+}
+
+/**
+ * The thread pool.
+ *
+ * Fields marked "locked" are protected by the lock.
+ */
+static struct tpool {
+#ifdef TPOOL_THREADS
+	GMutex *lock;					/**< Protects fields marked "locked" */
+	GCond *work_cond;				/**< Signals new jobs to the workers */
+	GCond *idle_cond;				/**< Signals job or worker termination */
+#endif
+	struct tpool_job *head[TPOOL_PRIO_COUNT];	/**< (locked) Pending jobs */
+	struct tpool_job *tail[TPOOL_PRIO_COUNT];	/**< (locked) Last ones */
+	struct tpool_job *done;			/**< (locked) Jobs run, LIFO */
+	struct tpool_job *delivering;	/**< Jobs being delivered, FIFO */
+	struct tpool_queue *queues;		/**< All the queues */
+	unsigned threads;				/**< (locked) Amount of running workers */
+	unsigned target;				/**< (locked) Wanted amount of workers */
+	int fd[2];						/**< Notification descriptors */
+	unsigned event_id;				/**< Input event for fd[0] */
+} *tpool;
+
+#ifdef TPOOL_THREADS
+#define TPOOL_LOCK(tp)		g_mutex_lock((tp)->lock)
+#define TPOOL_UNLOCK(tp)	g_mutex_unlock((tp)->lock)
+#else
+#define TPOOL_LOCK(tp)
+#define TPOOL_UNLOCK(tp)
+#endif
+
+static unsigned tpool_debug;
+
+/**
+ * Set debugging level.
+ */
+void
+tpool_set_debug(unsigned level)
+{
+	tpool_debug = level;
+}
+
+/**
+ * Signal the main thread that jobs were completed, or that pending jobs
+ * must be run by the main thread.
+ */
+static void
+tpool_notify(struct tpool *tp)
+{
+#ifdef HAS_EVENTFD
+	static const guint64 one = 1;
+
+	while (-1 == write(tp->fd[1], &one, sizeof one) && EINTR == errno)
+		continue;
+#else
+	/* A full pipe means the main thread has notifications pending */
+	while (-1 == write(tp->fd[1], "", 1) && EINTR == errno)
+		continue;
+#endif
+}
+
+/**
+ * Remove job from the list of pending jobs.
+ *
+ * This must be called with the pool locked.
+ */
+static void
+tpool_unlink(struct tpool *tp, struct tpool_job *job)
+{
+	g_assert(TPOOL_JOB_PENDING == job->state);
+
+	if (job->prev != NULL)
+		job->prev->next = job->next;
+	else
+		tp->head[job->prio] = job->next;
+
+	if (job->next != NULL)
+		job->next->prev = job->prev;
+	else
+		tp->tail[job->prio] = job->prev;
+
+	job->prev = job->next = NULL;
+	job->queue->stats.pending--;
+}
+
+/**
+ * Remove the pending job with the highest priority and flag it as running.
+ *
+ * This must be called with the pool locked.
+ *
+ * @return the job, NULL if there are none.
+ */
+static struct tpool_job *
+tpool_dequeue(struct tpool *tp)
+{
+	unsigned i;
+
+	for (i = 0; i < G_N_ELEMENTS(tp->head); i++) {
+		struct tpool_job *job = tp->head[i];
+
+		if (job != NULL) {
+			tpool_unlink(tp, job);
+			job->state = TPOOL_JOB_RUNNING;
+			job->queue->stats.running++;
+			return job;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Free job.
+ */
+static void
+tpool_job_free(struct tpool_job *job)
+{
+	tpool_job_check(job);
+
+	job->magic = 0;
+	WFREE(job);
+}
+
+#ifdef TPOOL_THREADS
+/**
+ * Worker thread main loop.
+ *
+ * Workers exit when the pool is shrinking, so they are not joined: the
+ * pool keeps track of the amount of running workers instead.
+ */
+static gpointer
+tpool_worker(gpointer data)
+{
+	struct tpool *tp = data;
+
+	g_mutex_lock(tp->lock);
+
+	while (tp->threads <= tp->target) {
+		struct tpool_job *job = tpool_dequeue(tp);
+
+		if (NULL == job) {
+			g_cond_wait(tp->work_cond, tp->lock);
+			continue;
+		}
+
+		g_mutex_unlock(tp->lock);
+
+		g_get_current_time(&job->started);
+		if (!job->cancelled)
+			(*job->work)(job, job->data);
+		g_get_current_time(&job->ended);
+
+		g_mutex_lock(tp->lock);
+
+		/*
+		 * The main thread is only notified when the list of completed jobs
+		 * goes from empty to non-empty: it processes the whole list anyway.
+		 */
+
+		if (NULL == tp->done)
+			tpool_notify(tp);
+		job->queue->stats.running--;
+		job->state = TPOOL_JOB_DONE;
+		job->next = tp->done;
+		tp->done = job;
+		g_cond_broadcast(tp->idle_cond);
+	}
+
+	tp->threads--;
+
+	/*
+	 * The last worker to leave hands the pending jobs over to the main
+	 * thread, which would otherwise only see them at the next submission.
+	 */
+
+	if (0 == tp->threads) {
+		unsigned i;
+
+		for (i = 0; i < G_N_ELEMENTS(tp->head); i++) {
+			if (tp->head[i] != NULL) {
+				tpool_notify(tp);
+				break;
+			}
+		}
+	}
+
+	g_cond_broadcast(tp->idle_cond);
+	g_mutex_unlock(tp->lock);
+
+	return NULL;
+}
+
+/**
+ * Create new workers or tell the surplus ones to exit, to reach the
+ * targeted amount of workers.
+ */
+static void
+tpool_adjust(struct tpool *tp)
+{
+	g_mutex_lock(tp->lock);
+
+	if (tp->threads > tp->target)
+		g_cond_broadcast(tp->work_cond);
+
+	while (tp->threads < tp->target) {
+		GError *error = NULL;
+
+		if (NULL == g_thread_create(tpool_worker, tp, FALSE, &error)) {
+			g_warning("%s(): cannot create thread: %s", G_STRFUNC,
+				error != NULL ? error->message : "unknown error");
+			if (error != NULL)
+				g_error_free(error);
+			tp->target = tp->threads;
+			break;
+		}
+		tp->threads++;
+	}
+
+	g_mutex_unlock(tp->lock);
+}
+
+/**
+ * Wait until the jobs of the queue which are being run are done.
+ *
+ * This must be called with the pool locked.
+ */
+static void
+tpool_queue_wait(struct tpool *tp, struct tpool_queue *q)
+{
+	while (q->stats.running != 0)
+		g_cond_wait(tp->idle_cond, tp->lock);
+}
+#else	/* !TPOOL_THREADS */
+static void
+tpool_adjust(struct tpool *tp)
+{
+	static gboolean warned;
+
+	if (tp->target != 0 && !warned) {
+		g_warning("no thread support, jobs will be run by the main thread");
+		warned = TRUE;
+	}
+
+	tp->target = 0;
+}
+
+static void
+tpool_queue_wait(struct tpool *tp, struct tpool_queue *q)
+{
+	(void) tp;
+	g_assert(0 == q->stats.running);
+}
+#endif	/* TPOOL_THREADS */
+
+/**
+ * Set the amount of worker threads.
+ *
+ * When set to 0, jobs are run by the main thread.
+ */
+void
+tpool_set_threads(unsigned n)
+{
+	struct tpool *tp = tpool;
+
+	g_assert(tp != NULL);
+
+	TPOOL_LOCK(tp);
+	tp->target = MIN(n, TPOOL_THREADS_MAX);
+	TPOOL_UNLOCK(tp);
+
+	tpool_adjust(tp);
+
+	/*
+	 * Pending jobs will be run by the main thread if there are no workers.
+	 * When surplus workers are still exiting, the last one notifies it.
+	 */
+
+	if (0 == tpool_threads())
+		tpool_notify(tp);
+
+	if (tpool_debug)
+		g_debug("TPOOL running %u worker thread%s",
+			tpool_threads(), 1 == tpool_threads() ? "" : "s");
+}
+
+/**
+ * @return amount of worker threads running.
+ */
+unsigned
+tpool_threads(void)
+{
+	struct tpool *tp = tpool;
+	unsigned n;
+
+	g_assert(tp != NULL);
+
+	TPOOL_LOCK(tp);
+	n = tp->threads;
+	TPOOL_UNLOCK(tp);
+
+	return n;
+}
+
+/**
+ * Create a new job queue.
+ *
+ * @param name		queue name, for statistics and logging
+ */
+tpool_queue_t *
+tpool_queue_make(const char *name)
+{
+	struct tpool_queue *q;
+
+	g_assert(tpool != NULL);
+	g_assert(name != NULL);
+
+	WALLOC0(q);
+	q->magic = TPOOL_QUEUE_MAGIC;
+	q->name = atom_str_get(name);
+	q->stats.name = q->name;
+	q->next = tpool->queues;
+	tpool->queues = q;
+
+	return q;
+}
+
+/**
+ * Discard the jobs of the queue held in the supplied list.
+ *
+ * @return the new list head.
+ */
+static struct tpool_job *
+tpool_queue_discard(struct tpool_job *list, const struct tpool_queue *q)
+{
+	struct tpool_job *job, *next, *head = NULL, *prev = NULL;
+
+	for (job = list; job != NULL; job = next) {
+		next = job->next;
+
+		if (job->queue == q) {
+			tpool_job_free(job);
+			continue;
+		}
+
+		if (prev != NULL)
+			prev->next = job;
+		else
+			head = job;
+		prev = job;
+	}
+
+	if (prev != NULL)
+		prev->next = NULL;
+
+	return head;
+}
+
+/**
+ * Free job queue, nullifying its pointer.
+ *
+ * Pending jobs are discarded and jobs being run are waited for.  The
+ * completion callback of these jobs is not invoked.
+ */
+void
+tpool_queue_free_null(tpool_queue_t **q_ptr)
+{
+	struct tpool *tp = tpool;
+	struct tpool_queue *q = *q_ptr;
+	struct tpool_queue **qp;
+	struct tpool_job *discarded = NULL;
+	unsigned i;
+
+	if (NULL == q)
+		return;
+
+	tpool_queue_check(q);
+	g_assert(tp != NULL);
+
+	TPOOL_LOCK(tp);
+
+	for (i = 0; i < G_N_ELEMENTS(tp->head); i++) {
+		struct tpool_job *job, *next;
+
+		for (job = tp->head[i]; job != NULL; job = next) {
+			next = job->next;
+			if (job->queue == q) {
+				tpool_unlink(tp, job);
+				job->next = discarded;
+				discarded = job;
+			}
+		}
+	}
+
+	tpool_queue_wait(tp, q);
+	tp->done = tpool_queue_discard(tp->done, q);
+
+	TPOOL_UNLOCK(tp);
+
+	tpool_queue_discard(discarded, q);
+
+	/*
+	 * A completion callback may be freeing the queue whilst we are
+	 * delivering completed jobs.
+	 */
+
+	tp->delivering = tpool_queue_discard(tp->delivering, q);
+
+	if (tpool_debug) {
+		g_debug("TPOOL freeing queue \"%s\": %s jobs submitted, "
+			"%s cancelled", q->name, uint64_to_string(q->stats.submitted),
+			uint64_to_string2(q->stats.cancelled));
+	}
+
+	for (qp = &tp->queues; *qp != NULL; qp = &(*qp)->next) {
+		if (*qp == q) {
+			*qp = q->next;
+			break;
+		}
+	}
+
+	atom_str_free_null(&q->name);
+	q->magic = 0;
+	WFREE(q);
+	*q_ptr = NULL;
+}
+
+/**
+ * @return the name of the queue.
+ */
+const char *
+tpool_queue_name(const tpool_queue_t *q)
+{
+	tpool_queue_check(q);
+
+	return q->name;
+}
+
+/**
+ * Submit a new job.
+ *
+ * @param q			the queue to which the job is submitted
+ * @param prio		the job priority
+ * @param work		the work routine, run by a worker thread
+ * @param done		the completion callback (may be NULL), run on main thread
+ * @param data		user data for both routines
+ *
+ * @return job handle, which can be used to cancel the job until its
+ * completion callback is invoked.
+ */
+tpool_job_t *
+tpool_submit(tpool_queue_t *q, tpool_prio_t prio,
+	tpool_work_t work, tpool_done_t done, void *data)
+{
+	struct tpool *tp = tpool;
+	struct tpool_job *job;
+
+	tpool_queue_check(q);
+	g_assert(UNSIGNED(prio) < TPOOL_PRIO_COUNT);
+	g_assert(work != NULL);
+	g_assert(tp != NULL);
+
+	WALLOC0(job);
+	job->magic = TPOOL_JOB_MAGIC;
+	job->queue = q;
+	job->work = work;
+	job->done = done;
+	job->data = data;
+	job->prio = prio;
+	tm_now_exact(&job->queued);
+
+	TPOOL_LOCK(tp);
+
+	job->state = TPOOL_JOB_PENDING;
+	job->prev = tp->tail[prio];
+	if (tp->tail[prio] != NULL)
+		tp->tail[prio]->next = job;
+	else
+		tp->head[prio] = job;
+	tp->tail[prio] = job;
+	q->stats.submitted++;
+	q->stats.pending++;
+
+#ifdef TPOOL_THREADS
+	g_cond_signal(tp->work_cond);
+#endif
+
+	if (0 == tp->threads)
+		tpool_notify(tp);
+
+	TPOOL_UNLOCK(tp);
+
+	return job;
+}
+
+/**
+ * Cancel job, nullifying its handle.
+ *
+ * The completion callback of a cancelled job is never invoked.
+ *
+ * @return TRUE if the job was cancelled before it started to run, FALSE
+ * if it was already running or done, in which case the job data may be
+ * still in use by a worker until the job terminates.
+ */
+gboolean
+tpool_cancel(tpool_job_t **job_ptr)
+{
+	struct tpool *tp = tpool;
+	struct tpool_job *job = *job_ptr;
+	gboolean pending = FALSE;
+
+	tpool_job_check(job);
+	g_assert(tp != NULL);
+
+	TPOOL_LOCK(tp);
+
+	if (TPOOL_JOB_PENDING == job->state) {
+		tpool_unlink(tp, job);
+		pending = TRUE;
+	} else {
+		job->cancelled = TRUE;
+	}
+
+	TPOOL_UNLOCK(tp);
+
+	job->queue->stats.cancelled++;
+
+	if (pending)
+		tpool_job_free(job);
+
+	*job_ptr = NULL;
+	return pending;
+}
+
+/**
+ * Check whether job was cancelled.
+ *
+ * This is meant to be called by the work routine, so that long-running
+ * jobs can stop early when their result is no longer wanted.
+ */
+gboolean
+tpool_job_cancelled(const tpool_job_t *job)
+{
+	tpool_job_check(job);
+
+	return job->cancelled;
+}
+
+/**
+ * Account for completed job and invoke its completion callback.
+ */
+static void
+tpool_deliver(struct tpool_job *job)
+{
+	struct tpool_stats *st = &job->queue->stats;
+	time_delta_t wait, run;
+
+	tpool_job_check(job);
+	g_assert(TPOOL_JOB_DONE == job->state);
+
+	wait = tm_elapsed_us(&job->started, &job->queued);
+	run = tm_elapsed_us(&job->ended, &job->started);
+	wait = MAX(wait, 0);
+	run = MAX(run, 0);
+
+	st->run_max_us = MAX(st->run_max_us, (guint64) run);
+
+	if (!job->cancelled) {
+		st->completed++;
+		st->wait_us += wait;
+		st->run_us += run;
+		if (job->done != NULL)
+			(*job->done)(job->data);
+	}
+
+	tpool_job_free(job);
+}
+
+/**
+ * Run the pending job with the highest priority on the main thread.
+ *
+ * @return TRUE if there are more pending jobs.
+ */
+static gboolean
+tpool_run_inline(struct tpool *tp)
+{
+	struct tpool_job *job;
+	gboolean more = FALSE;
+	unsigned i;
+
+	TPOOL_LOCK(tp);
+	job = tpool_dequeue(tp);
+	TPOOL_UNLOCK(tp);
+
+	if (NULL == job)
+		return FALSE;
+
+	tm_now_exact(&job->started);
+	if (!job->cancelled)
+		(*job->work)(job, job->data);
+	tm_now_exact(&job->ended);
+
+	TPOOL_LOCK(tp);
+	job->queue->stats.running--;
+	job->state = TPOOL_JOB_DONE;	/* Delivered right away */
+	for (i = 0; i < G_N_ELEMENTS(tp->head); i++)
+		more |= tp->head[i] != NULL;
+	TPOOL_UNLOCK(tp);
+
+	tpool_deliver(job);
+
+	return more;
+}
+
+/**
+ * Input callback invoked when jobs were completed, or when pending jobs
+ * must be run by the main thread.
+ */
+static void
+tpool_completed(void *data, int unused_source, inputevt_cond_t unused_cond)
+{
+	struct tpool *tp = data;
+	struct tpool_job *done = NULL;
+
+	(void) unused_source;
+	(void) unused_cond;
+
+#ifdef HAS_EVENTFD
+	{
+		guint64 count;
+
+		while (-1 == read(tp->fd[0], &count, sizeof count) && EINTR == errno)
+			continue;
+	}
+#else
+	{
+		char buf[64];
+
+		while (read(tp->fd[0], buf, sizeof buf) > 0)
+			continue;
+	}
+#endif
+
+	TPOOL_LOCK(tp);
+	while (tp->done != NULL) {
+		struct tpool_job *job = tp->done;
+
+		tp->done = job->next;
+		job->next = done;		/* Reverse, to process in completion order */
+		done = job;
+	}
+	TPOOL_UNLOCK(tp);
+
+	/*
+	 * Completion callbacks may cancel jobs or free queues, which would
+	 * affect the jobs we have yet to deliver.
+	 */
+
+	g_assert(NULL == tp->delivering);
+
+	tp->delivering = done;
+	while (tp->delivering != NULL) {
+		struct tpool_job *job = tp->delivering;
+
+		tp->delivering = job->next;
+		job->next = NULL;
+		tpool_deliver(job);
+	}
+
+	/*
+	 * Without workers, run one pending job per main loop iteration, so
+	 * as to not delay I/O processing.
+	 */
+
+	if (0 == tpool_threads() && tpool_run_inline(tp))
+		tpool_notify(tp);
+}
+
+/**
+ * Fill supplied vector with the statistics of the job queues.
+ *
+ * @param vec		the vector to fill
+ * @param n			amount of entries in vector
+ *
+ * @return the amount of entries filled.
+ */
+size_t
+tpool_queue_stats(struct tpool_stats *vec, size_t n)
+{
+	struct tpool *tp = tpool;
+	struct tpool_queue *q;
+	size_t i = 0;
+
+	g_assert(vec != NULL || 0 == n);
+
+	if (NULL == tp)
+		return 0;
+
+	TPOOL_LOCK(tp);
+	for (q = tp->queues; q != NULL && i < n; q = q->next)
+		vec[i++] = q->stats;		/* Struct copy */
+	TPOOL_UNLOCK(tp);
+
+	return i;
+}
+
+/**
+ * Initialize the thread pool.
+ *
+ * No workers are created until tpool_set_threads() is called, jobs being
+ * run by the main thread until then.
+ */
+void
+tpool_init(void)
+{
+	struct tpool *tp;
+	unsigned i;
+
+	g_assert(NULL == tpool);
+
+	WALLOC0(tp);
+
+#ifdef HAS_EVENTFD
+	tp->fd[0] = tp->fd[1] = eventfd(0, 0);
+	if (-1 == tp->fd[0])
+		g_error("%s(): cannot create eventfd: %s",
+			G_STRFUNC, g_strerror(errno));
+#else
+	if (-1 == pipe(tp->fd))
+		g_error("%s(): cannot create pipe: %s", G_STRFUNC, g_strerror(errno));
+#endif
+
+	for (i = 0; i < G_N_ELEMENTS(tp->fd); i++) {
+		fd_set_nonblocking(tp->fd[i]);
+		set_close_on_exec(tp->fd[i]);
+	}
+
+#ifdef TPOOL_THREADS
+	tp->lock = g_mutex_new();
+	tp->work_cond = g_cond_new();
+	tp->idle_cond = g_cond_new();
+#endif
+
+	tp->event_id = inputevt_add(tp->fd[0], INPUT_EVENT_RX,
+		tpool_completed, tp);
+
+	tpool = tp;
+}
+
+/**
+ * Stop the workers and free the thread pool.
+ *
+ * Jobs being run are waited for, pending jobs are discarded.
+ */
+void
+tpool_close(void)
+{
+	struct tpool *tp = tpool;
+
+	if (NULL == tp)
+		return;
+
+	while (tp->queues != NULL) {
+		struct tpool_queue *q = tp->queues;
+
+		g_warning("%s(): queue \"%s\" was not freed", G_STRFUNC, q->name);
+		tpool_queue_free_null(&q);
+	}
+
+	TPOOL_LOCK(tp);
+	tp->target = 0;
+#ifdef TPOOL_THREADS
+	g_cond_broadcast(tp->work_cond);
+	while (tp->threads != 0)
+		g_cond_wait(tp->idle_cond, tp->lock);
+#endif
+	TPOOL_UNLOCK(tp);
+
+	inputevt_remove(&tp->event_id);
+	fd_close(&tp->fd[0]);
+#ifndef HAS_EVENTFD
+	fd_close(&tp->fd[1]);
+#endif
+
+#ifdef TPOOL_THREADS
+	g_mutex_free(tp->lock);
+	g_cond_free(tp->work_cond);
+	g_cond_free(tp->idle_cond);
+#endif
+
+	WFREE(tp);
+	tpool = NULL;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
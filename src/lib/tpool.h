@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Thread pool.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _tpool_h_
+#define _tpool_h_
+
+#include "common.h"
+
+typedef struct tpool_queue tpool_queue_t;
+typedef struct tpool_job tpool_job_t;
+
+/**
+ * Job priorities, jobs with a higher priority being run first.
+ */
+typedef enum tpool_prio {
+	TPOOL_PRIO_HIGH = 0,
+	TPOOL_PRIO_NORMAL,
+	TPOOL_PRIO_LOW,
+
+	TPOOL_PRIO_COUNT
+} tpool_prio_t;
+
+/**
+ * A job routine, run by one of the worker threads.
+ *
+ * Since it runs concurrently with the main thread, it must not use any
+ * of the facilities which are not thread-safe: memory allocators, atoms,
+ * logging, callout queues, etc.  It must only work on the data it was
+ * given, which the main thread must not touch until completion.
+ *
+ * @param job		the job being run, to check for cancellation
+ * @param data		user-supplied job data
+ */
+typedef void (*tpool_work_t)(const tpool_job_t *job, void *data);
+
+/**
+ * A job completion callback, invoked on the main thread.
+ *
+ * @param data		user-supplied job data
+ */
+typedef void (*tpool_done_t)(void *data);
+
+/**
+ * Queue statistics, as returned by tpool_queue_stats().
+ */
+struct tpool_stats {
+	const char *name;		/**< Queue name */
+	guint64 submitted;		/**< Amount of jobs submitted */
+	guint64 completed;		/**< Amount of jobs completed */
+	guint64 cancelled;		/**< Amount of jobs cancelled */
+	guint64 wait_us;		/**< Waiting time of completed jobs, usecs */
+	guint64 run_us;			/**< Run time of completed jobs, in usecs */
+	guint64 run_max_us;		/**< Longest job run time, in usecs */
+	unsigned pending;		/**< Jobs currently waiting for a thread */
+	unsigned running;		/**< Jobs currently being run */
+};
+
+/*
+ * Public interface.
+ */
+
+void tpool_set_debug(unsigned level);
+void tpool_set_threads(unsigned n);
+unsigned tpool_threads(void);
+
+tpool_queue_t *tpool_queue_make(const char *name);
+void tpool_queue_free_null(tpool_queue_t **q_ptr);
+const char *tpool_queue_name(const tpool_queue_t *q);
+
+tpool_job_t *tpool_submit(tpool_queue_t *q, tpool_prio_t prio,
+	tpool_work_t work, tpool_done_t done, void *data);
+gboolean tpool_cancel(tpool_job_t **job_ptr);
+gboolean tpool_job_cancelled(const tpool_job_t *job);
+
+size_t tpool_queue_stats(struct tpool_stats *vec, size_t n);
+
+void tpool_init(void);
+void tpool_close(void);
+
+#endif	/* _tpool_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
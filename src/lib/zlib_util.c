@@ -44,6 +44,70 @@
 
 #define OUT_GROW	1024		/**< To grow output buffer if it's to short */
 
+/*
+ * Pool of initialized streams.
+ *
+ * Setting up a zlib stream allocates several hundreds of KiB for the
+ * largest windows, and connections come and go all the time.  Released
+ * streams are therefore reset and kept for the next user asking for the
+ * same level, window and memory parameters, up to a total amount of memory.
+ *
+ * The level is part of the pool key so that reused streams never need to
+ * go through deflateParams(), which compresses pending data and would
+ * therefore write through the output buffer of the former user.  Users
+ * changing the level of a stream must do so with zlib_deflate_params(),
+ * so that the stream is pooled under its new level.
+ */
+
+#define ZLIB_POOL_PROFILES	16			/**< Distinct stream parameters */
+#define ZLIB_POOL_MEMORY	(4 * 1024 * 1024)	/**< Max memory kept in pool */
+
+enum zlib_stream_magic { ZLIB_STREAM_MAGIC = 0x2b6a1f07U };
+
+/**
+ * A pooled stream, the z_stream must be the first field.
+ */
+struct zlib_stream {
+	z_stream z;						/**< The zlib stream */
+	enum zlib_stream_magic magic;
+	struct zlib_stream *next;		/**< Next in pool list */
+	size_t memory;					/**< Memory allocated by zlib */
+	int level;						/**< Current level, 0 for inflating */
+	int window_bits;				/**< Window, negative for raw deflate */
+	int mem_level;					/**< Memory level, 0 for inflating */
+};
+
+static inline void
+zlib_stream_check(const struct zlib_stream * const zs)
+{
+	g_assert(zs != NULL);
+	g_assert(ZLIB_STREAM_MAGIC == zs->magic);
+}
+
+/**
+ * Idle streams sharing the same parameters.
+ */
+static struct zlib_pool {
+	struct zlib_stream *head;		/**< Idle streams */
+	unsigned count;					/**< Amount of idle streams */
+	int level;
+	int window_bits;
+	int mem_level;
+} zlib_pool[ZLIB_POOL_PROFILES];
+
+static struct zlib_pool_stats zlib_stats;
+
+/**
+ * Header prepended to each block allocated for zlib, so that we can
+ * account for the memory released.
+ */
+union zlib_block {
+	size_t size;
+	double d;						/* Alignment */
+	void *p;						/* Alignment */
+	guint64 u;						/* Alignment */
+};
+
 /**
  * Maps the given error code to an error message.
  *
@@ -68,23 +132,373 @@ zlib_strerror(int errnum)
 	return "Invalid error code";
 }
 
+/**
+ * Memory allocation routine for zlib.
+ *
+ * The opaque pointer, when not NULL, is the stream being allocated, from
+ * zlib_deflate_get() or zlib_inflate_get().
+ */
 gpointer
-zlib_alloc_func(gpointer unused_opaque, guint n, guint m)
+zlib_alloc_func(gpointer opaque, guint n, guint m)
 {
-	(void) unused_opaque;
+	union zlib_block *b;
+	size_t size;
 
 	g_return_val_if_fail(n > 0, NULL);
 	g_return_val_if_fail(m > 0, NULL);
 	g_return_val_if_fail(m < ((size_t) -1) / n, NULL);
 
-	return halloc((size_t) n * m);
+	size = (size_t) n * m;
+	g_return_val_if_fail(size < ((size_t) -1) - sizeof *b, NULL);
+
+	b = halloc(size + sizeof *b);
+	b->size = size;
+	zlib_stats.memory += size;
+
+	if (opaque != NULL) {
+		struct zlib_stream *zs = opaque;
+
+		zlib_stream_check(zs);
+		zs->memory += size;
+	}
+
+	return &b[1];
 }
 
 void
-zlib_free_func(gpointer unused_opaque, gpointer p)
+zlib_free_func(gpointer opaque, gpointer p)
 {
-	(void) unused_opaque;
-	hfree(p);
+	union zlib_block *b;
+
+	if (NULL == p)
+		return;
+
+	b = (union zlib_block *) p - 1;
+	g_assert(zlib_stats.memory >= b->size);
+	zlib_stats.memory -= b->size;
+
+	if (opaque != NULL) {
+		struct zlib_stream *zs = opaque;
+
+		zlib_stream_check(zs);
+		g_assert(zs->memory >= b->size);
+		zs->memory -= b->size;
+	}
+
+	hfree(b);
+}
+
+/**
+ * Find pool for given stream parameters.
+ *
+ * @param level			the compression level, 0 for inflating streams
+ * @param window_bits	the window parameter
+ * @param mem_level		the memory level, 0 for inflating streams
+ * @param create		whether to allocate a free slot when missing
+ *
+ * @return the pool, NULL if not found or when there is no more room.
+ */
+static struct zlib_pool *
+zlib_pool_find(int level, int window_bits, int mem_level, gboolean create)
+{
+	unsigned i;
+
+	for (i = 0; i < G_N_ELEMENTS(zlib_pool); i++) {
+		struct zlib_pool *zp = &zlib_pool[i];
+
+		if (
+			zp->level == level &&
+			zp->window_bits == window_bits &&
+			zp->mem_level == mem_level
+		)
+			return zp;
+	}
+
+	if (!create)
+		return NULL;
+
+	for (i = 0; i < G_N_ELEMENTS(zlib_pool); i++) {
+		struct zlib_pool *zp = &zlib_pool[i];
+
+		if (0 == zp->window_bits) {
+			zp->level = level;
+			zp->window_bits = window_bits;
+			zp->mem_level = mem_level;
+			return zp;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Get an idle stream from the pool.
+ */
+static struct zlib_stream *
+zlib_pool_get(int level, int window_bits, int mem_level)
+{
+	struct zlib_pool *zp;
+	struct zlib_stream *zs;
+
+	zp = zlib_pool_find(level, window_bits, mem_level, FALSE);
+	if (NULL == zp || NULL == zp->head) {
+		zlib_stats.misses++;
+		return NULL;
+	}
+
+	zs = zp->head;
+	zlib_stream_check(zs);
+
+	zp->head = zs->next;
+	zp->count--;
+	zs->next = NULL;
+
+	g_assert(zlib_stats.pooled > 0);
+	g_assert(zlib_stats.pooled_memory >= zs->memory);
+
+	zlib_stats.pooled--;
+	zlib_stats.pooled_memory -= zs->memory;
+	zlib_stats.hits++;
+
+	return zs;
+}
+
+/**
+ * Free stream that could not be pooled.
+ */
+static void
+zlib_stream_free(struct zlib_stream *zs)
+{
+	int ret;
+
+	zlib_stream_check(zs);
+
+	ret = 0 == zs->mem_level ? inflateEnd(&zs->z) : deflateEnd(&zs->z);
+	if (ret != Z_OK && ret != Z_DATA_ERROR)
+		g_carp("while freeing zlib stream: %s", zlib_strerror(ret));
+
+	g_assert(zlib_stats.streams > 0);
+
+	zlib_stats.streams--;
+	zs->magic = 0;
+	WFREE(zs);
+}
+
+/**
+ * Put stream in the pool if there is room for it, or free it.
+ */
+static void
+zlib_pool_put(struct zlib_stream *zs)
+{
+	struct zlib_pool *zp;
+	int ret;
+
+	zlib_stream_check(zs);
+	g_assert(NULL == zs->next);
+
+	ret = 0 == zs->mem_level ? inflateReset(&zs->z) : deflateReset(&zs->z);
+	if (Z_OK != ret)
+		goto discard;
+
+	/*
+	 * Forget about the buffers of the former user, which are probably
+	 * freed by now.
+	 */
+
+	zs->z.next_in = NULL;
+	zs->z.avail_in = 0;
+	zs->z.next_out = NULL;
+	zs->z.avail_out = 0;
+
+	if (zlib_stats.pooled_memory + zs->memory > ZLIB_POOL_MEMORY)
+		goto discard;
+
+	zp = zlib_pool_find(zs->level, zs->window_bits, zs->mem_level, TRUE);
+	if (NULL == zp)
+		goto discard;
+
+	zs->next = zp->head;
+	zp->head = zs;
+	zp->count++;
+	zlib_stats.pooled++;
+	zlib_stats.pooled_memory += zs->memory;
+	return;
+
+discard:
+	zlib_stats.discarded++;
+	zlib_stream_free(zs);
+}
+
+/**
+ * Get a deflating stream, either from the pool or freshly initialized.
+ *
+ * @param level			compression level, between 0 and 9, or default
+ * @param window_bits	window size, negative for raw deflate (no header)
+ * @param mem_level		memory level, between 1 and 9
+ *
+ * @return initialized stream, to be released with zlib_deflate_release(),
+ * or NULL on error.
+ */
+z_streamp
+zlib_deflate_get(int level, int window_bits, int mem_level)
+{
+	struct zlib_stream *zs;
+	int ret;
+
+	g_assert(level == Z_DEFAULT_COMPRESSION || (level >= 0 && level <= 9));
+	g_assert(window_bits != 0);
+	g_assert(mem_level >= 1 && mem_level <= MAX_MEM_LEVEL);
+
+	if (Z_DEFAULT_COMPRESSION == level)
+		level = 6;		/* What zlib maps the default to */
+
+	zs = zlib_pool_get(level, window_bits, mem_level);
+	if (zs != NULL)
+		return &zs->z;
+
+	WALLOC0(zs);
+	zs->magic = ZLIB_STREAM_MAGIC;
+	zs->level = level;
+	zs->window_bits = window_bits;
+	zs->mem_level = mem_level;
+	zs->z.zalloc = zlib_alloc_func;
+	zs->z.zfree = zlib_free_func;
+	zs->z.opaque = zs;
+
+	ret = deflateInit2(&zs->z, level, Z_DEFLATED, window_bits, mem_level,
+			Z_DEFAULT_STRATEGY);
+
+	if (Z_OK != ret) {
+		g_carp("unable to initialize compressor: %s", zlib_strerror(ret));
+		zs->magic = 0;
+		WFREE(zs);
+		return NULL;
+	}
+
+	zlib_stats.streams++;
+	return &zs->z;
+}
+
+/**
+ * Get an inflating stream, either from the pool or freshly initialized.
+ *
+ * @param window_bits	window size, negative for raw inflate (no header)
+ *
+ * @return initialized stream, to be released with zlib_inflate_release(),
+ * or NULL on error.
+ */
+z_streamp
+zlib_inflate_get(int window_bits)
+{
+	struct zlib_stream *zs;
+	int ret;
+
+	g_assert(window_bits != 0);
+
+	zs = zlib_pool_get(0, window_bits, 0);
+	if (zs != NULL)
+		return &zs->z;
+
+	WALLOC0(zs);
+	zs->magic = ZLIB_STREAM_MAGIC;
+	zs->window_bits = window_bits;
+	zs->z.zalloc = zlib_alloc_func;
+	zs->z.zfree = zlib_free_func;
+	zs->z.opaque = zs;
+
+	ret = inflateInit2(&zs->z, window_bits);
+
+	if (Z_OK != ret) {
+		g_carp("unable to initialize decompressor: %s", zlib_strerror(ret));
+		zs->magic = 0;
+		WFREE(zs);
+		return NULL;
+	}
+
+	zlib_stats.streams++;
+	return &zs->z;
+}
+
+/**
+ * Change the compression level of a stream obtained via zlib_deflate_get().
+ *
+ * This calls deflateParams(), which may compress pending input with the
+ * former level, hence the output buffer of the stream must be set.
+ *
+ * @return the zlib status code.
+ */
+int
+zlib_deflate_params(z_streamp z, int level)
+{
+	struct zlib_stream *zs = (struct zlib_stream *) z;
+	int ret;
+
+	zlib_stream_check(zs);
+	g_assert(zs->mem_level != 0);
+	g_assert(level == Z_DEFAULT_COMPRESSION || (level >= 0 && level <= 9));
+
+	if (Z_DEFAULT_COMPRESSION == level)
+		level = 6;
+
+	ret = deflateParams(z, level, Z_DEFAULT_STRATEGY);
+	if (Z_OK == ret)
+		zs->level = level;
+
+	return ret;
+}
+
+/**
+ * Release stream obtained via zlib_deflate_get() or zlib_inflate_get(),
+ * and nullify its pointer.
+ */
+void
+zlib_stream_release(z_streamp *z_ptr)
+{
+	z_streamp z = *z_ptr;
+
+	if (z != NULL) {
+		struct zlib_stream *zs = (struct zlib_stream *) z;
+
+		zlib_stream_check(zs);
+		zlib_pool_put(zs);
+		*z_ptr = NULL;
+	}
+}
+
+/**
+ * Fill statistics about zlib memory usage and stream pooling.
+ */
+void
+zlib_pool_stats(struct zlib_pool_stats *stats)
+{
+	g_assert(stats != NULL);
+
+	*stats = zlib_stats;
+}
+
+/**
+ * Free the pooled streams.
+ */
+void
+zlib_close(void)
+{
+	unsigned i;
+
+	for (i = 0; i < G_N_ELEMENTS(zlib_pool); i++) {
+		struct zlib_pool *zp = &zlib_pool[i];
+		struct zlib_stream *zs, *next;
+
+		for (zs = zp->head; zs != NULL; zs = next) {
+			next = zs->next;
+			g_assert(zlib_stats.pooled_memory >= zs->memory);
+			zlib_stats.pooled--;
+			zlib_stats.pooled_memory -= zs->memory;
+			zs->next = NULL;
+			zlib_stream_free(zs);
+		}
+		zp->head = NULL;
+		zp->count = 0;
+	}
 }
 
 /**
@@ -36,6 +36,8 @@
 
 #include "common.h"
 
+#include <zlib.h>
+
 /**
  * Incremental deflater stream.
  */
@@ -55,6 +57,19 @@ typedef struct  {
 #define zlib_deflater_inlen(z)	((z)->inlen_total)
 #define zlib_deflater_closed(z)	((z)->closed)
 
+/**
+ * Statistics about zlib memory and stream pooling.
+ */
+struct zlib_pool_stats {
+	size_t memory;			/**< Memory allocated by zlib */
+	size_t pooled_memory;	/**< Memory held by idle pooled streams */
+	unsigned streams;		/**< Pooled streams allocated (idle or in use) */
+	unsigned pooled;		/**< Idle streams in the pool */
+	guint64 hits;			/**< Streams reused from the pool */
+	guint64 misses;			/**< Streams that had to be initialized */
+	guint64 discarded;		/**< Released streams freed, pool was full */
+};
+
 /*
  * Public interface.
  */
@@ -73,8 +88,16 @@ gpointer zlib_uncompress(gconstpointer data, int len, gulong uncompressed_len);
 int zlib_inflate_into(gconstpointer data, int len, gpointer out, int *outlen);
 gboolean zlib_is_valid_header(gconstpointer data, int len);
 
-void zlib_free_func(gpointer unused_opaque, gpointer p);
-gpointer zlib_alloc_func(gpointer unused_opaque, guint n, guint m);
+void zlib_free_func(gpointer opaque, gpointer p);
+gpointer zlib_alloc_func(gpointer opaque, guint n, guint m);
+
+z_streamp zlib_deflate_get(int level, int window_bits, int mem_level);
+int zlib_deflate_params(z_streamp z, int level);
+z_streamp zlib_inflate_get(int window_bits);
+void zlib_stream_release(z_streamp *z_ptr);
+
+void zlib_pool_stats(struct zlib_pool_stats *stats);
+void zlib_close(void);
 
 #endif	/* _zlib_util_h_ */
 
@@ -78,6 +78,7 @@
 #include "core/pcache.h"
 #include "core/pproxy.h"
 #include "core/publisher.h"
+#include "core/qrp.h"
 #include "core/routing.h"
 #include "core/rx.h"
 #include "core/search.h"
@@ -112,6 +113,7 @@
 #include "lib/debug.h"
 #include "lib/dbus_util.h"
 #include "lib/eval.h"
+#include "lib/evperf.h"
 #include "lib/fd.h"
 #include "lib/glib-missing.h"
 #include "lib/halloc.h"
@@ -129,14 +131,17 @@
 #include "lib/pattern.h"
 #include "lib/pow2.h"
 #include "lib/random.h"
+#include "lib/sha1.h"
 #include "lib/signal.h"
 #include "lib/stacktrace.h"
+#include "lib/stall.h"
 #include "lib/stringify.h"
 #include "lib/strtok.h"
 #include "lib/tea.h"
 #include "lib/tiger.h"
 #include "lib/tigertree.h"
 #include "lib/tm.h"
+#include "lib/tpool.h"
 #include "lib/utf8.h"
 #include "lib/vendors.h"
 #include "lib/vmm.h"
@@ -145,6 +150,7 @@
 #include "lib/wordvec.h"
 #include "lib/wq.h"
 #include "lib/zalloc.h"
+#include "lib/zlib_util.h"
 #include "shell/shell.h"
 #include "upnp/upnp.h"
 #include "xml/vxml.h"
@@ -481,6 +487,7 @@ gtk_gnutella_exit(int exit_code)
 	fn(arg);							\
 } while (0)
 
+	DO(stall_close);	/* Shutdown is not run from the main loop */
 	DO(shell_close);
 	DO(file_info_store_if_dirty);	/* For safety, will run again below */
 	DO(file_info_close_pre);
@@ -642,6 +649,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(bogons_close);	/* Idem, since host_close() can touch the cache */
 	DO(tx_collect);		/* Prevent spurious leak notifications */
 	DO(rx_collect);		/* Idem */
+	DO(zlib_close);		/* After TX and RX stacks released their streams */
 	DO(hostiles_close);
 	DO(spam_close);
 	DO(gip_close);
@@ -671,9 +679,11 @@ gtk_gnutella_exit(int exit_code)
 	DO(settings_close);	/* Must come after hcache_close() */
 	DO(misc_close);
 	DO(mingw_close);
+	DO(tpool_close);
 	DO(inputevt_close);
 	DO(locale_close);
 	DO(cq_close);
+	DO(evperf_close);
 	DO(wq_close);
 	DO(log_close);		/* Does not disable logging */
 
@@ -733,6 +743,7 @@ enum main_arg {
 	main_arg_shell,
 	main_arg_topless,
 	main_arg_use_poll,
+	main_arg_use_uring,
 	main_arg_version,
 
 	/* Passed through for Gtk+/GDK/GLib */
@@ -798,6 +809,7 @@ static struct {
 	OPTION(topless,			NONE, "Disable the graphical user-interface."),
 #endif	/* USE_TOPLESS */
 	OPTION(use_poll,		NONE, "Use poll() instead of epoll(), kqueue() etc."),
+	OPTION(use_uring,		NONE, "Use io_uring instead of epoll() if possible."),
 	OPTION(version,			NONE, "Show version information."),
 
 	/* These are handled by Gtk+/GDK/GLib */
@@ -1531,6 +1543,17 @@ main(int argc, char **argv)
 	signal_init();
 	halloc_init(!options[main_arg_no_halloc].used);
 	malloc_init_vtable();
+
+	/*
+	 * Older GLib versions require the thread system to be initialized
+	 * before any other GLib call, save for g_mem_set_vtable() done above.
+	 */
+
+#if defined(USE_GLIB2) && defined(G_THREADS_ENABLED)
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+#endif
+
 	vmm_malloc_inited();
 	zinit();
 	walloc_init();
@@ -1630,12 +1653,18 @@ main(int argc, char **argv)
 	random_init();
 	cq_init(callout_queue_idle, GNET_PROPERTY_PTR(cq_debug));
 	wq_init();
-	inputevt_init(options[main_arg_use_poll].used);
+	inputevt_init(
+		(options[main_arg_use_poll].used ? INPUTEVT_F_POLL : 0) |
+		(options[main_arg_use_uring].used ? INPUTEVT_F_URING : 0));
+	tpool_init();
+	sha1_check();
 	tiger_check();
 	tt_check();
+	qrp_check();
 	tea_test();
 	patricia_test();
 	strtok_test();
+	cq_test();
 	locale_init();
 	adns_init();
 	file_object_init();
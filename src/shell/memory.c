@@ -37,11 +37,13 @@
 
 #include "lib/ascii.h"
 #include "lib/fd.h"
+#include "lib/glib-missing.h"
 #include "lib/parse.h"
 #include "lib/misc.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/file.h"
+#include "lib/zlib_util.h"
 
 #include "lib/override.h"		/* Must be the last header included */
 
@@ -169,6 +171,41 @@ failure:
 	return REPLY_ERROR;
 }
 
+static enum shell_reply
+shell_exec_memory_zlib(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	struct zlib_pool_stats stats;
+	char buf[128];
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	zlib_pool_stats(&stats);
+
+	gm_snprintf(buf, sizeof buf, "zlib memory: %s\n",
+		size_t_to_string(stats.memory));
+	shell_write(sh, buf);
+	gm_snprintf(buf, sizeof buf, "zlib streams: %u (%u idle in pool)\n",
+		stats.streams, stats.pooled);
+	shell_write(sh, buf);
+	gm_snprintf(buf, sizeof buf, "zlib pool memory: %s\n",
+		size_t_to_string(stats.pooled_memory));
+	shell_write(sh, buf);
+	gm_snprintf(buf, sizeof buf, "zlib pool hits: %s\n",
+		uint64_to_string(stats.hits));
+	shell_write(sh, buf);
+	gm_snprintf(buf, sizeof buf, "zlib pool misses: %s\n",
+		uint64_to_string(stats.misses));
+	shell_write(sh, buf);
+	gm_snprintf(buf, sizeof buf, "zlib pool discarded: %s\n",
+		uint64_to_string(stats.discarded));
+	shell_write(sh, buf);
+
+	return REPLY_READY;
+}
+
 /**
  * Handles the memory command.
  */
@@ -188,6 +225,7 @@ shell_exec_memory(struct gnutella_shell *sh, int argc, const char *argv[])
 } G_STMT_END
 
 	CMD(dump);
+	CMD(zlib);
 #undef CMD
 	
 	shell_set_msg(sh, _("Unknown operation"));
@@ -213,7 +251,8 @@ shell_help_memory(int argc, const char *argv[])
 		/* FIXME */
 		return NULL;
 	} else {
-		return "memory dump ADDRESS LENGTH\n";
+		return "memory dump ADDRESS LENGTH\n"
+			"memory zlib\n";
 	}
 }
 
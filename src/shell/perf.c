@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup shell
+ * @file
+ *
+ * The "perf" command.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "cmd.h"
+
+#include "if/gnet_property.h"
+#include "if/gnet_property_priv.h"
+
+#include "lib/ascii.h"
+#include "lib/evperf.h"
+#include "lib/glib-missing.h"
+#include "lib/parse.h"
+#include "lib/stacktrace.h"
+#include "lib/stall.h"
+#include "lib/stringify.h"
+#include "lib/tpool.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define PERF_TOP_DEFAULT	20		/**< Default amount of entries shown */
+#define PERF_TOP_MAX		200		/**< Max amount of entries shown */
+#define PERF_BAR_WIDTH		30		/**< Width of histogram bars */
+#define PERF_STALL_FRAMES	4		/**< Frames shown per stall site */
+
+static enum shell_reply
+shell_exec_perf_on(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	gnet_prop_set_boolean_val(PROP_EVLOOP_PROFILING, TRUE);
+	shell_set_msg(sh, _("Event loop profiling enabled"));
+
+	return REPLY_READY;
+}
+
+static enum shell_reply
+shell_exec_perf_off(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	gnet_prop_set_boolean_val(PROP_EVLOOP_PROFILING, FALSE);
+	shell_set_msg(sh, _("Event loop profiling disabled"));
+
+	return REPLY_READY;
+}
+
+static enum shell_reply
+shell_exec_perf_reset(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	evperf_reset();
+	shell_set_msg(sh, _("Profiling statistics cleared"));
+
+	return REPLY_READY;
+}
+
+/**
+ * Lists the callbacks which consumed the most wall-clock time.
+ */
+static enum shell_reply
+shell_exec_perf_top(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	struct evperf_info *vec;
+	unsigned count = PERF_TOP_DEFAULT;
+	size_t i, n;
+	char buf[256];
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (argc > 2) {
+		const char *endptr;
+		int error;
+
+		count = parse_uint32(argv[2], &endptr, 10, &error);
+		if (error || '\0' != *endptr || 0 == count) {
+			shell_set_msg(sh, _("Invalid count"));
+			return REPLY_ERROR;
+		}
+		count = MIN(count, PERF_TOP_MAX);
+	}
+
+	if (!GNET_PROPERTY(evloop_profiling))
+		shell_write(sh, _("Warning: event loop profiling is disabled\n"));
+
+	vec = g_malloc(count * sizeof vec[0]);
+	n = evperf_top(vec, count);
+
+	gm_snprintf(buf, sizeof buf, "%-4s %10s %10s %9s %10s %9s %8s  %s\n",
+		"Kind", "Calls", "Wall (ms)", "Max (us)", "CPU (ms)", "Max (us)",
+		"Avg (us)", "Routine");
+	shell_write(sh, buf);
+
+	for (i = 0; i < n; i++) {
+		const struct evperf_info *info = &vec[i];
+
+		gm_snprintf(buf, sizeof buf,
+			"%-4s %10s %10.1f %9lu %10.1f %9lu %8lu  %s\n",
+			evperf_kind_to_string(info->kind),
+			uint64_to_string(info->calls),
+			info->wall / 1000.0, (unsigned long) info->wall_max,
+			info->cpu / 1000.0, (unsigned long) info->cpu_max,
+			(unsigned long) (info->wall / MAX(info->calls, 1)),
+			stacktrace_routine_name(info->fn, FALSE));
+		shell_write(sh, buf);
+	}
+
+	G_FREE_NULL(vec);
+
+	return REPLY_READY;
+}
+
+/**
+ * Format an amount of microseconds into a short string.
+ */
+static const char *
+perf_usecs(guint64 us)
+{
+	static char buf[32];
+
+	if (us < 1000)
+		gm_snprintf(buf, sizeof buf, "%lu us", (unsigned long) us);
+	else if (us < 1000000)
+		gm_snprintf(buf, sizeof buf, "%.1f ms", us / 1000.0);
+	else
+		gm_snprintf(buf, sizeof buf, "%.1f s", us / 1000000.0);
+
+	return buf;
+}
+
+/**
+ * Displays the histogram of main loop iteration durations.
+ */
+static enum shell_reply
+shell_exec_perf_histo(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	struct evperf_loop loop;
+	guint64 peak = 0;
+	char buf[256];
+	unsigned i;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (!GNET_PROPERTY(evloop_profiling))
+		shell_write(sh, _("Warning: event loop profiling is disabled\n"));
+
+	evperf_loop_stats(&loop);
+
+	gm_snprintf(buf, sizeof buf, _("Loop iterations: %s\n"),
+		uint64_to_string(loop.iterations));
+	shell_write(sh, buf);
+
+	if (0 == loop.iterations)
+		return REPLY_READY;
+
+	gm_snprintf(buf, sizeof buf, _("Average busy time: %s\n"),
+		perf_usecs(loop.busy / loop.iterations));
+	shell_write(sh, buf);
+	gm_snprintf(buf, sizeof buf, _("Longest iteration: %s\n"),
+		perf_usecs(loop.busy_max));
+	shell_write(sh, buf);
+	shell_write(sh, "\n");
+
+	for (i = 0; i < G_N_ELEMENTS(loop.histo); i++)
+		peak = MAX(peak, loop.histo[i]);
+
+	for (i = 0; i < G_N_ELEMENTS(loop.histo); i++) {
+		guint64 count = loop.histo[i];
+		gboolean last = i + 1 == G_N_ELEMENTS(loop.histo);
+		char bar[PERF_BAR_WIDTH + 1];
+		size_t len;
+
+		if (0 == count)
+			continue;
+
+		len = (count * PERF_BAR_WIDTH + peak - 1) / peak;
+		memset(bar, '#', len);
+		bar[len] = '\0';
+
+		/*
+		 * Slot i counts iterations lasting less than 2^(i+1) usecs, except
+		 * for the last one which counts all the iterations lasting longer.
+		 */
+
+		gm_snprintf(buf, sizeof buf, "%c %9s %10s %5.1f%% %s\n",
+			last ? '>' : '<', perf_usecs((guint64) 1 << (last ? i : i + 1)),
+			uint64_to_string(count), 100.0 * count / loop.iterations, bar);
+		shell_write(sh, buf);
+	}
+
+	return REPLY_READY;
+}
+
+/**
+ * Lists the sites where the main loop was caught stalling.
+ */
+static enum shell_reply
+shell_exec_perf_stalls(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	struct stall_info vec[PERF_TOP_DEFAULT];
+	size_t i, n;
+	char buf[256];
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (0 == GNET_PROPERTY(stall_threshold))
+		shell_write(sh, _("Warning: stall detection is disabled\n"));
+
+	gm_snprintf(buf, sizeof buf, _("Main loop stalls: %u\n"), stall_count());
+	shell_write(sh, buf);
+
+	n = stall_top(vec, G_N_ELEMENTS(vec));
+	if (0 == n)
+		return REPLY_READY;
+
+	gm_snprintf(buf, sizeof buf, "\n%8s %8s %10s %9s  %s\n",
+		"Stalls", "Samples", "Total (ms)", "Max (ms)", "Stack");
+	shell_write(sh, buf);
+
+	for (i = 0; i < n; i++) {
+		const struct stall_info *info = &vec[i];
+		size_t j;
+
+		for (j = 0; j < MIN(info->where->len, PERF_STALL_FRAMES); j++) {
+			const char *name =
+				stacktrace_routine_name(info->where->stack[j], TRUE);
+
+			if (0 == j) {
+				gm_snprintf(buf, sizeof buf, "%8u %8s %10s %9u  %s\n",
+					info->stalls, uint64_to_string(info->samples),
+					uint64_to_string2(info->total_ms), info->max_ms, name);
+			} else {
+				gm_snprintf(buf, sizeof buf, "%38s  %s\n", "", name);
+			}
+			shell_write(sh, buf);
+		}
+	}
+
+	return REPLY_READY;
+}
+
+/**
+ * Displays the statistics of the thread pool queues.
+ */
+static enum shell_reply
+shell_exec_perf_pool(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	struct tpool_stats vec[PERF_TOP_DEFAULT];
+	size_t i, n;
+	char buf[256];
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	gm_snprintf(buf, sizeof buf, _("Worker threads: %u\n"), tpool_threads());
+	shell_write(sh, buf);
+
+	n = tpool_queue_stats(vec, G_N_ELEMENTS(vec));
+	if (0 == n)
+		return REPLY_READY;
+
+	gm_snprintf(buf, sizeof buf, "\n%-12s %10s %10s %8s %6s %6s %9s %9s %9s\n",
+		"Queue", "Submitted", "Completed", "Cancel", "Pend", "Run",
+		"Wait (us)", "Run (us)", "Max (us)");
+	shell_write(sh, buf);
+
+	for (i = 0; i < n; i++) {
+		const struct tpool_stats *st = &vec[i];
+		guint64 ran = MAX(st->completed, 1);
+
+		gm_snprintf(buf, sizeof buf,
+			"%-12s %10s %10s %8lu %6u %6u %9lu %9lu %9lu\n",
+			st->name, uint64_to_string(st->submitted),
+			uint64_to_string2(st->completed), (unsigned long) st->cancelled,
+			st->pending, st->running, (unsigned long) (st->wait_us / ran),
+			(unsigned long) (st->run_us / ran), (unsigned long) st->run_max_us);
+		shell_write(sh, buf);
+	}
+
+	return REPLY_READY;
+}
+
+/**
+ * Handles the perf command.
+ */
+enum shell_reply
+shell_exec_perf(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (argc < 2)
+		return shell_exec_perf_top(sh, argc, argv);
+
+#define CMD(name) G_STMT_START { \
+	if (0 == ascii_strcasecmp(argv[1], #name)) \
+		return shell_exec_perf_ ## name(sh, argc, argv); \
+} G_STMT_END
+
+	CMD(histo);
+	CMD(off);
+	CMD(on);
+	CMD(pool);
+	CMD(reset);
+	CMD(stalls);
+	CMD(top);
+#undef CMD
+
+	shell_set_msg(sh, _("Unknown operation"));
+	return REPLY_ERROR;
+}
+
+const char *
+shell_summary_perf(void)
+{
+	return "Event loop profiling";
+}
+
+const char *
+shell_help_perf(int argc, const char *argv[])
+{
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (argc > 1) {
+		/* FIXME */
+		return NULL;
+	} else {
+		return "perf on|off|reset\n"
+			"perf top [COUNT]\n"
+			"perf histo\n"
+			"perf stalls\n"
+			"perf pool\n"
+			"  on: enable event loop profiling\n"
+			"  off: disable event loop profiling, keeping statistics\n"
+			"  reset: clear collected statistics\n"
+			"  top: show the callbacks using the most time (default)\n"
+			"  histo: show histogram of main loop iteration durations\n"
+			"  stalls: show where the main loop was caught stalling\n"
+			"  pool: show thread pool queue statistics (average times)\n";
+	}
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -296,6 +296,22 @@ general_type_str(gint value)
 		N_("DHT successful push-proxy lookups"),
 		N_("DHT successful node push-entry lookups"),
 		N_("DHT re-seeding of orphan downloads"),
+		N_("QRP leaf tables sharing an identical table"),
+		N_("QRP leaf tables stored on their own"),
+		N_("QRP distinct leaf tables held"),
+		N_("QRP identical leaf tables not merged again"),
+		N_("Local searches answered from cache"),
+		N_("Local searches not found in cache"),
+		N_("Files read sequentially (kernel hint)"),
+		N_("Bytes hinted for kernel read-ahead"),
+		N_("Bytes hinted for page cache eviction"),
+		N_("TX compression level raised"),
+		N_("TX compression level lowered"),
+		N_("UDP system calls reading datagrams"),
+		N_("UDP datagrams read"),
+		N_("UDP system calls writing datagrams"),
+		N_("UDP datagrams written"),
+		N_("UDP datagrams lost when flushing batch"),
 	};
 
 	STATIC_ASSERT(G_N_ELEMENTS(strs) == GNR_TYPE_COUNT);
@@ -103,8 +103,9 @@ nodes_gui_common_status_str(const gnet_node_status_t *n)
 			}
 
 			if (n->tx_compressed && GUI_PROPERTY(show_gnet_info_txc))
-				slen += gm_snprintf(gui_tmp, sizeof(gui_tmp), "TXc=%u,%d%%",
-						n->sent, (int) (n->tx_compression_ratio * 100.0));
+				slen += gm_snprintf(gui_tmp, sizeof(gui_tmp), "TXc=%u,%d%%,z%d",
+						n->sent, (int) (n->tx_compression_ratio * 100.0),
+						n->tx_deflate_level);
 			else
 				slen += gm_snprintf(gui_tmp, sizeof(gui_tmp), "TX=%u",
 						n->sent);